@@ -396,12 +396,16 @@ static void reset_handle(fec_handle *f)
     f->fd = -1;
     f->flags = 0;
     f->mode = 0;
+    f->threads = 0;
+    f->hash_data_pending = false;
     f->errors = 0;
     f->data_size = 0;
     f->pos = 0;
     f->size = 0;
 
     f->ecc = {};
+    f->cache = {};
+    f->verified = {};
     f->verity = {};
 }
 
@@ -419,6 +423,7 @@ int fec_close(struct fec_handle *f)
     }
 
     pthread_mutex_destroy(&f->mutex);
+    pthread_mutex_destroy(&f->hashtree_mutex);
 
     reset_handle(f);
     delete f;
@@ -491,6 +496,13 @@ int fec_get_status(struct fec_handle *f, struct fec_status *s)
     s->data_size = f->data_size;
     s->size = f->size;
 
+    pthread_mutex_lock(&f->mutex);
+    s->ecc_cache_hits = f->cache.hits;
+    s->ecc_cache_misses = f->cache.misses;
+    s->verify_skipped = f->verified.skipped;
+    s->verify_hashed = f->verified.hashed;
+    pthread_mutex_unlock(&f->mutex);
+
     return 0;
 }
 
@@ -498,13 +510,23 @@ int fec_get_status(struct fec_handle *f, struct fec_status *s)
    successful */
 int fec_open(struct fec_handle **handle, const char *path, int mode, int flags,
         int roots)
+{
+    return fec_open_threads(handle, path, mode, flags, roots, 0);
+}
+
+/* opens `path' like fec_open, validating the hash tree on up to `threads'
+   threads, or on one thread per CPU if `threads' is 0, but never on more than
+   VERITY_MAX_THREADS */
+int fec_open_threads(struct fec_handle **handle, const char *path, int mode,
+        int flags, int roots, int threads)
 {
     check(path);
     check(handle);
     check(roots > 0 && roots < FEC_RSM);
+    check(threads >= 0);
 
-    debug("path = %s, mode = %d, flags = %d, roots = %d", path, mode, flags,
-        roots);
+    debug("path = %s, mode = %d, flags = %d, roots = %d, threads = %d", path,
+        mode, flags, roots, threads);
 
     if (mode & (O_CREAT | O_TRUNC | O_EXCL | O_WRONLY)) {
         /* only reading and updating existing files is supported */
@@ -528,11 +550,35 @@ int fec_open(struct fec_handle **handle, const char *path, int mode, int flags,
     f->ecc.rsn = FEC_RSM - roots;
     f->flags = flags;
 
+    if (threads == 0) {
+        threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    if (threads < WORK_MIN_THREADS) {
+        threads = WORK_MIN_THREADS;
+    } else if (threads > VERITY_MAX_THREADS) {
+        threads = VERITY_MAX_THREADS;
+    }
+
+    f->threads = threads;
+
     if (unlikely(pthread_mutex_init(&f->mutex, NULL) != 0)) {
         error("failed to create a mutex: %s", strerror(errno));
         return -1;
     }
 
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+
+    int rc = pthread_mutex_init(&f->hashtree_mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    if (unlikely(rc != 0)) {
+        error("failed to create a mutex: %s", strerror(rc));
+        return -1;
+    }
+
     f->fd = TEMP_FAILURE_RETRY(open(path, mode | O_CLOEXEC));
 
     if (f->fd == -1) {
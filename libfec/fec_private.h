@@ -25,6 +25,8 @@
 #include <sys/syscall.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <list>
 #include <memory>
 #include <string>
 #include <vector>
@@ -40,10 +42,22 @@
 #define WORK_MIN_THREADS 1
 #define WORK_MAX_THREADS 64
 
+/* number of decoded RS blocks to keep in memory */
+#define ECC_CACHE_BLOCKS 4
+
 /* verity parameters */
 #define VERITY_CACHE_BLOCKS 4096
 #define VERITY_NO_CACHE UINT64_MAX
 
+/* hash tree blocks are read in chunks of this many blocks */
+#define VERITY_TREE_CHUNK_BLOCKS 256
+/* each validating thread takes this many hash tree blocks at a time */
+#define VERITY_VERIFY_CHUNK_BLOCKS 16
+/* minimum number of hash tree blocks on a level for each validating thread */
+#define VERITY_MIN_BLOCKS_PER_THREAD 32
+/* maximum number of threads validating the hash tree */
+#define VERITY_MAX_THREADS 8
+
 /* verity definitions */
 #define VERITY_METADATA_SIZE (8 * FEC_BLOCKSIZE)
 #define VERITY_TABLE_ARGS 10 /* mandatory arguments */
@@ -75,6 +89,37 @@ struct ecc_info {
     uint64_t start; /* offset in file */
 };
 
+/* the data blocks of a decoded RS block, FEC_BLOCKSIZE bytes each */
+struct ecc_cache_entry {
+    uint64_t rsb;
+    bool erasures; /* decoded using erasure locations */
+    std::unique_ptr<uint8_t[]> data;
+};
+
+/* least recently used cache of decoded RS blocks, protected by
+   `fec_handle::mutex' */
+struct ecc_cache {
+    std::list<ecc_cache_entry> entries; /* most recently used first */
+    uint64_t hits;
+    uint64_t misses;
+};
+
+/* data blocks that have passed verification with FEC_VERITY_CACHE, protected
+   by `fec_handle::mutex' */
+struct verified_blocks {
+    std::vector<uint64_t> bits; /* allocated on first use */
+    uint64_t skipped;
+    uint64_t hashed;
+};
+
+struct tree_reader;
+
+/* offsets and sizes in blocks of hash tree levels */
+struct tree_layout {
+    std::vector<uint64_t> offsets;
+    std::vector<uint32_t> blocks;
+};
+
 struct hashtree_info {
     // The number of the input data blocks to compute the hashtree.
     uint64_t data_blocks;
@@ -96,10 +141,27 @@ struct hashtree_info {
 
     // Reads the verity hash tree, validates it against the root hash in `root',
     // corrects errors if necessary, and copies valid data blocks for later use
-    // to 'hashtree'.
-    int verify_tree(const fec_handle *f, const uint8_t *root);
+    // to 'hashtree'. If the handle was opened with FEC_VERITY_LAZY, the lowest
+    // level is left for load_hash_data().
+    int verify_tree(fec_handle *f, const uint8_t *root);
+
+    // Reads and validates the lowest level of the hash tree if verify_tree()
+    // deferred it. Must be called with `fec_handle::hashtree_mutex' held.
+    int load_hash_data(fec_handle *f);
+
+    // Checks that 'block' has the hash at 'index' in the hash tree level
+    // 'expected'.
+    bool check_level_block(const uint8_t *expected, uint32_t index,
+                           const uint8_t *block);
 
    private:
+    int verify_level(fec_handle *f, tree_reader *reader, uint64_t level_pos,
+                     uint32_t blocks, uint64_t offset, const uint8_t *expected);
+
+    int read_levels(fec_handle *f, const tree_layout &layout, uint32_t first,
+                    uint32_t last, const uint8_t *expected,
+                    std::vector<uint8_t> &buf);
+
     bool ecc_read_hashes(fec_handle *f, uint64_t hash_offset, uint8_t *hash,
                          uint64_t data_offset, uint8_t *data);
 
@@ -113,6 +175,14 @@ struct hashtree_info {
     int nid_;  // NID for the hash algorithm.
     uint32_t digest_length_;
     uint32_t padded_digest_length_;
+
+    enum lazy_state { LAZY_NONE, LAZY_PENDING, LAZY_LOADING, LAZY_FAILED };
+
+    // With FEC_VERITY_LAZY, the layout of the levels below the root block and
+    // the validated level above the data hashes, until they are loaded.
+    lazy_state lazy_state_ = LAZY_NONE;
+    tree_layout lazy_layout_;
+    std::vector<uint8_t> lazy_expected_;
 };
 
 struct verity_info {
@@ -132,10 +202,18 @@ struct avb_info {
 
 struct fec_handle {
     ecc_info ecc;
+    ecc_cache cache;
+    verified_blocks verified;
     int fd;
     int flags; /* additional flags passed to fec_open */
     int mode; /* mode for open(2) */
+    int threads; /* threads for validating the hash tree */
     pthread_mutex_t mutex;
+    /* recursive, held while loading deferred verity data hashes */
+    pthread_mutex_t hashtree_mutex;
+    /* set until deferred verity data hashes have been loaded, can be read
+       without holding `hashtree_mutex' */
+    std::atomic<bool> hash_data_pending;
     uint64_t errors;
     uint64_t data_size;
     uint64_t pos;
@@ -144,7 +222,11 @@ struct fec_handle {
     verity_info verity;
     avb_info avb;
 
-    hashtree_info hashtree() const {
+    const hashtree_info &hashtree() const {
+        return avb.valid ? avb.hashtree : verity.hashtree;
+    }
+
+    hashtree_info &hashtree() {
         return avb.valid ? avb.hashtree : verity.hashtree;
     }
 };
@@ -167,6 +249,8 @@ extern uint64_t verity_get_size(uint64_t file_size, uint32_t *verity_levels,
 
 extern int verity_parse_header(fec_handle *f, uint64_t offset);
 
+extern int verity_load_hash_data(fec_handle *f);
+
 /* helper macros */
 #ifndef unlikely
     #define unlikely(x) __builtin_expect(!!(x), 0)
@@ -22,9 +22,13 @@ extern "C" {
     #include <fec.h>
 }
 
+#include <fec/rs_simd.h>
+
 #include "fec_private.h"
 
 using rs_unique_ptr = std::unique_ptr<void, decltype(&free_rs_char)>;
+using rs_simd_unique_ptr =
+    std::unique_ptr<fec_rs_simd, decltype(&fec_rs_simd_free)>;
 
 /* prints a hexdump of `data' using warn(...) */
 static void dump(const char *name, uint64_t value, const uint8_t *data,
@@ -85,7 +89,7 @@ static inline bool is_erasure(fec_handle *f, uint64_t offset,
 /* check if `offset' is within a block expected to contain zeros */
 static inline bool is_zero(fec_handle *f, uint64_t offset)
 {
-    auto hashtree = f->hashtree();
+    const auto &hashtree = f->hashtree();
 
     if (hashtree.hash_data.empty() || unlikely(offset >= f->data_size)) {
         return false;
@@ -102,10 +106,89 @@ static inline bool is_zero(fec_handle *f, uint64_t offset)
                    SHA256_DIGEST_LENGTH);
 }
 
+/* copies the data block at `data_index' of RS block `rsb' to `dest' if the
+   block has been decoded recently */
+static bool ecc_cache_get(fec_handle *f, uint64_t rsb, bool use_erasures,
+        int data_index, uint8_t *dest)
+{
+    ecc_cache *c = &f->cache;
+    bool found = false;
+
+    pthread_mutex_lock(&f->mutex);
+
+    for (auto it = c->entries.begin(); it != c->entries.end(); ++it) {
+        if (it->rsb != rsb || it->erasures != use_erasures) {
+            continue;
+        }
+
+        /* move to the front of the list */
+        c->entries.splice(c->entries.begin(), c->entries, it);
+
+        memcpy(dest, &c->entries.front().data[data_index * FEC_BLOCKSIZE],
+               FEC_BLOCKSIZE);
+
+        found = true;
+        break;
+    }
+
+    if (found) {
+        ++c->hits;
+    } else {
+        ++c->misses;
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+    return found;
+}
+
+/* stores the data blocks of decoded RS block `rsb' from `ecc_data', replacing
+   the least recently used block if the cache is full */
+static void ecc_cache_put(fec_handle *f, uint64_t rsb, bool use_erasures,
+        const uint8_t *ecc_data)
+{
+    ecc_cache *c = &f->cache;
+
+    pthread_mutex_lock(&f->mutex);
+
+    for (const auto& entry : c->entries) {
+        if (entry.rsb == rsb && entry.erasures == use_erasures) {
+            /* another thread decoded the same block */
+            pthread_mutex_unlock(&f->mutex);
+            return;
+        }
+    }
+
+    if (c->entries.size() >= ECC_CACHE_BLOCKS) {
+        /* reuse the buffer of the least recently used block */
+        c->entries.splice(c->entries.begin(), c->entries,
+            std::prev(c->entries.end()));
+    } else {
+        std::unique_ptr<uint8_t[]> data(
+            new (std::nothrow) uint8_t[f->ecc.rsn * FEC_BLOCKSIZE]);
+
+        if (unlikely(!data)) {
+            /* caching is optional */
+            pthread_mutex_unlock(&f->mutex);
+            return;
+        }
+
+        c->entries.push_front({0, false, std::move(data)});
+    }
+
+    ecc_cache_entry& entry = c->entries.front();
+
+    entry.rsb = rsb;
+    entry.erasures = use_erasures;
+    memcpy(entry.data.get(), ecc_data, f->ecc.rsn * FEC_BLOCKSIZE);
+
+    pthread_mutex_unlock(&f->mutex);
+}
+
 /* reads and decodes a single block starting from `offset', returns the number
    of bytes corrected in `errors' */
-static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
-        bool use_erasures, uint8_t *ecc_data, size_t *errors)
+static int __ecc_read(fec_handle *f, void *rs, const fec_rs_simd *rs_simd,
+        uint8_t *dest, uint64_t offset, bool use_erasures, uint8_t *ecc_data,
+        size_t *errors)
 {
     check(offset % FEC_BLOCKSIZE == 0);
     ecc_info *e = &f->ecc;
@@ -114,6 +197,14 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
        offset */
     uint64_t rsb = offset - (offset / (e->rounds * FEC_BLOCKSIZE)) *
                         e->rounds * FEC_BLOCKSIZE;
+
+    /* one decode recovers all the data blocks in the RS block, so neighbouring
+       reads can often be served from memory */
+    if (ecc_cache_get(f, rsb, use_erasures,
+            (int)((offset - rsb) / (e->rounds * FEC_BLOCKSIZE)), dest)) {
+        return FEC_BLOCKSIZE;
+    }
+
     int data_index = -1;
     int erasures[e->rsn];
     int neras = 0;
@@ -121,6 +212,10 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
     /* verity is required to check for erasures */
     check(!use_erasures || !f->hashtree().hash_data.empty());
 
+    /* data blocks are kept in `ecc_data' one after another, so byte `j' of
+       all the RS codewords is in the same row of blocks */
+    const uint8_t *rows[FEC_RSM];
+
     for (int i = 0; i < e->rsn; ++i) {
         uint64_t interleaved = fec_ecc_interleave(rsb * e->rsn + i, e->rsn,
                                     e->rounds);
@@ -131,7 +226,9 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
 
         /* to improve our chances of correcting IO errors, initialize the
            buffer to zeros even if we are going to read to it later */
-        uint8_t bbuf[FEC_BLOCKSIZE] = {0};
+        uint8_t *bbuf = &ecc_data[i * FEC_BLOCKSIZE];
+        memset(bbuf, 0, FEC_BLOCKSIZE);
+        rows[i] = bbuf;
 
         if (likely(interleaved < e->start) && !is_zero(f, interleaved)) {
             /* copy raw data to reconstruct the RS block */
@@ -147,33 +244,51 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
                 erasures[neras++] = i;
             }
         }
-
-        for (int j = 0; j < FEC_BLOCKSIZE; ++j) {
-            ecc_data[j * FEC_RSM + i] = bbuf[j];
-        }
     }
 
     check(data_index >= 0);
 
+    /* parity bytes for all FEC_BLOCKSIZE codewords of the RS block are stored
+       next to each other, so fetch them with a single read into the staging
+       area after the data blocks instead of one read per codeword */
+    uint8_t *parity = &ecc_data[e->rsn * FEC_BLOCKSIZE];
+
+    if (!raw_pread(f->fd, parity, e->roots * FEC_BLOCKSIZE,
+                   e->start + rsb * e->roots)) {
+        error("failed to read ecc data: %s", strerror(errno));
+        return -1;
+    }
+
+    /* re-encode all codewords at once; the syndromes of a codeword are zero
+       exactly when its stored parity matches, and only the rest need to go
+       through the decoder */
+    uint8_t *expected = &ecc_data[FEC_RSM * FEC_BLOCKSIZE];
+    fec_rs_simd_encode(rs_simd, rows, FEC_BLOCKSIZE, expected);
+
     size_t nerrs = 0;
+    uint8_t codeword[FEC_RSM];
     uint8_t copy[FEC_RSM];
 
     for (int i = 0; i < FEC_BLOCKSIZE; ++i) {
-        /* copy parity data */
-        if (!raw_pread(f->fd, &ecc_data[i * FEC_RSM + e->rsn], e->roots,
-                       e->start + (i + rsb) * e->roots)) {
-            error("failed to read ecc data: %s", strerror(errno));
-            return -1;
+        if (likely(!memcmp(&expected[i * e->roots], &parity[i * e->roots],
+                           e->roots))) {
+            continue;
         }
 
+        for (int j = 0; j < e->rsn; ++j) {
+            codeword[j] = ecc_data[j * FEC_BLOCKSIZE + i];
+        }
+
+        memcpy(&codeword[e->rsn], &parity[i * e->roots], e->roots);
+
         /* for debugging decoding failures, because decode_rs_char can mangle
-           ecc_data */
+           the codeword */
         if (unlikely(use_erasures)) {
-            memcpy(copy, &ecc_data[i * FEC_RSM], FEC_RSM);
+            memcpy(copy, codeword, FEC_RSM);
         }
 
         /* decode */
-        int rc = decode_rs_char(rs, &ecc_data[i * FEC_RSM], erasures, neras);
+        int rc = decode_rs_char(rs, codeword, erasures, neras);
 
         if (unlikely(rc < 0)) {
             if (use_erasures) {
@@ -193,32 +308,41 @@ static int __ecc_read(fec_handle *f, void *rs, uint8_t *dest, uint64_t offset,
             nerrs += rc;
         }
 
-        dest[i] = ecc_data[i * FEC_RSM + data_index];
+        for (int j = 0; j < e->rsn; ++j) {
+            ecc_data[j * FEC_BLOCKSIZE + i] = codeword[j];
+        }
     }
 
+    memcpy(dest, &ecc_data[data_index * FEC_BLOCKSIZE], FEC_BLOCKSIZE);
+
     if (nerrs) {
         warn("RS block %" PRIu64 ": corrected %zu errors", rsb, nerrs);
         *errors += nerrs;
     }
 
+    ecc_cache_put(f, rsb, use_erasures, ecc_data);
+
     return FEC_BLOCKSIZE;
 }
 
-/* initializes RS decoder and allocates memory for interleaving */
+/* initializes RS decoder and encoder, and allocates memory for the data blocks
+   and parity of one RS block, followed by space for re-encoded parity */
 static int ecc_init(fec_handle *f, rs_unique_ptr& rs,
-        std::unique_ptr<uint8_t[]>& ecc_data)
+        rs_simd_unique_ptr& rs_simd, std::unique_ptr<uint8_t[]>& ecc_data)
 {
     check(f);
 
     rs.reset(init_rs_char(FEC_PARAMS(f->ecc.roots)));
+    rs_simd.reset(fec_rs_simd_init(f->ecc.roots));
 
-    if (unlikely(!rs)) {
+    if (unlikely(!rs || !rs_simd)) {
         error("failed to initialize RS");
         errno = ENOMEM;
         return -1;
     }
 
-    ecc_data.reset(new (std::nothrow) uint8_t[FEC_RSM * FEC_BLOCKSIZE]);
+    ecc_data.reset(new (std::nothrow)
+        uint8_t[(FEC_RSM + f->ecc.roots) * FEC_BLOCKSIZE]);
 
     if (unlikely(!ecc_data)) {
         error("failed to allocate ecc buffer");
@@ -243,9 +367,10 @@ static ssize_t ecc_read(fec_handle *f, uint8_t *dest, size_t count,
     debug("[%" PRIu64 ", %" PRIu64 ")", offset, offset + count);
 
     rs_unique_ptr rs(NULL, free_rs_char);
+    rs_simd_unique_ptr rs_simd(NULL, fec_rs_simd_free);
     std::unique_ptr<uint8_t[]> ecc_data;
 
-    if (ecc_init(f, rs, ecc_data) == -1) {
+    if (ecc_init(f, rs, rs_simd, ecc_data) == -1) {
         return -1;
     }
 
@@ -257,8 +382,8 @@ static ssize_t ecc_read(fec_handle *f, uint8_t *dest, size_t count,
 
     while (left > 0) {
         /* there's no erasure detection without verity metadata */
-        if (__ecc_read(f, rs.get(), data, curr * FEC_BLOCKSIZE, false,
-                ecc_data.get(), errors) == -1) {
+        if (__ecc_read(f, rs.get(), rs_simd.get(), data, curr * FEC_BLOCKSIZE,
+                false, ecc_data.get(), errors) == -1) {
             return -1;
         }
 
@@ -279,6 +404,46 @@ static ssize_t ecc_read(fec_handle *f, uint8_t *dest, size_t count,
     return count;
 }
 
+/* returns true if data block `index' has passed verification earlier, and
+   counts the lookup */
+static bool verified_get(fec_handle *f, uint64_t index)
+{
+    verified_blocks *v = &f->verified;
+    bool found;
+
+    pthread_mutex_lock(&f->mutex);
+
+    found = index / 64 < v->bits.size() &&
+                (v->bits[index / 64] & (1ULL << (index % 64)));
+
+    if (found) {
+        ++v->skipped;
+    } else {
+        ++v->hashed;
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+    return found;
+}
+
+/* marks data block `index' as verified */
+static void verified_set(fec_handle *f, uint64_t index)
+{
+    verified_blocks *v = &f->verified;
+
+    pthread_mutex_lock(&f->mutex);
+
+    if (v->bits.empty()) {
+        v->bits.resize((f->data_size / FEC_BLOCKSIZE + 63) / 64, 0);
+    }
+
+    if (index / 64 < v->bits.size()) {
+        v->bits[index / 64] |= 1ULL << (index % 64);
+    }
+
+    pthread_mutex_unlock(&f->mutex);
+}
+
 /* reads `count' bytes from `offset', corrects possible errors with
    erasure detection, and verifies the integrity of read data using
    verity hash tree; returns the number of corrections in `errors' */
@@ -295,9 +460,10 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
     debug("[%" PRIu64 ", %" PRIu64 ")", offset, offset + count);
 
     rs_unique_ptr rs(NULL, free_rs_char);
+    rs_simd_unique_ptr rs_simd(NULL, fec_rs_simd_free);
     std::unique_ptr<uint8_t[]> ecc_data;
 
-    if (f->ecc.start && ecc_init(f, rs, ecc_data) == -1) {
+    if (f->ecc.start && ecc_init(f, rs, rs_simd, ecc_data) == -1) {
         return -1;
     }
 
@@ -305,6 +471,7 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
     size_t coff = (size_t)(offset - curr * FEC_BLOCKSIZE);
     size_t left = count;
     uint8_t data[FEC_BLOCKSIZE];
+    bool cache = !!(f->flags & FEC_VERITY_CACHE);
 
     uint64_t max_hash_block =
         (f->hashtree().hash_data.size() - SHA256_DIGEST_LENGTH) /
@@ -329,7 +496,15 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
             return -1;
         }
 
+        if (cache && verified_get(f, curr)) {
+            goto valid;
+        }
+
         if (likely(f->hashtree().check_block_hash_with_index(curr, data))) {
+            if (cache) {
+                verified_set(f, curr);
+            }
+
             goto valid;
         }
 
@@ -352,15 +527,15 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
 
         /* try to correct without erasures first, because checking for
            erasure locations is slower */
-        if (__ecc_read(f, rs.get(), data, curr_offset, false, ecc_data.get(),
-                       errors) == FEC_BLOCKSIZE &&
+        if (__ecc_read(f, rs.get(), rs_simd.get(), data, curr_offset, false,
+                       ecc_data.get(), errors) == FEC_BLOCKSIZE &&
             f->hashtree().check_block_hash_with_index(curr, data)) {
             goto corrected;
         }
 
         /* try to correct with erasures */
-        if (__ecc_read(f, rs.get(), data, curr_offset, true, ecc_data.get(),
-                       errors) == FEC_BLOCKSIZE &&
+        if (__ecc_read(f, rs.get(), rs_simd.get(), data, curr_offset, true,
+                       ecc_data.get(), errors) == FEC_BLOCKSIZE &&
             f->hashtree().check_block_hash_with_index(curr, data)) {
             goto corrected;
         }
@@ -375,10 +550,17 @@ static ssize_t verity_read(fec_handle *f, uint8_t *dest, size_t count,
 
 corrected:
         /* update the corrected block to the file if we are in r/w mode */
-        if (f->mode & O_RDWR &&
-            !raw_pwrite(f->fd, data, FEC_BLOCKSIZE, curr_offset)) {
-            error("failed to write: %s", strerror(errno));
-            return -1;
+        if (f->mode & O_RDWR) {
+            if (!raw_pwrite(f->fd, data, FEC_BLOCKSIZE, curr_offset)) {
+                error("failed to write: %s", strerror(errno));
+                return -1;
+            }
+
+            /* the block on disk is now valid; in read-only mode it is still
+               corrupted, and must be corrected again on the next read */
+            if (cache) {
+                verified_set(f, curr);
+            }
         }
 
 valid:
@@ -524,6 +706,11 @@ ssize_t fec_pread(struct fec_handle *f, void *buf, size_t count,
         return -1;
     }
 
+    if (unlikely(f->flags & FEC_VERITY_LAZY) &&
+            verity_load_hash_data(f) == -1) {
+        return -1;
+    }
+
     if (!f->hashtree().hash_data.empty()) {
         return process(f, (uint8_t *)buf,
                        get_max_count(offset, count, f->data_size), offset,
@@ -550,3 +737,34 @@ ssize_t fec_pread(struct fec_handle *f, void *buf, size_t count,
 
     return -1;
 }
+
+/* forgets blocks in [offset, offset + count) that have been verified, and
+   any decoded RS blocks, after the file was modified outside of `f' */
+int fec_invalidate(struct fec_handle *f, uint64_t offset, size_t count)
+{
+    check(f);
+
+    if (unlikely(offset > UINT64_MAX - count)) {
+        errno = EOVERFLOW;
+        return -1;
+    }
+
+    verified_blocks *v = &f->verified;
+
+    pthread_mutex_lock(&f->mutex);
+
+    if (count > 0) {
+        uint64_t first = offset / FEC_BLOCKSIZE;
+        uint64_t last = (offset + count - 1) / FEC_BLOCKSIZE;
+
+        for (uint64_t i = first; i <= last && i / 64 < v->bits.size(); ++i) {
+            v->bits[i / 64] &= ~(1ULL << (i % 64));
+        }
+    }
+
+    /* cached RS blocks interleave data from the whole file */
+    f->cache.entries.clear();
+
+    pthread_mutex_unlock(&f->mutex);
+    return 0;
+}
@@ -0,0 +1,376 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <string.h>
+
+#include <new>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <immintrin.h>
+    #define RS_SIMD_X86
+#elif defined(__aarch64__)
+    #include <arm_neon.h>
+    #define RS_SIMD_NEON
+#endif
+
+#include <fec/rs_simd.h>
+
+/* code parameters, must match FEC_PARAMS in fec/ecc.h */
+#define RS_SYMBOLS 255
+#define RS_GFPOLY 0x11d
+
+/* returns the number of codewords processed, starting from zero */
+typedef size_t (*encode_func)(const fec_rs_simd *rs,
+        const uint8_t *const *rows, size_t count, uint8_t *parity);
+
+struct fec_rs_simd {
+    int roots;
+    int rsn;
+    const char *kernel;
+    encode_func encode;
+    /* feedback multipliers: the shift register update for parity byte `p'
+       is parity[p] = parity[p + 1] ^ feedback * taps[p] */
+    uint8_t taps[RS_SYMBOLS];
+    /* taps[p] * feedback for all feedback values, indexed by
+       feedback * roots + p */
+    std::vector<uint8_t> mul;
+    /* taps[p] * n and taps[p] * (n << 4) for 0 <= n < 16, repeated twice
+       so the tables can be used directly as 256-bit vectors */
+    alignas(32) uint8_t mul_lo[RS_SYMBOLS][32];
+    alignas(32) uint8_t mul_hi[RS_SYMBOLS][32];
+};
+
+static uint8_t alpha_to[RS_SYMBOLS + 1];
+static uint8_t index_of[RS_SYMBOLS + 1];
+
+/* builds the GF(2^8) tables once, thread-safe through static
+   initialization */
+static void init_gf_tables()
+{
+    static const bool initialized = []() {
+        unsigned sr = 1;
+
+        index_of[0] = RS_SYMBOLS; /* log(0) = -inf */
+        alpha_to[RS_SYMBOLS] = 0;
+
+        for (int i = 0; i < RS_SYMBOLS; ++i) {
+            index_of[sr] = i;
+            alpha_to[i] = sr;
+            sr <<= 1;
+
+            if (sr & 0x100) {
+                sr ^= RS_GFPOLY;
+            }
+
+            sr &= RS_SYMBOLS;
+        }
+
+        return true;
+    }();
+
+    (void)initialized;
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b)
+{
+    if (!a || !b) {
+        return 0;
+    }
+
+    return alpha_to[(index_of[a] + index_of[b]) % RS_SYMBOLS];
+}
+
+/* computes codewords [begin, count) one symbol at a time */
+static void encode_scalar(const fec_rs_simd *rs, const uint8_t *const *rows,
+        size_t begin, size_t count, uint8_t *parity)
+{
+    const int roots = rs->roots;
+
+    for (size_t k = begin; k < count; ++k) {
+        uint8_t *bb = &parity[k * roots];
+        memset(bb, 0, roots);
+
+        for (int i = 0; i < rs->rsn; ++i) {
+            const uint8_t *m = &rs->mul[(rows[i][k] ^ bb[0]) * roots];
+
+            for (int p = 0; p < roots - 1; ++p) {
+                bb[p] = bb[p + 1] ^ m[p];
+            }
+
+            bb[roots - 1] = m[roots - 1];
+        }
+    }
+}
+
+/* stores `lanes' parity vectors from `out' in codeword order */
+static void store_parity(const uint8_t *out, int roots, size_t lanes,
+        uint8_t *parity)
+{
+    for (size_t l = 0; l < lanes; ++l) {
+        for (int p = 0; p < roots; ++p) {
+            parity[l * roots + p] = out[p * lanes + l];
+        }
+    }
+}
+
+#ifdef RS_SIMD_X86
+__attribute__((target("ssse3")))
+static size_t encode_ssse3(const fec_rs_simd *rs, const uint8_t *const *rows,
+        size_t count, uint8_t *parity)
+{
+    const int roots = rs->roots;
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    __m128i par[RS_SYMBOLS];
+    alignas(16) uint8_t out[RS_SYMBOLS * 16];
+    size_t k;
+
+    for (k = 0; k + 16 <= count; k += 16) {
+        for (int p = 0; p < roots; ++p) {
+            par[p] = _mm_setzero_si128();
+        }
+
+        for (int i = 0; i < rs->rsn; ++i) {
+            __m128i fb = _mm_xor_si128(
+                _mm_loadu_si128((const __m128i *)&rows[i][k]), par[0]);
+            __m128i lo = _mm_and_si128(fb, mask);
+            __m128i hi = _mm_and_si128(_mm_srli_epi16(fb, 4), mask);
+
+            for (int p = 0; p < roots; ++p) {
+                __m128i m = _mm_xor_si128(
+                    _mm_shuffle_epi8(
+                        _mm_load_si128((const __m128i *)rs->mul_lo[p]), lo),
+                    _mm_shuffle_epi8(
+                        _mm_load_si128((const __m128i *)rs->mul_hi[p]), hi));
+
+                par[p] = p < roots - 1 ? _mm_xor_si128(par[p + 1], m) : m;
+            }
+        }
+
+        for (int p = 0; p < roots; ++p) {
+            _mm_store_si128((__m128i *)&out[p * 16], par[p]);
+        }
+
+        store_parity(out, roots, 16, &parity[k * roots]);
+    }
+
+    return k;
+}
+
+__attribute__((target("avx2")))
+static size_t encode_avx2(const fec_rs_simd *rs, const uint8_t *const *rows,
+        size_t count, uint8_t *parity)
+{
+    const int roots = rs->roots;
+    const __m256i mask = _mm256_set1_epi8(0x0f);
+    __m256i par[RS_SYMBOLS];
+    alignas(32) uint8_t out[RS_SYMBOLS * 32];
+    size_t k;
+
+    for (k = 0; k + 32 <= count; k += 32) {
+        for (int p = 0; p < roots; ++p) {
+            par[p] = _mm256_setzero_si256();
+        }
+
+        for (int i = 0; i < rs->rsn; ++i) {
+            __m256i fb = _mm256_xor_si256(
+                _mm256_loadu_si256((const __m256i *)&rows[i][k]), par[0]);
+            __m256i lo = _mm256_and_si256(fb, mask);
+            __m256i hi = _mm256_and_si256(_mm256_srli_epi16(fb, 4), mask);
+
+            for (int p = 0; p < roots; ++p) {
+                __m256i m = _mm256_xor_si256(
+                    _mm256_shuffle_epi8(
+                        _mm256_load_si256((const __m256i *)rs->mul_lo[p]), lo),
+                    _mm256_shuffle_epi8(
+                        _mm256_load_si256((const __m256i *)rs->mul_hi[p]), hi));
+
+                par[p] = p < roots - 1 ? _mm256_xor_si256(par[p + 1], m) : m;
+            }
+        }
+
+        for (int p = 0; p < roots; ++p) {
+            _mm256_store_si256((__m256i *)&out[p * 32], par[p]);
+        }
+
+        store_parity(out, roots, 32, &parity[k * roots]);
+    }
+
+    return k;
+}
+#endif /* RS_SIMD_X86 */
+
+#ifdef RS_SIMD_NEON
+static size_t encode_neon(const fec_rs_simd *rs, const uint8_t *const *rows,
+        size_t count, uint8_t *parity)
+{
+    const int roots = rs->roots;
+    const uint8x16_t mask = vdupq_n_u8(0x0f);
+    uint8x16_t par[RS_SYMBOLS];
+    uint8_t out[RS_SYMBOLS * 16];
+    size_t k;
+
+    for (k = 0; k + 16 <= count; k += 16) {
+        for (int p = 0; p < roots; ++p) {
+            par[p] = vdupq_n_u8(0);
+        }
+
+        for (int i = 0; i < rs->rsn; ++i) {
+            uint8x16_t fb = veorq_u8(vld1q_u8(&rows[i][k]), par[0]);
+            uint8x16_t lo = vandq_u8(fb, mask);
+            uint8x16_t hi = vshrq_n_u8(fb, 4);
+
+            for (int p = 0; p < roots; ++p) {
+                uint8x16_t m = veorq_u8(
+                    vqtbl1q_u8(vld1q_u8(rs->mul_lo[p]), lo),
+                    vqtbl1q_u8(vld1q_u8(rs->mul_hi[p]), hi));
+
+                par[p] = p < roots - 1 ? veorq_u8(par[p + 1], m) : m;
+            }
+        }
+
+        for (int p = 0; p < roots; ++p) {
+            vst1q_u8(&out[p * 16], par[p]);
+        }
+
+        store_parity(out, roots, 16, &parity[k * roots]);
+    }
+
+    return k;
+}
+#endif /* RS_SIMD_NEON */
+
+int fec_rs_simd_set_kernel(fec_rs_simd *rs, const char *name)
+{
+    if (!rs || !name) {
+        return -1;
+    }
+
+    if (!strcmp(name, "scalar")) {
+        rs->kernel = "scalar";
+        rs->encode = nullptr;
+        return 0;
+    }
+
+#ifdef RS_SIMD_X86
+    __builtin_cpu_init();
+
+    if (!strcmp(name, "avx2") && __builtin_cpu_supports("avx2")) {
+        rs->kernel = "avx2";
+        rs->encode = encode_avx2;
+        return 0;
+    }
+
+    if (!strcmp(name, "ssse3") && __builtin_cpu_supports("ssse3")) {
+        rs->kernel = "ssse3";
+        rs->encode = encode_ssse3;
+        return 0;
+    }
+#endif
+
+#ifdef RS_SIMD_NEON
+    if (!strcmp(name, "neon")) {
+        rs->kernel = "neon";
+        rs->encode = encode_neon;
+        return 0;
+    }
+#endif
+
+    return -1;
+}
+
+fec_rs_simd *fec_rs_simd_init(int roots)
+{
+    if (roots <= 0 || roots >= RS_SYMBOLS) {
+        return nullptr;
+    }
+
+    fec_rs_simd *rs = new (std::nothrow) fec_rs_simd;
+
+    if (!rs) {
+        return nullptr;
+    }
+
+    init_gf_tables();
+
+    rs->roots = roots;
+    rs->rsn = RS_SYMBOLS - roots;
+
+    /* generator polynomial with roots alpha^0 ... alpha^(roots - 1), see
+       init_rs_char */
+    uint8_t genpoly[RS_SYMBOLS + 1];
+    genpoly[0] = 1;
+
+    for (int i = 0; i < roots; ++i) {
+        genpoly[i + 1] = 1;
+
+        for (int j = i; j > 0; --j) {
+            genpoly[j] = genpoly[j - 1] ^ gf_mul(genpoly[j], alpha_to[i]);
+        }
+
+        genpoly[0] = gf_mul(genpoly[0], alpha_to[i]);
+    }
+
+    for (int p = 0; p < roots; ++p) {
+        rs->taps[p] = genpoly[roots - 1 - p];
+    }
+
+    rs->mul.resize(256 * roots);
+
+    for (int fb = 0; fb < 256; ++fb) {
+        for (int p = 0; p < roots; ++p) {
+            rs->mul[fb * roots + p] = gf_mul(fb, rs->taps[p]);
+        }
+    }
+
+    for (int p = 0; p < roots; ++p) {
+        for (int n = 0; n < 32; ++n) {
+            rs->mul_lo[p][n] = gf_mul(rs->taps[p], n % 16);
+            rs->mul_hi[p][n] = gf_mul(rs->taps[p], (n % 16) << 4);
+        }
+    }
+
+    if (fec_rs_simd_set_kernel(rs, "avx2") != 0 &&
+            fec_rs_simd_set_kernel(rs, "ssse3") != 0 &&
+            fec_rs_simd_set_kernel(rs, "neon") != 0) {
+        fec_rs_simd_set_kernel(rs, "scalar");
+    }
+
+    return rs;
+}
+
+void fec_rs_simd_free(fec_rs_simd *rs)
+{
+    delete rs;
+}
+
+const char *fec_rs_simd_kernel(const fec_rs_simd *rs)
+{
+    return rs ? rs->kernel : nullptr;
+}
+
+void fec_rs_simd_encode(const fec_rs_simd *rs, const uint8_t *const *rows,
+        size_t count, uint8_t *parity)
+{
+    size_t done = 0;
+
+    if (rs->encode) {
+        done = rs->encode(rs, rows, count, parity);
+    }
+
+    /* codewords that do not fill a vector */
+    encode_scalar(rs, rows, done, count, parity);
+}
@@ -15,6 +15,7 @@
  */
 
 #include <ctype.h>
+#include <pthread.h>
 #include <stdlib.h>
 
 #include <algorithm>
@@ -201,7 +202,278 @@ bool hashtree_info::ecc_read_hashes(fec_handle *f, uint64_t hash_offset,
     return true;
 }
 
-int hashtree_info::verify_tree(const fec_handle *f, const uint8_t *root) {
+/* reads `size' bytes of the hash tree from `offset' to `buf' in the
+   background, so that the blocks read so far can be verified meanwhile */
+struct tree_reader {
+    int fd;
+    uint8_t *buf;
+    uint64_t offset;
+    uint64_t size;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    uint64_t done; /* bytes read so far */
+    int error; /* errno if reading failed */
+    bool cancel; /* set to stop reading early */
+    pthread_t thread;
+};
+
+static void *__read_tree(void *cookie)
+{
+    tree_reader *r = static_cast<tree_reader *>(cookie);
+    const uint64_t chunk = VERITY_TREE_CHUNK_BLOCKS * FEC_BLOCKSIZE;
+
+    for (uint64_t pos = 0; pos < r->size; pos += chunk) {
+        uint64_t n = std::min(chunk, r->size - pos);
+        bool ok = raw_pread(r->fd, &r->buf[pos], n, r->offset + pos);
+
+        pthread_mutex_lock(&r->mutex);
+
+        if (ok) {
+            r->done = pos + n;
+        } else {
+            r->error = errno ? errno : EIO;
+        }
+
+        bool cancel = r->cancel;
+
+        pthread_cond_broadcast(&r->cond);
+        pthread_mutex_unlock(&r->mutex);
+
+        if (!ok || cancel) {
+            break;
+        }
+    }
+
+    return nullptr;
+}
+
+static int start_reader(tree_reader *r, int fd, uint8_t *buf, uint64_t offset,
+                        uint64_t size) {
+    r->fd = fd;
+    r->buf = buf;
+    r->offset = offset;
+    r->size = size;
+    r->done = 0;
+    r->error = 0;
+    r->cancel = false;
+
+    pthread_mutex_init(&r->mutex, nullptr);
+    pthread_cond_init(&r->cond, nullptr);
+
+    if (pthread_create(&r->thread, nullptr, __read_tree, r) != 0) {
+        error("failed to create thread: %s", strerror(errno));
+        pthread_cond_destroy(&r->cond);
+        pthread_mutex_destroy(&r->mutex);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* stops reading after the current chunk if the whole range hasn't been read
+   yet, and waits for the reader to finish */
+static void stop_reader(tree_reader *r) {
+    pthread_mutex_lock(&r->mutex);
+    r->cancel = true;
+    pthread_mutex_unlock(&r->mutex);
+
+    pthread_join(r->thread, nullptr);
+    pthread_cond_destroy(&r->cond);
+    pthread_mutex_destroy(&r->mutex);
+}
+
+/* waits until the first `size' bytes have been read, returns false if
+   reading them failed */
+static bool wait_reader(tree_reader *r, uint64_t size) {
+    pthread_mutex_lock(&r->mutex);
+
+    while (r->done < size && !r->error) {
+        pthread_cond_wait(&r->cond, &r->mutex);
+    }
+
+    bool ok = r->done >= size;
+
+    if (!ok) {
+        errno = r->error;
+    }
+
+    pthread_mutex_unlock(&r->mutex);
+    return ok;
+}
+
+struct level_verify_info {
+    hashtree_info *hashtree;
+    tree_reader *reader;
+    const uint8_t *expected;
+    uint64_t level_pos; /* position of the level in the reader's buffer */
+    uint32_t blocks;
+    pthread_mutex_t mutex;
+    uint32_t next; /* the next block to verify, protected by `mutex' */
+    std::vector<uint32_t> invalid; /* protected by `mutex' */
+    bool read_failed;
+};
+
+/* thread function, verifies chunks of blocks as they are read */
+static void *__verify_level(void *cookie)
+{
+    level_verify_info *v = static_cast<level_verify_info *>(cookie);
+    std::vector<uint32_t> invalid;
+    bool read_failed = false;
+
+    while (!read_failed) {
+        pthread_mutex_lock(&v->mutex);
+        uint32_t first = v->next;
+        uint32_t last = std::min<uint32_t>(v->blocks,
+                                           first + VERITY_VERIFY_CHUNK_BLOCKS);
+        v->next = last;
+        pthread_mutex_unlock(&v->mutex);
+
+        if (first >= last) {
+            break;
+        }
+
+        if (!wait_reader(v->reader, v->level_pos +
+                                        (uint64_t)last * FEC_BLOCKSIZE)) {
+            read_failed = true;
+            break;
+        }
+
+        for (uint32_t j = first; j < last; ++j) {
+            if (!v->hashtree->check_level_block(v->expected, j,
+                    &v->reader->buf[v->level_pos + (uint64_t)j * FEC_BLOCKSIZE])) {
+                invalid.push_back(j);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&v->mutex);
+    v->invalid.insert(v->invalid.end(), invalid.begin(), invalid.end());
+    v->read_failed |= read_failed;
+    pthread_mutex_unlock(&v->mutex);
+
+    return nullptr;
+}
+
+bool hashtree_info::check_level_block(const uint8_t *expected, uint32_t index,
+                                      const uint8_t *block) {
+    return check_block_hash(&expected[index * padded_digest_length_], block);
+}
+
+// Verifies the `blocks' hash tree blocks at file offset `offset' against the
+// hashes in `expected' on up to `f->threads' threads, as `reader' reads them
+// to its buffer starting from `level_pos'. Invalid blocks are corrected using
+// ecc, and rewritten if the handle is writable.
+int hashtree_info::verify_level(fec_handle *f, tree_reader *reader,
+                                uint64_t level_pos, uint32_t blocks,
+                                uint64_t offset, const uint8_t *expected) {
+    int threads = f->threads;
+
+    if (threads > (int)(blocks / VERITY_MIN_BLOCKS_PER_THREAD)) {
+        threads = blocks / VERITY_MIN_BLOCKS_PER_THREAD;
+    }
+    if (threads < WORK_MIN_THREADS) {
+        threads = WORK_MIN_THREADS;
+    }
+
+    level_verify_info info;
+    info.hashtree = this;
+    info.reader = reader;
+    info.expected = expected;
+    info.level_pos = level_pos;
+    info.blocks = blocks;
+    info.next = 0;
+    info.read_failed = false;
+    pthread_mutex_init(&info.mutex, nullptr);
+
+    std::vector<pthread_t> handles;
+
+    for (int i = 1; i < threads; ++i) {
+        pthread_t thread;
+
+        if (pthread_create(&thread, nullptr, __verify_level, &info) != 0) {
+            warn("failed to create thread: %s", strerror(errno));
+            break;
+        }
+
+        handles.push_back(thread);
+    }
+
+    /* the calling thread helps out and picks up any remaining blocks */
+    __verify_level(&info);
+
+    for (auto thread : handles) {
+        pthread_join(thread, nullptr);
+    }
+
+    pthread_mutex_destroy(&info.mutex);
+
+    if (info.read_failed) {
+        error("failed to read hashes: %s", strerror(reader->error));
+        errno = reader->error;
+        return -1;
+    }
+
+    std::sort(info.invalid.begin(), info.invalid.end());
+
+    for (auto j : info.invalid) {
+        uint8_t *block = &reader->buf[level_pos + (uint64_t)j * FEC_BLOCKSIZE];
+        uint64_t block_offset = offset + (uint64_t)j * FEC_BLOCKSIZE;
+
+        /* ecc reads are very I/O intensive, so only correct the blocks
+           that didn't validate */
+        if (!ecc_read_hashes(f, 0, nullptr, block_offset, block) ||
+            !check_level_block(expected, j, block)) {
+            error("invalid hash tree: data_offset %" PRIu64 ", block %u",
+                  offset, j);
+            return -1;
+        }
+
+        /* update the corrected blocks to the file if we are in r/w mode */
+        if (f->mode & O_RDWR &&
+            !raw_pwrite(f->fd, block, FEC_BLOCKSIZE, block_offset)) {
+            error("failed to write hashes: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Reads and verifies the levels [first, last) of the tree described by
+// `layout' to `buf', where level `first - 1' has already been verified and
+// is in `expected'. Returns the verified levels in `buf'.
+int hashtree_info::read_levels(fec_handle *f, const tree_layout &layout,
+                               uint32_t first, uint32_t last,
+                               const uint8_t *expected,
+                               std::vector<uint8_t> &buf) {
+    uint64_t start = layout.offsets[first];
+    uint64_t size = layout.offsets[last - 1] +
+                    (uint64_t)layout.blocks[last - 1] * FEC_BLOCKSIZE - start;
+
+    buf.resize(size);
+
+    tree_reader reader;
+
+    if (start_reader(&reader, f->fd, buf.data(), start, size) == -1) {
+        return -1;
+    }
+
+    int rc = 0;
+
+    for (uint32_t i = first; i < last && rc == 0; ++i) {
+        uint64_t level_pos = layout.offsets[i] - start;
+
+        rc = verify_level(f, &reader, level_pos, layout.blocks[i],
+                          layout.offsets[i], expected);
+
+        expected = &buf[level_pos];
+    }
+
+    stop_reader(&reader);
+    return rc;
+}
+
+int hashtree_info::verify_tree(fec_handle *f, const uint8_t *root) {
     check(f);
     check(root);
 
@@ -217,14 +489,12 @@ int hashtree_info::verify_tree(const fec_handle *f, const uint8_t *root) {
     check(hash_start + hash_size <= f->data_size);
 
     uint64_t hash_offset = hash_start;
-    uint64_t data_offset = hash_offset + FEC_BLOCKSIZE;
 
     /* validate the root hash */
     if (!raw_pread(f->fd, data, FEC_BLOCKSIZE, hash_offset) ||
         !check_block_hash(root, data)) {
         /* try to correct */
-        if (!ecc_read_hashes(const_cast<fec_handle *>(f), 0, nullptr,
-                             hash_offset, data) ||
+        if (!ecc_read_hashes(f, 0, nullptr, hash_offset, data) ||
             !check_block_hash(root, data)) {
             error("root hash invalid");
             return -1;
@@ -243,19 +513,26 @@ int hashtree_info::verify_tree(const fec_handle *f, const uint8_t *root) {
     verity_get_size(data_blocks * FEC_BLOCKSIZE, NULL, hashes,
                     padded_digest_length_);
 
-    uint64_t hash_data_offset = data_offset;
-    uint32_t hash_data_blocks = 0;
-    /* calculate the size and offset for the data hashes */
+    /* the levels below the root block, top-down, with the data hashes
+       last */
+    tree_layout layout;
+    uint64_t data_offset = hash_offset + FEC_BLOCKSIZE;
+
     for (uint32_t i = 1; i < levels; ++i) {
         uint32_t blocks = hashes[levels - i];
         debug("%u hash blocks on level %u", blocks, levels - i);
 
-        hash_data_offset = data_offset;
-        hash_data_blocks = blocks;
+        layout.offsets.push_back(data_offset);
+        layout.blocks.push_back(blocks);
 
         data_offset += blocks * FEC_BLOCKSIZE;
     }
 
+    check(!layout.blocks.empty());
+
+    uint32_t hash_data_blocks = layout.blocks.back();
+    uint64_t hash_data_offset = layout.offsets.back();
+
     check(hash_data_blocks);
     check(hash_data_blocks <= hash_size / FEC_BLOCKSIZE);
 
@@ -264,78 +541,111 @@ int hashtree_info::verify_tree(const fec_handle *f, const uint8_t *root) {
     check(hash_data_offset < f->data_size);
     check(hash_data_offset + hash_data_blocks * FEC_BLOCKSIZE <= f->data_size);
 
-    /* copy data hashes to memory in case they are corrupted, so we don't
-       have to correct them every time they are needed */
-    std::vector<uint8_t> data_hashes(hash_data_blocks * FEC_BLOCKSIZE, 0);
+    std::vector<uint8_t> zero_block(FEC_BLOCKSIZE, 0);
+    zero_hash.resize(padded_digest_length_, 0);
+    if (get_hash(zero_block.data(), zero_hash.data()) == -1) {
+        error("failed to hash");
+        return -1;
+    }
 
-    /* validate the rest of the hash tree */
-    data_offset = hash_offset + FEC_BLOCKSIZE;
+    uint32_t data_level = layout.blocks.size() - 1;
 
-    std::vector<uint8_t> buffer(padded_digest_length_, 0);
-    for (uint32_t i = 1; i < levels; ++i) {
-        uint32_t blocks = hashes[levels - i];
+    if (f->flags & FEC_VERITY_LAZY) {
+        /* validate the upper levels, and leave the data hashes, which are
+           nearly all of the tree, for load_hash_data */
+        std::vector<uint8_t> upper(data, data + FEC_BLOCKSIZE);
 
-        for (uint32_t j = 0; j < blocks; ++j) {
-            /* ecc reads are very I/O intensive, so read raw hash tree and do
-               error correcting only if it doesn't validate */
-            if (!raw_pread(f->fd, buffer.data(), padded_digest_length_,
-                           hash_offset + j * padded_digest_length_) ||
-                !raw_pread(f->fd, data, FEC_BLOCKSIZE,
-                           data_offset + j * FEC_BLOCKSIZE)) {
-                error("failed to read hashes: %s", strerror(errno));
+        if (data_level > 0) {
+            if (read_levels(f, layout, 0, data_level, data, upper) == -1) {
                 return -1;
             }
 
-            if (!check_block_hash(buffer.data(), data)) {
-                /* try to correct */
-                if (!ecc_read_hashes(const_cast<fec_handle *>(f),
-                                     hash_offset + j * padded_digest_length_,
-                                     buffer.data(),
-                                     data_offset + j * FEC_BLOCKSIZE, data) ||
-                    !check_block_hash(buffer.data(), data)) {
-                    error("invalid hash tree: hash_offset %" PRIu64
-                          ", "
-                          "data_offset %" PRIu64 ", block %u",
-                          hash_offset, data_offset, j);
-                    return -1;
-                }
-
-                /* update the corrected blocks to the file if we are in r/w
-                   mode */
-                if (f->mode & O_RDWR) {
-                    if (!raw_pwrite(f->fd, buffer.data(), padded_digest_length_,
-                                    hash_offset + j * padded_digest_length_) ||
-                        !raw_pwrite(f->fd, data, FEC_BLOCKSIZE,
-                                    data_offset + j * FEC_BLOCKSIZE)) {
-                        error("failed to write hashes: %s", strerror(errno));
-                        return -1;
-                    }
-                }
-            }
-
-            if (blocks == hash_data_blocks) {
-                std::copy(data, data + FEC_BLOCKSIZE,
-                          data_hashes.begin() + j * FEC_BLOCKSIZE);
-            }
+            upper.erase(upper.begin(), upper.end() -
+                            (uint64_t)layout.blocks[data_level - 1] *
+                                FEC_BLOCKSIZE);
         }
 
-        hash_offset = data_offset;
-        data_offset += blocks * FEC_BLOCKSIZE;
+        lazy_layout_ = std::move(layout);
+        lazy_expected_ = std::move(upper);
+        lazy_state_ = LAZY_PENDING;
+        f->hash_data_pending = true;
+
+        debug("valid, data hashes pending");
+        return 0;
+    }
+
+    /* copy data hashes to memory in case they are corrupted, so we don't
+       have to correct them every time they are needed; the levels above
+       them are dropped once validated */
+    std::vector<uint8_t> tree;
+
+    if (read_levels(f, layout, 0, data_level + 1, data, tree) == -1) {
+        return -1;
     }
 
+    tree.erase(tree.begin(), tree.end() -
+                   (uint64_t)hash_data_blocks * FEC_BLOCKSIZE);
+
     debug("valid");
 
-    this->hash_data = std::move(data_hashes);
+    this->hash_data = std::move(tree);
+    return 0;
+}
 
-    std::vector<uint8_t> zero_block(FEC_BLOCKSIZE, 0);
-    zero_hash.resize(padded_digest_length_, 0);
-    if (get_hash(zero_block.data(), zero_hash.data()) == -1) {
-        error("failed to hash");
+int hashtree_info::load_hash_data(fec_handle *f) {
+    check(f);
+
+    if (lazy_state_ == LAZY_FAILED) {
+        errno = EIO;
         return -1;
     }
+
+    if (lazy_state_ != LAZY_PENDING) {
+        return 0; /* already loaded, or being loaded by this thread */
+    }
+
+    /* reads needed to correct the tree fall back to ecc meanwhile */
+    lazy_state_ = LAZY_LOADING;
+
+    uint32_t data_level = lazy_layout_.blocks.size() - 1;
+    std::vector<uint8_t> tree;
+
+    if (read_levels(f, lazy_layout_, data_level, data_level + 1,
+                    lazy_expected_.data(), tree) == -1) {
+        error("failed to load data hashes");
+        lazy_state_ = LAZY_FAILED;
+        errno = EIO;
+        return -1;
+    }
+
+    debug("data hashes valid");
+
+    hash_data = std::move(tree);
+    lazy_expected_.clear();
+    lazy_state_ = LAZY_NONE;
+    f->hash_data_pending = false;
     return 0;
 }
 
+/* validates the data hashes of a handle opened with FEC_VERITY_LAZY on the
+   first read */
+int verity_load_hash_data(fec_handle *f)
+{
+    check(f);
+
+    /* once loaded, the data hashes never change, so reads don't need to
+       take the lock */
+    if (!f->hash_data_pending) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&f->hashtree_mutex);
+    int rc = f->hashtree().load_hash_data(f);
+    pthread_mutex_unlock(&f->hashtree_mutex);
+
+    return rc;
+}
+
 /* reads, corrects and parses the verity table, validates parameters, and if
    `f->flags' does not have `FEC_VERITY_DISABLE' set, calls `verify_tree' to
    load and validate the hash tree */
@@ -457,7 +767,8 @@ static int parse_table(fec_handle *f, uint64_t offset, uint32_t size, bool useec
             return -1;
         }
 
-        check(!v->hashtree.hash_data.empty());
+        check(!v->hashtree.hash_data.empty() ||
+              (f->flags & FEC_VERITY_LAZY));
         check(!v->hashtree.zero_hash.empty());
     }
 
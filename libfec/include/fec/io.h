@@ -58,6 +58,12 @@ struct fec_status {
     uint64_t errors;
     uint64_t data_size;
     uint64_t size;
+    uint64_t ecc_cache_hits;
+    uint64_t ecc_cache_misses;
+    /* blocks read with FEC_VERITY_CACHE that were known to be valid, and
+       blocks that had to be hashed */
+    uint64_t verify_skipped;
+    uint64_t verify_hashed;
 };
 
 struct fec_ecc_metadata {
@@ -81,7 +87,13 @@ struct fec_verity_metadata {
 enum {
     FEC_FS_EXT4 = 1 << 0,
     FEC_FS_SQUASH = 1 << 1,
-    FEC_VERITY_DISABLE = 1 << 8
+    FEC_VERITY_DISABLE = 1 << 8,
+    /* validate the lowest level of the hash tree on the first read instead
+       of in fec_open */
+    FEC_VERITY_LAZY = 1 << 9,
+    /* remember blocks that pass verification and do not hash them again on
+       later reads; call fec_invalidate after modifying the file */
+    FEC_VERITY_CACHE = 1 << 10
 };
 
 struct fec_handle;
@@ -90,6 +102,11 @@ struct fec_handle;
 extern int fec_open(struct fec_handle **f, const char *path, int mode,
         int flags, int roots);
 
+/* like fec_open, but validates the hash tree using at most `threads'
+   threads; 0 selects a default based on the number of CPUs */
+extern int fec_open_threads(struct fec_handle **f, const char *path, int mode,
+        int flags, int roots, int threads);
+
 extern int fec_close(struct fec_handle *f);
 
 extern int fec_verity_set_status(struct fec_handle *f, bool enabled);
@@ -109,6 +126,8 @@ extern ssize_t fec_read(struct fec_handle *f, void *buf, size_t count);
 extern ssize_t fec_pread(struct fec_handle *f, void *buf, size_t count,
         uint64_t offset);
 
+extern int fec_invalidate(struct fec_handle *f, uint64_t offset, size_t count);
+
 #ifdef __cplusplus
 } /* extern "C" */
 
@@ -133,10 +152,11 @@ namespace fec {
         }
 
         bool open(const std::string& fn, int mode = O_RDONLY, int flags = 0,
-                    int roots = FEC_DEFAULT_ROOTS)
+                    int roots = FEC_DEFAULT_ROOTS, int threads = 0)
         {
             fec_handle *fh = nullptr;
-            int rc = fec_open(&fh, fn.c_str(), mode, flags, roots);
+            int rc = fec_open_threads(&fh, fn.c_str(), mode, flags, roots,
+                                      threads);
             if (!rc) {
                 handle_.reset(fh);
             }
@@ -159,6 +179,10 @@ namespace fec {
             return fec_pread(handle_.get(), buf, count, offset);
         }
 
+        bool invalidate(uint64_t offset, size_t count) {
+            return !fec_invalidate(handle_.get(), offset, count);
+        }
+
         bool get_status(fec_status& status) {
             return !fec_get_status(handle_.get(), &status);
         }
@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef ___FEC_RS_SIMD_H___
+#define ___FEC_RS_SIMD_H___
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Reed-Solomon encoder for RS(255, 255 - roots) using the code parameters in
+   FEC_PARAMS, computing many codewords at once. Symbols of neighbouring
+   codewords are expected to be next to each other in memory, which is how
+   interleaved ecc data is laid out, so they can be processed as vectors with
+   GF(2^8) multiplication tables split by nibble. The fastest kernel supported
+   by the CPU is selected at runtime. */
+struct fec_rs_simd;
+
+extern struct fec_rs_simd *fec_rs_simd_init(int roots);
+
+extern void fec_rs_simd_free(struct fec_rs_simd *rs);
+
+/* returns the name of the kernel in use: "avx2", "ssse3", "neon" or
+   "scalar" */
+extern const char *fec_rs_simd_kernel(const struct fec_rs_simd *rs);
+
+/* switches to kernel `name', returns 0 if the CPU supports it */
+extern int fec_rs_simd_set_kernel(struct fec_rs_simd *rs, const char *name);
+
+/* computes parity for `count' codewords, where data symbol `i' of codeword
+   `k' is rows[i][k] for 0 <= i < 255 - roots, and stores the `roots' parity
+   bytes of codeword `k' starting from parity[k * roots]; the output is
+   identical to calling encode_rs_char for each codeword */
+extern void fec_rs_simd_encode(const struct fec_rs_simd *rs,
+        const uint8_t *const *rows, size_t count, uint8_t *parity);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* ___FEC_RS_SIMD_H___ */
@@ -0,0 +1,104 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <new>
+#include <string>
+
+#include <fec/io.h>
+
+using namespace std;
+const unsigned bufsize = 2 * 1024 * FEC_BLOCKSIZE;
+
+/* returns the number of read system calls made by this process so far, as
+   reported by the kernel in /proc/self/io, or 0 if not available */
+static uint64_t get_read_syscalls()
+{
+    ifstream io("/proc/self/io");
+    string key;
+    uint64_t value;
+
+    while (io >> key >> value) {
+        if (key == "syscr:") {
+            return value;
+        }
+    }
+
+    return 0;
+}
+
+/* reads an image with ecc data through libfec without verity, so that every
+   block goes through RS decoding, and reports the cost per decoded MiB */
+int main(int argc, char **argv)
+{
+    if (argc != 2) {
+        cerr << "usage: " << argv[0] << " input" << endl;
+        return 1;
+    }
+
+    unique_ptr<uint8_t[]> buffer(new (nothrow) uint8_t[bufsize]);
+
+    if (!buffer) {
+        cerr << "failed to allocate buffer" << endl;
+        return 1;
+    }
+
+    fec::io input(argv[1], O_RDONLY, FEC_VERITY_DISABLE);
+
+    if (!input) {
+        return 1;
+    }
+
+    if (!input.has_ecc()) {
+        cerr << argv[1] << " has no valid ecc data" << endl;
+        return 1;
+    }
+
+    uint64_t syscalls = get_read_syscalls();
+    auto start = chrono::steady_clock::now();
+    uint64_t total = 0;
+    ssize_t count;
+
+    do {
+        count = input.read(buffer.get(), bufsize);
+
+        if (count == -1) {
+            cerr << "read failed at offset " << total << endl;
+            return 1;
+        }
+
+        total += count;
+    } while (count > 0);
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    syscalls = get_read_syscalls() - syscalls;
+
+    double mib = static_cast<double>(total) / (1024 * 1024);
+
+    cout << "decoded " << total << " bytes in " << elapsed.count() << " s"
+         << endl;
+
+    if (mib > 0 && elapsed.count() > 0) {
+        cout << "throughput: " << mib / elapsed.count() << " MiB/s" << endl;
+        cout << "read syscalls: " << syscalls << " ("
+             << syscalls / mib << " per MiB)" << endl;
+    }
+
+    return 0;
+}
@@ -56,6 +56,7 @@ class FecUnitTest : public ::testing::Test {
     // Builds the verity metadata and appends the bytes to the image.
     void BuildAndAppendsVerityMetadata() {
         BuildHashtree("sha256");
+        std::string data_blocks = std::to_string(image_.size() / 4096);
         // Append the hashtree to the end of image.
         image_.insert(image_.end(), hashtree_content_.begin(),
                       hashtree_content_.end());
@@ -69,8 +70,8 @@ class FecUnitTest : public ::testing::Test {
             "fake_block_device",
             "4096",
             "4096",
-            "256",
-            "256",
+            data_blocks,
+            data_blocks,
             "sha256",
             HashTreeBuilder::BytesArrayToString(root_hash_),
             HashTreeBuilder::BytesArrayToString(salt_),
@@ -217,6 +218,189 @@ TEST_F(FecUnitTest, VerityImage_FecRead) {
     ASSERT_EQ(std::vector<uint8_t>(1024, 255), read_data);
 }
 
+TEST_F(FecUnitTest, VerityImage_EccCache) {
+    TemporaryFile verity_image;
+    BuildAndAppendsVerityMetadata();
+    ASSERT_TRUE(android::base::WriteFully(verity_image.fd, image_.data(),
+                                          image_.size()));
+    TemporaryFile ecc_image;
+    BuildAndAppendsEccImage(verity_image.path, ecc_image.path);
+    std::string ecc_content;
+    ASSERT_TRUE(android::base::ReadFileToString(ecc_image.path, &ecc_content));
+    ASSERT_TRUE(android::base::WriteStringToFd(ecc_content, verity_image.fd));
+
+    // With 267 blocks and 2 roots there are 2 rounds, so blocks 253 and 255
+    // belong to the same RS block.
+    std::vector<uint8_t> corruption(100, 10);
+    for (uint64_t block : {253, 255}) {
+        uint64_t corrupt_offset = 4096 * block;
+        ASSERT_EQ(corrupt_offset, lseek64(verity_image.fd, corrupt_offset, 0));
+        ASSERT_TRUE(android::base::WriteFully(
+            verity_image.fd, corruption.data(), corruption.size()));
+    }
+
+    std::vector<uint8_t> read_data(1024, 0);
+    struct fec_handle *handle = nullptr;
+    ASSERT_EQ(0,
+              fec_open(&handle, verity_image.path, O_RDONLY, FEC_FS_EXT4, 2));
+    std::unique_ptr<fec_handle> guard(handle);
+
+    ASSERT_EQ(1024, fec_pread(handle, read_data.data(), 1024, 4096 * 255));
+    ASSERT_EQ(std::vector<uint8_t>(1024, 255), read_data);
+
+    // The verity metadata is in the same RS block, and the block is first
+    // decoded without erasures, so there may already have been cache hits.
+    fec_status status{};
+    ASSERT_EQ(0, fec_get_status(handle, &status));
+    uint64_t hits = status.ecc_cache_hits;
+    uint64_t misses = status.ecc_cache_misses;
+
+    // The second block is recovered from the cached RS block.
+    ASSERT_EQ(1024, fec_pread(handle, read_data.data(), 1024, 4096 * 253));
+    ASSERT_EQ(std::vector<uint8_t>(1024, 253), read_data);
+
+    ASSERT_EQ(0, fec_get_status(handle, &status));
+    ASSERT_EQ(misses, status.ecc_cache_misses);
+    ASSERT_LE(hits + 1, status.ecc_cache_hits);
+}
+
+TEST_F(FecUnitTest, VerityImage_LazyVerify) {
+    TemporaryFile verity_image;
+    BuildAndAppendsVerityMetadata();
+    ASSERT_TRUE(android::base::WriteFully(verity_image.fd, image_.data(),
+                                          image_.size()));
+
+    struct fec_handle *handle = nullptr;
+    ASSERT_EQ(0, fec_open(&handle, verity_image.path, O_RDONLY,
+                          FEC_FS_EXT4 | FEC_VERITY_LAZY, 2));
+    std::unique_ptr<fec_handle> guard(handle);
+
+    // Only the upper levels are verified when the image is opened.
+    ASSERT_TRUE(handle->verity.hashtree.hash_data.empty());
+
+    std::vector<uint8_t> read_data(1024, 0);
+    ASSERT_EQ(1024, fec_pread(handle, read_data.data(), 1024, 4096 * 10));
+    ASSERT_EQ(std::vector<uint8_t>(1024, 10), read_data);
+
+    ASSERT_EQ(std::vector<uint8_t>(hashtree_content_.begin() + 4096,
+                                   hashtree_content_.end()),
+              handle->hashtree().hash_data);
+}
+
+TEST_F(FecUnitTest, VerityImage_CorrectHashtreeOnThreads) {
+    // Use 32 MiB of data, which has 64 blocks of data hashes, enough to
+    // validate them on two threads.
+    image_.clear();
+    for (unsigned i = 0; i < 8192; i++) {
+        image_.insert(image_.end(), 4096, i & 0xff);
+    }
+
+    TemporaryFile verity_image;
+    BuildAndAppendsVerityMetadata();
+    ASSERT_TRUE(android::base::WriteFully(verity_image.fd, image_.data(),
+                                          image_.size()));
+    TemporaryFile ecc_image;
+    BuildAndAppendsEccImage(verity_image.path, ecc_image.path);
+    std::string ecc_content;
+    ASSERT_TRUE(android::base::ReadFileToString(ecc_image.path, &ecc_content));
+    ASSERT_TRUE(android::base::WriteStringToFd(ecc_content, verity_image.fd));
+
+    // Corrupt a block of data hashes past the first chunk taken by a thread.
+    uint64_t hash_offset = 8192 * 4096;
+    uint64_t corrupt_offset = hash_offset + 4096 + 40 * 4096 + 100;
+    ASSERT_EQ(corrupt_offset, lseek64(verity_image.fd, corrupt_offset, 0));
+    std::vector<uint8_t> corruption(20, 5);
+    ASSERT_TRUE(android::base::WriteFully(verity_image.fd, corruption.data(),
+                                          corruption.size()));
+
+    struct fec_handle *handle = nullptr;
+    ASSERT_EQ(0, fec_open_threads(&handle, verity_image.path, O_RDWR,
+                                  FEC_FS_EXT4, 2, 4));
+    std::unique_ptr<fec_handle> guard(handle);
+
+    ASSERT_EQ(std::vector<uint8_t>(hashtree_content_.begin() + 4096,
+                                   hashtree_content_.end()),
+              handle->hashtree().hash_data);
+
+    std::vector<uint8_t> read_data(1024, 0);
+    ASSERT_EQ(1024, fec_pread(handle, read_data.data(), 1024, 4096 * 5130));
+    ASSERT_EQ(std::vector<uint8_t>(1024, 5130 & 0xff), read_data);
+
+    // The corrected block is written back to the image.
+    std::string content;
+    ASSERT_TRUE(android::base::ReadFileToString(verity_image.path, &content));
+    ASSERT_EQ(hashtree_content_,
+              content.substr(hash_offset, hashtree_content_.size()));
+}
+
+TEST_F(FecUnitTest, VerityImage_VerifiedCache) {
+    TemporaryFile verity_image;
+    BuildAndAppendsVerityMetadata();
+    ASSERT_TRUE(android::base::WriteFully(verity_image.fd, image_.data(),
+                                          image_.size()));
+
+    struct fec_handle *handle = nullptr;
+    ASSERT_EQ(0, fec_open(&handle, verity_image.path, O_RDONLY,
+                          FEC_FS_EXT4 | FEC_VERITY_CACHE, 2));
+    std::unique_ptr<fec_handle> guard(handle);
+
+    std::vector<uint8_t> read_data(1024, 0);
+    fec_status status{};
+    for (uint64_t expected_skipped : {0, 1}) {
+        ASSERT_EQ(1024, fec_pread(handle, read_data.data(), 1024, 4096 * 10));
+        ASSERT_EQ(std::vector<uint8_t>(1024, 10), read_data);
+
+        ASSERT_EQ(0, fec_get_status(handle, &status));
+        ASSERT_EQ(expected_skipped, status.verify_skipped);
+        ASSERT_EQ(1, status.verify_hashed);
+    }
+
+    // The block is hashed again after it may have been modified.
+    ASSERT_EQ(0, fec_invalidate(handle, 4096 * 10 + 100, 1));
+    ASSERT_EQ(1024, fec_pread(handle, read_data.data(), 1024, 4096 * 10));
+
+    ASSERT_EQ(0, fec_get_status(handle, &status));
+    ASSERT_EQ(1, status.verify_skipped);
+    ASSERT_EQ(2, status.verify_hashed);
+}
+
+TEST_F(FecUnitTest, VerityImage_VerifiedCacheCorruptedBlock) {
+    TemporaryFile verity_image;
+    BuildAndAppendsVerityMetadata();
+    ASSERT_TRUE(android::base::WriteFully(verity_image.fd, image_.data(),
+                                          image_.size()));
+    TemporaryFile ecc_image;
+    BuildAndAppendsEccImage(verity_image.path, ecc_image.path);
+    std::string ecc_content;
+    ASSERT_TRUE(android::base::ReadFileToString(ecc_image.path, &ecc_content));
+    ASSERT_TRUE(android::base::WriteStringToFd(ecc_content, verity_image.fd));
+
+    uint64_t corrupt_offset = 4096 * 10;
+    ASSERT_EQ(corrupt_offset, lseek64(verity_image.fd, corrupt_offset, 0));
+    std::vector<uint8_t> corruption(100, 99);
+    ASSERT_TRUE(android::base::WriteFully(verity_image.fd, corruption.data(),
+                                          corruption.size()));
+
+    struct fec_handle *handle = nullptr;
+    ASSERT_EQ(0, fec_open(&handle, verity_image.path, O_RDONLY,
+                          FEC_FS_EXT4 | FEC_VERITY_CACHE, 2));
+    std::unique_ptr<fec_handle> guard(handle);
+
+    // The corrected block isn't written back in read-only mode, so it has to
+    // be corrected on every read.
+    std::vector<uint8_t> read_data(1024, 0);
+    fec_status status{};
+    for (uint64_t expected_hashed : {1, 2}) {
+        ASSERT_EQ(1024, fec_pread(handle, read_data.data(), 1024,
+                                  corrupt_offset));
+        ASSERT_EQ(std::vector<uint8_t>(1024, 10), read_data);
+
+        ASSERT_EQ(0, fec_get_status(handle, &status));
+        ASSERT_EQ(0, status.verify_skipped);
+        ASSERT_EQ(expected_hashed, status.verify_hashed);
+    }
+}
+
 TEST_F(FecUnitTest, LoadAvbImage_HashtreeFooter) {
     TemporaryFile avb_image;
     ASSERT_TRUE(
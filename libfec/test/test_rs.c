@@ -24,6 +24,7 @@
 #include <unistd.h>
 #include <string.h>
 #include <fec.h>
+#include <fec/rs_simd.h>
 
 #define FEC_RSM 255
 #define FEC_ROOTS 16
@@ -31,6 +32,69 @@
 #define FEC_PARAMS(roots) \
     8, 0x11d, 0, 1, (roots), 0
 
+#define SIMD_CODEWORDS 1000 /* not a multiple of the vector size */
+
+/* compares each fec_rs_simd kernel supported by the CPU against encode_rs_char
+   for random codewords, returns the number of mismatches */
+static int test_simd(void *rs, int roots)
+{
+    static const char *kernels[] = { "scalar", "ssse3", "avx2", "neon" };
+    static uint8_t columns[FEC_RSM][SIMD_CODEWORDS];
+    static uint8_t expected[SIMD_CODEWORDS * FEC_RSM];
+    static uint8_t parity[SIMD_CODEWORDS * FEC_RSM];
+    const uint8_t *rows[FEC_RSM];
+    uint8_t data[FEC_RSM];
+    struct fec_rs_simd *simd;
+    int rsn = FEC_RSM - roots;
+    int i, k, failures = 0;
+    size_t n;
+
+    simd = fec_rs_simd_init(roots);
+
+    if (!simd) {
+        perror("fec_rs_simd_init");
+        exit(1);
+    }
+
+    printf("simd: roots %d, default kernel %s\n", roots,
+        fec_rs_simd_kernel(simd));
+
+    for (i = 0; i < rsn; ++i) {
+        for (k = 0; k < SIMD_CODEWORDS; ++k) {
+            columns[i][k] = (uint8_t)rand();
+        }
+
+        rows[i] = columns[i];
+    }
+
+    for (k = 0; k < SIMD_CODEWORDS; ++k) {
+        for (i = 0; i < rsn; ++i) {
+            data[i] = columns[i][k];
+        }
+
+        encode_rs_char(rs, data, &expected[k * roots]);
+    }
+
+    for (n = 0; n < sizeof(kernels) / sizeof(kernels[0]); ++n) {
+        if (fec_rs_simd_set_kernel(simd, kernels[n]) != 0) {
+            printf("\t%s: not supported\n", kernels[n]);
+            continue;
+        }
+
+        fec_rs_simd_encode(simd, rows, SIMD_CODEWORDS, parity);
+
+        if (memcmp(parity, expected, SIMD_CODEWORDS * roots)) {
+            printf("\t%s: MISMATCH\n", kernels[n]);
+            ++failures;
+        } else {
+            printf("\t%s: ok\n", kernels[n]);
+        }
+    }
+
+    fec_rs_simd_free(simd);
+    return failures;
+}
+
 int main()
 {
     uint8_t data[FEC_RSM];
@@ -89,5 +153,20 @@ int main()
         printf("\t\t%d errors in output\n", errors);
     }
 
-    exit(0);
+    free_rs_char(rs);
+
+    errors = 0;
+    for (i = 2; i <= 24; i += 2) {
+        rs = init_rs_char(FEC_PARAMS(i));
+
+        if (!rs) {
+            perror("init_rs_char");
+            exit(1);
+        }
+
+        errors += test_simd(rs, i);
+        free_rs_char(rs);
+    }
+
+    exit(errors ? 1 : 0);
 }
@@ -16,8 +16,11 @@
 
 #include "OfflineUnwinder.h"
 
+#include <string.h>
 #include <sys/mman.h>
 
+#include <algorithm>
+#include <string_view>
 #include <unordered_map>
 
 #include <android-base/logging.h>
@@ -26,6 +29,7 @@
 #include <unwindstack/MachineX86.h>
 #include <unwindstack/MachineX86_64.h>
 #include <unwindstack/Maps.h>
+#include <unwindstack/Memory.h>
 #include <unwindstack/Regs.h>
 #include <unwindstack/RegsArm.h>
 #include <unwindstack/RegsArm64.h>
@@ -51,6 +55,12 @@ namespace simpleperf {
 // Max frames seen so far is 463, in http://b/110923759.
 static constexpr size_t MAX_UNWINDING_FRAMES = 512;
 
+// The unwinding result cache has 1024 entries.
+static constexpr size_t UNWINDING_CACHE_SIZE_BITS = 10;
+// Size of stack data hashed in UnwindingCacheKey. Stack data near sp, holding return addresses
+// of the innermost frames, differs most between samples.
+static constexpr size_t UNWINDING_CACHE_STACK_HASH_SIZE = 256;
+
 static unwindstack::Regs* GetBacktraceRegs(const RegSet& regs) {
   switch (regs.arch) {
     case ARCH_ARM: {
@@ -182,9 +192,95 @@ void UnwindMaps::UpdateMaps(const MapSet& map_set) {
   Sort();
 }
 
+UnwindingCacheKey::UnwindingCacheKey(pid_t pid, uint64_t maps_version, const RegSet& regs,
+                                     const char* stack, size_t stack_size)
+    : pid(pid),
+      maps_version(maps_version),
+      regs(regs),
+      stack_size(stack_size),
+      stack_hash(std::hash<std::string_view>()(
+          std::string_view(stack, std::min(stack_size, UNWINDING_CACHE_STACK_HASH_SIZE)))) {}
+
+bool UnwindingCacheKey::operator==(const UnwindingCacheKey& other) const {
+  // Values of invalid regs are 0, so all values can be compared.
+  return pid == other.pid && maps_version == other.maps_version && regs.arch == other.regs.arch &&
+         regs.valid_mask == other.regs.valid_mask &&
+         memcmp(regs.data, other.regs.data, sizeof(regs.data)) == 0 &&
+         stack_size == other.stack_size && stack_hash == other.stack_hash;
+}
+
+const UnwindingResultCache::Entry* UnwindingResultCache::Find(const UnwindingCacheKey& key,
+                                                              const char* stack) const {
+  if (entries_.empty()) {
+    return nullptr;
+  }
+  const Entry* entry = entries_[GetIndex(key)].get();
+  if (entry == nullptr || !(entry->key == key)) {
+    return nullptr;
+  }
+  // Equal stack sizes keep the compared range in the stack.
+  if (memcmp(entry->stack_data.data(), stack + entry->stack_data_offset,
+             entry->stack_data.size()) != 0) {
+    return nullptr;
+  }
+  return entry;
+}
+
+void UnwindingResultCache::Add(Entry&& entry) {
+  if (entries_.empty()) {
+    entries_.resize(static_cast<size_t>(1) << size_bits_);
+  }
+  size_t index = GetIndex(entry.key);
+  entries_[index].reset(new Entry(std::move(entry)));
+}
+
+size_t UnwindingResultCache::GetIndex(const UnwindingCacheKey& key) const {
+  uint64_t ip = 0;
+  uint64_t sp = 0;
+  key.regs.GetIpRegValue(&ip);
+  key.regs.GetSpRegValue(&sp);
+  uint64_t hash = key.stack_hash;
+  for (uint64_t value : {static_cast<uint64_t>(key.pid), key.maps_version, ip, sp}) {
+    hash = (hash ^ value) * 0x100000001b3ULL;
+  }
+  return (hash ^ (hash >> 32)) & ((static_cast<size_t>(1) << size_bits_) - 1);
+}
+
+// Memory of the stack data in a sample, like the memory created by
+// unwindstack::Memory::CreateOfflineMemory(). It also records the range of stack data read by
+// unwinding, which decides the unwinding result.
+class StackMemory : public unwindstack::Memory {
+ public:
+  StackMemory(const char* stack, uint64_t stack_addr, size_t stack_size)
+      : stack_(stack), stack_addr_(stack_addr), stack_size_(stack_size) {}
+
+  size_t Read(uint64_t addr, void* dst, size_t size) override {
+    if (addr < stack_addr_ || addr - stack_addr_ >= stack_size_) {
+      return 0;
+    }
+    size_t offset = addr - stack_addr_;
+    size = std::min(size, stack_size_ - offset);
+    memcpy(dst, stack_ + offset, size);
+    read_start_ = std::min(read_start_, offset);
+    read_end_ = std::max(read_end_, offset + size);
+    return size;
+  }
+
+  size_t ReadStart() const { return read_start_ < read_end_ ? read_start_ : 0; }
+  size_t ReadEnd() const { return read_end_; }
+
+ private:
+  const char* stack_;
+  const uint64_t stack_addr_;
+  const size_t stack_size_;
+  size_t read_start_ = SIZE_MAX;
+  size_t read_end_ = 0;
+};
+
 class OfflineUnwinderImpl : public OfflineUnwinder {
  public:
-  OfflineUnwinderImpl(bool collect_stat) : collect_stat_(collect_stat) {
+  OfflineUnwinderImpl(bool collect_stat)
+      : collect_stat_(collect_stat), unwinding_cache_(UNWINDING_CACHE_SIZE_BITS) {
     unwindstack::Elf::SetCachingEnabled(true);
   }
 
@@ -195,6 +291,7 @@ class OfflineUnwinderImpl : public OfflineUnwinder {
  private:
   bool collect_stat_;
   std::unordered_map<pid_t, UnwindMaps> cached_maps_;
+  UnwindingResultCache unwinding_cache_;
 };
 
 bool OfflineUnwinderImpl::UnwindCallChain(const ThreadEntry& thread, const RegSet& regs,
@@ -215,16 +312,30 @@ bool OfflineUnwinderImpl::UnwindCallChain(const ThreadEntry& thread, const RegSe
   }
   uint64_t stack_addr = sp_reg_value;
 
+  UnwindingCacheKey key(thread.pid, thread.maps->version, regs, stack, stack_size);
+  const UnwindingResultCache::Entry* entry = unwinding_cache_.Find(key, stack);
+  if (entry != nullptr) {
+    *ips = entry->ips;
+    *sps = entry->sps;
+    is_callchain_broken_for_incomplete_jit_debug_info_ =
+        entry->is_callchain_broken_for_incomplete_jit_debug_info;
+    if (collect_stat_) {
+      unwinding_result_ = entry->unwinding_result;
+      unwinding_result_.used_time = GetSystemClock() - start_time;
+      unwinding_result_.cache_hit = true;
+    }
+    return true;
+  }
+
   UnwindMaps& cached_map = cached_maps_[thread.pid];
   cached_map.UpdateMaps(*thread.maps);
   std::unique_ptr<unwindstack::Regs> unwind_regs(GetBacktraceRegs(regs));
   if (!unwind_regs) {
     return false;
   }
-  unwindstack::Unwinder unwinder(
-      MAX_UNWINDING_FRAMES, &cached_map, unwind_regs.get(),
-      unwindstack::Memory::CreateOfflineMemory(reinterpret_cast<const uint8_t*>(stack), stack_addr,
-                                               stack_addr + stack_size));
+  auto stack_memory = std::make_shared<StackMemory>(stack, stack_addr, stack_size);
+  unwindstack::Unwinder unwinder(MAX_UNWINDING_FRAMES, &cached_map, unwind_regs.get(),
+                                 stack_memory);
   unwinder.SetResolveNames(false);
   unwinder.Unwind();
   size_t last_jit_method_frame = UINT_MAX;
@@ -292,7 +403,13 @@ bool OfflineUnwinderImpl::UnwindCallChain(const ThreadEntry& thread, const RegSe
     }
     unwinding_result_.stack_start = stack_addr;
     unwinding_result_.stack_end = stack_addr + stack_size;
+    unwinding_result_.cache_hit = false;
   }
+  size_t read_start = stack_memory->ReadStart();
+  size_t read_end = stack_memory->ReadEnd();
+  unwinding_cache_.Add(UnwindingResultCache::Entry{
+      std::move(key), read_start, std::vector<char>(stack + read_start, stack + read_end), *ips,
+      *sps, unwinding_result_, is_callchain_broken_for_incomplete_jit_debug_info_});
   return true;
 }
 
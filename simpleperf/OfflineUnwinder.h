@@ -48,6 +48,9 @@ struct UnwindingResult {
   } stop_info;
   uint64_t stack_start;
   uint64_t stack_end;
+  // Whether the callchain is from the unwinding result cache. Not stored in
+  // UnwindingResultRecord.
+  bool cache_hit = false;
 };
 
 class OfflineUnwinder {
@@ -16,8 +16,15 @@
 
 #pragma once
 
+#include <sys/types.h>
+
+#include <memory>
+#include <vector>
+
 #include <unwindstack/Maps.h>
 
+#include "OfflineUnwinder.h"
+#include "perf_regs.h"
 #include "thread_tree.h"
 
 namespace simpleperf {
@@ -31,4 +38,47 @@ class UnwindMaps : public unwindstack::Maps {
   std::vector<const MapEntry*> entries_;
 };
 
+// Identifies the input of unwinding a sample. Unwinding samples with the same registers and stack
+// data in a process gives the same callchain, as long as maps of the process don't change. Only
+// stack data near sp is hashed. Stack data read by unwinding is compared when finding an entry.
+struct UnwindingCacheKey {
+  pid_t pid;
+  uint64_t maps_version;
+  RegSet regs;
+  size_t stack_size;
+  uint64_t stack_hash;
+
+  UnwindingCacheKey(pid_t pid, uint64_t maps_version, const RegSet& regs, const char* stack,
+                    size_t stack_size);
+  bool operator==(const UnwindingCacheKey& other) const;
+};
+
+// Caches results of unwinding recent samples. Samples hitting a hot loop often have the same
+// registers and stack data. It is a direct-mapped table indexed by a hash of the key, so a new
+// result replaces the old one having the same index.
+class UnwindingResultCache {
+ public:
+  struct Entry {
+    UnwindingCacheKey key;
+    // Stack data read by unwinding, starting at stack_data_offset in the stack.
+    size_t stack_data_offset;
+    std::vector<char> stack_data;
+    std::vector<uint64_t> ips;
+    std::vector<uint64_t> sps;
+    UnwindingResult unwinding_result;
+    bool is_callchain_broken_for_incomplete_jit_debug_info;
+  };
+
+  explicit UnwindingResultCache(size_t size_bits) : size_bits_(size_bits) {}
+  // Return the entry of key, if stack data it read is the same in stack.
+  const Entry* Find(const UnwindingCacheKey& key, const char* stack) const;
+  void Add(Entry&& entry);
+
+ private:
+  size_t GetIndex(const UnwindingCacheKey& key) const;
+
+  const size_t size_bits_;
+  std::vector<std::unique_ptr<Entry>> entries_;
+};
+
 }  // namespace simpleperf
@@ -85,3 +85,56 @@ TEST(OfflineUnwinder, UnwindMaps) {
   maps.UpdateMaps(map_set);
   ASSERT_TRUE(CheckUnwindMaps(maps, map_set));
 }
+
+TEST(OfflineUnwinder, UnwindingResultCache) {
+  ScopedCurrentArch scoped_arch(ARCH_ARM64);
+  uint64_t reg_values[] = {0x1000, 0x2000};
+  RegSet regs(PERF_SAMPLE_REGS_ABI_64, (1ULL << PERF_REG_ARM64_SP) | (1ULL << PERF_REG_ARM64_PC),
+              reg_values);
+  std::vector<char> stack(512, 'a');
+  UnwindingCacheKey key(1, 1, regs, stack.data(), stack.size());
+
+  UnwindingResultCache cache(4);
+  ASSERT_EQ(cache.Find(key, stack.data()), nullptr);
+  UnwindingResult unwinding_result;
+  unwinding_result.stop_reason = UnwindingResult::MAP_MISSING;
+  // Unwinding read stack data in [8, 40).
+  cache.Add(UnwindingResultCache::Entry{key, 8, std::vector<char>(32, 'a'), {0x2000, 0x3000},
+                                        {0x1000, 0x1100}, unwinding_result, true});
+  const UnwindingResultCache::Entry* entry = cache.Find(key, stack.data());
+  ASSERT_NE(entry, nullptr);
+  ASSERT_EQ(entry->ips, std::vector<uint64_t>({0x2000, 0x3000}));
+  ASSERT_EQ(entry->sps, std::vector<uint64_t>({0x1000, 0x1100}));
+  ASSERT_EQ(entry->unwinding_result.stop_reason, UnwindingResult::MAP_MISSING);
+  ASSERT_TRUE(entry->is_callchain_broken_for_incomplete_jit_debug_info);
+
+  // A key with the same registers and stack data hits the cache.
+  ASSERT_EQ(cache.Find(UnwindingCacheKey(1, 1, regs, stack.data(), stack.size()), stack.data()),
+            entry);
+
+  // Changing the pid, maps version, registers or stack data misses the cache.
+  ASSERT_EQ(cache.Find(UnwindingCacheKey(2, 1, regs, stack.data(), stack.size()), stack.data()),
+            nullptr);
+  ASSERT_EQ(cache.Find(UnwindingCacheKey(1, 2, regs, stack.data(), stack.size()), stack.data()),
+            nullptr);
+  ASSERT_EQ(
+      cache.Find(UnwindingCacheKey(1, 1, regs, stack.data(), stack.size() - 1), stack.data()),
+      nullptr);
+  RegSet regs2 = regs;
+  regs2.data[PERF_REG_ARM64_X0] = 1;
+  ASSERT_EQ(cache.Find(UnwindingCacheKey(1, 1, regs2, stack.data(), stack.size()), stack.data()),
+            nullptr);
+  // Stack data not read by unwinding isn't compared.
+  stack.back() = 'b';
+  ASSERT_EQ(cache.Find(UnwindingCacheKey(1, 1, regs, stack.data(), stack.size()), stack.data()),
+            entry);
+  // Stack data read by unwinding is compared, even if it isn't hashed.
+  std::vector<char> stack2(stack);
+  stack2[20] = 'b';
+  UnwindingCacheKey key2(1, 1, regs, stack2.data(), stack2.size());
+  key2.stack_hash = key.stack_hash;
+  ASSERT_EQ(cache.Find(key2, stack2.data()), nullptr);
+  stack[0] = 'b';
+  ASSERT_EQ(cache.Find(UnwindingCacheKey(1, 1, regs, stack.data(), stack.size()), stack.data()),
+            nullptr);
+}
@@ -31,6 +31,23 @@ namespace simpleperf {
 
 static constexpr size_t kDefaultLowBufferLevel = 10 * 1024 * 1024u;
 static constexpr size_t kDefaultCriticalBufferLevel = 5 * 1024 * 1024u;
+// Max records read by RecordReadThread::ReadRecordBatch() before releasing their space.
+static constexpr size_t kRecordBatchSize = 64;
+
+// Stack size limits of AdaptiveSampling are multiples of 1K, and at least 1K.
+static constexpr size_t kStackSizeLimitUnit = 1024;
+static constexpr size_t kStackSizeLimitTableSize = 4096;
+// Shrink the stack size limit of a thread to the stack usage of its last 32 samples.
+static constexpr size_t kStackUsageSampleCount = 32;
+// The sample drop rate is adjusted by one step every 100ms of record time. It is raised when
+// kernel buffers were half full during the period, and lowered when they stayed less than a
+// quarter full during the whole period.
+static constexpr uint64_t kDropRatePeriodInNs = 100000000;
+static constexpr double kHighBufferUsage = 0.5;
+static constexpr double kLowBufferUsage = 0.25;
+static constexpr uint32_t kDropRateStep = 100;
+static constexpr uint32_t kMaxDropRate = 900;
+static constexpr size_t kMaxAdaptiveSamplingDecisions = 65536;
 
 RecordBuffer::RecordBuffer(size_t buffer_size)
     : read_head_(0), write_head_(0), buffer_size_(buffer_size), buffer_(new char[buffer_size]) {
@@ -79,7 +96,7 @@ void RecordBuffer::FinishWrite() {
 
 char* RecordBuffer::GetCurrentRecord() {
   size_t write_head = write_head_.load(std::memory_order_acquire);
-  size_t read_head = read_head_.load(std::memory_order_relaxed);
+  size_t read_head = read_pos_;
   if (read_head == write_head) {
     return nullptr;
   }
@@ -100,12 +117,19 @@ char* RecordBuffer::GetCurrentRecord() {
 }
 
 void RecordBuffer::MoveToNextRecord() {
-  size_t read_head = read_head_.load(std::memory_order_relaxed);
-  read_head = (read_head + cur_read_record_size_) % buffer_size_;
-  read_head_.store(read_head, std::memory_order_release);
+  MoveToNextRecordInBatch();
+  ReleaseReadSpace();
+}
+
+void RecordBuffer::MoveToNextRecordInBatch() {
+  read_pos_ = (read_pos_ + cur_read_record_size_) % buffer_size_;
   cur_read_record_size_ = 0;
 }
 
+void RecordBuffer::ReleaseReadSpace() {
+  read_head_.store(read_pos_, std::memory_order_release);
+}
+
 RecordParser::RecordParser(const perf_event_attr& attr)
     : sample_type_(attr.sample_type),
       sample_regs_count_(__builtin_popcountll(attr.sample_regs_user)) {
@@ -168,6 +192,89 @@ size_t RecordParser::GetStackSizePos(
   return (sample_type_ & PERF_SAMPLE_STACK_USER) ? pos : 0;
 }
 
+AdaptiveSampling::AdaptiveSampling(size_t max_stack_size)
+    : max_stack_size_(max_stack_size),
+      stack_size_limits_(new std::atomic<uint64_t>[kStackSizeLimitTableSize]) {
+  for (size_t i = 0; i < kStackSizeLimitTableSize; ++i) {
+    stack_size_limits_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+void AdaptiveSampling::UpdateStackUsage(pid_t tid, uint64_t time, uint64_t used_stack_size,
+                                        uint64_t stack_size) {
+  auto it = stack_usages_.find(tid);
+  if (it == stack_usages_.end()) {
+    it = stack_usages_.emplace(tid, StackUsage{max_stack_size_}).first;
+  }
+  StackUsage& usage = it->second;
+  usage.max_used_stack_size = std::max(usage.max_used_stack_size, used_stack_size);
+  usage.sample_count++;
+  size_t new_limit = usage.limit;
+  if (stack_size >= usage.limit && used_stack_size + kStackSizeLimitUnit > stack_size) {
+    // Unwinding reached the end of the cut stack data, so callchains may be truncated.
+    new_limit = std::min(usage.limit * 2, max_stack_size_);
+    usage.max_used_stack_size = 0;
+    usage.sample_count = 0;
+  } else if (usage.sample_count >= kStackUsageSampleCount) {
+    size_t limit = std::max<size_t>(Align(usage.max_used_stack_size, kStackSizeLimitUnit),
+                                    kStackSizeLimitUnit);
+    new_limit = std::min(limit + kStackSizeLimitUnit, usage.limit);
+    usage.max_used_stack_size = 0;
+    usage.sample_count = 0;
+  }
+  std::atomic<uint64_t>& entry = stack_size_limits_[tid % kStackSizeLimitTableSize];
+  if (new_limit != usage.limit) {
+    usage.limit = new_limit;
+    AddDecision(time, PerfFileFormat::DECISION_STACK_SIZE_LIMIT, tid, new_limit);
+    entry.store((static_cast<uint64_t>(tid) << 32) | new_limit, std::memory_order_relaxed);
+  } else if (usage.limit < max_stack_size_ &&
+             (entry.load(std::memory_order_relaxed) >> 32) != static_cast<uint32_t>(tid)) {
+    // The entry was taken by another thread with the same index.
+    entry.store((static_cast<uint64_t>(tid) << 32) | usage.limit, std::memory_order_relaxed);
+  }
+}
+
+size_t AdaptiveSampling::GetStackSizeLimit(pid_t tid) const {
+  uint64_t value = stack_size_limits_[tid % kStackSizeLimitTableSize].load(
+      std::memory_order_relaxed);
+  size_t limit = static_cast<uint32_t>(value);
+  if ((value >> 32) == static_cast<uint32_t>(tid) && limit != 0) {
+    return limit;
+  }
+  return max_stack_size_;
+}
+
+void AdaptiveSampling::UpdateDropRate(int first_cpu, uint64_t time, double buffer_usage,
+                                      DropRateState* state) {
+  state->max_buffer_usage = std::max(state->max_buffer_usage, buffer_usage);
+  if (state->period_start_time != 0 && time < state->period_start_time + kDropRatePeriodInNs) {
+    return;
+  }
+  uint32_t drop_rate = state->drop_rate;
+  if (state->max_buffer_usage >= kHighBufferUsage) {
+    state->drop_rate = std::min(drop_rate + kDropRateStep, kMaxDropRate);
+  } else if (state->max_buffer_usage < kLowBufferUsage) {
+    state->drop_rate = drop_rate > kDropRateStep ? drop_rate - kDropRateStep : 0;
+  }
+  if (state->drop_rate != drop_rate) {
+    AddDecision(time, PerfFileFormat::DECISION_SAMPLE_DROP_RATE, first_cpu, state->drop_rate);
+  }
+  state->period_start_time = time;
+  state->max_buffer_usage = 0;
+}
+
+std::vector<PerfFileFormat::AdaptiveSamplingDecision> AdaptiveSampling::GetDecisions() {
+  std::lock_guard<std::mutex> lock(decision_mutex_);
+  return decisions_;
+}
+
+void AdaptiveSampling::AddDecision(uint64_t time, uint32_t type, uint32_t id, uint64_t value) {
+  std::lock_guard<std::mutex> lock(decision_mutex_);
+  if (decisions_.size() < kMaxAdaptiveSamplingDecisions) {
+    decisions_.push_back({time, type, id, value});
+  }
+}
+
 KernelRecordReader::KernelRecordReader(EventFd* event_fd) : event_fd_(event_fd) {
   size_t buffer_size;
   buffer_ = event_fd_->GetMappedBuffer(buffer_size);
@@ -209,16 +316,19 @@ bool KernelRecordReader::MoveToNextRecord(const RecordParser& parser) {
   return true;
 }
 
-RecordReadThread::RecordReadThread(size_t record_buffer_size, const perf_event_attr& attr,
+RecordReadWorker::RecordReadWorker(size_t record_buffer_size, const perf_event_attr& attr,
                                    size_t min_mmap_pages, size_t max_mmap_pages,
                                    size_t aux_buffer_size, bool allow_cutting_samples,
-                                   bool exclude_perf)
+                                   pid_t exclude_pid,
+                                   const std::function<bool()>& data_notification_callback)
     : record_buffer_(record_buffer_size),
       record_parser_(attr),
-      attr_(attr),
       min_mmap_pages_(min_mmap_pages),
       max_mmap_pages_(max_mmap_pages),
-      aux_buffer_size_(aux_buffer_size) {
+      aux_buffer_size_(aux_buffer_size),
+      exclude_pid_(exclude_pid),
+      data_notification_callback_(data_notification_callback),
+      last_record_time_(0) {
   if (attr.sample_type & PERF_SAMPLE_STACK_USER) {
     stack_size_in_sample_record_ = attr.sample_stack_user;
   }
@@ -227,69 +337,41 @@ RecordReadThread::RecordReadThread(size_t record_buffer_size, const perf_event_a
   if (!allow_cutting_samples) {
     record_buffer_low_level_ = record_buffer_critical_level_;
   }
-  if (exclude_perf) {
-    exclude_pid_ = getpid();
-  }
 }
 
-RecordReadThread::~RecordReadThread() {
+RecordReadWorker::~RecordReadWorker() {
   if (read_thread_) {
-    StopReadThread();
+    if (SendCmd(CMD_STOP_THREAD, nullptr)) {
+      WaitCmdResult();
+    }
+    JoinReadThread();
   }
 }
 
-bool RecordReadThread::RegisterDataCallback(IOEventLoop& loop,
-                                            const std::function<bool()>& data_callback) {
+bool RecordReadWorker::StartReadThread() {
   int cmd_fd[2];
-  int data_fd[2];
-  if (pipe2(cmd_fd, O_CLOEXEC) != 0 || pipe2(data_fd, O_CLOEXEC) != 0) {
+  if (pipe2(cmd_fd, O_CLOEXEC) != 0) {
     PLOG(ERROR) << "pipe2";
     return false;
   }
   read_cmd_fd_.reset(cmd_fd[0]);
   write_cmd_fd_.reset(cmd_fd[1]);
   cmd_ = NO_CMD;
-  read_data_fd_.reset(data_fd[0]);
-  write_data_fd_.reset(data_fd[1]);
-  has_data_notification_ = false;
-  if (!loop.AddReadEvent(read_data_fd_, data_callback)) {
-    return false;
-  }
   read_thread_.reset(new std::thread([&]() { RunReadThread(); }));
   return true;
 }
 
-bool RecordReadThread::AddEventFds(const std::vector<EventFd*>& event_fds) {
-  return SendCmdToReadThread(CMD_ADD_EVENT_FDS, const_cast<std::vector<EventFd*>*>(&event_fds));
-}
-
-bool RecordReadThread::RemoveEventFds(const std::vector<EventFd*>& event_fds) {
-  return SendCmdToReadThread(CMD_REMOVE_EVENT_FDS, const_cast<std::vector<EventFd*>*>(&event_fds));
-}
-
-bool RecordReadThread::SyncKernelBuffer() {
-  return SendCmdToReadThread(CMD_SYNC_KERNEL_BUFFER, nullptr);
-}
-
-bool RecordReadThread::StopReadThread() {
-  bool result = SendCmdToReadThread(CMD_STOP_THREAD, nullptr);
-  if (result) {
-    read_thread_->join();
-    read_thread_ = nullptr;
-  }
-  return result;
-}
-
-bool RecordReadThread::SendCmdToReadThread(Cmd cmd, void* cmd_arg) {
+bool RecordReadWorker::SendCmd(Cmd cmd, void* cmd_arg) {
   {
     std::lock_guard<std::mutex> lock(cmd_mutex_);
     cmd_ = cmd;
     cmd_arg_ = cmd_arg;
   }
   char dummy = 0;
-  if (TEMP_FAILURE_RETRY(write(write_cmd_fd_, &dummy, 1)) != 1) {
-    return false;
-  }
+  return TEMP_FAILURE_RETRY(write(write_cmd_fd_, &dummy, 1)) == 1;
+}
+
+bool RecordReadWorker::WaitCmdResult() {
   std::unique_lock<std::mutex> lock(cmd_mutex_);
   while (cmd_ != NO_CMD) {
     cmd_finish_cond_.wait(lock);
@@ -297,34 +379,19 @@ bool RecordReadThread::SendCmdToReadThread(Cmd cmd, void* cmd_arg) {
   return cmd_result_;
 }
 
-std::unique_ptr<Record> RecordReadThread::GetRecord() {
-  record_buffer_.MoveToNextRecord();
-  char* p = record_buffer_.GetCurrentRecord();
-  if (p != nullptr) {
-    std::unique_ptr<Record> r = ReadRecordFromBuffer(attr_, p);
-    if (r->type() == PERF_RECORD_AUXTRACE) {
-      auto auxtrace = static_cast<AuxTraceRecord*>(r.get());
-      record_buffer_.AddCurrentRecordSize(auxtrace->data->aux_size);
-      auxtrace->location.addr = r->Binary() + r->size();
-    }
-    return r;
-  }
-  if (has_data_notification_) {
-    char dummy;
-    TEMP_FAILURE_RETRY(read(read_data_fd_, &dummy, 1));
-    has_data_notification_ = false;
-  }
-  return nullptr;
+void RecordReadWorker::JoinReadThread() {
+  read_thread_->join();
+  read_thread_ = nullptr;
 }
 
-void RecordReadThread::RunReadThread() {
+void RecordReadWorker::RunReadThread() {
   IncreaseThreadPriority();
   IOEventLoop loop;
   CHECK(loop.AddReadEvent(read_cmd_fd_, [&]() { return HandleCmd(loop); }));
   loop.RunLoop();
 }
 
-void RecordReadThread::IncreaseThreadPriority() {
+void RecordReadWorker::IncreaseThreadPriority() {
   // TODO: use real time priority for root.
   rlimit rlim;
   int result = getrlimit(RLIMIT_NICE, &rlim);
@@ -336,12 +403,12 @@ void RecordReadThread::IncreaseThreadPriority() {
   }
 }
 
-RecordReadThread::Cmd RecordReadThread::GetCmd() {
+RecordReadWorker::Cmd RecordReadWorker::GetCmd() {
   std::lock_guard<std::mutex> lock(cmd_mutex_);
   return cmd_;
 }
 
-bool RecordReadThread::HandleCmd(IOEventLoop& loop) {
+bool RecordReadWorker::HandleCmd(IOEventLoop& loop) {
   char dummy;
   TEMP_FAILURE_RETRY(read(read_cmd_fd_, &dummy, 1));
   bool result = true;
@@ -370,7 +437,7 @@ bool RecordReadThread::HandleCmd(IOEventLoop& loop) {
   return true;
 }
 
-bool RecordReadThread::HandleAddEventFds(IOEventLoop& loop,
+bool RecordReadWorker::HandleAddEventFds(IOEventLoop& loop,
                                          const std::vector<EventFd*>& event_fds) {
   std::unordered_map<int, EventFd*> cpu_map;
   for (size_t pages = max_mmap_pages_; pages >= min_mmap_pages_; pages >>= 1) {
@@ -420,7 +487,7 @@ bool RecordReadThread::HandleAddEventFds(IOEventLoop& loop,
   return true;
 }
 
-bool RecordReadThread::HandleRemoveEventFds(const std::vector<EventFd*>& event_fds) {
+bool RecordReadWorker::HandleRemoveEventFds(const std::vector<EventFd*>& event_fds) {
   for (auto& event_fd : event_fds) {
     if (event_fd->HasMappedBuffer()) {
       auto it = std::find_if(kernel_record_readers_.begin(), kernel_record_readers_.end(),
@@ -445,12 +512,14 @@ static bool CompareRecordTime(KernelRecordReader* r1, KernelRecordReader* r2) {
 // When reading from mmap buffers, we prefer reading from all buffers at once rather than reading
 // one buffer at a time. Because by reading all buffers at once, we can merge records from
 // different buffers easily in memory. Otherwise, we have to sort records with greater effort.
-bool RecordReadThread::ReadRecordsFromKernelBuffer() {
+bool RecordReadWorker::ReadRecordsFromKernelBuffer() {
   do {
     std::vector<KernelRecordReader*> readers;
+    double buffer_usage = 0;
     for (auto& reader : kernel_record_readers_) {
       if (reader.GetDataFromKernelBuffer()) {
         readers.push_back(&reader);
+        buffer_usage = std::max(buffer_usage, reader.GetBufferUsage());
       }
     }
     bool has_data = false;
@@ -482,11 +551,21 @@ bool RecordReadThread::ReadRecordsFromKernelBuffer() {
         }
       }
     }
+    if (!readers.empty()) {
+      uint64_t time = 0;
+      for (auto& reader : readers) {
+        time = std::max(time, reader->RecordTime());
+      }
+      last_record_time_.store(time, std::memory_order_release);
+      if (adaptive_sampling_ != nullptr) {
+        adaptive_sampling_->UpdateDropRate(first_cpu_, time, buffer_usage, &drop_rate_state_);
+      }
+    }
     ReadAuxDataFromKernelBuffer(&has_data);
     if (!has_data) {
       break;
     }
-    if (!SendDataNotificationToMainThread()) {
+    if (!data_notification_callback_()) {
       return false;
     }
     // If there are no commands, we can loop until there is no more data from the kernel.
@@ -494,7 +573,7 @@ bool RecordReadThread::ReadRecordsFromKernelBuffer() {
   return true;
 }
 
-void RecordReadThread::PushRecordToRecordBuffer(KernelRecordReader* kernel_record_reader) {
+void RecordReadWorker::PushRecordToRecordBuffer(KernelRecordReader* kernel_record_reader) {
   const perf_event_header& header = kernel_record_reader->RecordHeader();
   if (header.type == PERF_RECORD_SAMPLE && exclude_pid_ != -1) {
     uint32_t pid;
@@ -503,6 +582,15 @@ void RecordReadThread::PushRecordToRecordBuffer(KernelRecordReader* kernel_recor
       return;
     }
   }
+  if (header.type == PERF_RECORD_SAMPLE && drop_rate_state_.drop_rate > 0) {
+    // Drop drop_rate out of 1000 samples evenly.
+    drop_credit_ += drop_rate_state_.drop_rate;
+    if (drop_credit_ >= 1000) {
+      drop_credit_ -= 1000;
+      stat_.throttled_samples++;
+      return;
+    }
+  }
   if (header.type == PERF_RECORD_SAMPLE && stack_size_in_sample_record_ > 1024) {
     size_t free_size = record_buffer_.GetFreeSize();
     if (free_size < record_buffer_critical_level_) {
@@ -518,6 +606,12 @@ void RecordReadThread::PushRecordToRecordBuffer(KernelRecordReader* kernel_recor
       // the call chain joiner can complete the callchains.
       stack_size_limit = 1024;
     }
+    if (adaptive_sampling_ != nullptr && record_parser_.GetPidPosInSampleRecord() != 0) {
+      uint32_t tid;
+      kernel_record_reader->ReadRecord(record_parser_.GetPidPosInSampleRecord() + sizeof(uint32_t),
+                                       sizeof(tid), &tid);
+      stack_size_limit = std::min(stack_size_limit, adaptive_sampling_->GetStackSizeLimit(tid));
+    }
     size_t stack_size_pos = record_parser_.GetStackSizePos(
         [&](size_t pos, size_t size, void* dest) {
           return kernel_record_reader->ReadRecord(pos, size, dest);
@@ -577,7 +671,7 @@ void RecordReadThread::PushRecordToRecordBuffer(KernelRecordReader* kernel_recor
   }
 }
 
-void RecordReadThread::ReadAuxDataFromKernelBuffer(bool* has_data) {
+void RecordReadWorker::ReadAuxDataFromKernelBuffer(bool* has_data) {
   for (auto& reader : kernel_record_readers_) {
     EventFd* event_fd = reader.GetEventFd();
     if (event_fd->HasAuxBuffer()) {
@@ -615,9 +709,308 @@ void RecordReadThread::ReadAuxDataFromKernelBuffer(bool* has_data) {
   }
 }
 
+RecordReadThread::RecordReadThread(size_t record_buffer_size, const perf_event_attr& attr,
+                                   size_t min_mmap_pages, size_t max_mmap_pages,
+                                   size_t aux_buffer_size, bool allow_cutting_samples,
+                                   bool exclude_perf, size_t read_thread_count)
+    : attr_(attr), record_parser_(attr) {
+  read_thread_count = std::max<size_t>(read_thread_count, 1);
+  size_t cpu_count = std::max<long>(sysconf(_SC_NPROCESSORS_CONF), 1);
+  cpus_per_worker_ = (cpu_count + read_thread_count - 1) / read_thread_count;
+  pid_t exclude_pid = exclude_perf ? getpid() : -1;
+  for (size_t i = 0; i < read_thread_count; ++i) {
+    workers_.emplace_back(new RecordReadWorker(
+        record_buffer_size / read_thread_count, attr, min_mmap_pages, max_mmap_pages,
+        aux_buffer_size, allow_cutting_samples, exclude_pid,
+        [this]() { return SendDataNotificationToMainThread(); }));
+  }
+  current_records_.resize(read_thread_count);
+  synced_times_.resize(read_thread_count, 0);
+}
+
+RecordReadThread::~RecordReadThread() {
+  if (read_threads_started_) {
+    StopReadThread();
+  }
+}
+
+void RecordReadThread::SetAdaptiveSampling(AdaptiveSampling* adaptive_sampling) {
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    workers_[i]->SetAdaptiveSampling(adaptive_sampling, i * cpus_per_worker_);
+  }
+}
+
+void RecordReadThread::SetBufferLevels(size_t record_buffer_low_level,
+                                       size_t record_buffer_critical_level) {
+  for (auto& worker : workers_) {
+    worker->SetBufferLevels(record_buffer_low_level / workers_.size(),
+                            record_buffer_critical_level / workers_.size());
+  }
+}
+
+bool RecordReadThread::RegisterDataCallback(IOEventLoop& loop,
+                                            const std::function<bool()>& data_callback) {
+  int data_fd[2];
+  if (pipe2(data_fd, O_CLOEXEC) != 0) {
+    PLOG(ERROR) << "pipe2";
+    return false;
+  }
+  read_data_fd_.reset(data_fd[0]);
+  write_data_fd_.reset(data_fd[1]);
+  has_data_notification_ = false;
+  if (!loop.AddReadEvent(read_data_fd_, data_callback)) {
+    return false;
+  }
+  for (auto& worker : workers_) {
+    if (!worker->StartReadThread()) {
+      return false;
+    }
+    read_threads_started_ = true;
+  }
+  return true;
+}
+
+bool RecordReadThread::AddEventFds(const std::vector<EventFd*>& event_fds) {
+  return SendCmdToReadThreads(RecordReadWorker::CMD_ADD_EVENT_FDS, &event_fds);
+}
+
+bool RecordReadThread::RemoveEventFds(const std::vector<EventFd*>& event_fds) {
+  return SendCmdToReadThreads(RecordReadWorker::CMD_REMOVE_EVENT_FDS, &event_fds);
+}
+
+bool RecordReadThread::SyncKernelBuffer() {
+  return SendCmdToReadThreads(RecordReadWorker::CMD_SYNC_KERNEL_BUFFER, nullptr);
+}
+
+bool RecordReadThread::StopReadThread() {
+  bool result = SendCmdToReadThreads(RecordReadWorker::CMD_STOP_THREAD, nullptr);
+  if (result) {
+    for (auto& worker : workers_) {
+      worker->JoinReadThread();
+    }
+    read_threads_started_ = false;
+  }
+  return result;
+}
+
+// If event_fds isn't nullptr, they are split by cpu, and each read thread only gets the cmd if
+// it has event fds. Otherwise, all read threads get the cmd. The cmd is sent to all read threads
+// before waiting for results, so they handle it in parallel.
+bool RecordReadThread::SendCmdToReadThreads(RecordReadWorker::Cmd cmd,
+                                            const std::vector<EventFd*>* event_fds) {
+  std::lock_guard<std::mutex> lock(cmd_mutex_);
+  std::vector<std::vector<EventFd*>> worker_event_fds(workers_.size());
+  if (event_fds != nullptr) {
+    for (EventFd* event_fd : *event_fds) {
+      size_t index = event_fd->Cpu() < 0 ? 0 : event_fd->Cpu() / cpus_per_worker_;
+      worker_event_fds[std::min(index, workers_.size() - 1)].push_back(event_fd);
+    }
+  }
+  std::vector<RecordReadWorker*> cmd_workers;
+  bool result = true;
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (event_fds != nullptr && worker_event_fds[i].empty()) {
+      continue;
+    }
+    if (!workers_[i]->SendCmd(cmd, event_fds != nullptr ? &worker_event_fds[i] : nullptr)) {
+      result = false;
+      break;
+    }
+    cmd_workers.push_back(workers_[i].get());
+  }
+  for (RecordReadWorker* worker : cmd_workers) {
+    if (!worker->WaitCmdResult()) {
+      result = false;
+    }
+  }
+  return result;
+}
+
+bool RecordReadThread::SyncReadThreads(const std::vector<size_t>& worker_indexes) {
+  std::lock_guard<std::mutex> lock(cmd_mutex_);
+  size_t sent = 0;
+  while (sent < worker_indexes.size() &&
+         workers_[worker_indexes[sent]]->SendCmd(RecordReadWorker::CMD_SYNC_KERNEL_BUFFER,
+                                                 nullptr)) {
+    sent++;
+  }
+  bool result = sent == worker_indexes.size();
+  for (size_t i = 0; i < sent; ++i) {
+    if (!workers_[worker_indexes[i]]->WaitCmdResult()) {
+      result = false;
+    }
+  }
+  return result;
+}
+
+bool RecordReadThread::ReadRecordBatch(const std::function<bool(Record*)>& callback,
+                                       size_t* record_count) {
+  // Release the record returned by GetRecord().
+  ReleaseLastRecord();
+  size_t count = 0;
+  bool result = true;
+  int worker;
+  while (count < kRecordBatchSize && (worker = GetNextRecordWorker()) != -1) {
+    count++;
+    char* p = current_records_[worker].data;
+    auto header = reinterpret_cast<const perf_event_header*>(p);
+    if (header->type == PERF_RECORD_SAMPLE) {
+      SampleRecord r(attr_, p);
+      result = callback(&r);
+    } else {
+      std::unique_ptr<Record> r = ParseCurrentRecord(worker);
+      result = callback(r.get());
+    }
+    MoveToNextRecord(worker);
+    if (!result) {
+      break;
+    }
+  }
+  for (auto& worker : workers_) {
+    worker->GetRecordBuffer().ReleaseReadSpace();
+  }
+  if (count == 0) {
+    ClearDataNotification();
+  }
+  *record_count = count;
+  return result;
+}
+
+std::unique_ptr<Record> RecordReadThread::GetRecord() {
+  ReleaseLastRecord();
+  int worker = GetNextRecordWorker();
+  if (worker != -1) {
+    last_record_worker_ = worker;
+    return ParseCurrentRecord(worker);
+  }
+  ClearDataNotification();
+  return nullptr;
+}
+
+const RecordStat& RecordReadThread::GetStat() {
+  stat_ = RecordStat();
+  for (auto& worker : workers_) {
+    const RecordStat& stat = worker->GetStat();
+    stat_.lost_samples += stat.lost_samples;
+    stat_.lost_non_samples += stat.lost_non_samples;
+    stat_.cut_stack_samples += stat.cut_stack_samples;
+    stat_.aux_data_size += stat.aux_data_size;
+    stat_.lost_aux_data_size += stat.lost_aux_data_size;
+    stat_.throttled_samples += stat.throttled_samples;
+  }
+  return stat_;
+}
+
+bool RecordReadThread::GetCurrentRecord(size_t worker_index) {
+  CurrentRecord& record = current_records_[worker_index];
+  if (record.data == nullptr) {
+    record.data = workers_[worker_index]->GetRecordBuffer().GetCurrentRecord();
+    if (record.data == nullptr) {
+      return false;
+    }
+    record.time = 0;
+    if (workers_.size() > 1) {
+      auto header = reinterpret_cast<const perf_event_header*>(record.data);
+      // AUXTRACE records are generated by read threads, and don't have time.
+      size_t time_pos =
+          header->type == PERF_RECORD_AUXTRACE ? 0 : record_parser_.GetTimePos(*header);
+      if (time_pos != 0) {
+        memcpy(&record.time, record.data + time_pos, sizeof(record.time));
+      }
+    }
+  }
+  return true;
+}
+
+// Records in a RecordBuffer are already merged by time in the read thread. So the merge only
+// compares the current records of RecordBuffers. It is done lazily when reading records, and
+// stack data of sample records isn't copied.
+// A worker with an empty RecordBuffer may still push records earlier than the next record, like
+// records in kernel buffers it hasn't read yet. So before returning a record, each of these
+// workers should have pushed all records up to its time. Otherwise, the worker is synced first.
+int RecordReadThread::GetNextRecordWorker() {
+  int next = -1;
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (GetCurrentRecord(i) &&
+        (next == -1 || current_records_[i].time < current_records_[next].time)) {
+      next = i;
+    }
+  }
+  if (next == -1 || workers_.size() == 1 || !read_threads_started_) {
+    return next;
+  }
+  std::vector<size_t> lagging_workers;
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    if (current_records_[i].data != nullptr || synced_times_[i] >= current_records_[next].time) {
+      continue;
+    }
+    // Get the time before checking the RecordBuffer again, so records read before the time are
+    // visible.
+    synced_times_[i] = std::max(synced_times_[i], workers_[i]->GetLastRecordTime());
+    if (GetCurrentRecord(i)) {
+      if (current_records_[i].time < current_records_[next].time) {
+        next = i;
+      }
+    } else if (synced_times_[i] < current_records_[next].time) {
+      lagging_workers.push_back(i);
+    }
+  }
+  if (!lagging_workers.empty()) {
+    // Records up to sync_time were generated before syncing, so lagging workers read all their
+    // records up to sync_time when syncing.
+    uint64_t sync_time = current_records_[next].time;
+    for (auto& worker : workers_) {
+      sync_time = std::max(sync_time, worker->GetLastRecordTime());
+    }
+    if (SyncReadThreads(lagging_workers)) {
+      for (size_t i : lagging_workers) {
+        synced_times_[i] = sync_time;
+      }
+    }
+    for (size_t i : lagging_workers) {
+      if (GetCurrentRecord(i) && current_records_[i].time < current_records_[next].time) {
+        next = i;
+      }
+    }
+  }
+  return next;
+}
+
+std::unique_ptr<Record> RecordReadThread::ParseCurrentRecord(size_t worker_index) {
+  std::unique_ptr<Record> r = ReadRecordFromBuffer(attr_, current_records_[worker_index].data);
+  if (r->type() == PERF_RECORD_AUXTRACE) {
+    auto auxtrace = static_cast<AuxTraceRecord*>(r.get());
+    workers_[worker_index]->GetRecordBuffer().AddCurrentRecordSize(auxtrace->data->aux_size);
+    auxtrace->location.addr = r->Binary() + r->size();
+  }
+  return r;
+}
+
+void RecordReadThread::MoveToNextRecord(size_t worker_index) {
+  workers_[worker_index]->GetRecordBuffer().MoveToNextRecordInBatch();
+  current_records_[worker_index].data = nullptr;
+}
+
+void RecordReadThread::ReleaseLastRecord() {
+  if (last_record_worker_ != -1) {
+    MoveToNextRecord(last_record_worker_);
+    workers_[last_record_worker_]->GetRecordBuffer().ReleaseReadSpace();
+    last_record_worker_ = -1;
+  }
+}
+
+void RecordReadThread::ClearDataNotification() {
+  if (has_data_notification_) {
+    char dummy;
+    TEMP_FAILURE_RETRY(read(read_data_fd_, &dummy, 1));
+    has_data_notification_ = false;
+  }
+}
+
 bool RecordReadThread::SendDataNotificationToMainThread() {
-  if (!has_data_notification_.load(std::memory_order_relaxed)) {
-    has_data_notification_ = true;
+  // It is called by all read threads, so only one of them writes the notification.
+  if (!has_data_notification_.load(std::memory_order_relaxed) &&
+      !has_data_notification_.exchange(true)) {
     char dummy = 0;
     if (TEMP_FAILURE_RETRY(write(write_data_fd_, &dummy, 1)) != 1) {
       PLOG(ERROR) << "write";
@@ -24,12 +24,15 @@
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <android-base/macros.h>
 #include <android-base/unique_fd.h>
 
 #include "event_fd.h"
 #include "record.h"
+#include "record_file_format.h"
 
 namespace simpleperf {
 
@@ -53,11 +56,18 @@ class RecordBuffer {
   void AddCurrentRecordSize(size_t size) { cur_read_record_size_ += size; }
   // Called after reading a record, the space of the record will be writable.
   void MoveToNextRecord();
+  // Like MoveToNextRecord(), but the space of the record isn't writable until
+  // ReleaseReadSpace(). Used to read records in batches.
+  void MoveToNextRecordInBatch();
+  // Make the space of records read in a batch writable.
+  void ReleaseReadSpace();
 
  private:
   std::atomic_size_t read_head_;
   std::atomic_size_t write_head_;
   size_t cur_write_record_size_ = 0;
+  // Start of the current record. It is ahead of read_head_ when reading records in a batch.
+  size_t read_pos_ = 0;
   size_t cur_read_record_size_ = 0;
   const size_t buffer_size_;
   std::unique_ptr<char> buffer_;
@@ -92,6 +102,65 @@ struct RecordStat {
   size_t cut_stack_samples = 0;
   uint64_t aux_data_size = 0;
   uint64_t lost_aux_data_size = 0;
+  // Samples dropped by adaptive sampling.
+  size_t throttled_samples = 0;
+};
+
+// AdaptiveSampling adjusts how much data is recorded per sample while recording dwarf based call
+// graph, based on feedback from the main thread and the read threads:
+// 1. The main thread reports how much stack is used by unwinding samples of each thread. Read
+//    threads cut stack data of samples to a per thread limit, which grows when unwinding uses up
+//    the stack data, and shrinks to what unwinding used recently.
+// 2. Each read thread reports how full its kernel buffers are. When they are filling up, a
+//    proportion of samples is dropped evenly in the read thread, instead of losing records
+//    in bursts when the kernel buffers overflow. The proportion changes at most once per period
+//    of record time, so short bursts don't make it swing.
+// Decisions are kept to be saved in the adaptive_sampling feature section.
+class AdaptiveSampling {
+ public:
+  // Sample drop rate of a read thread, only used in the read thread.
+  struct DropRateState {
+    // Samples dropped out of 1000.
+    uint32_t drop_rate = 0;
+    // Record time of the last update, or 0 if not updated yet.
+    uint64_t period_start_time = 0;
+    // Max used proportion of the kernel buffers since the last update.
+    double max_buffer_usage = 0;
+  };
+
+  explicit AdaptiveSampling(size_t max_stack_size);
+
+  // Called in the main thread after unwinding a sample of thread tid.
+  void UpdateStackUsage(pid_t tid, uint64_t time, uint64_t used_stack_size,
+                        uint64_t stack_size);
+  // Called in read threads to get the stack size limit of samples of thread tid.
+  size_t GetStackSizeLimit(pid_t tid) const;
+  // Called in read threads after reading kernel buffers of cpus starting from first_cpu.
+  // buffer_usage is the max used proportion of the kernel buffers, and time is the time of the
+  // last record read.
+  void UpdateDropRate(int first_cpu, uint64_t time, double buffer_usage, DropRateState* state);
+  std::vector<PerfFileFormat::AdaptiveSamplingDecision> GetDecisions();
+
+ private:
+  struct StackUsage {
+    size_t limit;
+    uint64_t max_used_stack_size = 0;
+    size_t sample_count = 0;
+  };
+
+  void AddDecision(uint64_t time, uint32_t type, uint32_t id, uint64_t value);
+
+  const size_t max_stack_size_;
+  // Stack size limits shared with read threads, indexed by tid. Each entry stores
+  // (tid << 32 | limit). Threads not in the table use max_stack_size_.
+  std::unique_ptr<std::atomic<uint64_t>[]> stack_size_limits_;
+  // Only used in the main thread.
+  std::unordered_map<pid_t, StackUsage> stack_usages_;
+
+  std::mutex decision_mutex_;
+  std::vector<PerfFileFormat::AdaptiveSamplingDecision> decisions_;
+
+  DISALLOW_COPY_AND_ASSIGN(AdaptiveSampling);
 };
 
 // Read records from the kernel buffer belong to an event_fd.
@@ -102,6 +171,11 @@ class KernelRecordReader {
   EventFd* GetEventFd() const { return event_fd_; }
   // Get available data in the kernel buffer. Return true if there is some data.
   bool GetDataFromKernelBuffer();
+  // Return the used proportion of the kernel buffer. Valid after GetDataFromKernelBuffer()
+  // returns true.
+  double GetBufferUsage() const {
+    return static_cast<double>(init_data_size_) / (buffer_mask_ + 1);
+  }
   // Get header of the current record.
   const perf_event_header& RecordHeader() { return record_header_; }
   // Get time of the current record.
@@ -122,48 +196,46 @@ class KernelRecordReader {
   uint64_t record_time_ = 0;
 };
 
-// To reduce sample lost rate when recording dwarf based call graph, RecordReadThread uses a
-// separate high priority (nice -20) thread to read records from kernel buffers to a RecordBuffer.
-class RecordReadThread {
+// Read records from kernel buffers of a group of cpus to a RecordBuffer in a separate thread.
+// It is used by RecordReadThread, which merges records from all workers.
+class RecordReadWorker {
  public:
-  RecordReadThread(size_t record_buffer_size, const perf_event_attr& attr, size_t min_mmap_pages,
-                   size_t max_mmap_pages, size_t aux_buffer_size,
-                   bool allow_cutting_samples = true, bool exclude_perf = false);
-  ~RecordReadThread();
+  enum Cmd {
+    NO_CMD,
+    CMD_ADD_EVENT_FDS,
+    CMD_REMOVE_EVENT_FDS,
+    CMD_SYNC_KERNEL_BUFFER,
+    CMD_STOP_THREAD,
+  };
+
+  RecordReadWorker(size_t record_buffer_size, const perf_event_attr& attr, size_t min_mmap_pages,
+                   size_t max_mmap_pages, size_t aux_buffer_size, bool allow_cutting_samples,
+                   pid_t exclude_pid, const std::function<bool()>& data_notification_callback);
+  ~RecordReadWorker();
   void SetBufferLevels(size_t record_buffer_low_level, size_t record_buffer_critical_level) {
     record_buffer_low_level_ = record_buffer_low_level;
     record_buffer_critical_level_ = record_buffer_critical_level;
   }
+  // first_cpu is the first cpu whose kernel buffer is read by this worker.
+  void SetAdaptiveSampling(AdaptiveSampling* adaptive_sampling, int first_cpu) {
+    adaptive_sampling_ = adaptive_sampling;
+    first_cpu_ = first_cpu;
+  }
 
   // Below functions are called in the main thread:
 
-  // When there are records in the RecordBuffer, data_callback will be called in the main thread.
-  bool RegisterDataCallback(IOEventLoop& loop, const std::function<bool()>& data_callback);
-  // Create and read kernel buffers for new event fds.
-  bool AddEventFds(const std::vector<EventFd*>& event_fds);
-  // Destroy kernel buffers of existing event fds.
-  bool RemoveEventFds(const std::vector<EventFd*>& event_fds);
-  // Move all available records in kernel buffers to the RecordBuffer.
-  bool SyncKernelBuffer();
-  // Stop the read thread, no more records will be put into the RecordBuffer.
-  bool StopReadThread();
-
-  // If available, return the next record in the RecordBuffer, otherwise return nullptr.
-  std::unique_ptr<Record> GetRecord();
-
+  bool StartReadThread();
+  // Send a cmd to the read thread. Use WaitCmdResult() to wait for the result.
+  bool SendCmd(Cmd cmd, void* cmd_arg);
+  bool WaitCmdResult();
+  void JoinReadThread();
+  RecordBuffer& GetRecordBuffer() { return record_buffer_; }
   const RecordStat& GetStat() const { return stat_; }
+  // Return the time of the last record read from kernel buffers. Records read later aren't
+  // earlier than it, and records read before it are visible in the RecordBuffer.
+  uint64_t GetLastRecordTime() const { return last_record_time_.load(std::memory_order_acquire); }
 
  private:
-  enum Cmd {
-    NO_CMD,
-    CMD_ADD_EVENT_FDS,
-    CMD_REMOVE_EVENT_FDS,
-    CMD_SYNC_KERNEL_BUFFER,
-    CMD_STOP_THREAD,
-  };
-
-  bool SendCmdToReadThread(Cmd cmd, void* cmd_arg);
-
   // Below functions are called in the read thread:
 
   void RunReadThread();
@@ -175,7 +247,6 @@ class RecordReadThread {
   bool ReadRecordsFromKernelBuffer();
   void PushRecordToRecordBuffer(KernelRecordReader* kernel_record_reader);
   void ReadAuxDataFromKernelBuffer(bool* has_data);
-  bool SendDataNotificationToMainThread();
 
   RecordBuffer record_buffer_;
   // When free size in record buffer is below low level, we cut stack data of sample records to 1K.
@@ -184,11 +255,18 @@ class RecordReadThread {
   // losing more important records (like mmap or fork records).
   size_t record_buffer_critical_level_;
   RecordParser record_parser_;
-  perf_event_attr attr_;
   size_t stack_size_in_sample_record_ = 0;
   size_t min_mmap_pages_;
   size_t max_mmap_pages_;
   size_t aux_buffer_size_;
+  pid_t exclude_pid_;
+  std::function<bool()> data_notification_callback_;
+  std::atomic<uint64_t> last_record_time_;
+  AdaptiveSampling* adaptive_sampling_ = nullptr;
+  int first_cpu_ = 0;
+  // Decided by adaptive_sampling_.
+  AdaptiveSampling::DropRateState drop_rate_state_;
+  uint32_t drop_credit_ = 0;
 
   // Used to pass command notification from the main thread to the read thread.
   android::base::unique_fd write_cmd_fd_;
@@ -199,15 +277,96 @@ class RecordReadThread {
   void* cmd_arg_;
   bool cmd_result_;
 
-  // Used to send data notification from the read thread to the main thread.
+  std::unique_ptr<std::thread> read_thread_;
+  std::vector<KernelRecordReader> kernel_record_readers_;
+
+  RecordStat stat_;
+
+  DISALLOW_COPY_AND_ASSIGN(RecordReadWorker);
+};
+
+// To reduce sample lost rate when recording dwarf based call graph, RecordReadThread uses separate
+// high priority (nice -20) threads to read records from kernel buffers to RecordBuffers. By
+// default, one thread reads kernel buffers of all cpus. With more read threads, cpus are split
+// into groups of adjacent cpus (which are usually in the same cluster), and each group has its own
+// read thread and RecordBuffer. The main thread merges records from RecordBuffers by time when
+// reading them.
+class RecordReadThread {
+ public:
+  RecordReadThread(size_t record_buffer_size, const perf_event_attr& attr, size_t min_mmap_pages,
+                   size_t max_mmap_pages, size_t aux_buffer_size,
+                   bool allow_cutting_samples = true, bool exclude_perf = false,
+                   size_t read_thread_count = 1);
+  ~RecordReadThread();
+  // Buffer levels are split evenly among read threads.
+  void SetBufferLevels(size_t record_buffer_low_level, size_t record_buffer_critical_level);
+  // Should be called before adding event fds. adaptive_sampling should outlive read threads.
+  void SetAdaptiveSampling(AdaptiveSampling* adaptive_sampling);
+
+  // Below functions are called in the main thread:
+
+  // When there are records in RecordBuffers, data_callback will be called in the main thread.
+  bool RegisterDataCallback(IOEventLoop& loop, const std::function<bool()>& data_callback);
+  // Create and read kernel buffers for new event fds.
+  bool AddEventFds(const std::vector<EventFd*>& event_fds);
+  // Destroy kernel buffers of existing event fds.
+  bool RemoveEventFds(const std::vector<EventFd*>& event_fds);
+  // Move all available records in kernel buffers to RecordBuffers.
+  bool SyncKernelBuffer();
+  // Stop read threads, no more records will be put into RecordBuffers.
+  bool StopReadThread();
+
+  // If available, return the next record in RecordBuffers, otherwise return nullptr.
+  std::unique_ptr<Record> GetRecord();
+  // Read a batch of records in RecordBuffers, and call callback for each of them. Sample
+  // records are parsed in place without allocation, so records are only valid in the callback.
+  // The space of the batch is released to read threads after the batch is processed.
+  // Set *record_count to the number of records read, which is 0 if RecordBuffers are empty.
+  // Return false if the callback returns false.
+  bool ReadRecordBatch(const std::function<bool(Record*)>& callback, size_t* record_count);
+
+  // Return stats summed over read threads.
+  const RecordStat& GetStat();
+
+ private:
+  // The current record of a worker's RecordBuffer, which hasn't been read by the main thread.
+  struct CurrentRecord {
+    char* data = nullptr;
+    uint64_t time = 0;
+  };
+
+  bool SendCmdToReadThreads(RecordReadWorker::Cmd cmd, const std::vector<EventFd*>* event_fds);
+  bool SyncReadThreads(const std::vector<size_t>& worker_indexes);
+  // Get the current record of a worker if not got yet. Return false if its RecordBuffer is empty.
+  bool GetCurrentRecord(size_t worker_index);
+  // Return the index of the worker having the earliest current record, or -1 if all
+  // RecordBuffers are empty.
+  int GetNextRecordWorker();
+  // Parse the current record of a worker. AUXTRACE records are followed by aux data.
+  std::unique_ptr<Record> ParseCurrentRecord(size_t worker_index);
+  void MoveToNextRecord(size_t worker_index);
+  void ReleaseLastRecord();
+  void ClearDataNotification();
+  bool SendDataNotificationToMainThread();
+
+  perf_event_attr attr_;
+  RecordParser record_parser_;
+  size_t cpus_per_worker_;
+  std::vector<std::unique_ptr<RecordReadWorker>> workers_;
+  std::vector<CurrentRecord> current_records_;
+  // For each worker, records not later than the time are all in its RecordBuffer.
+  std::vector<uint64_t> synced_times_;
+  // Cmds may be sent when merging records, so cmds sent to read threads are serialized.
+  std::mutex cmd_mutex_;
+  // The worker of the record returned by GetRecord(), or -1.
+  int last_record_worker_ = -1;
+
+  // Used to send data notification from read threads to the main thread.
   android::base::unique_fd write_data_fd_;
   android::base::unique_fd read_data_fd_;
   std::atomic_bool has_data_notification_;
 
-  std::unique_ptr<std::thread> read_thread_;
-  std::vector<KernelRecordReader> kernel_record_readers_;
-  pid_t exclude_pid_ = -1;
-
+  bool read_threads_started_ = false;
   RecordStat stat_;
 };
 
@@ -73,6 +73,26 @@ TEST_F(RecordBufferTest, fifo) {
   }
 }
 
+TEST_F(RecordBufferTest, read_in_batch) {
+  buffer_.reset(new RecordBuffer(sizeof(perf_event_header) * 10));
+  size_t free_size = buffer_->GetFreeSize();
+  for (uint32_t i = 0; i < 4; ++i) {
+    ASSERT_NO_FATAL_FAILURE(PushRecord(i, sizeof(perf_event_header)));
+  }
+  for (uint32_t i = 0; i < 3; ++i) {
+    char* p = buffer_->GetCurrentRecord();
+    ASSERT_NE(p, nullptr);
+    ASSERT_EQ(reinterpret_cast<perf_event_header*>(p)->type, i);
+    buffer_->MoveToNextRecordInBatch();
+  }
+  // Space of records read in a batch isn't writable until released.
+  ASSERT_EQ(buffer_->GetFreeSize(), free_size - 4 * sizeof(perf_event_header));
+  buffer_->ReleaseReadSpace();
+  ASSERT_EQ(buffer_->GetFreeSize(), free_size - sizeof(perf_event_header));
+  ASSERT_NO_FATAL_FAILURE(PopRecord(3, sizeof(perf_event_header)));
+  ASSERT_EQ(buffer_->GetCurrentRecord(), nullptr);
+}
+
 TEST(RecordParser, smoke) {
   std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(
       GetTestData(PERF_DATA_NO_UNWIND));
@@ -228,8 +248,10 @@ class RecordReadThreadTest : public ::testing::Test {
       event_fds_[i].reset(new MockEventFd(attr, i, buffers_[i].data(), buffer_size, false));
       EXPECT_CALL(*event_fds_[i], CreateMappedBuffer(_, _)).Times(1).WillOnce(Return(true));
       EXPECT_CALL(*event_fds_[i], StartPolling(_, _)).Times(1).WillOnce(Return(true));
-      EXPECT_CALL(*event_fds_[i], GetAvailableMmapDataSize(Truly(SetArg(0)))).Times(1)
-          .WillOnce(Return(data_size));
+      // Kernel buffers may be read again when merging records from multiple read threads.
+      EXPECT_CALL(*event_fds_[i], GetAvailableMmapDataSize(Truly(SetArg(0))))
+          .WillOnce(Return(data_size))
+          .WillRepeatedly(Return(0));
       EXPECT_CALL(*event_fds_[i], DiscardMmapData(Eq(data_size))).Times(1);
       EXPECT_CALL(*event_fds_[i], StopPolling()).Times(1).WillOnce(Return(true));
       EXPECT_CALL(*event_fds_[i], DestroyMappedBuffer()).Times(1);
@@ -300,6 +322,166 @@ TEST_F(RecordReadThreadTest, read_records) {
   }
 }
 
+TEST_F(RecordReadThreadTest, read_record_batch) {
+  perf_event_attr attr = CreateFakeEventAttr();
+  RecordReadThread thread(128 * 1024, attr, 1, 1, 0);
+  IOEventLoop loop;
+  size_t record_index = 0;
+  auto record_callback = [&](Record* r) {
+    std::unique_ptr<Record>& expected = records_[record_index++];
+    return r->size() == expected->size() &&
+           memcmp(r->Binary(), expected->Binary(), r->size()) == 0;
+  };
+  auto callback = [&]() {
+    size_t record_count;
+    do {
+      if (!thread.ReadRecordBatch(record_callback, &record_count)) {
+        return false;
+      }
+    } while (record_count > 0);
+    return loop.ExitLoop();
+  };
+  ASSERT_TRUE(thread.RegisterDataCallback(loop, callback));
+  records_ = CreateFakeRecords(attr, 500, 0, 0);
+  std::vector<EventFd*> event_fds = CreateFakeEventFds(attr, 5);
+  ASSERT_TRUE(thread.AddEventFds(event_fds));
+  ASSERT_TRUE(thread.SyncKernelBuffer());
+  ASSERT_TRUE(loop.RunLoop());
+  ASSERT_EQ(record_index, records_.size());
+  ASSERT_TRUE(thread.RemoveEventFds(event_fds));
+}
+
+TEST_F(RecordReadThreadTest, read_records_with_multiple_read_threads) {
+  perf_event_attr attr = CreateFakeEventAttr();
+  RecordReadThread thread(128 * 1024, attr, 1, 1, 0, true, false, 3);
+  IOEventLoop loop;
+  ASSERT_TRUE(thread.RegisterDataCallback(loop, []() { return true; }));
+  for (size_t event_fd_count = 1; event_fd_count < 10; ++event_fd_count) {
+    records_ = CreateFakeRecords(attr, event_fd_count * 10, 0, 0);
+    std::vector<EventFd*> event_fds = CreateFakeEventFds(attr, event_fd_count);
+    ASSERT_TRUE(thread.AddEventFds(event_fds));
+    ASSERT_TRUE(thread.SyncKernelBuffer());
+    // Records from different read threads are merged by time.
+    size_t record_index = 0;
+    auto record_callback = [&](Record* r) {
+      std::unique_ptr<Record>& expected = records_[record_index++];
+      return r->size() == expected->size() &&
+             memcmp(r->Binary(), expected->Binary(), r->size()) == 0;
+    };
+    size_t record_count;
+    do {
+      ASSERT_TRUE(thread.ReadRecordBatch(record_callback, &record_count));
+    } while (record_count > 0);
+    ASSERT_EQ(record_index, records_.size());
+    ASSERT_TRUE(thread.RemoveEventFds(event_fds));
+  }
+}
+
+TEST_F(RecordReadThreadTest, wait_for_lagging_read_threads_when_merging_records) {
+  perf_event_attr attr = CreateFakeEventAttr();
+  RecordReadThread thread(128 * 1024, attr, 1, 1, 0, true, false, 2);
+  IOEventLoop loop;
+  ASSERT_TRUE(thread.RegisterDataCallback(loop, []() { return true; }));
+  // Records at time 4 and 6 are in the kernel buffer of the first read thread. The record at time
+  // 5 is in the kernel buffer of the second read thread, and only becomes available after the
+  // second read thread reads its kernel buffer the first time.
+  records_ = CreateFakeRecords(attr, 3, 0, 0);
+  size_t record_size = records_[0]->size();
+  size_t buffer_size = AlignToPowerOfTwo(record_size * 2);
+  buffers_.assign(2, std::vector<char>(buffer_size));
+  memcpy(buffers_[0].data(), records_[0]->Binary(), record_size);
+  memcpy(buffers_[0].data() + record_size, records_[2]->Binary(), record_size);
+  memcpy(buffers_[1].data(), records_[1]->Binary(), record_size);
+  // Put the second kernel buffer in the cpu group of the second read thread.
+  int cpu_count = std::max<long>(sysconf(_SC_NPROCESSORS_CONF), 1);
+  int cpus[2] = {0, std::max(cpu_count - 1, 1)};
+  size_t data_sizes[2] = {record_size * 2, record_size};
+  event_fds_.resize(2);
+  std::vector<EventFd*> event_fds;
+  for (size_t i = 0; i < 2; ++i) {
+    event_fds_[i].reset(new MockEventFd(attr, cpus[i], buffers_[i].data(), buffer_size, false));
+    EXPECT_CALL(*event_fds_[i], CreateMappedBuffer(_, _)).Times(1).WillOnce(Return(true));
+    EXPECT_CALL(*event_fds_[i], StartPolling(_, _)).Times(1).WillOnce(Return(true));
+    EXPECT_CALL(*event_fds_[i], DiscardMmapData(Eq(data_sizes[i]))).Times(1);
+    EXPECT_CALL(*event_fds_[i], StopPolling()).Times(1).WillOnce(Return(true));
+    EXPECT_CALL(*event_fds_[i], DestroyMappedBuffer()).Times(1);
+    EXPECT_CALL(*event_fds_[i], DestroyAuxBuffer()).Times(1);
+    event_fds.push_back(event_fds_[i].get());
+  }
+  EXPECT_CALL(*event_fds_[0], GetAvailableMmapDataSize(Truly(SetArg(0))))
+      .WillOnce(Return(data_sizes[0]))
+      .WillRepeatedly(Return(0));
+  EXPECT_CALL(*event_fds_[1], GetAvailableMmapDataSize(Truly(SetArg(0))))
+      .WillOnce(Return(0))
+      .WillOnce(Return(data_sizes[1]))
+      .WillRepeatedly(Return(0));
+  ASSERT_TRUE(thread.AddEventFds(event_fds));
+  ASSERT_TRUE(thread.SyncKernelBuffer());
+  std::vector<uint64_t> times;
+  auto record_callback = [&](Record* r) {
+    times.push_back(r->Timestamp());
+    return true;
+  };
+  size_t record_count;
+  do {
+    ASSERT_TRUE(thread.ReadRecordBatch(record_callback, &record_count));
+  } while (record_count > 0);
+  ASSERT_EQ(times, std::vector<uint64_t>({4, 5, 6}));
+  ASSERT_TRUE(thread.RemoveEventFds(event_fds));
+}
+
+// Read records in the main thread while read threads push records. Check that no record is
+// received twice or out of order for a cpu, and records not received are counted as lost.
+TEST_F(RecordReadThreadTest, stress_read_records_with_multiple_read_threads) {
+  perf_event_attr attr = CreateFakeEventAttr();
+  const size_t event_fd_count = 8;
+  const size_t records_per_fd = 256;
+  RecordReadThread thread(64 * 1024, attr, 1, 1, 0, true, false, 4);
+  IOEventLoop loop;
+  ASSERT_TRUE(thread.RegisterDataCallback(loop, []() { return true; }));
+  size_t total_records = 0;
+  size_t received_records = 0;
+  for (size_t round = 0; round < 20; ++round) {
+    records_ = CreateFakeRecords(attr, event_fd_count * records_per_fd, 0, 0);
+    std::vector<EventFd*> event_fds = CreateFakeEventFds(attr, event_fd_count);
+    total_records += records_.size();
+    std::atomic_bool pushed(false);
+    std::thread push_thread([&]() {
+      thread.AddEventFds(event_fds);
+      thread.SyncKernelBuffer();
+      pushed = true;
+    });
+    std::vector<uint64_t> last_time(event_fd_count, 0);
+    bool order_error = false;
+    auto record_callback = [&](Record* r) {
+      // Record times start from 4, and record i is in the kernel buffer of cpu i % fd_count.
+      uint64_t time = r->Timestamp();
+      size_t fd_index = (time - 4) % event_fd_count;
+      if (time <= last_time[fd_index] && last_time[fd_index] != 0) {
+        order_error = true;
+      }
+      last_time[fd_index] = time;
+      received_records++;
+      return true;
+    };
+    size_t record_count;
+    bool read_result;
+    while (true) {
+      bool is_pushed = pushed;
+      read_result = thread.ReadRecordBatch(record_callback, &record_count);
+      if (!read_result || (is_pushed && record_count == 0)) {
+        break;
+      }
+    }
+    push_thread.join();
+    ASSERT_TRUE(read_result);
+    ASSERT_FALSE(order_error);
+    ASSERT_TRUE(thread.RemoveEventFds(event_fds));
+  }
+  ASSERT_GT(received_records, 0u);
+  ASSERT_EQ(received_records + thread.GetStat().lost_samples, total_records);
+}
+
 TEST_F(RecordReadThreadTest, process_sample_record) {
   perf_event_attr attr = CreateFakeEventAttr();
   attr.sample_type |= PERF_SAMPLE_STACK_USER;
@@ -442,6 +624,113 @@ TEST_F(RecordReadThreadTest, exclude_perf) {
   CheckRecordEqual(*received_records[0], *records_[1]);
 }
 
+TEST(AdaptiveSampling, stack_size_limit) {
+  AdaptiveSampling adaptive_sampling(64 * 1024);
+  ASSERT_EQ(adaptive_sampling.GetStackSizeLimit(1), 64 * 1024u);
+  // The limit shrinks to the stack usage of recent samples.
+  for (size_t i = 0; i < 32; ++i) {
+    adaptive_sampling.UpdateStackUsage(1, i, i == 0 ? 3000 : 100, 64 * 1024);
+  }
+  ASSERT_EQ(adaptive_sampling.GetStackSizeLimit(1), 4096u);
+  ASSERT_EQ(adaptive_sampling.GetStackSizeLimit(2), 64 * 1024u);
+  // The limit doubles when unwinding uses up the cut stack data.
+  adaptive_sampling.UpdateStackUsage(1, 100, 4000, 4096);
+  ASSERT_EQ(adaptive_sampling.GetStackSizeLimit(1), 8192u);
+  // Not when the stack data is smaller than the limit, which means it isn't cut.
+  adaptive_sampling.UpdateStackUsage(1, 101, 2000, 2048);
+  ASSERT_EQ(adaptive_sampling.GetStackSizeLimit(1), 8192u);
+  // Threads sharing an entry in the table don't use each other's limits.
+  ASSERT_EQ(adaptive_sampling.GetStackSizeLimit(1 + 4096), 64 * 1024u);
+
+  std::vector<PerfFileFormat::AdaptiveSamplingDecision> decisions =
+      adaptive_sampling.GetDecisions();
+  ASSERT_EQ(decisions.size(), 2u);
+  ASSERT_EQ(decisions[0].time, 31u);
+  ASSERT_EQ(decisions[0].type, PerfFileFormat::DECISION_STACK_SIZE_LIMIT);
+  ASSERT_EQ(decisions[0].id, 1u);
+  ASSERT_EQ(decisions[0].value, 4096u);
+  ASSERT_EQ(decisions[1].time, 100u);
+  ASSERT_EQ(decisions[1].value, 8192u);
+}
+
+TEST(AdaptiveSampling, drop_rate) {
+  AdaptiveSampling adaptive_sampling(64 * 1024);
+  AdaptiveSampling::DropRateState state;
+  const uint64_t period = 100000000;
+  // The first update changes the drop rate. Later updates in the same period don't.
+  uint64_t time = period;
+  for (size_t i = 0; i < 10; ++i) {
+    adaptive_sampling.UpdateDropRate(4, time + i, 0.9, &state);
+  }
+  ASSERT_EQ(state.drop_rate, 100u);
+  // The drop rate is raised by one step a period.
+  for (size_t i = 0; i < 10; ++i) {
+    time += period;
+    adaptive_sampling.UpdateDropRate(4, time, 0.9, &state);
+  }
+  ASSERT_EQ(state.drop_rate, 900u);
+  // The drop rate doesn't change when the buffer usage is moderate.
+  time += period;
+  adaptive_sampling.UpdateDropRate(4, time, 0.3, &state);
+  ASSERT_EQ(state.drop_rate, 900u);
+  // The drop rate isn't lowered when the buffer usage was high in the period.
+  adaptive_sampling.UpdateDropRate(4, time + 1, 0.9, &state);
+  time += period;
+  adaptive_sampling.UpdateDropRate(4, time, 0.1, &state);
+  ASSERT_EQ(state.drop_rate, 900u);
+  time += period;
+  adaptive_sampling.UpdateDropRate(4, time, 0.1, &state);
+  ASSERT_EQ(state.drop_rate, 800u);
+  std::vector<PerfFileFormat::AdaptiveSamplingDecision> decisions =
+      adaptive_sampling.GetDecisions();
+  ASSERT_EQ(decisions.size(), 10u);
+  ASSERT_EQ(decisions.back().time, time);
+  ASSERT_EQ(decisions.back().type, PerfFileFormat::DECISION_SAMPLE_DROP_RATE);
+  ASSERT_EQ(decisions.back().id, 4u);
+  ASSERT_EQ(decisions.back().value, 800u);
+}
+
+TEST_F(RecordReadThreadTest, adaptive_sampling) {
+  perf_event_attr attr = CreateFakeEventAttr();
+  attr.sample_type |= PERF_SAMPLE_STACK_USER;
+  attr.sample_stack_user = 64 * 1024;
+  RecordReadThread thread(128 * 1024, attr, 1, 1, 0);
+  thread.SetBufferLevels(0, 0);
+  AdaptiveSampling adaptive_sampling(attr.sample_stack_user);
+  thread.SetAdaptiveSampling(&adaptive_sampling);
+  IOEventLoop loop;
+  ASSERT_TRUE(thread.RegisterDataCallback(loop, []() { return true; }));
+  auto read_records = [&](std::vector<std::unique_ptr<Record>>& records) {
+    records.clear();
+    std::vector<EventFd*> event_fds = CreateFakeEventFds(attr, 1);
+    ASSERT_TRUE(thread.AddEventFds(event_fds));
+    ASSERT_TRUE(thread.SyncKernelBuffer());
+    ASSERT_TRUE(thread.RemoveEventFds(event_fds));
+    while (auto r = thread.GetRecord()) {
+      records.emplace_back(std::move(r));
+    }
+  };
+
+  // Stack data is cut to the stack size limit of the thread.
+  records_ = CreateFakeRecords(attr, 1, 8192, 8192);
+  pid_t tid = static_cast<SampleRecord*>(records_[0].get())->tid_data.tid;
+  for (size_t i = 0; i < 32; ++i) {
+    adaptive_sampling.UpdateStackUsage(tid, i, 1000, 8192);
+  }
+  std::vector<std::unique_ptr<Record>> received_records;
+  read_records(received_records);
+  ASSERT_EQ(received_records.size(), 1u);
+  ASSERT_EQ(static_cast<SampleRecord*>(received_records[0].get())->stack_user_data.size, 2048u);
+  ASSERT_EQ(thread.GetStat().cut_stack_samples, 1u);
+
+  // The kernel buffer was more than half full, so 100 out of 1000 samples are dropped.
+  records_ = CreateFakeRecords(attr, 20, 0, 0);
+  read_records(received_records);
+  ASSERT_EQ(received_records.size(), 18u);
+  ASSERT_EQ(thread.GetStat().throttled_samples, 2u);
+  ASSERT_EQ(thread.GetStat().lost_samples, 0u);
+}
+
 struct FakeAuxData {
   std::vector<char> buf1;
   std::vector<char> buf2;
@@ -17,6 +17,7 @@
 #ifndef SIMPLE_PERF_SAMPLE_COMPARATOR_H_
 #define SIMPLE_PERF_SAMPLE_COMPARATOR_H_
 
+#include <stdint.h>
 #include <string.h>
 
 #include <vector>
@@ -50,6 +51,15 @@ int Compare(const T& a, const T& b) {
     return strcmp(sample1->compare_part, sample2->compare_part);    \
   }
 
+// A key function returns a value of a sample, which is the same for two
+// samples only when the compare function added with it returns 0. It is used
+// to hash samples.
+#define BUILD_KEY_FUNCTION(function_name, key_part)  \
+  template <typename EntryT>                         \
+  uint64_t function_name(const EntryT* sample) {     \
+    return static_cast<uint64_t>(sample->key_part);  \
+  }
+
 BUILD_COMPARE_VALUE_FUNCTION(ComparePid, pid);
 BUILD_COMPARE_VALUE_FUNCTION(CompareTid, tid);
 BUILD_COMPARE_VALUE_FUNCTION_REVERSE(CompareSampleCount, sample_count);
@@ -75,20 +85,39 @@ int ComparePeriod(const EntryT* sample1, const EntryT* sample2) {
 }
 
 // SampleComparator is a class using a collection of compare functions to
-// compare two samples.
+// compare two samples. If each compare function is added with a key function,
+// samples can also be compared and hashed by their keys.
 
 template <typename EntryT>
 class SampleComparator {
  public:
   typedef int (*compare_sample_func_t)(const EntryT*, const EntryT*);
+  typedef uint64_t (*sample_key_func_t)(const EntryT*);
 
-  void AddCompareFunction(compare_sample_func_t func) {
+  void AddCompareFunction(compare_sample_func_t func,
+                          sample_key_func_t key_func = nullptr) {
     compare_v_.push_back(func);
+    key_v_.push_back(key_func);
+    has_keys_ = has_keys_ && key_func != nullptr;
   }
 
   void AddComparator(const SampleComparator<EntryT>& other) {
     compare_v_.insert(compare_v_.end(), other.compare_v_.begin(),
                       other.compare_v_.end());
+    key_v_.insert(key_v_.end(), other.key_v_.begin(), other.key_v_.end());
+    has_keys_ = has_keys_ && other.has_keys_;
+  }
+
+  bool HasKeys() const { return has_keys_; }
+
+  // Should only be called when HasKeys() returns true.
+  uint64_t HashSample(const EntryT* sample) const {
+    uint64_t hash = 0;
+    for (const auto& func : key_v_) {
+      hash = (hash ^ func(sample)) * 0x9e3779b97f4a7c15ULL;
+      hash ^= hash >> 32;
+    }
+    return hash;
   }
 
   bool operator()(const EntryT* sample1, const EntryT* sample2) const {
@@ -102,6 +131,14 @@ class SampleComparator {
   }
 
   bool IsSameSample(const EntryT* sample1, const EntryT* sample2) const {
+    if (has_keys_) {
+      for (const auto& func : key_v_) {
+        if (func(sample1) != func(sample2)) {
+          return false;
+        }
+      }
+      return true;
+    }
     for (const auto& func : compare_v_) {
       if (func(sample1, sample2) != 0) {
         return false;
@@ -114,6 +151,8 @@ class SampleComparator {
 
  private:
   std::vector<compare_sample_func_t> compare_v_;
+  std::vector<sample_key_func_t> key_v_;
+  bool has_keys_ = true;
 };
 
 #endif  // SIMPLE_PERF_SAMPLE_COMPARATOR_H_
@@ -23,16 +23,73 @@
 #include <functional>
 #include <memory>
 #include <queue>
+#include <utility>
 #include <vector>
 
 #include <android-base/logging.h>
 
+// Allocates arrays of T in blocks, which are freed together with the arena. So callchain nodes
+// don't need to be allocated one by one, and are close to each other in memory.
+template <typename T>
+class CallChainArena {
+ public:
+  CallChainArena() {}
+
+  CallChainArena(CallChainArena&& other) { *this = std::move(other); }
+
+  CallChainArena& operator=(CallChainArena&& other) {
+    blocks_ = std::move(other.blocks_);
+    other.blocks_.clear();
+    pos_ = std::exchange(other.pos_, nullptr);
+    left_ = std::exchange(other.left_, 0);
+    next_block_size_ = std::exchange(other.next_block_size_, MIN_BLOCK_SIZE);
+    return *this;
+  }
+
+  T* Allocate(size_t n) {
+    if (n > left_) {
+      size_t size = std::max(n, next_block_size_);
+      next_block_size_ = std::min(next_block_size_ * 2, MAX_BLOCK_SIZE);
+      blocks_.emplace_back(new T[size]);
+      pos_ = blocks_.back().get();
+      left_ = size;
+    }
+    T* result = pos_;
+    pos_ += n;
+    left_ -= n;
+    return result;
+  }
+
+ private:
+  // Most callchain trees are small, so start with small blocks.
+  static constexpr size_t MIN_BLOCK_SIZE = 4;
+  static constexpr size_t MAX_BLOCK_SIZE = 1024;
+
+  std::vector<std::unique_ptr<T[]>> blocks_;
+  T* pos_ = nullptr;
+  size_t left_ = 0;
+  size_t next_block_size_ = MIN_BLOCK_SIZE;
+};
+
+// Entries of a callchain node, stored in the arena of the callchain tree.
+template <typename EntryT>
+struct CallChainEntries {
+  EntryT** data = nullptr;
+  size_t length = 0;
+
+  size_t size() const { return length; }
+  EntryT* operator[](size_t i) const { return data[i]; }
+  EntryT* front() const { return data[0]; }
+  EntryT* const* begin() const { return data; }
+  EntryT* const* end() const { return data + length; }
+};
+
 template <typename EntryT>
 struct CallChainNode {
   uint64_t period;
   uint64_t children_period;
-  std::vector<EntryT*> chain;
-  std::vector<std::unique_ptr<CallChainNode>> children;
+  CallChainEntries<EntryT> chain;
+  std::vector<CallChainNode*> children;
 };
 
 template <typename EntryT>
@@ -42,9 +99,11 @@ struct CallChainRoot {
   // And we don't need to show it in brief callgraph report mode.
   bool duplicated;
   uint64_t children_period;
-  std::vector<std::unique_ptr<NodeT>> children;
+  std::vector<NodeT*> children;
 
   CallChainRoot() : duplicated(false), children_period(0) {}
+  CallChainRoot(CallChainRoot&&) = default;
+  CallChainRoot& operator=(CallChainRoot&&) = default;
 
   void AddCallChain(
       const std::vector<EntryT*>& callchain, uint64_t period,
@@ -52,8 +111,7 @@ struct CallChainRoot {
     children_period += period;
     NodeT* p = FindMatchingNode(children, callchain[0], is_same_sample);
     if (p == nullptr) {
-      std::unique_ptr<NodeT> new_node = AllocateNode(callchain, 0, period, 0);
-      children.push_back(std::move(new_node));
+      children.push_back(AllocateNode(callchain, 0, period, 0));
       return;
     }
     size_t callchain_pos = 0;
@@ -80,21 +138,42 @@ struct CallChainRoot {
           continue;
         }
       }
-      std::unique_ptr<NodeT> new_node =
-          AllocateNode(callchain, callchain_pos, period, 0);
-      p->children.push_back(std::move(new_node));
+      p->children.push_back(AllocateNode(callchain, callchain_pos, period, 0));
       break;
     }
   }
 
+  // Adds the callchains of another tree, using get_entry() to find the entry of this tree for each
+  // entry of the other tree. Callchains are added in the order their nodes are shown, so the result
+  // is the same as calling AddCallChain() for callchains of the other tree after the ones of this
+  // tree.
+  void Merge(const CallChainRoot& other, std::function<EntryT*(EntryT*)> get_entry,
+             std::function<bool(const EntryT*, const EntryT*)> is_same_sample) {
+    std::vector<EntryT*> callchain;
+    std::function<void(const NodeT&)> add_node = [&](const NodeT& node) {
+      size_t size = callchain.size();
+      for (EntryT* entry : node.chain) {
+        callchain.push_back(get_entry(entry));
+      }
+      AddCallChain(callchain, node.period, is_same_sample);
+      for (NodeT* child : node.children) {
+        add_node(*child);
+      }
+      callchain.resize(size);
+    };
+    for (NodeT* child : other.children) {
+      add_node(*child);
+    }
+  }
+
   void SortByPeriod() {
-    std::queue<std::vector<std::unique_ptr<NodeT>>*> queue;
+    std::queue<std::vector<NodeT*>*> queue;
     queue.push(&children);
     while (!queue.empty()) {
-      std::vector<std::unique_ptr<NodeT>>* v = queue.front();
+      std::vector<NodeT*>* v = queue.front();
       queue.pop();
       std::sort(v->begin(), v->end(), CallChainRoot::CompareNodeByPeriod);
-      for (auto& node : *v) {
+      for (NodeT* node : *v) {
         if (!node->children.empty()) {
           queue.push(&node->children);
         }
@@ -104,11 +183,11 @@ struct CallChainRoot {
 
  private:
   NodeT* FindMatchingNode(
-      const std::vector<std::unique_ptr<NodeT>>& nodes, const EntryT* sample,
-      std::function<bool(const EntryT*, const EntryT*)> is_same_sample) {
-    for (auto& node : nodes) {
+      const std::vector<NodeT*>& nodes, const EntryT* sample,
+      const std::function<bool(const EntryT*, const EntryT*)>& is_same_sample) {
+    for (NodeT* node : nodes) {
       if (is_same_sample(node->chain.front(), sample)) {
-        return node.get();
+        return node;
       }
     }
     return nullptr;
@@ -116,7 +195,7 @@ struct CallChainRoot {
 
   size_t GetMatchingLengthInNode(
       NodeT* node, const std::vector<EntryT*>& chain, size_t chain_start,
-      std::function<bool(const EntryT*, const EntryT*)> is_same_sample) {
+      const std::function<bool(const EntryT*, const EntryT*)>& is_same_sample) {
     size_t i, j;
     for (i = 0, j = chain_start; i < node->chain.size() && j < chain.size();
          ++i, ++j) {
@@ -128,34 +207,39 @@ struct CallChainRoot {
   }
 
   void SplitNode(NodeT* parent, size_t parent_length) {
-    std::unique_ptr<NodeT> child = AllocateNode(
-        parent->chain, parent_length, parent->period, parent->children_period);
+    // The child shares the entries after parent_length with the parent.
+    NodeT* child = node_arena_.Allocate(1);
+    child->chain.data = parent->chain.data + parent_length;
+    child->chain.length = parent->chain.length - parent_length;
+    child->period = parent->period;
+    child->children_period = parent->children_period;
     child->children = std::move(parent->children);
     parent->period = 0;
     parent->children_period = child->period + child->children_period;
-    parent->chain.resize(parent_length);
+    parent->chain.length = parent_length;
     parent->children.clear();
-    parent->children.push_back(std::move(child));
+    parent->children.push_back(child);
   }
 
-  std::unique_ptr<NodeT> AllocateNode(const std::vector<EntryT*>& chain,
-                                      size_t chain_start, uint64_t period,
-                                      uint64_t children_period) {
-    std::unique_ptr<NodeT> node(new NodeT);
-    for (size_t i = chain_start; i < chain.size(); ++i) {
-      node->chain.push_back(chain[i]);
-    }
+  NodeT* AllocateNode(const std::vector<EntryT*>& chain, size_t chain_start, uint64_t period,
+                      uint64_t children_period) {
+    NodeT* node = node_arena_.Allocate(1);
+    node->chain.length = chain.size() - chain_start;
+    node->chain.data = entry_arena_.Allocate(node->chain.length);
+    std::copy(chain.begin() + chain_start, chain.end(), node->chain.data);
     node->period = period;
     node->children_period = children_period;
     return node;
   }
 
-  static bool CompareNodeByPeriod(const std::unique_ptr<NodeT>& n1,
-                                  const std::unique_ptr<NodeT>& n2) {
+  static bool CompareNodeByPeriod(const NodeT* n1, const NodeT* n2) {
     uint64_t period1 = n1->period + n1->children_period;
     uint64_t period2 = n2->period + n2->children_period;
     return period1 > period2;
   }
+
+  CallChainArena<NodeT> node_arena_;
+  CallChainArena<EntryT*> entry_arena_;
 };
 
 #endif  // SIMPLE_PERF_CALLCHAIN_H_
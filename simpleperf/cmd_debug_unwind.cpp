@@ -115,6 +115,7 @@ class DebugUnwindCommand : public Command {
     uint64_t unwinding_sample_count = 0u;
     uint64_t total_unwinding_time_in_ns = 0u;
     uint64_t max_unwinding_time_in_ns = 0u;
+    uint64_t unwinding_cache_hit_count = 0u;
 
     // For memory consumption.
     MemStat mem_before_unwinding;
@@ -246,6 +247,9 @@ bool DebugUnwindCommand::ProcessRecord(Record* record) {
       stat_.total_unwinding_time_in_ns += unwinding_result.used_time;
       stat_.max_unwinding_time_in_ns = std::max(stat_.max_unwinding_time_in_ns,
                                                 unwinding_result.used_time);
+      if (unwinding_result.cache_hit) {
+        stat_.unwinding_cache_hit_count++;
+      }
       if (!writer_->WriteRecord(UnwindingResultRecord(r.time_data.time, unwinding_result))) {
         return false;
       }
@@ -391,6 +395,9 @@ void DebugUnwindCommand::PrintStat() {
            / 1000 / stat_.unwinding_sample_count);
     printf("Max unwinding time: %f us\n", static_cast<double>(stat_.max_unwinding_time_in_ns)
            / 1000);
+    printf("Unwinding cache hits: %" PRIu64 " (%f%%)\n", stat_.unwinding_cache_hit_count,
+           static_cast<double>(stat_.unwinding_cache_hit_count) * 100 /
+               stat_.unwinding_sample_count);
   }
   printf("Memory change:\n");
   PrintIndented(1, "VmPeak: %s -> %s\n", stat_.mem_before_unwinding.vm_peak.c_str(),
@@ -306,6 +306,39 @@ bool DumpRecordCommand::DumpFeatureSection() {
       for (auto offset : record_file_reader_->ReadAuxTraceFeature()) {
         PrintIndented(2, "%" PRIu64 "\n", offset);
       }
+    } else if (feature == FEAT_COMPRESSION) {
+      uint32_t compression_type;
+      uint64_t data_size;
+      std::vector<CompressedFrame> frames;
+      if (record_file_reader_->ReadCompressionFeature(&compression_type, &data_size, &frames)) {
+        PrintIndented(1, "compression_type: %s\n",
+                      compression_type == COMPRESSION_ZLIB ? "zlib" : "unknown");
+        PrintIndented(1, "data_size: %" PRIu64 "\n", data_size);
+        PrintIndented(1, "frames:\n");
+        for (const auto& frame : frames) {
+          PrintIndented(2, "file_offset %" PRIu64 ", compressed_size %" PRIu32
+                        ", data_offset %" PRIu64 ", data_size %" PRIu32 "\n",
+                        frame.file_offset, frame.compressed_size, frame.data_offset,
+                        frame.data_size);
+        }
+      }
+    } else if (feature == FEAT_ADAPTIVE_SAMPLING) {
+      std::vector<AdaptiveSamplingDecision> decisions;
+      if (record_file_reader_->ReadAdaptiveSamplingFeature(&decisions)) {
+        PrintIndented(1, "decisions:\n");
+        for (const auto& decision : decisions) {
+          if (decision.type == DECISION_STACK_SIZE_LIMIT) {
+            PrintIndented(2, "time %" PRIu64 ": stack size limit of thread %" PRIu32
+                          " is %" PRIu64 "\n", decision.time, decision.id, decision.value);
+          } else if (decision.type == DECISION_SAMPLE_DROP_RATE) {
+            PrintIndented(2, "time %" PRIu64 ": sample drop rate of cpus from %" PRIu32
+                          " is %" PRIu64 "/1000\n", decision.time, decision.id, decision.value);
+          } else {
+            PrintIndented(2, "time %" PRIu64 ": unknown decision type %" PRIu32 "\n",
+                          decision.time, decision.type);
+          }
+        }
+      }
     }
   }
   return true;
@@ -22,8 +22,14 @@
 #include <sys/utsname.h>
 #include <time.h>
 #include <unistd.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -99,6 +105,218 @@ static constexpr size_t kDefaultAuxBufferSize = 4 * 1024 * 1024;
 // So make default period to 100ms.
 static constexpr double kDefaultEtmDataFlushPeriodInSec = 0.1;
 
+// Max threads used to unwind samples in post unwinding by default.
+static constexpr size_t kDefaultMaxPostUnwindJobs = 8;
+
+static bool CanUnwindSampleRecord(const SampleRecord& r) {
+  return (r.sample_type & PERF_SAMPLE_CALLCHAIN) && (r.sample_type & PERF_SAMPLE_REGS_USER) &&
+         (r.regs_user_data.reg_mask != 0) && (r.sample_type & PERF_SAMPLE_STACK_USER) &&
+         (r.GetValidStackSize() > 0);
+}
+
+// Unwinds sample records on worker threads in post unwinding. The thread reading records updates
+// the thread tree, and passes each sample with a snapshot of maps of its process, which is shared
+// by samples until the maps change. Each worker has its own OfflineUnwinder. Records are passed
+// back in their original order after unwinding.
+class ParallelPostUnwinder {
+ public:
+  // Called for each record in record order. [ips] and [sps] are the unwound callchain of a sample
+  // record, or nullptr for records not unwound.
+  using SaveRecordFunction = std::function<bool(Record* record, const std::vector<uint64_t>* ips,
+                                                const std::vector<uint64_t>* sps)>;
+
+  ParallelPostUnwinder(size_t jobs, SaveRecordFunction save_record)
+      : save_record_(std::move(save_record)), max_pending_batches_(jobs * 2) {
+    for (size_t i = 0; i < jobs; ++i) {
+      // Unwinders are created here instead of on worker threads, because creating the first
+      // unwinder sets up global caches in libunwindstack.
+      std::shared_ptr<OfflineUnwinder> unwinder = OfflineUnwinder::Create(false);
+      workers_.emplace_back([this, unwinder]() { RunWorker(unwinder.get()); });
+    }
+  }
+
+  ~ParallelPostUnwinder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished_ = true;
+    }
+    batch_cond_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // [thread] is the thread of a sample record to unwind, or nullptr for other records. It should
+  // be called after updating the thread tree with records before this one.
+  bool ProcessRecord(std::unique_ptr<Record> record, const ThreadEntry* thread) {
+    if (!batch_) {
+      batch_.reset(new Batch);
+      batch_->id = next_batch_id_++;
+    }
+    batch_->items.emplace_back();
+    Item& item = batch_->items.back();
+    item.record = std::move(record);
+    if (thread != nullptr) {
+      item.unwind = true;
+      item.thread.pid = thread->pid;
+      item.thread.tid = thread->tid;
+      item.thread.comm = thread->comm;
+      item.thread.maps = GetMapsSnapshot(thread->maps);
+    }
+    if (batch_->items.size() == BATCH_SIZE) {
+      SubmitBatch();
+      return SaveBatches(max_pending_batches_);
+    }
+    return true;
+  }
+
+  // Wait for all records to be unwound and saved.
+  bool Finish() {
+    if (batch_) {
+      SubmitBatch();
+    }
+    return SaveBatches(0);
+  }
+
+ private:
+  static constexpr size_t BATCH_SIZE = 64;
+  static constexpr size_t MIN_MAP_SNAPSHOTS_TO_DROP = 64;
+
+  struct Item {
+    std::unique_ptr<Record> record;
+    bool unwind = false;
+    ThreadEntry thread;
+    bool unwinding_succeeded = false;
+    std::vector<uint64_t> ips;
+    std::vector<uint64_t> sps;
+  };
+
+  struct Batch {
+    uint64_t id;
+    std::vector<Item> items;
+  };
+
+  std::shared_ptr<MapSet> GetMapsSnapshot(const std::shared_ptr<MapSet>& maps) {
+    if (map_snapshots_.size() >= max_map_snapshots_) {
+      DropUnusedMapsSnapshots();
+    }
+    // The cache keeps a reference to each MapSet, so its address isn't reused by another one.
+    auto& cache = map_snapshots_[maps.get()];
+    if (!cache.second || cache.second->version != maps->version) {
+      cache.first = maps;
+      cache.second.reset(new MapSet);
+      cache.second->maps = maps->maps;
+      cache.second->version = maps->version;
+    }
+    return cache.second;
+  }
+
+  // Drop snapshots not used by any queued sample, with their references to MapSets. Only this
+  // thread adds references to snapshots, so a snapshot only referenced by the cache stays unused.
+  // Dropping starts again when the cache has doubled, so the cost is shared by the added entries.
+  void DropUnusedMapsSnapshots() {
+    for (auto it = map_snapshots_.begin(); it != map_snapshots_.end();) {
+      if (it->second.second.use_count() == 1) {
+        it = map_snapshots_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    max_map_snapshots_ = std::max(MIN_MAP_SNAPSHOTS_TO_DROP, map_snapshots_.size() * 2);
+  }
+
+  void SubmitBatch() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      batches_.push_back(std::move(batch_));
+    }
+    batch_cond_.notify_one();
+  }
+
+  void RunWorker(OfflineUnwinder* unwinder) {
+    while (true) {
+      std::unique_ptr<Batch> batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        batch_cond_.wait(lock, [this]() { return finished_ || !batches_.empty(); });
+        if (batches_.empty()) {
+          return;
+        }
+        batch = std::move(batches_.front());
+        batches_.pop_front();
+      }
+      for (Item& item : batch->items) {
+        if (item.unwind) {
+          auto& r = *static_cast<SampleRecord*>(item.record.get());
+          RegSet regs(r.regs_user_data.abi, r.regs_user_data.reg_mask, r.regs_user_data.regs);
+          item.unwinding_succeeded =
+              unwinder->UnwindCallChain(item.thread, regs, r.stack_user_data.data,
+                                        r.GetValidStackSize(), &item.ips, &item.sps);
+          // Release the snapshot, so it can be freed once maps change or it is dropped from the
+          // cache.
+          item.thread.maps.reset();
+        }
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        unwound_batches_[batch->id] = std::move(batch);
+      }
+      unwound_cond_.notify_one();
+    }
+  }
+
+  // Save unwound batches in record order, and wait while more than max_pending batches aren't
+  // saved.
+  bool SaveBatches(size_t max_pending) {
+    while (true) {
+      std::unique_ptr<Batch> batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        unwound_cond_.wait(lock, [&]() {
+          return next_batch_id_ - next_save_id_ <= max_pending ||
+                 unwound_batches_.count(next_save_id_) != 0;
+        });
+        auto it = unwound_batches_.find(next_save_id_);
+        if (it == unwound_batches_.end()) {
+          return true;
+        }
+        batch = std::move(it->second);
+        unwound_batches_.erase(it);
+        next_save_id_++;
+      }
+      for (Item& item : batch->items) {
+        if (item.unwind && !item.unwinding_succeeded) {
+          return false;
+        }
+        if (!save_record_(item.record.get(), item.unwind ? &item.ips : nullptr,
+                          item.unwind ? &item.sps : nullptr)) {
+          return false;
+        }
+      }
+    }
+  }
+
+  SaveRecordFunction save_record_;
+  const size_t max_pending_batches_;
+  std::unique_ptr<Batch> batch_;
+  uint64_t next_batch_id_ = 0;
+  // Map from a MapSet in the thread tree to the MapSet and its latest snapshot.
+  std::unordered_map<const MapSet*, std::pair<std::shared_ptr<MapSet>, std::shared_ptr<MapSet>>>
+      map_snapshots_;
+  size_t max_map_snapshots_ = MIN_MAP_SNAPSHOTS_TO_DROP;
+
+  std::mutex mutex_;
+  std::condition_variable batch_cond_;
+  std::condition_variable unwound_cond_;
+  // Batches waiting to be unwound, guarded by mutex_.
+  std::deque<std::unique_ptr<Batch>> batches_;
+  // Batches waiting to be saved, guarded by mutex_.
+  std::map<uint64_t, std::unique_ptr<Batch>> unwound_batches_;
+  uint64_t next_save_id_ = 0;
+  bool finished_ = false;
+  std::vector<std::thread> workers_;
+};
+
 struct TimeStat {
   uint64_t prepare_recording_time = 0;
   uint64_t start_recording_time = 0;
@@ -204,6 +422,8 @@ class RecordCommand : public Command {
 "                       stack will be recorded in perf.data and unwound while\n"
 "                       recording by default. Use --post-unwind=yes to switch\n"
 "                       to unwind after recording.\n"
+"--post-unwind-jobs <n>  Use n threads to unwind samples in post unwinding. Default is\n"
+"                        the number of cpus, at most 8.\n"
 "--no-unwind   If `--call-graph dwarf` option is used, then the user's stack\n"
 "              will be unwound by default. Use this option to disable the\n"
 "              unwinding of the user's stack.\n"
@@ -219,8 +439,22 @@ class RecordCommand : public Command {
 "                   the stack data in samples. When the available space reaches critical level,\n"
 "                   it drops all samples. This option makes simpleperf not cut samples when the\n"
 "                   available space reaches low level.\n"
+"--record-read-threads count  Use count threads to read records from the kernel. Cpus are\n"
+"                             split into groups of adjacent cpus, and each group is read by\n"
+"                             a thread with its own record buffer. It can reduce lost samples\n"
+"                             when recording dwarf based call graphs on many cpus. Default is 1.\n"
+"--adaptive-sampling  Adjust recorded data while recording to reduce lost samples. When\n"
+"                     recording dwarf based call graphs, stack data in samples of each thread\n"
+"                     is cut to the size used by unwinding recent samples of the thread. When\n"
+"                     kernel buffers are filling up, part of samples are dropped evenly.\n"
+"                     Decisions are saved in the adaptive_sampling feature section.\n"
+"                     Stack data isn't adjusted with --post-unwind.\n"
 "\n"
 "Recording file options:\n"
+"--data-shards count   Write records to count temporary files with separate threads\n"
+"                      while recording, and merge them into the record file after\n"
+"                      recording. Samples are split by cpu. It reduces the time used\n"
+"                      by the main thread to write records in system wide recording.\n"
 "--no-dump-kernel-symbols  Don't dump kernel symbols in perf.data. By default\n"
 "                          kernel symbols will be dumped when needed.\n"
 "--no-dump-symbols       Don't dump symbols in perf.data. By default symbols are\n"
@@ -232,6 +466,8 @@ class RecordCommand : public Command {
 "--symfs <dir>    Look for files with symbols relative to this directory.\n"
 "                 This option is used to provide files with symbol table and\n"
 "                 debug information, which are used for unwinding and dumping symbols.\n"
+"-z level  Compress records in the data section of the record file with zlib, at level\n"
+"          1-9. Level 1 is the fastest. Compression is done by a separate thread.\n"
 "\n"
 "Other options:\n"
 "--exit-with-parent            Stop recording when the process starting\n"
@@ -304,13 +540,17 @@ class RecordCommand : public Command {
   bool DumpMapsForRecord(Record* record);
   bool SaveRecordForPostUnwinding(Record* record);
   bool SaveRecordAfterUnwinding(Record* record);
+  bool SaveUnwoundRecord(Record* record);
   bool SaveRecordWithoutUnwinding(Record* record);
   bool ProcessJITDebugInfo(const std::vector<JITDebugInfo>& debug_info, bool sync_kernel_records);
   bool ProcessControlCmd(IOEventLoop* loop);
 
   void UpdateRecord(Record* record);
   bool UnwindRecord(SampleRecord& r);
+  bool UpdateCallChainAfterUnwinding(SampleRecord& r, const std::vector<uint64_t>& ips,
+                                     const std::vector<uint64_t>& sps);
   bool PostUnwindRecords();
+  bool PostUnwindRecordsInParallel(RecordFileReader& reader);
   bool JoinCallChains();
   bool DumpAdditionalFeatures(const std::vector<std::string>& args);
   bool DumpBuildIdFeature();
@@ -327,6 +567,9 @@ class RecordCommand : public Command {
   bool unwind_dwarf_callchain_;
   bool post_unwind_;
   std::unique_ptr<OfflineUnwinder> offline_unwinder_;
+  size_t post_unwind_jobs_ =
+      std::max<size_t>(1, std::min<size_t>(std::thread::hardware_concurrency(),
+                                           kDefaultMaxPostUnwindJobs));
   bool child_inherit_;
   double duration_in_sec_;
   bool can_dump_kernel_symbols_;
@@ -354,6 +597,8 @@ class RecordCommand : public Command {
   bool trace_offcpu_;
   bool exclude_kernel_callchain_;
   uint64_t size_limit_in_bytes_ = 0;
+  size_t data_shard_count_ = 0;
+  size_t compression_level_ = 0;
   uint64_t max_sample_freq_ = DEFAULT_SAMPLE_FREQ_FOR_NONTRACEPOINT_EVENT;
   size_t cpu_time_max_percent_ = 25;
 
@@ -362,6 +607,9 @@ class RecordCommand : public Command {
   size_t callchain_joiner_min_matching_nodes_;
   std::unique_ptr<CallChainJoiner> callchain_joiner_;
   bool allow_cutting_samples_ = true;
+  size_t record_read_thread_count_ = 1;
+  bool adaptive_sampling_enabled_ = false;
+  std::unique_ptr<AdaptiveSampling> adaptive_sampling_;
 
   std::unique_ptr<JITDebugReader> jit_debug_reader_;
   uint64_t last_record_timestamp_;  // used to insert Mmap2Records for JIT debug info
@@ -487,9 +735,13 @@ bool RecordCommand::PrepareRecording(Workload* workload) {
   }
   size_t record_buffer_size = system_wide_collection_ ? kSystemWideRecordBufferSize
                                                       : kRecordBufferSize;
+  if (adaptive_sampling_enabled_) {
+    adaptive_sampling_.reset(new AdaptiveSampling(dump_stack_size_in_dwarf_sampling_));
+  }
   if (!event_selection_set_.MmapEventFiles(mmap_page_range_.first, mmap_page_range_.second,
                                            aux_buffer_size_, record_buffer_size,
-                                           allow_cutting_samples_, exclude_perf_)) {
+                                           allow_cutting_samples_, exclude_perf_,
+                                           record_read_thread_count_, adaptive_sampling_.get())) {
     return false;
   }
   auto callback =
@@ -669,12 +921,14 @@ bool RecordCommand::PostProcessRecording(const std::vector<std::string>& args) {
     if (record_stat.cut_stack_samples > 0) {
       cut_samples = android::base::StringPrintf(" (cut %zu)", record_stat.cut_stack_samples);
     }
-    lost_record_count_ += record_stat.lost_samples + record_stat.lost_non_samples;
+    lost_record_count_ += record_stat.lost_samples + record_stat.lost_non_samples +
+        record_stat.throttled_samples;
     LOG(INFO) << "Samples recorded: " << sample_record_count_ << cut_samples
               << ". Samples lost: " << lost_record_count_ << ".";
     LOG(DEBUG) << "In user space, dropped " << record_stat.lost_samples << " samples, "
                << record_stat.lost_non_samples << " non samples, cut stack of "
-               << record_stat.cut_stack_samples << " samples.";
+               << record_stat.cut_stack_samples << " samples, throttled "
+               << record_stat.throttled_samples << " samples.";
     if (sample_record_count_ + lost_record_count_ != 0) {
       double lost_percent =
           static_cast<double>(lost_record_count_) / (lost_record_count_ + sample_record_count_);
@@ -803,6 +1057,10 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
       if (!GetUintOption(args, &i, &cpu_time_max_percent_, 1, 100)) {
         return false;
       }
+    } else if (args[i] == "--data-shards") {
+      if (!GetUintOption(args, &i, &data_shard_count_, 1, 256)) {
+        return false;
+      }
     } else if (args[i] == "--duration") {
       if (!GetDoubleOption(args, &i, &duration_in_sec_, 1e-9)) {
         return false;
@@ -891,6 +1149,12 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
       }
     } else if (args[i] == "--no-cut-samples") {
       allow_cutting_samples_ = false;
+    } else if (args[i] == "--adaptive-sampling") {
+      adaptive_sampling_enabled_ = true;
+    } else if (args[i] == "--record-read-threads") {
+      if (!GetUintOption(args, &i, &record_read_thread_count_, 1, 64)) {
+        return false;
+      }
     } else if (args[i] == "-o") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
@@ -920,6 +1184,10 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
         LOG(ERROR) << "unexpected option " << args[i];
         return false;
       }
+    } else if (args[i] == "--post-unwind-jobs") {
+      if (!GetUintOption(args, &i, &post_unwind_jobs_, 1)) {
+        return false;
+      }
     } else if (args[i] == "--size-limit") {
       if (!GetUintOption(args, &i, &size_limit_in_bytes_, 1, std::numeric_limits<uint64_t>::max(),
                          true)) {
@@ -964,6 +1232,10 @@ bool RecordCommand::ParseOptions(const std::vector<std::string>& args,
       if (!SetTracepointEventsFilePath(args[i])) {
         return false;
       }
+    } else if (args[i] == "-z") {
+      if (!GetUintOption(args, &i, &compression_level_, 1, 9)) {
+        return false;
+      }
     } else if (args[i] == "--") {
       i++;
       break;
@@ -1096,6 +1368,9 @@ bool RecordCommand::CreateAndInitRecordFile() {
   if (record_file_writer_ == nullptr) {
     return false;
   }
+  if (data_shard_count_ > 0 && !record_file_writer_->UseDataShards(data_shard_count_)) {
+    return false;
+  }
   // Use first perf_event_attr and first event id to dump mmap and comm records.
   dumping_attr_id_ = event_selection_set_.GetEventAttrWithId()[0];
   return DumpKernelSymbol() && DumpTracingData() && DumpKernelMaps() && DumpUserSpaceMaps() &&
@@ -1113,6 +1388,9 @@ std::unique_ptr<RecordFileWriter> RecordCommand::CreateRecordFile(
   if (!writer->WriteAttrSection(event_selection_set_.GetEventAttrWithId())) {
     return nullptr;
   }
+  if (compression_level_ > 0 && !writer->SetCompressionLevel(compression_level_)) {
+    return nullptr;
+  }
   return writer;
 }
 
@@ -1337,6 +1615,16 @@ bool RecordCommand::SaveRecordAfterUnwinding(Record* record) {
     if (!UnwindRecord(r)) {
       return false;
     }
+  } else if (record->type() != PERF_RECORD_LOST) {
+    thread_tree_.Update(*record);
+  }
+  return SaveUnwoundRecord(record);
+}
+
+// Save a record after unwinding it if it is a sample. Records are saved in their original order.
+bool RecordCommand::SaveUnwoundRecord(Record* record) {
+  if (record->type() == PERF_RECORD_SAMPLE) {
+    auto& r = *static_cast<SampleRecord*>(record);
     // ExcludeKernelCallChain() should go after UnwindRecord() to notice the generated user call
     // chain.
     if (r.InKernel() && exclude_kernel_callchain_ && !r.ExcludeKernelCallChain()) {
@@ -1346,8 +1634,6 @@ bool RecordCommand::SaveRecordAfterUnwinding(Record* record) {
     sample_record_count_++;
   } else if (record->type() == PERF_RECORD_LOST) {
     lost_record_count_ += static_cast<LostRecord*>(record)->lost;
-  } else {
-    thread_tree_.Update(*record);
   }
   return record_file_writer_->WriteRecord(*record);
 }
@@ -1494,11 +1780,7 @@ void RecordCommand::UpdateRecord(Record* record) {
 }
 
 bool RecordCommand::UnwindRecord(SampleRecord& r) {
-  if ((r.sample_type & PERF_SAMPLE_CALLCHAIN) &&
-      (r.sample_type & PERF_SAMPLE_REGS_USER) &&
-      (r.regs_user_data.reg_mask != 0) &&
-      (r.sample_type & PERF_SAMPLE_STACK_USER) &&
-      (r.GetValidStackSize() > 0)) {
+  if (CanUnwindSampleRecord(r)) {
     ThreadEntry* thread =
         thread_tree_.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
     RegSet regs(r.regs_user_data.abi, r.regs_user_data.reg_mask, r.regs_user_data.regs);
@@ -1519,11 +1801,22 @@ bool RecordCommand::UnwindRecord(SampleRecord& r) {
         return false;
       }
     }
-    r.ReplaceRegAndStackWithCallChain(ips);
-    if (callchain_joiner_) {
-      return callchain_joiner_->AddCallChain(r.tid_data.pid, r.tid_data.tid,
-                                             CallChainJoiner::ORIGINAL_OFFLINE, ips, sps);
+    if (adaptive_sampling_ && !post_unwind_ && !sps.empty()) {
+      adaptive_sampling_->UpdateStackUsage(r.tid_data.tid, r.Timestamp(),
+                                           sps.back() - sps.front(), r.stack_user_data.size);
     }
+    return UpdateCallChainAfterUnwinding(r, ips, sps);
+  }
+  return true;
+}
+
+bool RecordCommand::UpdateCallChainAfterUnwinding(SampleRecord& r,
+                                                  const std::vector<uint64_t>& ips,
+                                                  const std::vector<uint64_t>& sps) {
+  r.ReplaceRegAndStackWithCallChain(ips);
+  if (callchain_joiner_) {
+    return callchain_joiner_->AddCallChain(r.tid_data.pid, r.tid_data.tid,
+                                           CallChainJoiner::ORIGINAL_OFFLINE, ips, sps);
   }
   return true;
 }
@@ -1550,12 +1843,43 @@ bool RecordCommand::PostUnwindRecords() {
   }
   sample_record_count_ = 0;
   lost_record_count_ = 0;
+  if (post_unwind_jobs_ > 1) {
+    return PostUnwindRecordsInParallel(*reader);
+  }
   auto callback = [this](std::unique_ptr<Record> record) {
     return SaveRecordAfterUnwinding(record.get());
   };
   return reader->ReadDataSection(callback);
 }
 
+bool RecordCommand::PostUnwindRecordsInParallel(RecordFileReader& reader) {
+  ParallelPostUnwinder unwinder(
+      post_unwind_jobs_, [this](Record* record, const std::vector<uint64_t>* ips,
+                                const std::vector<uint64_t>* sps) {
+        if (ips != nullptr &&
+            !UpdateCallChainAfterUnwinding(*static_cast<SampleRecord*>(record), *ips, *sps)) {
+          return false;
+        }
+        return SaveUnwoundRecord(record);
+      });
+  auto callback = [&](std::unique_ptr<Record> record) {
+    const ThreadEntry* thread = nullptr;
+    if (record->type() == PERF_RECORD_SAMPLE) {
+      auto& r = *static_cast<SampleRecord*>(record.get());
+      // AdjustCallChainGeneratedByKernel() should go before unwinding, as in
+      // SaveRecordAfterUnwinding().
+      r.AdjustCallChainGeneratedByKernel();
+      if (CanUnwindSampleRecord(r)) {
+        thread = thread_tree_.FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
+      }
+    } else if (record->type() != PERF_RECORD_LOST) {
+      thread_tree_.Update(*record);
+    }
+    return unwinder.ProcessRecord(std::move(record), thread);
+  };
+  return reader.ReadDataSection(callback) && unwinder.Finish();
+}
+
 bool RecordCommand::JoinCallChains() {
   // 1. Prepare joined callchains.
   if (!callchain_joiner_->JoinCallChains()) {
@@ -1634,6 +1958,9 @@ bool RecordCommand::DumpAdditionalFeatures(
   if (!auxtrace_offset.empty()) {
     feature_count++;
   }
+  if (adaptive_sampling_) {
+    feature_count++;
+  }
   if (!record_file_writer_->BeginWriteFeatures(feature_count)) {
     return false;
   }
@@ -1676,6 +2003,10 @@ bool RecordCommand::DumpAdditionalFeatures(
   if (!auxtrace_offset.empty() && !record_file_writer_->WriteAuxTraceFeature(auxtrace_offset)) {
     return false;
   }
+  if (adaptive_sampling_ &&
+      !record_file_writer_->WriteAdaptiveSamplingFeature(adaptive_sampling_->GetDecisions())) {
+    return false;
+  }
 
   if (!record_file_writer_->EndWriteFeatures()) {
     return false;
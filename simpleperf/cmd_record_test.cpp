@@ -362,6 +362,19 @@ TEST(record_cmd, post_unwind_option) {
   ASSERT_TRUE(RunRecordCmd({"-p", pid, "--call-graph", "dwarf", "--post-unwind=no"}));
 }
 
+TEST(record_cmd, post_unwind_jobs_option) {
+  OMIT_TEST_ON_NON_NATIVE_ABIS();
+  ASSERT_TRUE(IsDwarfCallChainSamplingSupported());
+  std::vector<std::unique_ptr<Workload>> workloads;
+  CreateProcesses(1, &workloads);
+  std::string pid = std::to_string(workloads[0]->GetPid());
+  ASSERT_TRUE(
+      RunRecordCmd({"-p", pid, "--call-graph", "dwarf", "--post-unwind", "--post-unwind-jobs", "1"}));
+  ASSERT_TRUE(
+      RunRecordCmd({"-p", pid, "--call-graph", "dwarf", "--post-unwind", "--post-unwind-jobs", "4"}));
+  ASSERT_FALSE(RunRecordCmd({"--post-unwind-jobs", "0"}));
+}
+
 TEST(record_cmd, existing_processes) {
   std::vector<std::unique_ptr<Workload>> workloads;
   CreateProcesses(2, &workloads);
@@ -698,6 +711,31 @@ TEST(record_cmd, size_limit_option) {
   ASSERT_FALSE(RunRecordCmd({"--size-limit", "0"}));
 }
 
+TEST(record_cmd, compression_option) {
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RunRecordCmd({"-z", "1"}, tmpfile.path));
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader);
+  ASSERT_TRUE(reader->HasFeature(PerfFileFormat::FEAT_COMPRESSION));
+  ASSERT_FALSE(reader->DataSection().empty());
+  ASSERT_FALSE(RunRecordCmd({"-z", "10"}));
+}
+
+TEST(record_cmd, adaptive_sampling_option) {
+  OMIT_TEST_ON_NON_NATIVE_ABIS();
+  ASSERT_TRUE(IsDwarfCallChainSamplingSupported());
+  std::vector<std::unique_ptr<Workload>> workloads;
+  CreateProcesses(1, &workloads);
+  std::string pid = std::to_string(workloads[0]->GetPid());
+  TemporaryFile tmpfile;
+  ASSERT_TRUE(RunRecordCmd({"-p", pid, "--call-graph", "dwarf", "--adaptive-sampling"},
+                           tmpfile.path));
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile.path);
+  ASSERT_TRUE(reader);
+  std::vector<PerfFileFormat::AdaptiveSamplingDecision> decisions;
+  ASSERT_TRUE(reader->ReadAdaptiveSamplingFeature(&decisions));
+}
+
 TEST(record_cmd, support_mmap2) {
   // mmap2 is supported in kernel >= 3.16. If not supported, please cherry pick below kernel
   // patches:
@@ -16,10 +16,15 @@
 
 #include <inttypes.h>
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
 #include <functional>
 #include <map>
+#include <mutex>
 #include <set>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <unordered_set>
 #include <vector>
@@ -46,14 +51,36 @@ namespace {
 static std::set<std::string> branch_sort_keys = {
     "dso_from", "dso_to", "symbol_from", "symbol_to",
 };
+// Assigns a small id to each string, so samples can be compared and hashed by
+// ids instead of strings. Strings are cached by their addresses, as comms, dso
+// paths and symbol names don't move while building sample trees.
+class StringIdMap {
+ public:
+  uint32_t GetId(const char* s) {
+    auto it = addr_ids_.find(s);
+    if (it != addr_ids_.end()) {
+      return it->second;
+    }
+    auto result = ids_.emplace(s, static_cast<uint32_t>(ids_.size()));
+    addr_ids_[s] = result.first->second;
+    return result.first->second;
+  }
+
+ private:
+  std::unordered_map<const char*, uint32_t> addr_ids_;
+  std::unordered_map<std::string_view, uint32_t> ids_;
+};
+
 struct BranchFromEntry {
   const MapEntry* map;
   const Symbol* symbol;
   uint64_t vaddr_in_file;
   uint64_t flags;
+  uint32_t dso_id;
+  uint32_t symbol_id;
 
   BranchFromEntry()
-      : map(nullptr), symbol(nullptr), vaddr_in_file(0), flags(0) {}
+      : map(nullptr), symbol(nullptr), vaddr_in_file(0), flags(0), dso_id(0), symbol_id(0) {}
 };
 
 struct SampleEntry {
@@ -68,6 +95,10 @@ struct SampleEntry {
   const MapEntry* map;
   const Symbol* symbol;
   uint64_t vaddr_in_file;
+  // ids of thread_comm, map->dso->Path() and symbol->DemangledName()
+  uint32_t comm_id;
+  uint32_t dso_id;
+  uint32_t symbol_id;
   BranchFromEntry branch_from;
   // a callchain tree representing all callchains in the sample
   CallChainRoot<SampleEntry> callchain;
@@ -84,7 +115,10 @@ struct SampleEntry {
         thread_comm(thread->comm),
         map(map),
         symbol(symbol),
-        vaddr_in_file(vaddr_in_file) {}
+        vaddr_in_file(vaddr_in_file),
+        comm_id(0),
+        dso_id(0),
+        symbol_id(0) {}
 
   // The data member 'callchain' can only move, not copy.
   SampleEntry(SampleEntry&&) = default;
@@ -102,15 +136,44 @@ struct SampleTree {
   uint64_t total_error_callchains;
 };
 
+// The thread, maps and symbols looked up to build samples from a sample record, in lookup order.
+// They depend on the records before the sample record, so are looked up by the thread reading the
+// record file, and used to build samples on other threads.
+struct SampleLookups {
+  struct Addr {
+    const MapEntry* map;
+    const Symbol* symbol;
+    uint64_t vaddr_in_file;
+    uint32_t dso_id;
+    uint32_t symbol_id;
+  };
+
+  ThreadEntry thread;
+  uint32_t comm_id;
+  std::vector<Addr> addrs;
+};
+
 BUILD_COMPARE_VALUE_FUNCTION(CompareVaddrInFile, vaddr_in_file);
+BUILD_KEY_FUNCTION(PidKey, pid);
+BUILD_KEY_FUNCTION(TidKey, tid);
+BUILD_KEY_FUNCTION(CommKey, comm_id);
+BUILD_KEY_FUNCTION(DsoKey, dso_id);
+BUILD_KEY_FUNCTION(SymbolKey, symbol_id);
+BUILD_KEY_FUNCTION(VaddrInFileKey, vaddr_in_file);
+BUILD_KEY_FUNCTION(DsoFromKey, branch_from.dso_id);
+BUILD_KEY_FUNCTION(SymbolFromKey, branch_from.symbol_id);
 BUILD_DISPLAY_HEX64_FUNCTION(DisplayVaddrInFile, vaddr_in_file);
 
 class ReportCmdSampleTreeBuilder : public SampleTreeBuilder<SampleEntry, uint64_t> {
  public:
   ReportCmdSampleTreeBuilder(const SampleComparator<SampleEntry>& sample_comparator,
-                             ThreadTree* thread_tree)
+                             ThreadTree* thread_tree, StringIdMap* string_ids)
       : SampleTreeBuilder(sample_comparator),
         thread_tree_(thread_tree),
+        string_ids_(string_ids),
+        record_lookups_(nullptr),
+        replay_lookups_(nullptr),
+        replay_pos_(0),
         total_samples_(0),
         total_period_(0),
         total_error_callchains_(0) {}
@@ -145,43 +208,86 @@ class ReportCmdSampleTreeBuilder : public SampleTreeBuilder<SampleEntry, uint64_
     return ProcessSampleRecord(r);
   }
 
+  // Look up what is needed to build samples from a record, without adding them to the tree.
+  void LookupSampleRecord(const SampleRecord& r, SampleLookups* lookups) {
+    record_lookups_ = lookups;
+    ProcessSampleRecord(r);
+    record_lookups_ = nullptr;
+    lookup_samples_.clear();
+  }
+
+  // Build samples from a record using lookups made by LookupSampleRecord(). It doesn't access
+  // the thread tree, so can run on any thread.
+  void ProcessSampleRecordWithLookups(const SampleRecord& r, const SampleLookups& lookups) {
+    replay_lookups_ = &lookups;
+    replay_pos_ = 0;
+    ProcessSampleRecord(r);
+    replay_lookups_ = nullptr;
+  }
+
+  void Merge(ReportCmdSampleTreeBuilder& other) {
+    SampleTreeBuilder::Merge(other);
+    total_samples_ += other.total_samples_;
+    total_period_ += other.total_period_;
+    total_error_callchains_ += other.total_error_callchains_;
+  }
+
  protected:
   virtual uint64_t GetPeriod(const SampleRecord& r) = 0;
 
   SampleEntry* CreateSample(const SampleRecord& r, bool in_kernel,
                             uint64_t* acc_info) override {
-    const ThreadEntry* thread =
-        thread_tree_->FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
-    const MapEntry* map =
-        thread_tree_->FindMap(thread, r.ip_data.ip, in_kernel);
+    uint32_t comm_id;
+    const ThreadEntry* thread = FindThread(r, &comm_id);
+    const MapEntry* map = FindMap(thread, r.ip_data.ip, in_kernel);
     uint64_t vaddr_in_file;
-    const Symbol* symbol =
-        thread_tree_->FindSymbol(map, r.ip_data.ip, &vaddr_in_file);
+    uint32_t dso_id;
+    uint32_t symbol_id;
+    const Symbol* symbol = FindSymbol(map, r.ip_data.ip, &vaddr_in_file, &dso_id, &symbol_id);
     uint64_t period = GetPeriod(r);
     *acc_info = period;
-    return InsertSample(std::unique_ptr<SampleEntry>(
-        new SampleEntry(r.time_data.time, period, 0, 1, thread, map, symbol, vaddr_in_file)));
+    std::unique_ptr<SampleEntry> sample(
+        new SampleEntry(r.time_data.time, period, 0, 1, thread, map, symbol, vaddr_in_file));
+    sample->comm_id = comm_id;
+    sample->dso_id = dso_id;
+    sample->symbol_id = symbol_id;
+    if (record_lookups_ != nullptr) {
+      return FilterSample(sample.get()) ? KeepLookupSample(std::move(sample)) : nullptr;
+    }
+    return InsertSample(std::move(sample));
   }
 
   SampleEntry* CreateBranchSample(const SampleRecord& r,
                                   const BranchStackItemType& item) override {
-    const ThreadEntry* thread =
-        thread_tree_->FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
-    const MapEntry* from_map = thread_tree_->FindMap(thread, item.from);
+    uint32_t comm_id;
+    const ThreadEntry* thread = FindThread(r, &comm_id);
+    const MapEntry* from_map = FindMap(thread, item.from);
     uint64_t from_vaddr_in_file;
+    uint32_t from_dso_id;
+    uint32_t from_symbol_id;
     const Symbol* from_symbol =
-        thread_tree_->FindSymbol(from_map, item.from, &from_vaddr_in_file);
-    const MapEntry* to_map = thread_tree_->FindMap(thread, item.to);
+        FindSymbol(from_map, item.from, &from_vaddr_in_file, &from_dso_id, &from_symbol_id);
+    const MapEntry* to_map = FindMap(thread, item.to);
     uint64_t to_vaddr_in_file;
+    uint32_t to_dso_id;
+    uint32_t to_symbol_id;
     const Symbol* to_symbol =
-        thread_tree_->FindSymbol(to_map, item.to, &to_vaddr_in_file);
+        FindSymbol(to_map, item.to, &to_vaddr_in_file, &to_dso_id, &to_symbol_id);
     std::unique_ptr<SampleEntry> sample(
         new SampleEntry(r.time_data.time, r.period_data.period, 0, 1, thread,
                         to_map, to_symbol, to_vaddr_in_file));
+    sample->comm_id = comm_id;
+    sample->dso_id = to_dso_id;
+    sample->symbol_id = to_symbol_id;
     sample->branch_from.map = from_map;
     sample->branch_from.symbol = from_symbol;
     sample->branch_from.vaddr_in_file = from_vaddr_in_file;
     sample->branch_from.flags = item.flags;
+    sample->branch_from.dso_id = from_dso_id;
+    sample->branch_from.symbol_id = from_symbol_id;
+    if (record_lookups_ != nullptr) {
+      return KeepLookupSample(std::move(sample));
+    }
     return InsertSample(std::move(sample));
   }
 
@@ -189,21 +295,34 @@ class ReportCmdSampleTreeBuilder : public SampleTreeBuilder<SampleEntry, uint64_
                                      uint64_t ip, bool in_kernel,
                                      const std::vector<SampleEntry*>& callchain,
                                      const uint64_t& acc_info) override {
-    const MapEntry* map = thread_tree_->FindMap(thread, ip, in_kernel);
+    const MapEntry* map = FindMap(thread, ip, in_kernel);
     if (thread_tree_->IsUnknownDso(map->dso)) {
       // The unwinders can give wrong ip addresses, which can't map to a valid dso. Skip them.
       total_error_callchains_++;
       return nullptr;
     }
     uint64_t vaddr_in_file;
-    const Symbol* symbol = thread_tree_->FindSymbol(map, ip, &vaddr_in_file);
+    uint32_t dso_id;
+    uint32_t symbol_id;
+    const Symbol* symbol = FindSymbol(map, ip, &vaddr_in_file, &dso_id, &symbol_id);
     std::unique_ptr<SampleEntry> callchain_sample(new SampleEntry(
         sample->time, 0, acc_info, 0, thread, map, symbol, vaddr_in_file));
     callchain_sample->thread_comm = sample->thread_comm;
+    callchain_sample->comm_id = sample->comm_id;
+    callchain_sample->dso_id = dso_id;
+    callchain_sample->symbol_id = symbol_id;
+    if (record_lookups_ != nullptr) {
+      return KeepLookupSample(std::move(callchain_sample));
+    }
     return InsertCallChainSample(std::move(callchain_sample), callchain);
   }
 
   const ThreadEntry* GetThreadOfSample(SampleEntry* sample) override {
+    // When building samples with lookups, the thread has no maps, so can't be used to unwind
+    // samples. Callchains were looked up in the thread of the sample by LookupSampleRecord().
+    if (replay_lookups_ != nullptr) {
+      return &replay_lookups_->thread;
+    }
     return thread_tree_->FindThreadOrNew(sample->pid, sample->tid);
   }
 
@@ -248,7 +367,80 @@ class ReportCmdSampleTreeBuilder : public SampleTreeBuilder<SampleEntry, uint64_
   }
 
  private:
+  // Ids of strings are looked up with the thread, maps and symbols. So they are only assigned
+  // by the thread reading the record file.
+  const ThreadEntry* FindThread(const SampleRecord& r, uint32_t* comm_id) {
+    if (replay_lookups_ != nullptr) {
+      *comm_id = replay_lookups_->comm_id;
+      return &replay_lookups_->thread;
+    }
+    const ThreadEntry* thread = thread_tree_->FindThreadOrNew(r.tid_data.pid, r.tid_data.tid);
+    *comm_id = string_ids_->GetId(thread->comm);
+    if (record_lookups_ != nullptr) {
+      record_lookups_->thread = ThreadEntry{thread->pid, thread->tid, thread->comm, nullptr};
+      record_lookups_->comm_id = *comm_id;
+    }
+    return thread;
+  }
+
+  const MapEntry* FindMap(const ThreadEntry* thread, uint64_t ip, bool in_kernel) {
+    if (replay_lookups_ != nullptr) {
+      return replay_lookups_->addrs[replay_pos_++].map;
+    }
+    return AddMapLookup(thread_tree_->FindMap(thread, ip, in_kernel));
+  }
+
+  const MapEntry* FindMap(const ThreadEntry* thread, uint64_t ip) {
+    if (replay_lookups_ != nullptr) {
+      return replay_lookups_->addrs[replay_pos_++].map;
+    }
+    return AddMapLookup(thread_tree_->FindMap(thread, ip));
+  }
+
+  // Should be called after FindMap() for the same ip.
+  const Symbol* FindSymbol(const MapEntry* map, uint64_t ip, uint64_t* vaddr_in_file,
+                           uint32_t* dso_id, uint32_t* symbol_id) {
+    if (replay_lookups_ != nullptr) {
+      const SampleLookups::Addr& addr = replay_lookups_->addrs[replay_pos_ - 1];
+      *vaddr_in_file = addr.vaddr_in_file;
+      *dso_id = addr.dso_id;
+      *symbol_id = addr.symbol_id;
+      return addr.symbol;
+    }
+    const Symbol* symbol = thread_tree_->FindSymbol(map, ip, vaddr_in_file);
+    *dso_id = string_ids_->GetId(map->dso->Path().c_str());
+    // Demangled here, so samples on other threads don't demangle names.
+    *symbol_id = string_ids_->GetId(symbol->DemangledName());
+    if (record_lookups_ != nullptr) {
+      SampleLookups::Addr& addr = record_lookups_->addrs.back();
+      addr.symbol = symbol;
+      addr.vaddr_in_file = *vaddr_in_file;
+      addr.dso_id = *dso_id;
+      addr.symbol_id = *symbol_id;
+    }
+    return symbol;
+  }
+
+  const MapEntry* AddMapLookup(const MapEntry* map) {
+    if (record_lookups_ != nullptr) {
+      record_lookups_->addrs.push_back({map, nullptr, 0, 0, 0});
+    }
+    return map;
+  }
+
+  // When only looking up a record, samples are kept until the record is processed, as they can
+  // be used by following callchain samples.
+  SampleEntry* KeepLookupSample(std::unique_ptr<SampleEntry> sample) {
+    lookup_samples_.push_back(std::move(sample));
+    return lookup_samples_.back().get();
+  }
+
   ThreadTree* thread_tree_;
+  StringIdMap* string_ids_;
+  SampleLookups* record_lookups_;
+  const SampleLookups* replay_lookups_;
+  size_t replay_pos_;
+  std::vector<std::unique_ptr<SampleEntry>> lookup_samples_;
 
   std::unordered_set<int> pid_filter_;
   std::unordered_set<int> tid_filter_;
@@ -265,8 +457,8 @@ class ReportCmdSampleTreeBuilder : public SampleTreeBuilder<SampleEntry, uint64_
 class EventCountSampleTreeBuilder : public ReportCmdSampleTreeBuilder {
  public:
   EventCountSampleTreeBuilder(const SampleComparator<SampleEntry>& sample_comparator,
-                              ThreadTree* thread_tree)
-      : ReportCmdSampleTreeBuilder(sample_comparator, thread_tree) { }
+                              ThreadTree* thread_tree, StringIdMap* string_ids)
+      : ReportCmdSampleTreeBuilder(sample_comparator, thread_tree, string_ids) {}
 
  protected:
   uint64_t GetPeriod(const SampleRecord& r) override {
@@ -278,8 +470,8 @@ class EventCountSampleTreeBuilder : public ReportCmdSampleTreeBuilder {
 class TimestampSampleTreeBuilder : public ReportCmdSampleTreeBuilder {
  public:
   TimestampSampleTreeBuilder(const SampleComparator<SampleEntry>& sample_comparator,
-                             ThreadTree* thread_tree)
-      : ReportCmdSampleTreeBuilder(sample_comparator, thread_tree) { }
+                             ThreadTree* thread_tree, StringIdMap* string_ids)
+      : ReportCmdSampleTreeBuilder(sample_comparator, thread_tree, string_ids) {}
 
   void ReportCmdProcessSampleRecord(std::shared_ptr<SampleRecord>& r) override {
     pid_t tid = static_cast<pid_t>(r->tid_data.tid);
@@ -311,6 +503,7 @@ class TimestampSampleTreeBuilder : public ReportCmdSampleTreeBuilder {
 struct SampleTreeBuilderOptions {
   SampleComparator<SampleEntry> comparator;
   ThreadTree* thread_tree;
+  StringIdMap* string_ids;
   std::unordered_set<std::string> comm_filter;
   std::unordered_set<std::string> dso_filter;
   std::unordered_set<std::string> symbol_filter;
@@ -325,9 +518,9 @@ struct SampleTreeBuilderOptions {
   std::unique_ptr<ReportCmdSampleTreeBuilder> CreateSampleTreeBuilder() {
     std::unique_ptr<ReportCmdSampleTreeBuilder> builder;
     if (trace_offcpu) {
-      builder.reset(new TimestampSampleTreeBuilder(comparator, thread_tree));
+      builder.reset(new TimestampSampleTreeBuilder(comparator, thread_tree, string_ids));
     } else {
-      builder.reset(new EventCountSampleTreeBuilder(comparator, thread_tree));
+      builder.reset(new EventCountSampleTreeBuilder(comparator, thread_tree, string_ids));
     }
     builder->SetFilters(pid_filter, tid_filter, comm_filter, dso_filter, symbol_filter);
     builder->SetBranchSampleOption(use_branch_address);
@@ -337,6 +530,161 @@ struct SampleTreeBuilderOptions {
   }
 };
 
+// Builds sample trees on worker threads. The thread reading the record file updates the thread
+// tree and looks up each sample record. Batches of sample records are built into sample trees on
+// worker threads, which are merged in record order. So the result is the same as building all
+// samples on one thread.
+class ParallelSampleTreeBuilder {
+ public:
+  ParallelSampleTreeBuilder(const SampleTreeBuilderOptions& options,
+                            std::vector<std::unique_ptr<ReportCmdSampleTreeBuilder>>& builders,
+                            size_t jobs)
+      : options_(options), builders_(builders), max_pending_batches_(jobs * 2) {
+    SampleTreeBuilderOptions lookup_options = options;
+    lookup_options.build_callchain = false;
+    lookup_builder_ = lookup_options.CreateSampleTreeBuilder();
+    for (size_t i = 0; i < jobs; ++i) {
+      workers_.emplace_back([this]() { RunWorker(); });
+    }
+  }
+
+  ~ParallelSampleTreeBuilder() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      finished_ = true;
+    }
+    batch_cond_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Should be called after updating the thread tree with records before this one.
+  void ProcessSampleRecord(std::unique_ptr<Record> record, size_t attr_id) {
+    if (!batch_) {
+      batch_.reset(new Batch);
+      batch_->id = next_batch_id_++;
+    }
+    batch_->samples.emplace_back();
+    Sample& sample = batch_->samples.back();
+    lookup_builder_->LookupSampleRecord(*static_cast<SampleRecord*>(record.get()),
+                                        &sample.lookups);
+    sample.record = std::move(record);
+    sample.attr_id = attr_id;
+    if (batch_->samples.size() == BATCH_SIZE) {
+      SubmitBatch();
+      MergeBatches(max_pending_batches_);
+    }
+  }
+
+  // Wait for all samples to be built, and merge them into the builders.
+  void Finish() {
+    if (batch_) {
+      SubmitBatch();
+    }
+    MergeBatches(0);
+  }
+
+ private:
+  static constexpr size_t BATCH_SIZE = 1000;
+
+  struct Sample {
+    std::unique_ptr<Record> record;
+    size_t attr_id;
+    SampleLookups lookups;
+  };
+
+  struct Batch {
+    uint64_t id;
+    std::vector<Sample> samples;
+    // A builder for each event attr having samples in the batch.
+    std::vector<std::unique_ptr<ReportCmdSampleTreeBuilder>> builders;
+  };
+
+  void SubmitBatch() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      batches_.push_back(std::move(batch_));
+    }
+    batch_cond_.notify_one();
+  }
+
+  void RunWorker() {
+    while (true) {
+      std::unique_ptr<Batch> batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        batch_cond_.wait(lock, [this]() { return finished_ || !batches_.empty(); });
+        if (batches_.empty()) {
+          return;
+        }
+        batch = std::move(batches_.front());
+        batches_.pop_front();
+      }
+      batch->builders.resize(builders_.size());
+      for (Sample& sample : batch->samples) {
+        auto& builder = batch->builders[sample.attr_id];
+        if (!builder) {
+          builder = options_.CreateSampleTreeBuilder();
+        }
+        builder->ProcessSampleRecordWithLookups(*static_cast<SampleRecord*>(sample.record.get()),
+                                                sample.lookups);
+      }
+      batch->samples.clear();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        built_batches_[batch->id] = std::move(batch);
+      }
+      built_cond_.notify_one();
+    }
+  }
+
+  // Merge built batches in record order, and wait while more than max_pending batches aren't
+  // merged.
+  void MergeBatches(size_t max_pending) {
+    while (true) {
+      std::unique_ptr<Batch> batch;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        built_cond_.wait(lock, [&]() {
+          return next_batch_id_ - next_merge_id_ <= max_pending ||
+                 built_batches_.count(next_merge_id_) != 0;
+        });
+        auto it = built_batches_.find(next_merge_id_);
+        if (it == built_batches_.end()) {
+          return;
+        }
+        batch = std::move(it->second);
+        built_batches_.erase(it);
+        next_merge_id_++;
+      }
+      for (size_t i = 0; i < builders_.size(); ++i) {
+        if (batch->builders[i]) {
+          builders_[i]->Merge(*batch->builders[i]);
+        }
+      }
+    }
+  }
+
+  SampleTreeBuilderOptions options_;
+  std::vector<std::unique_ptr<ReportCmdSampleTreeBuilder>>& builders_;
+  const size_t max_pending_batches_;
+  std::unique_ptr<ReportCmdSampleTreeBuilder> lookup_builder_;
+  std::unique_ptr<Batch> batch_;
+  uint64_t next_batch_id_ = 0;
+
+  std::mutex mutex_;
+  std::condition_variable batch_cond_;
+  std::condition_variable built_cond_;
+  // Batches waiting to be built, guarded by mutex_.
+  std::deque<std::unique_ptr<Batch>> batches_;
+  // Batches waiting to be merged, guarded by mutex_.
+  std::map<uint64_t, std::unique_ptr<Batch>> built_batches_;
+  uint64_t next_merge_id_ = 0;
+  bool finished_ = false;
+  std::vector<std::thread> workers_;
+};
+
 using ReportCmdSampleTreeSorter = SampleTreeSorter<SampleEntry>;
 using ReportCmdSampleTreeDisplayer =
     SampleTreeDisplayer<SampleEntry, SampleTree>;
@@ -380,6 +728,8 @@ class ReportCommand : public Command {
 "                      the graph shows how functions call others.\n"
 "                      Default is caller mode.\n"
 "-i <file>  Specify path of record file, default is perf.data.\n"
+"--jobs <n>  Use n threads to load symbols and build the report. The report\n"
+"            is the same as built with one thread, which is the default.\n"
 "--kallsyms <file>     Set the file to read kernel symbols.\n"
 "--max-stack <frames>  Set max stack frames shown when printing call graph.\n"
 "-n         Print the sample count for each item.\n"
@@ -408,6 +758,8 @@ class ReportCommand : public Command {
 "                        symbol_to       -- name of function branched to\n"
 "                      The default sort keys are:\n"
 "                        comm,pid,tid,dso,symbol\n"
+"--symbol-cache <dir>  Cache symbols and build ids read from elf files in <dir>,\n"
+"                      so later reports don't need to parse the same files.\n"
 "--symbols symbol1;symbol2;...    Report only for selected symbols.\n"
 "--symfs <dir>         Look for files with symbols relative to this directory.\n"
 "--tids tid1,tid2,...  Report only for selected tids.\n"
@@ -426,7 +778,9 @@ class ReportCommand : public Command {
         raw_period_(false),
         brief_callgraph_(true),
         trace_offcpu_(false),
-        sched_switch_attr_id_(0u) {}
+        sched_switch_attr_id_(0u),
+        has_tid_sort_key_(false),
+        jobs_(1) {}
 
   bool Run(const std::vector<std::string>& args);
 
@@ -447,6 +801,7 @@ class ReportCommand : public Command {
   std::unique_ptr<RecordFileReader> record_file_reader_;
   std::vector<EventAttrWithName> event_attrs_;
   ThreadTree thread_tree_;
+  StringIdMap string_ids_;
   // Create a SampleTreeBuilder and SampleTree for each event_attr.
   std::vector<SampleTree> sample_tree_;
   SampleTreeBuilderOptions sample_tree_builder_options_;
@@ -466,6 +821,9 @@ class ReportCommand : public Command {
   bool brief_callgraph_;
   bool trace_offcpu_;
   size_t sched_switch_attr_id_;
+  bool has_tid_sort_key_;
+  uint32_t jobs_;
+  std::unique_ptr<ParallelSampleTreeBuilder> parallel_builder_;
 
   std::string report_filename_;
 };
@@ -481,6 +839,7 @@ bool ReportCommand::Run(const std::vector<std::string>& args) {
   if (record_file_reader_ == nullptr) {
     return false;
   }
+  record_file_reader_->MapDataSection();
   ReadMetaInfoFromRecordFile();
   if (!ReadEventAttrFromRecordFile()) {
     return false;
@@ -545,6 +904,10 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
       }
       record_filename_ = args[i];
 
+    } else if (args[i] == "--jobs") {
+      if (!GetUintOption(args, &i, &jobs_, 1)) {
+        return false;
+      }
     } else if (args[i] == "--kallsyms") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
@@ -599,6 +962,13 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
         return false;
       }
       sort_keys = android::base::Split(args[i], ",");
+    } else if (args[i] == "--symbol-cache") {
+      if (!NextArgumentOrError(args, &i)) {
+        return false;
+      }
+      if (!Dso::SetSymbolCacheDir(args[i])) {
+        return false;
+      }
     } else if (args[i] == "--symbols") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
@@ -661,34 +1031,35 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
       return false;
     }
     if (key == "pid") {
-      comparator.AddCompareFunction(ComparePid);
+      comparator.AddCompareFunction(ComparePid, PidKey);
       displayer.AddDisplayFunction("Pid", DisplayPid);
     } else if (key == "tid") {
-      comparator.AddCompareFunction(CompareTid);
+      has_tid_sort_key_ = true;
+      comparator.AddCompareFunction(CompareTid, TidKey);
       displayer.AddDisplayFunction("Tid", DisplayTid);
     } else if (key == "comm") {
-      comparator.AddCompareFunction(CompareComm);
+      comparator.AddCompareFunction(CompareComm, CommKey);
       displayer.AddDisplayFunction("Command", DisplayComm);
     } else if (key == "dso") {
-      comparator.AddCompareFunction(CompareDso);
+      comparator.AddCompareFunction(CompareDso, DsoKey);
       displayer.AddDisplayFunction("Shared Object", DisplayDso);
     } else if (key == "symbol") {
-      comparator.AddCompareFunction(CompareSymbol);
+      comparator.AddCompareFunction(CompareSymbol, SymbolKey);
       displayer.AddDisplayFunction("Symbol", DisplaySymbol);
     } else if (key == "vaddr_in_file") {
-      comparator.AddCompareFunction(CompareVaddrInFile);
+      comparator.AddCompareFunction(CompareVaddrInFile, VaddrInFileKey);
       displayer.AddDisplayFunction("VaddrInFile", DisplayVaddrInFile);
     } else if (key == "dso_from") {
-      comparator.AddCompareFunction(CompareDsoFrom);
+      comparator.AddCompareFunction(CompareDsoFrom, DsoFromKey);
       displayer.AddDisplayFunction("Source Shared Object", DisplayDsoFrom);
     } else if (key == "dso_to") {
-      comparator.AddCompareFunction(CompareDso);
+      comparator.AddCompareFunction(CompareDso, DsoKey);
       displayer.AddDisplayFunction("Target Shared Object", DisplayDso);
     } else if (key == "symbol_from") {
-      comparator.AddCompareFunction(CompareSymbolFrom);
+      comparator.AddCompareFunction(CompareSymbolFrom, SymbolFromKey);
       displayer.AddDisplayFunction("Source Symbol", DisplaySymbolFrom);
     } else if (key == "symbol_to") {
-      comparator.AddCompareFunction(CompareSymbol);
+      comparator.AddCompareFunction(CompareSymbol, SymbolKey);
       displayer.AddDisplayFunction("Target Symbol", DisplaySymbol);
     } else {
       LOG(ERROR) << "Unknown sort key: " << key;
@@ -718,6 +1089,7 @@ bool ReportCommand::ParseOptions(const std::vector<std::string>& args) {
 
   sample_tree_builder_options_.comparator = comparator;
   sample_tree_builder_options_.thread_tree = &thread_tree_;
+  sample_tree_builder_options_.string_ids = &string_ids_;
 
   SampleComparator<SampleEntry> sort_comparator;
   sort_comparator.AddCompareFunction(CompareTotalPeriod);
@@ -778,6 +1150,10 @@ bool ReportCommand::ReadEventAttrFromRecordFile() {
 
 bool ReportCommand::ReadFeaturesFromRecordFile() {
   record_file_reader_->LoadBuildIdAndFileFeatures(thread_tree_);
+  if (jobs_ > 1 && record_file_reader_->HasFeature(PerfFileFormat::FEAT_FILE)) {
+    // The file feature has dsos hit by samples. Load their symbols before reading samples.
+    Dso::LoadSymbolsInParallel(thread_tree_.GetAllDsos(), jobs_);
+  }
 
   std::string arch =
       record_file_reader_->ReadFeatureString(PerfFileFormat::FEAT_ARCH);
@@ -832,6 +1208,24 @@ bool ReportCommand::ReadSampleTreeFromRecordFile() {
   for (size_t i = 0; i < event_attrs_.size(); ++i) {
     sample_tree_builder_.push_back(sample_tree_builder_options_.CreateSampleTreeBuilder());
   }
+  if (jobs_ > 1) {
+    // Samples are unwound on the thread tree of the time they are recorded, and samples in
+    // trace offcpu mode depend on the next sample. Both need to be built in record order.
+    // Callchains are looked up in the thread of the first sample merged into the same entry,
+    // which is only known when building in record order, unless samples are sorted by tid.
+    bool can_build_in_parallel = !trace_offcpu_ && (!accumulate_callchain_ || has_tid_sort_key_);
+    for (const auto& attr : event_attrs_) {
+      if (accumulate_callchain_ && (attr.attr.sample_type & PERF_SAMPLE_STACK_USER)) {
+        can_build_in_parallel = false;
+      }
+    }
+    if (can_build_in_parallel) {
+      parallel_builder_.reset(new ParallelSampleTreeBuilder(sample_tree_builder_options_,
+                                                            sample_tree_builder_, jobs_));
+    } else {
+      LOG(DEBUG) << "Samples can't be built in parallel, use one thread.";
+    }
+  }
 
   if (!record_file_reader_->ReadDataSection(
           [this](std::unique_ptr<Record> record) {
@@ -839,6 +1233,10 @@ bool ReportCommand::ReadSampleTreeFromRecordFile() {
           })) {
     return false;
   }
+  if (parallel_builder_) {
+    parallel_builder_->Finish();
+    parallel_builder_.reset();
+  }
   for (size_t i = 0; i < sample_tree_builder_.size(); ++i) {
     sample_tree_.push_back(sample_tree_builder_[i]->GetSampleTree());
     sample_tree_sorter_->Sort(sample_tree_.back().samples, print_callgraph_);
@@ -850,7 +1248,9 @@ bool ReportCommand::ProcessRecord(std::unique_ptr<Record> record) {
   thread_tree_.Update(*record);
   if (record->type() == PERF_RECORD_SAMPLE) {
     size_t attr_id = record_file_reader_->GetAttrIndexOfRecord(record.get());
-    if (!trace_offcpu_) {
+    if (parallel_builder_) {
+      parallel_builder_->ProcessSampleRecord(std::move(record), attr_id);
+    } else if (!trace_offcpu_) {
       sample_tree_builder_[attr_id]->ReportCmdProcessSampleRecord(
           *static_cast<SampleRecord*>(record.get()));
     } else {
@@ -90,6 +90,8 @@ class ReportSampleCommand : public Command {
 "--remove-unknown-kernel-symbols  Remove kernel callchains when kernel symbols\n"
 "                                 are not available in perf.data.\n"
 "--show-art-frames  Show frames of internal methods in the ART Java interpreter.\n"
+"--symbol-cache <dir>  Cache symbols and build ids read from elf files in <dir>,\n"
+"                      so later runs don't need to parse the same files.\n"
 "--symdir <dir>     Look for files with symbols in a directory recursively.\n"
             // clang-format on
             ),
@@ -237,6 +239,7 @@ bool ReportSampleCommand::Run(const std::vector<std::string>& args) {
 }
 
 bool ReportSampleCommand::ParseOptions(const std::vector<std::string>& args) {
+  std::vector<std::string> symdirs;
   for (size_t i = 0; i < args.size(); ++i) {
     if (args[i] == "--dump-protobuf-report") {
       if (!NextArgumentOrError(args, &i)) {
@@ -261,18 +264,29 @@ bool ReportSampleCommand::ParseOptions(const std::vector<std::string>& args) {
       remove_unknown_kernel_symbols_ = true;
     } else if (args[i] == "--show-art-frames") {
       show_art_frames_ = true;
-    } else if (args[i] == "--symdir") {
+    } else if (args[i] == "--symbol-cache") {
       if (!NextArgumentOrError(args, &i)) {
         return false;
       }
-      if (!Dso::AddSymbolDir(args[i])) {
+      if (!Dso::SetSymbolCacheDir(args[i])) {
+        return false;
+      }
+    } else if (args[i] == "--symdir") {
+      if (!NextArgumentOrError(args, &i)) {
         return false;
       }
+      symdirs.push_back(args[i]);
     } else {
       ReportUnknownOption(args, i);
       return false;
     }
   }
+  // Add symdirs after setting the symbol cache, which caches build ids of files in them.
+  for (const std::string& symdir : symdirs) {
+    if (!Dso::AddSymbolDir(symdir)) {
+      return false;
+    }
+  }
 
   if (use_protobuf_ && report_filename_.empty()) {
     report_filename_ = "report_sample.trace";
@@ -422,6 +436,7 @@ bool ReportSampleCommand::OpenRecordFile() {
   if (record_file_reader_ == nullptr) {
     return false;
   }
+  record_file_reader_->MapDataSection();
   record_file_reader_->LoadBuildIdAndFileFeatures(thread_tree_);
   auto& meta_info = record_file_reader_->GetMetaInfoFeature();
   if (auto it = meta_info.find("trace_offcpu"); it != meta_info.end()) {
@@ -495,6 +495,28 @@ TEST_F(ReportCommandTest, report_big_trace_data) {
   ASSERT_TRUE(success);
 }
 
+TEST_F(ReportCommandTest, jobs_option) {
+  std::vector<std::pair<std::string, std::vector<std::string>>> reports = {
+      {PERF_DATA, {}},
+      {PERF_DATA_WITH_MULTIPLE_PIDS_AND_TIDS, {"--sort", "dso", "--tids", "17441,17442"}},
+      {CALLGRAPH_FP_PERF_DATA, {"-g", "--full-callgraph"}},
+      {CALLGRAPH_FP_PERF_DATA, {"--children", "-g", "callee", "--sort", "symbol"}},
+      {CALLGRAPH_FP_PERF_DATA, {"--children", "--sort", "tid,symbol"}},
+      {PERF_DATA_WITH_WRONG_IP_IN_CALLCHAIN, {"-g"}},
+      {BRANCH_PERF_DATA, {"-b", "--sort", "symbol_from,symbol_to"}},
+      {PERF_DATA_WITH_TRACE_OFFCPU, {"-g"}},
+  };
+  for (auto& [perf_data, args] : reports) {
+    Report(perf_data, args);
+    ASSERT_TRUE(success);
+    std::string expected = content;
+    args.insert(args.end(), {"--jobs", "4"});
+    Report(perf_data, args);
+    ASSERT_TRUE(success);
+    ASSERT_EQ(content, expected) << perf_data;
+  }
+}
+
 #if defined(__linux__)
 #include "event_selection_set.h"
 
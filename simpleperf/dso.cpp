@@ -16,17 +16,29 @@
 
 #include "dso.h"
 
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#endif
 
 #include <algorithm>
+#include <atomic>
 #include <limits>
 #include <memory>
+#include <thread>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <android-base/parseint.h>
+#include <android-base/stringprintf.h>
 #include <android-base/strings.h>
+#include <android-base/unique_fd.h>
 
 #include "environment.h"
 #include "read_apk.h"
@@ -44,11 +56,282 @@ std::string RemovePathSeparatorSuffix(const std::string& path) {
   return path;
 }
 
+static bool GetFileSizeAndMtime(const std::string& path, uint64_t* size, uint64_t* mtime) {
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) {
+    return false;
+  }
+  *size = static_cast<uint64_t>(st.st_size);
+#if defined(__linux__)
+  *mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000ULL + st.st_mtim.tv_nsec;
+#else
+  *mtime = static_cast<uint64_t>(st.st_mtime) * 1000000000ULL;
+#endif
+  return true;
+}
+
+// Write a file in the cache dir atomically, so a concurrent run never sees a partial file.
+static bool WriteCacheFile(const std::string& path, const std::string& data) {
+  // Files can be written by threads loading symbols in parallel.
+  static std::atomic<uint32_t> tmp_file_id(0);
+  std::string tmp_path = path + android::base::StringPrintf(".tmp%d_%u", getpid(), tmp_file_id++);
+  if (!android::base::WriteStringToFile(data, tmp_path) ||
+      rename(tmp_path.c_str(), path.c_str()) != 0) {
+    PLOG(DEBUG) << "failed to write " << path;
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// A symbol file in the cache has a SymbolFileHeader, symbol_count SymbolFileEntries sorted by
+// address, and a string pool of string_pool_size bytes storing null-terminated strings.
+static constexpr char SYMBOL_FILE_MAGIC[8] = {'S', 'P', 'S', 'Y', 'M', 'B', 'O', 'L'};
+static constexpr uint32_t SYMBOL_FILE_VERSION = 1;
+static constexpr uint32_t SYMBOL_FILE_FLAG_DEMANGLED_NAMES = 1;
+static constexpr uint32_t NO_DEMANGLED_NAME = std::numeric_limits<uint32_t>::max();
+
+struct SymbolFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint64_t elf_size;
+  uint64_t elf_mtime;
+  uint64_t symbol_count;
+  uint64_t string_pool_size;
+  // Offsets are in the string pool.
+  uint32_t elf_path_offset;
+  uint32_t reserved;
+};
+
+struct SymbolFileEntry {
+  uint64_t addr;
+  uint64_t len;
+  uint32_t name_offset;
+  uint32_t demangled_name_offset;
+};
+
+void PersistentSymbolCache::Reset() {
+  FlushBuildIds();
+  UnmapFiles();
+  dir_.clear();
+  build_ids_loaded_ = false;
+  build_ids_changed_ = false;
+  build_ids_.clear();
+}
+
+bool PersistentSymbolCache::SetDir(const std::string& dir) {
+  std::string cache_dir = RemovePathSeparatorSuffix(dir);
+  if (!IsDir(cache_dir) && !MkdirWithParents(cache_dir + OS_PATH_SEPARATOR)) {
+    LOG(ERROR) << "Invalid symbol cache dir " << cache_dir;
+    return false;
+  }
+  FlushBuildIds();
+  dir_ = cache_dir;
+  build_ids_loaded_ = false;
+  build_ids_.clear();
+  return true;
+}
+
+bool PersistentSymbolCache::ReadSymbols(const BuildId& build_id, const std::string& elf_path,
+                                        bool demangle, std::vector<Symbol>* symbols) {
+#if defined(_WIN32)
+  return false;
+#else
+  uint64_t elf_size;
+  uint64_t elf_mtime;
+  if (!Enabled() || build_id.IsEmpty() || !GetFileSizeAndMtime(elf_path, &elf_size, &elf_mtime)) {
+    return false;
+  }
+  std::string path = dir_ + OS_PATH_SEPARATOR + build_id.ToString().substr(2) + ".sym";
+  android::base::unique_fd fd(TEMP_FAILURE_RETRY(open(path.c_str(), O_RDONLY | O_CLOEXEC)));
+  struct stat st;
+  if (fd == -1 || fstat(fd, &st) != 0 ||
+      static_cast<uint64_t>(st.st_size) <= sizeof(SymbolFileHeader)) {
+    return false;
+  }
+  size_t map_size = st.st_size;
+  // Cache files are replaced by rename() rather than rewritten in place, and a private mapping
+  // isn't affected by writes from other processes.
+  void* addr = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (addr == MAP_FAILED) {
+    PLOG(DEBUG) << "failed to map " << path;
+    return false;
+  }
+  const char* p = static_cast<const char*>(addr);
+  const SymbolFileHeader* header = reinterpret_cast<const SymbolFileHeader*>(p);
+  const SymbolFileEntry* entries = reinterpret_cast<const SymbolFileEntry*>(header + 1);
+  uint64_t max_symbol_count = (map_size - sizeof(SymbolFileHeader)) / sizeof(SymbolFileEntry);
+  bool valid = memcmp(header->magic, SYMBOL_FILE_MAGIC, sizeof(SYMBOL_FILE_MAGIC)) == 0 &&
+               header->version == SYMBOL_FILE_VERSION && header->elf_size == elf_size &&
+               header->elf_mtime == elf_mtime && header->symbol_count <= max_symbol_count &&
+               header->string_pool_size > 0 &&
+               header->string_pool_size == map_size - sizeof(SymbolFileHeader) -
+                                               header->symbol_count * sizeof(SymbolFileEntry);
+  const char* string_pool = valid ? p + map_size - header->string_pool_size : nullptr;
+  valid = valid && string_pool[header->string_pool_size - 1] == '\0' &&
+          header->elf_path_offset < header->string_pool_size &&
+          elf_path == string_pool + header->elf_path_offset;
+  bool has_demangled_names = demangle && (header->flags & SYMBOL_FILE_FLAG_DEMANGLED_NAMES);
+  for (uint64_t i = 0; valid && i < header->symbol_count; ++i) {
+    const SymbolFileEntry& entry = entries[i];
+    valid = entry.name_offset < header->string_pool_size &&
+            (entry.demangled_name_offset == NO_DEMANGLED_NAME ||
+             entry.demangled_name_offset < header->string_pool_size);
+  }
+  if (!valid) {
+    munmap(addr, map_size);
+    return false;
+  }
+  symbols->clear();
+  symbols->reserve(header->symbol_count);
+  for (uint64_t i = 0; i < header->symbol_count; ++i) {
+    const SymbolFileEntry& entry = entries[i];
+    const char* demangled_name = nullptr;
+    if (has_demangled_names && entry.demangled_name_offset != NO_DEMANGLED_NAME) {
+      demangled_name = string_pool + entry.demangled_name_offset;
+    }
+    symbols->push_back(
+        Symbol(string_pool + entry.name_offset, demangled_name, entry.addr, entry.len));
+  }
+  std::lock_guard<std::mutex> lock(mapped_files_mutex_);
+  mapped_files_.emplace_back(addr, map_size);
+  return true;
+#endif
+}
+
+void PersistentSymbolCache::WriteSymbols(const BuildId& build_id, const std::string& elf_path,
+                                         bool demangle, const std::vector<Symbol>& symbols) {
+#if !defined(_WIN32)
+  SymbolFileHeader header;
+  if (!Enabled() || build_id.IsEmpty() ||
+      !GetFileSizeAndMtime(elf_path, &header.elf_size, &header.elf_mtime)) {
+    return;
+  }
+  memcpy(header.magic, SYMBOL_FILE_MAGIC, sizeof(SYMBOL_FILE_MAGIC));
+  header.version = SYMBOL_FILE_VERSION;
+  header.flags = demangle ? SYMBOL_FILE_FLAG_DEMANGLED_NAMES : 0;
+  header.symbol_count = symbols.size();
+  header.reserved = 0;
+  std::string string_pool;
+  auto add_string = [&](const char* s) {
+    size_t offset = string_pool.size();
+    string_pool.append(s, strlen(s) + 1);
+    return offset;
+  };
+  header.elf_path_offset = add_string(elf_path.c_str());
+  std::vector<SymbolFileEntry> entries(symbols.size());
+  for (size_t i = 0; i < symbols.size(); ++i) {
+    const Symbol& symbol = symbols[i];
+    SymbolFileEntry& entry = entries[i];
+    entry.addr = symbol.addr;
+    entry.len = symbol.len;
+    entry.name_offset = add_string(symbol.Name());
+    entry.demangled_name_offset = NO_DEMANGLED_NAME;
+    if (demangle) {
+      // Demangle names when caching them, so later runs don't need to.
+      const char* demangled_name = symbol.DemangledName();
+      entry.demangled_name_offset = (strcmp(demangled_name, symbol.Name()) == 0)
+                                        ? entry.name_offset
+                                        : add_string(demangled_name);
+    }
+    if (string_pool.size() >= NO_DEMANGLED_NAME) {
+      return;
+    }
+  }
+  header.string_pool_size = string_pool.size();
+  std::string data(reinterpret_cast<const char*>(&header), sizeof(header));
+  data.append(reinterpret_cast<const char*>(entries.data()),
+              entries.size() * sizeof(SymbolFileEntry));
+  data += string_pool;
+  WriteCacheFile(dir_ + OS_PATH_SEPARATOR + build_id.ToString().substr(2) + ".sym", data);
+#endif
+}
+
+// Build ids are cached in a text file, with one line per file in the format:
+//   <ElfStatus> <build id> <file size> <file mtime> <file path>
+ElfStatus PersistentSymbolCache::GetBuildIdFromElfFile(const std::string& path,
+                                                       BuildId* build_id) {
+  uint64_t file_size;
+  uint64_t file_mtime;
+  if (!Enabled() || !GetFileSizeAndMtime(path, &file_size, &file_mtime)) {
+    return ::GetBuildIdFromElfFile(path, build_id);
+  }
+  LoadBuildIds();
+  auto it = build_ids_.find(path);
+  if (it != build_ids_.end() && it->second.file_size == file_size &&
+      it->second.file_mtime == file_mtime) {
+    *build_id = it->second.build_id;
+    return it->second.status;
+  }
+  ElfStatus status = ::GetBuildIdFromElfFile(path, build_id);
+  build_ids_[path] = CachedBuildId{file_size, file_mtime, status,
+                                   status == ElfStatus::NO_ERROR ? *build_id : BuildId()};
+  build_ids_changed_ = true;
+  return status;
+}
+
+void PersistentSymbolCache::LoadBuildIds() {
+  if (build_ids_loaded_) {
+    return;
+  }
+  build_ids_loaded_ = true;
+  std::string content;
+  if (!android::base::ReadFileToString(dir_ + OS_PATH_SEPARATOR + "build_ids", &content)) {
+    return;
+  }
+  for (const std::string& line : android::base::Split(content, "\n")) {
+    std::vector<std::string> items = android::base::Split(line, " ");
+    if (items.size() < 5u) {
+      continue;
+    }
+    uint32_t status;
+    CachedBuildId cached;
+    if (!android::base::ParseUint(items[0], &status) ||
+        status > ElfStatus::SECTION_NOT_FOUND ||
+        !android::base::ParseUint(items[2], &cached.file_size) ||
+        !android::base::ParseUint(items[3], &cached.file_mtime)) {
+      continue;
+    }
+    cached.status = static_cast<ElfStatus>(status);
+    cached.build_id = BuildId(items[1]);
+    // The path is the rest of the line, which can contain spaces.
+    size_t path_start = items[0].size() + items[1].size() + items[2].size() + items[3].size() + 4;
+    build_ids_[line.substr(path_start)] = cached;
+  }
+}
+
+void PersistentSymbolCache::FlushBuildIds() {
+  if (!build_ids_changed_) {
+    return;
+  }
+  build_ids_changed_ = false;
+  std::string content;
+  for (const auto& pair : build_ids_) {
+    const CachedBuildId& cached = pair.second;
+    content += android::base::StringPrintf(
+        "%d %s %" PRIu64 " %" PRIu64 " %s\n", cached.status,
+        cached.build_id.ToString().substr(2).c_str(), cached.file_size, cached.file_mtime,
+        pair.first.c_str());
+  }
+  WriteCacheFile(dir_ + OS_PATH_SEPARATOR + "build_ids", content);
+}
+
+void PersistentSymbolCache::UnmapFiles() {
+#if !defined(_WIN32)
+  for (auto& pair : mapped_files_) {
+    munmap(pair.first, pair.second);
+  }
+#endif
+  mapped_files_.clear();
+}
+
 void DebugElfFileFinder::Reset() {
   vdso_64bit_.clear();
   vdso_32bit_.clear();
   symfs_dir_.clear();
   build_id_to_file_map_.clear();
+  symbol_cache_ = nullptr;
 }
 
 bool DebugElfFileFinder::SetSymFsDir(const std::string& symfs_dir) {
@@ -77,6 +360,9 @@ bool DebugElfFileFinder::AddSymbolDir(const std::string& symbol_dir) {
   }
   std::string dir = RemovePathSeparatorSuffix(symbol_dir);
   CollectBuildIdInDir(dir);
+  if (symbol_cache_ != nullptr) {
+    symbol_cache_->FlushBuildIds();
+  }
   return true;
 }
 
@@ -87,7 +373,10 @@ void DebugElfFileFinder::CollectBuildIdInDir(const std::string& dir) {
       CollectBuildIdInDir(path);
     } else {
       BuildId build_id;
-      if (GetBuildIdFromElfFile(path, &build_id) == ElfStatus::NO_ERROR) {
+      ElfStatus status = (symbol_cache_ != nullptr)
+                             ? symbol_cache_->GetBuildIdFromElfFile(path, &build_id)
+                             : GetBuildIdFromElfFile(path, &build_id);
+      if (status == ElfStatus::NO_ERROR) {
         build_id_to_file_map_[build_id.ToString()] = path;
       }
     }
@@ -181,11 +470,20 @@ std::string DebugElfFileFinder::GetPathInSymFsDir(const std::string& path) {
 }  // namespace simpleperf_dso_imp
 
 static OneTimeFreeAllocator symbol_name_allocator;
+// Set in threads loading symbols in parallel, and moved to symbol_name_allocator after loading.
+static thread_local OneTimeFreeAllocator* thread_symbol_name_allocator = nullptr;
+
+static const char* AllocateSymbolName(std::string_view name) {
+  if (thread_symbol_name_allocator != nullptr) {
+    return thread_symbol_name_allocator->AllocateString(name);
+  }
+  return symbol_name_allocator.AllocateString(name);
+}
 
 Symbol::Symbol(std::string_view name, uint64_t addr, uint64_t len)
     : addr(addr),
       len(len),
-      name_(symbol_name_allocator.AllocateString(name)),
+      name_(AllocateSymbolName(name)),
       demangled_name_(nullptr),
       dump_id_(UINT_MAX) {
 }
@@ -196,7 +494,7 @@ const char* Symbol::DemangledName() const {
     if (s == name_) {
       demangled_name_ = name_;
     } else {
-      demangled_name_ = symbol_name_allocator.AllocateString(s);
+      demangled_name_ = AllocateSymbolName(s);
     }
   }
   return demangled_name_;
@@ -210,6 +508,7 @@ std::unordered_map<std::string, BuildId> Dso::build_id_map_;
 size_t Dso::dso_count_;
 uint32_t Dso::g_dump_id_;
 simpleperf_dso_impl::DebugElfFileFinder Dso::debug_elf_file_finder_;
+simpleperf_dso_impl::PersistentSymbolCache Dso::persistent_symbol_cache_;
 
 void Dso::SetDemangle(bool demangle) { demangle_ = demangle; }
 
@@ -241,6 +540,38 @@ std::string Dso::Demangle(const std::string& name) {
   return result;
 }
 
+void Dso::LoadSymbolsInParallel(const std::vector<Dso*>& dsos, size_t jobs) {
+  std::atomic<size_t> next_dso(0);
+  size_t thread_count = std::max<size_t>(1, std::min(jobs, dsos.size()));
+  std::vector<OneTimeFreeAllocator> allocators(thread_count);
+  auto load_symbols = [&](size_t thread_id) {
+    thread_symbol_name_allocator = &allocators[thread_id];
+    for (size_t i = next_dso++; i < dsos.size(); i = next_dso++) {
+      Dso* dso = dsos[i];
+      if (!dso->is_loaded_) {
+        dso->Load();
+      }
+      if (demangle_) {
+        for (const Symbol& symbol : dso->symbols_) {
+          symbol.DemangledName();
+        }
+      }
+    }
+    thread_symbol_name_allocator = nullptr;
+  };
+  std::vector<std::thread> threads;
+  for (size_t i = 1; i < thread_count; ++i) {
+    threads.emplace_back(load_symbols, i);
+  }
+  load_symbols(0);
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  for (auto& allocator : allocators) {
+    symbol_name_allocator.TakeMemoryFrom(allocator);
+  }
+}
+
 bool Dso::SetSymFsDir(const std::string& symfs_dir) {
   return debug_elf_file_finder_.SetSymFsDir(symfs_dir);
 }
@@ -249,6 +580,14 @@ bool Dso::AddSymbolDir(const std::string& symbol_dir) {
   return debug_elf_file_finder_.AddSymbolDir(symbol_dir);
 }
 
+bool Dso::SetSymbolCacheDir(const std::string& symbol_cache_dir) {
+  if (!persistent_symbol_cache_.SetDir(symbol_cache_dir)) {
+    return false;
+  }
+  debug_elf_file_finder_.SetSymbolCache(&persistent_symbol_cache_);
+  return true;
+}
+
 void Dso::SetVmlinux(const std::string& vmlinux) { vmlinux_ = vmlinux; }
 
 void Dso::SetBuildIds(
@@ -306,6 +645,7 @@ Dso::~Dso() {
     build_id_map_.clear();
     g_dump_id_ = 0;
     debug_elf_file_finder_.Reset();
+    persistent_symbol_cache_.Reset();
   }
 }
 
@@ -324,14 +664,17 @@ const Symbol* Dso::FindSymbol(uint64_t vaddr_in_dso) {
   if (!is_loaded_) {
     Load();
   }
-  auto it = std::upper_bound(symbols_.begin(), symbols_.end(),
-                             Symbol("", vaddr_in_dso, 0),
-                             Symbol::CompareValueByAddr);
-  if (it != symbols_.begin()) {
-    --it;
-    if (it->addr <= vaddr_in_dso && (it->addr + it->len > vaddr_in_dso)) {
-      return &*it;
-    }
+  if (symbol_cache_.empty()) {
+    symbol_cache_.resize(SYMBOL_CACHE_SIZE, SymbolCacheEntry{UINT64_MAX, nullptr});
+  }
+  SymbolCacheEntry& entry =
+      symbol_cache_[(vaddr_in_dso * 0x9e3779b97f4a7c15ULL) >> (64 - SYMBOL_CACHE_BITS)];
+  if (entry.vaddr_in_dso != vaddr_in_dso) {
+    entry.vaddr_in_dso = vaddr_in_dso;
+    entry.symbol = FindSymbolInIndex(vaddr_in_dso);
+  }
+  if (entry.symbol != nullptr) {
+    return entry.symbol;
   }
   if (!unknown_symbols_.empty()) {
     auto it = unknown_symbols_.find(vaddr_in_dso);
@@ -345,6 +688,7 @@ const Symbol* Dso::FindSymbol(uint64_t vaddr_in_dso) {
 void Dso::SetSymbols(std::vector<Symbol>* symbols) {
   symbols_ = std::move(*symbols);
   symbols->clear();
+  UpdateSymbolIndex();
 }
 
 void Dso::AddUnknownSymbol(uint64_t vaddr_in_dso, const std::string& name) {
@@ -376,6 +720,35 @@ void Dso::Load() {
                    std::back_inserter(merged_symbols), Symbol::CompareValueByAddr);
     symbols_ = std::move(merged_symbols);
   }
+  UpdateSymbolIndex();
+}
+
+void Dso::UpdateSymbolIndex() {
+  symbol_addrs_.resize(symbols_.size());
+  for (size_t i = 0; i < symbols_.size(); ++i) {
+    symbol_addrs_[i] = symbols_[i].addr;
+  }
+  symbol_cache_.clear();
+}
+
+// Find the last symbol starting at or before vaddr_in_dso, like std::upper_bound() on symbols_.
+// The search has no unpredictable branches, and only reads symbols_ for the result.
+const Symbol* Dso::FindSymbolInIndex(uint64_t vaddr_in_dso) const {
+  if (symbol_addrs_.empty() || symbol_addrs_[0] > vaddr_in_dso) {
+    return nullptr;
+  }
+  const uint64_t* base = symbol_addrs_.data();
+  size_t n = symbol_addrs_.size();
+  while (n > 1) {
+    size_t half = n / 2;
+    base = (base[half] <= vaddr_in_dso) ? base + half : base;
+    n -= half;
+  }
+  const Symbol* symbol = &symbols_[base - symbol_addrs_.data()];
+  if (symbol->addr + symbol->len > vaddr_in_dso) {
+    return symbol;
+  }
+  return nullptr;
 }
 
 static void ReportReadElfSymbolResult(ElfStatus result, const std::string& path,
@@ -555,6 +928,7 @@ class ElfDso : public Dso {
       }
     };
     ElfStatus status;
+    bool cacheable = false;
     std::tuple<bool, std::string, std::string> tuple = SplitUrlInApk(debug_file_path_);
     if (std::get<0>(tuple)) {
       EmbeddedElf* elf = ApkInspector::FindElfInApkByName(std::get<1>(tuple), std::get<2>(tuple));
@@ -565,11 +939,19 @@ class ElfDso : public Dso {
                                                  elf->entry_size(), build_id, symbol_callback);
       }
     } else {
+      if (persistent_symbol_cache_.ReadSymbols(build_id, debug_file_path_, demangle_, &symbols)) {
+        LOG(VERBOSE) << "Read symbols of " << debug_file_path_ << " from symbol cache";
+        return symbols;
+      }
       status = ParseSymbolsFromElfFile(debug_file_path_, build_id, symbol_callback);
+      cacheable = true;
     }
     ReportReadElfSymbolResult(status, path_, debug_file_path_,
                               symbols_.empty() ? android::base::WARNING : android::base::DEBUG);
     SortAndFixSymbols(symbols);
+    if (cacheable && status == ElfStatus::NO_ERROR) {
+      persistent_symbol_cache_.WriteSymbols(build_id, debug_file_path_, demangle_, symbols);
+    }
     return symbols;
   }
 
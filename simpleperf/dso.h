@@ -18,6 +18,7 @@
 #define SIMPLE_PERF_DSO_H_
 
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -29,12 +30,56 @@
 #include "read_elf.h"
 
 
+struct Symbol;
+
 namespace simpleperf_dso_impl {
 
+// Cache symbols and build ids read from elf files in a directory, so later runs can use them
+// without parsing elf files. Symbols of an elf file are stored in a file named by its build id,
+// which can be mapped in memory. Cached results are only used when the elf file has the same
+// path, size and modification time as when they were cached.
+class PersistentSymbolCache {
+ public:
+  void Reset();
+  bool SetDir(const std::string& dir);
+  bool Enabled() const { return !dir_.empty(); }
+  // Read symbols sorted by address. Return false if the symbols aren't cached or are out of date.
+  bool ReadSymbols(const BuildId& build_id, const std::string& elf_path, bool demangle,
+                   std::vector<Symbol>* symbols);
+  // Symbols should be sorted by address.
+  void WriteSymbols(const BuildId& build_id, const std::string& elf_path, bool demangle,
+                    const std::vector<Symbol>& symbols);
+  // Like GetBuildIdFromElfFile(), but use the build id cached for an unchanged file.
+  ElfStatus GetBuildIdFromElfFile(const std::string& path, BuildId* build_id);
+  // Write build ids read since the last flush to the cache.
+  void FlushBuildIds();
+
+ private:
+  struct CachedBuildId {
+    uint64_t file_size;
+    uint64_t file_mtime;
+    ElfStatus status;
+    BuildId build_id;
+  };
+
+  void LoadBuildIds();
+  void UnmapFiles();
+
+  std::string dir_;
+  bool build_ids_loaded_ = false;
+  bool build_ids_changed_ = false;
+  std::unordered_map<std::string, CachedBuildId> build_ids_;
+  // Mapped symbol files, kept until Reset(), as names of loaded symbols refer to them.
+  std::vector<std::pair<void*, size_t>> mapped_files_;
+  // Guard mapped_files_, as symbols of dsos can be loaded in parallel.
+  std::mutex mapped_files_mutex_;
+};
+
 // Find elf files with symbol table and debug information.
 class DebugElfFileFinder {
  public:
   void Reset();
+  void SetSymbolCache(PersistentSymbolCache* symbol_cache) { symbol_cache_ = symbol_cache; }
   bool SetSymFsDir(const std::string& symfs_dir);
   bool AddSymbolDir(const std::string& symbol_dir);
   void SetVdsoFile(const std::string& vdso_file, bool is_64bit);
@@ -50,6 +95,7 @@ class DebugElfFileFinder {
   std::string vdso_32bit_;
   std::string symfs_dir_;
   std::unordered_map<std::string, std::string> build_id_to_file_map_;
+  PersistentSymbolCache* symbol_cache_ = nullptr;
 };
 
 }  // namespace simpleperf_dso_impl
@@ -93,11 +139,16 @@ struct Symbol {
   }
 
  private:
+  // Used to create symbols with names in a symbol cache file.
+  Symbol(const char* name, const char* demangled_name, uint64_t addr, uint64_t len)
+      : addr(addr), len(len), name_(name), demangled_name_(demangled_name), dump_id_(UINT_MAX) {}
+
   const char* name_;
   mutable const char* demangled_name_;
   mutable uint32_t dump_id_;
 
   friend class Dso;
+  friend class simpleperf_dso_impl::PersistentSymbolCache;
 };
 
 enum DsoType {
@@ -115,6 +166,9 @@ class Dso {
  public:
   static void SetDemangle(bool demangle);
   static std::string Demangle(const std::string& name);
+  // Load symbols of dsos with multiple threads, instead of one by one when first looking up
+  // symbols in them. Symbol names are also demangled if demangling is enabled.
+  static void LoadSymbolsInParallel(const std::vector<Dso*>& dsos, size_t jobs);
   // SymFsDir is used to provide an alternative root directory looking for files with symbols.
   // For example, if we are searching symbols for /system/lib/libc.so and SymFsDir is /data/symbols,
   // then we will also search file /data/symbols/system/lib/libc.so.
@@ -122,6 +176,9 @@ class Dso {
   // SymbolDir is used to add a directory containing files with symbols. Each file under it will
   // be searched recursively to build a build_id_map.
   static bool AddSymbolDir(const std::string& symbol_dir);
+  // SymbolCacheDir is used to cache symbols and build ids read from elf files, so later runs
+  // don't need to parse the same elf files again. It should be set before adding symbol dirs.
+  static bool SetSymbolCacheDir(const std::string& symbol_cache_dir);
   static void SetVmlinux(const std::string& vmlinux);
   static void SetKallsyms(std::string kallsyms) {
     if (!kallsyms.empty()) {
@@ -194,12 +251,15 @@ class Dso {
   static size_t dso_count_;
   static uint32_t g_dump_id_;
   static simpleperf_dso_impl::DebugElfFileFinder debug_elf_file_finder_;
+  static simpleperf_dso_impl::PersistentSymbolCache persistent_symbol_cache_;
 
   Dso(DsoType type, const std::string& path, const std::string& debug_file_path);
   BuildId GetExpectedBuildId();
 
   void Load();
   virtual std::vector<Symbol> LoadSymbols() = 0;
+  void UpdateSymbolIndex();
+  const Symbol* FindSymbolInIndex(uint64_t vaddr_in_dso) const;
 
   DsoType type_;
   // path of the shared library used by the profiled program
@@ -210,6 +270,17 @@ class Dso {
   // File name of the shared library, got by removing directories in path_.
   std::string file_name_;
   std::vector<Symbol> symbols_;
+  // Addresses of symbols_, searched instead of symbols_ to touch fewer cache lines.
+  std::vector<uint64_t> symbol_addrs_;
+  // Results of searching symbol_addrs_ for recently looked up addresses, indexed by a hash of the
+  // address. Samples hit a small set of addresses again and again.
+  static constexpr size_t SYMBOL_CACHE_BITS = 8;
+  static constexpr size_t SYMBOL_CACHE_SIZE = 1 << SYMBOL_CACHE_BITS;
+  struct SymbolCacheEntry {
+    uint64_t vaddr_in_dso;
+    const Symbol* symbol;
+  };
+  std::vector<SymbolCacheEntry> symbol_cache_;
   // unknown symbols are like [libc.so+0x1234].
   std::unordered_map<uint64_t, Symbol> unknown_symbols_;
   bool is_loaded_;
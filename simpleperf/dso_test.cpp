@@ -133,6 +133,51 @@ TEST(DebugElfFileFinder, find_basename_in_symfs_dir) {
             symfs_dir + OS_PATH_SEPARATOR + "elf");
 }
 
+TEST(PersistentSymbolCache, cache_symbols_and_build_ids) {
+  TemporaryDir cache_dir;
+  TemporaryFile elf_file;
+  std::string data;
+  ASSERT_TRUE(android::base::ReadFileToString(GetTestData(ELF_FILE), &data));
+  ASSERT_TRUE(android::base::WriteStringToFile(data, elf_file.path));
+  BuildId expected_build_id;
+  ASSERT_EQ(GetBuildIdFromElfFile(elf_file.path, &expected_build_id), ElfStatus::NO_ERROR);
+  BuildId build_id;
+  PersistentSymbolCache cache;
+  ASSERT_TRUE(cache.SetDir(cache_dir.path));
+  ASSERT_EQ(cache.GetBuildIdFromElfFile(elf_file.path, &build_id), ElfStatus::NO_ERROR);
+  ASSERT_EQ(build_id, expected_build_id);
+
+  std::vector<Symbol> symbols;
+  symbols.emplace_back("_Z4funcv", 0x1000, 0x10);
+  symbols.emplace_back("main", 0x1010, 0x20);
+  std::vector<Symbol> cached_symbols;
+  ASSERT_FALSE(cache.ReadSymbols(build_id, elf_file.path, true, &cached_symbols));
+  cache.WriteSymbols(build_id, elf_file.path, true, symbols);
+  ASSERT_TRUE(cache.ReadSymbols(build_id, elf_file.path, true, &cached_symbols));
+  ASSERT_EQ(cached_symbols.size(), symbols.size());
+  for (size_t i = 0; i < symbols.size(); ++i) {
+    ASSERT_EQ(cached_symbols[i].addr, symbols[i].addr);
+    ASSERT_EQ(cached_symbols[i].len, symbols[i].len);
+    ASSERT_STREQ(cached_symbols[i].Name(), symbols[i].Name());
+    ASSERT_STREQ(cached_symbols[i].DemangledName(), symbols[i].DemangledName());
+  }
+  ASSERT_STREQ(cached_symbols[0].DemangledName(), "func()");
+  // Symbols aren't read for a different path.
+  ASSERT_FALSE(cache.ReadSymbols(build_id, GetTestData(ELF_FILE), true, &cached_symbols));
+
+  // Build ids are read from the cache by a new run.
+  cache.Reset();
+  ASSERT_TRUE(cache.SetDir(cache_dir.path));
+  ASSERT_EQ(cache.GetBuildIdFromElfFile(elf_file.path, &build_id), ElfStatus::NO_ERROR);
+  ASSERT_EQ(build_id, expected_build_id);
+
+  // Cached results aren't used after the elf file changes.
+  ASSERT_TRUE(android::base::WriteStringToFile("not an elf file", elf_file.path));
+  ASSERT_FALSE(cache.ReadSymbols(build_id, elf_file.path, true, &cached_symbols));
+  ASSERT_NE(cache.GetBuildIdFromElfFile(elf_file.path, &build_id), ElfStatus::NO_ERROR);
+  cache.Reset();
+}
+
 TEST(dso, dex_file_dso) {
 #if defined(__linux__)
   for (DsoType dso_type : {DSO_DEX_FILE, DSO_ELF_FILE}) {
@@ -190,6 +235,59 @@ TEST(dso, embedded_elf) {
   ASSERT_EQ(build_id, native_lib_build_id);
 }
 
+TEST(dso, FindSymbol) {
+  std::unique_ptr<Dso> dso = Dso::CreateDso(DSO_UNKNOWN_FILE, "unknown");
+  std::vector<Symbol> symbols;
+  for (uint64_t i = 0; i < 1000; ++i) {
+    symbols.emplace_back("func" + std::to_string(i), 0x1000 + i * 0x20, 0x10);
+  }
+  dso->SetSymbols(&symbols);
+  // Look up each address twice, to also get results from the cache.
+  for (int repeat = 0; repeat < 2; ++repeat) {
+    ASSERT_EQ(dso->FindSymbol(0xfff), nullptr);
+    for (uint64_t i = 0; i < 1000; ++i) {
+      uint64_t addr = 0x1000 + i * 0x20;
+      const Symbol* symbol = dso->FindSymbol(addr + 0xf);
+      ASSERT_NE(symbol, nullptr);
+      ASSERT_EQ(symbol->addr, addr);
+      ASSERT_EQ(dso->FindSymbol(addr + 0x10), nullptr);
+    }
+  }
+  // Results aren't cached across changing symbols.
+  symbols.emplace_back("func", 0x1010, 0x10);
+  dso->SetSymbols(&symbols);
+  ASSERT_EQ(dso->FindSymbol(0x1000), nullptr);
+  const Symbol* symbol = dso->FindSymbol(0x1010);
+  ASSERT_NE(symbol, nullptr);
+  ASSERT_STREQ(symbol->Name(), "func");
+}
+
+TEST(dso, LoadSymbolsInParallel) {
+  std::vector<std::string> paths = {GetTestData(ELF_FILE), GetTestData("libc.so"),
+                                    GetTestData(ELF_FILE), GetTestData("libc.so")};
+  std::vector<std::unique_ptr<Dso>> dsos;
+  std::vector<Dso*> dsos_to_load;
+  for (const std::string& path : paths) {
+    dsos.emplace_back(Dso::CreateDso(DSO_ELF_FILE, path));
+    dsos_to_load.push_back(dsos.back().get());
+  }
+  Dso::LoadSymbolsInParallel(dsos_to_load, 3);
+  for (size_t i = 0; i < paths.size(); ++i) {
+    std::unique_ptr<Dso> expected_dso = Dso::CreateDso(DSO_ELF_FILE, paths[i]);
+    // Load symbols lazily.
+    expected_dso->FindSymbol(0);
+    const std::vector<Symbol>& expected_symbols = expected_dso->GetSymbols();
+    const std::vector<Symbol>& symbols = dsos[i]->GetSymbols();
+    ASSERT_FALSE(symbols.empty());
+    ASSERT_EQ(symbols.size(), expected_symbols.size());
+    for (size_t j = 0; j < symbols.size(); ++j) {
+      ASSERT_EQ(symbols[j].addr, expected_symbols[j].addr);
+      ASSERT_EQ(symbols[j].len, expected_symbols[j].len);
+      ASSERT_STREQ(symbols[j].DemangledName(), expected_symbols[j].DemangledName());
+    }
+  }
+}
+
 TEST(dso, IpToVaddrInFile) {
   std::unique_ptr<Dso> dso = Dso::CreateDso(DSO_ELF_FILE, GetTestData("libc.so"));
   ASSERT_TRUE(dso);
@@ -630,11 +630,16 @@ bool EventSelectionSet::ReadCounters(std::vector<CountersInfo>* counters) {
 
 bool EventSelectionSet::MmapEventFiles(size_t min_mmap_pages, size_t max_mmap_pages,
                                        size_t aux_buffer_size, size_t record_buffer_size,
-                                       bool allow_cutting_samples, bool exclude_perf) {
+                                       bool allow_cutting_samples, bool exclude_perf,
+                                       size_t record_read_thread_count,
+                                       simpleperf::AdaptiveSampling* adaptive_sampling) {
   record_read_thread_.reset(
       new simpleperf::RecordReadThread(record_buffer_size, groups_[0][0].event_attr, min_mmap_pages,
                                        max_mmap_pages, aux_buffer_size, allow_cutting_samples,
-                                       exclude_perf));
+                                       exclude_perf, record_read_thread_count));
+  if (adaptive_sampling != nullptr) {
+    record_read_thread_->SetAdaptiveSampling(adaptive_sampling);
+  }
   return true;
 }
 
@@ -667,15 +672,15 @@ bool EventSelectionSet::ReadMmapEventData(bool with_time_limit) {
   if (with_time_limit) {
     start_time_in_ns = GetSystemClock();
   }
-  std::unique_ptr<Record> r;
-  while ((r = record_read_thread_->GetRecord()) != nullptr) {
-    if (!record_callback_(r.get())) {
+  size_t record_count;
+  do {
+    if (!record_read_thread_->ReadRecordBatch(record_callback_, &record_count)) {
       return false;
     }
     if (with_time_limit && (GetSystemClock() - start_time_in_ns) >= 1e8) {
       break;
     }
-  }
+  } while (record_count > 0);
   return true;
 }
 
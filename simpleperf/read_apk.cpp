@@ -34,8 +34,10 @@
 #include "utils.h"
 
 std::unordered_map<std::string, ApkInspector::ApkNode> ApkInspector::embedded_elf_cache_;
+std::mutex ApkInspector::embedded_elf_cache_mutex_;
 
 EmbeddedElf* ApkInspector::FindElfInApkByOffset(const std::string& apk_path, uint64_t file_offset) {
+  std::lock_guard<std::mutex> lock(embedded_elf_cache_mutex_);
   // Already in cache?
   ApkNode& node = embedded_elf_cache_[apk_path];
   auto it = node.offset_map.find(file_offset);
@@ -53,6 +55,7 @@ EmbeddedElf* ApkInspector::FindElfInApkByOffset(const std::string& apk_path, uin
 
 EmbeddedElf* ApkInspector::FindElfInApkByName(const std::string& apk_path,
                                               const std::string& entry_name) {
+  std::lock_guard<std::mutex> lock(embedded_elf_cache_mutex_);
   ApkNode& node = embedded_elf_cache_[apk_path];
   auto it = node.name_map.find(entry_name);
   if (it != node.name_map.end()) {
@@ -20,6 +20,7 @@
 #include <stdint.h>
 
 #include <memory>
+#include <mutex>
 #include <string>
 #include <tuple>
 #include <unordered_map>
@@ -85,6 +86,8 @@ class ApkInspector {
     std::unordered_map<std::string, EmbeddedElf*> name_map;
   };
   static std::unordered_map<std::string, ApkNode> embedded_elf_cache_;
+  // Symbols of elf files in apks can be loaded in parallel.
+  static std::mutex embedded_elf_cache_mutex_;
 };
 
 std::string GetUrlInApk(const std::string& apk_path, const std::string& elf_filename);
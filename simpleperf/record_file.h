@@ -46,8 +46,18 @@ class RecordFileWriter {
   ~RecordFileWriter();
 
   bool WriteAttrSection(const std::vector<EventAttrWithId>& attr_ids);
+  // Write records to shard_count temporary shard files, each written by a separate thread, instead
+  // of writing them to the record file. Sample records are assigned to shards by cpu. Shards are
+  // merged into the data section in the order records are written, before reading the data
+  // section, writing features or closing the file.
+  bool UseDataShards(size_t shard_count);
+  // Compress the data section in frames with zlib at [level] (1-9), in a separate thread. Should
+  // be called before writing records. The compression feature section describing the frames is
+  // written when finishing the feature section, or when closing the file.
+  bool SetCompressionLevel(int level);
   bool WriteRecord(const Record& record);
 
+  // Return the size of the data section before compression.
   uint64_t GetDataSectionSize() const { return data_section_size_; }
   bool ReadDataSection(const std::function<void(const Record*)>& callback);
 
@@ -59,18 +69,28 @@ class RecordFileWriter {
   bool WriteAuxTraceFeature(const std::vector<uint64_t>& auxtrace_offset);
   bool WriteFileFeatures(const std::vector<Dso*>& files);
   bool WriteMetaInfoFeature(const std::unordered_map<std::string, std::string>& info_map);
+  bool WriteAdaptiveSamplingFeature(
+      const std::vector<PerfFileFormat::AdaptiveSamplingDecision>& decisions);
   bool WriteFeature(int feature, const std::vector<char>& data);
   bool EndWriteFeatures();
 
   bool Close();
 
  private:
+  struct DataShard;
+  struct DataCompressor;
+
   RecordFileWriter(const std::string& filename, FILE* fp);
+  bool MergeDataShards();
+  bool FinishDataSection();
+  uint64_t GetDataSectionFileSize() const;
+  bool WriteCompressionFeature();
   void GetHitModulesInBuffer(const char* p, const char* end,
                              std::vector<std::string>* hit_kernel_modules,
                              std::vector<std::string>* hit_user_files);
   bool WriteFileHeader();
   bool WriteData(const void* buf, size_t len);
+  bool WriteToDataSection(const void* buf, size_t len);
   bool Write(const void* buf, size_t len);
   bool Read(void* buf, size_t len);
   bool GetFilePos(uint64_t* file_pos);
@@ -97,9 +117,47 @@ class RecordFileWriter {
   std::map<int, PerfFileFormat::SectionDesc> features_;
   size_t feature_count_;
 
+  std::vector<std::unique_ptr<DataShard>> data_shards_;
+  // The shard and the id of the record being written, set when using data shards.
+  DataShard* cur_data_shard_ = nullptr;
+  uint64_t cur_record_id_ = 0;
+
+  std::unique_ptr<DataCompressor> data_compressor_;
+
   DISALLOW_COPY_AND_ASSIGN(RecordFileWriter);
 };
 
+// CompressedDataReader reads the data section of a record file stored in compressed frames. It
+// keeps one decompressed frame, and decompresses another frame when reading out of it.
+class CompressedDataReader {
+ public:
+  CompressedDataReader(FILE* fp, const std::string& filename,
+                       const std::vector<PerfFileFormat::CompressedFrame>& frames);
+
+  const std::vector<PerfFileFormat::CompressedFrame>& Frames() const { return frames_; }
+
+  // Read from the current position, which is initially the start of the data section.
+  bool Read(void* buf, size_t len);
+  bool Skip(uint64_t len);
+  // Move the current position to [offset] in the uncompressed data section.
+  bool Seek(uint64_t offset);
+
+ private:
+  bool LoadFrameAtPos();
+
+  FILE* fp_;
+  const std::string filename_;
+  std::vector<PerfFileFormat::CompressedFrame> frames_;
+  uint64_t data_size_;
+  uint64_t pos_;
+  // The frame decompressed in frame_data_, or frames_.size() if none.
+  size_t frame_index_;
+  std::vector<char> frame_data_;
+  std::vector<char> compressed_buf_;
+
+  DISALLOW_COPY_AND_ASSIGN(CompressedDataReader);
+};
+
 // RecordFileReader read contents from a perf record file, like perf.data.
 class RecordFileReader {
  public:
@@ -140,12 +198,22 @@ class RecordFileReader {
   // Otherwise return false.
   bool ReadRecord(std::unique_ptr<Record>& record);
 
+  // Map the data section into memory. Then records are read in place instead of being copied
+  // to a new buffer each, and they can only be used while the reader is open. Should be called
+  // before reading records. Return false if the file can't be mapped, in which case records are
+  // still read from the file.
+  bool MapDataSection();
+
   size_t GetAttrIndexOfRecord(const Record* record);
 
   std::vector<std::string> ReadCmdlineFeature();
   std::vector<BuildIdRecord> ReadBuildIdFeature();
   std::string ReadFeatureString(int feature);
   std::vector<uint64_t> ReadAuxTraceFeature();
+  bool ReadCompressionFeature(uint32_t* compression_type, uint64_t* data_size,
+                              std::vector<PerfFileFormat::CompressedFrame>* frames);
+  bool ReadAdaptiveSamplingFeature(
+      std::vector<PerfFileFormat::AdaptiveSamplingDecision>* decisions);
 
   // File feature section contains many file information. This function reads
   // one file information located at [read_pos]. [read_pos] is 0 at the first
@@ -174,10 +242,15 @@ class RecordFileReader {
   bool ReadIdsForAttr(const PerfFileFormat::FileAttr& attr, std::vector<uint64_t>* ids);
   bool ReadFeatureSectionDescriptors();
   bool ReadMetaInfoFeature();
+  bool UseCompressedData();
   void UseRecordingEnvironment();
   std::unique_ptr<Record> ReadRecord();
+  bool ReadMappedRecord(char** data, std::unique_ptr<char[]>* owned);
   bool Read(void* buf, size_t len);
   bool ReadAtOffset(uint64_t offset, void* buf, size_t len);
+  bool ReadData(void* buf, size_t len);
+  bool SkipData(uint64_t len);
+  bool ReadDataAtOffset(uint64_t offset, void* buf, size_t len);
   void ProcessEventIdRecord(const EventIdRecord& r);
   bool BuildAuxDataLocation();
 
@@ -193,8 +266,20 @@ class RecordFileReader {
   size_t event_id_pos_in_sample_records_;
   size_t event_id_reverse_pos_in_non_sample_records_;
 
+  // Size of the data section before compression.
+  uint64_t data_size_;
   uint64_t read_record_size_;
 
+  // The mapping of the data section, set by MapDataSection().
+  void* data_map_addr_;
+  size_t data_map_size_;
+  char* mapped_data_;
+
+  // Set when the data section is compressed. compressed_data_ reads records in order, while
+  // random_access_data_ reads data at file offsets, like aux data.
+  std::unique_ptr<CompressedDataReader> compressed_data_;
+  std::unique_ptr<CompressedDataReader> random_access_data_;
+
   std::unordered_map<std::string, std::string> meta_info_;
   std::unique_ptr<ScopedCurrentArch> scoped_arch_;
   std::unique_ptr<ScopedEventTypes> scoped_event_types_;
@@ -65,6 +65,23 @@ meta_info feature section:
   keys in meta_info feature section include:
     simpleperf_version,
 
+compression feature section:
+  uint32_t compression_type;  // COMPRESSION_ZLIB
+  uint32_t frame_count;
+  uint64_t data_size;  // size of the uncompressed data section
+  CompressedFrame frames[frame_count];
+
+  When the compression feature section exists, the data section is split into frames, which are
+  compressed separately and stored one after another. The file section of the data section covers
+  the compressed frames. Offsets in the data section, like those in the auxtrace feature section
+  and aux data locations, are offsets as if the data section wasn't compressed.
+
+adaptive_sampling feature section:
+  uint32_t decision_count;
+  AdaptiveSamplingDecision decisions[decision_count];
+
+  Decisions made when recording with --adaptive-sampling, in the order they are made.
+
 */
 
 namespace PerfFileFormat {
@@ -95,6 +112,8 @@ enum {
   FEAT_SIMPLEPERF_START = 128,
   FEAT_FILE = FEAT_SIMPLEPERF_START,
   FEAT_META_INFO,
+  FEAT_COMPRESSION,
+  FEAT_ADAPTIVE_SAMPLING,
   FEAT_MAX_NUM = 256,
 };
 
@@ -123,6 +142,31 @@ struct FileAttr {
   SectionDesc ids;
 };
 
+enum CompressionType : uint32_t {
+  COMPRESSION_ZLIB = 1,
+};
+
+struct CompressedFrame {
+  uint64_t file_offset;      // offset of the compressed frame in the file
+  uint64_t data_offset;      // offset of the frame in the uncompressed data section
+  uint32_t compressed_size;  // size of the compressed frame
+  uint32_t data_size;        // size of the frame after decompression
+};
+
+enum AdaptiveSamplingDecisionType : uint32_t {
+  // Cut stack data in samples of thread id to value bytes.
+  DECISION_STACK_SIZE_LIMIT = 1,
+  // Drop value out of 1000 samples read by the read thread of cpus starting from cpu id.
+  DECISION_SAMPLE_DROP_RATE = 2,
+};
+
+struct AdaptiveSamplingDecision {
+  uint64_t time;  // in ns
+  uint32_t type;  // AdaptiveSamplingDecisionType
+  uint32_t id;
+  uint64_t value;
+};
+
 }  // namespace PerfFileFormat
 
 #endif  // SIMPLE_PERF_RECORD_FILE_FORMAT_H_
@@ -18,10 +18,18 @@
 
 #include <fcntl.h>
 #include <string.h>
+#if !defined(_WIN32)
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include <algorithm>
+#include <limits>
 #include <set>
 #include <vector>
 
 #include <android-base/logging.h>
+#include <zlib.h>
 
 #include "event_attr.h"
 #include "record.h"
@@ -52,6 +60,8 @@ static const std::map<int, std::string> feature_name_map = {
     {FEAT_AUXTRACE, "auxtrace"},
     {FEAT_FILE, "file"},
     {FEAT_META_INFO, "meta_info"},
+    {FEAT_COMPRESSION, "compression"},
+    {FEAT_ADAPTIVE_SAMPLING, "adaptive_sampling"},
 };
 
 std::string GetFeatureName(int feature_id) {
@@ -79,7 +89,8 @@ std::unique_ptr<RecordFileReader> RecordFileReader::CreateInstance(const std::st
   }
   auto reader = std::unique_ptr<RecordFileReader>(new RecordFileReader(filename, fp));
   if (!reader->ReadHeader() || !reader->ReadAttrSection() ||
-      !reader->ReadFeatureSectionDescriptors() || !reader->ReadMetaInfoFeature()) {
+      !reader->ReadFeatureSectionDescriptors() || !reader->ReadMetaInfoFeature() ||
+      !reader->UseCompressedData()) {
     return nullptr;
   }
   reader->UseRecordingEnvironment();
@@ -88,7 +99,8 @@ std::unique_ptr<RecordFileReader> RecordFileReader::CreateInstance(const std::st
 
 RecordFileReader::RecordFileReader(const std::string& filename, FILE* fp)
     : filename_(filename), record_fp_(fp), event_id_pos_in_sample_records_(0),
-      event_id_reverse_pos_in_non_sample_records_(0), read_record_size_(0) {
+      event_id_reverse_pos_in_non_sample_records_(0), data_size_(0), read_record_size_(0),
+      data_map_addr_(nullptr), data_map_size_(0), mapped_data_(nullptr) {
 }
 
 RecordFileReader::~RecordFileReader() {
@@ -99,6 +111,13 @@ RecordFileReader::~RecordFileReader() {
 
 bool RecordFileReader::Close() {
   bool result = true;
+#if !defined(_WIN32)
+  if (data_map_addr_ != nullptr) {
+    munmap(data_map_addr_, data_map_size_);
+    data_map_addr_ = nullptr;
+    mapped_data_ = nullptr;
+  }
+#endif
   if (fclose(record_fp_) != 0) {
     PLOG(ERROR) << "failed to close record file '" << filename_ << "'";
     result = false;
@@ -115,6 +134,7 @@ bool RecordFileReader::ReadHeader() {
     LOG(ERROR) << filename_ << " is not a valid profiling record file.";
     return false;
   }
+  data_size_ = header_.data.size;
   return true;
 }
 
@@ -232,15 +252,49 @@ bool RecordFileReader::ReadDataSection(
   return false;
 }
 
+bool RecordFileReader::MapDataSection() {
+#if defined(_WIN32)
+  return false;
+#else
+  if (mapped_data_ != nullptr) {
+    return true;
+  }
+  if (read_record_size_ != 0 || header_.data.size == 0 || compressed_data_ != nullptr ||
+      header_.data.size > std::numeric_limits<size_t>::max() / 2) {
+    return false;
+  }
+  // The mapping is private and writable, because some records, like SampleRecord, can be
+  // modified in place. Modifications are never written back to the file.
+  uint64_t page_size = sysconf(_SC_PAGE_SIZE);
+  uint64_t map_offset = header_.data.offset & ~(page_size - 1);
+  size_t map_size = header_.data.offset - map_offset + header_.data.size;
+  void* addr = mmap(nullptr, map_size, PROT_READ | PROT_WRITE, MAP_PRIVATE,
+                    fileno(record_fp_), map_offset);
+  if (addr == MAP_FAILED) {
+    PLOG(DEBUG) << "failed to map data section of " << filename_;
+    return false;
+  }
+  madvise(addr, map_size, MADV_SEQUENTIAL);
+  data_map_addr_ = addr;
+  data_map_size_ = map_size;
+  mapped_data_ = static_cast<char*>(addr) + (header_.data.offset - map_offset);
+  return true;
+#endif
+}
+
 bool RecordFileReader::ReadRecord(std::unique_ptr<Record>& record) {
-  if (read_record_size_ == 0) {
-    if (fseek(record_fp_, header_.data.offset, SEEK_SET) != 0) {
+  if (read_record_size_ == 0 && mapped_data_ == nullptr) {
+    if (compressed_data_ != nullptr) {
+      if (!compressed_data_->Seek(0)) {
+        return false;
+      }
+    } else if (fseek(record_fp_, header_.data.offset, SEEK_SET) != 0) {
       PLOG(ERROR) << "fseek() failed";
       return false;
     }
   }
   record = nullptr;
-  if (read_record_size_ < header_.data.size) {
+  if (read_record_size_ < data_size_) {
     record = ReadRecord();
     if (record == nullptr) {
       return false;
@@ -253,48 +307,57 @@ bool RecordFileReader::ReadRecord(std::unique_ptr<Record>& record) {
 }
 
 std::unique_ptr<Record> RecordFileReader::ReadRecord() {
-  char header_buf[Record::header_size()];
-  if (!Read(header_buf, Record::header_size())) {
-    return nullptr;
-  }
-  RecordHeader header(header_buf);
   std::unique_ptr<char[]> p;
-  if (header.type == SIMPLE_PERF_RECORD_SPLIT) {
-    // Read until meeting a RECORD_SPLIT_END record.
-    std::vector<char> buf;
-    size_t cur_size = 0;
-    char header_buf[Record::header_size()];
-    while (header.type == SIMPLE_PERF_RECORD_SPLIT) {
-      size_t bytes_to_read = header.size - Record::header_size();
-      buf.resize(cur_size + bytes_to_read);
-      if (!Read(&buf[cur_size], bytes_to_read)) {
-        return nullptr;
-      }
-      cur_size += bytes_to_read;
-      read_record_size_ += header.size;
-      if (!Read(header_buf, Record::header_size())) {
-        return nullptr;
-      }
-      header = RecordHeader(header_buf);
-    }
-    if (header.type != SIMPLE_PERF_RECORD_SPLIT_END) {
-      LOG(ERROR) << "SPLIT records are not followed by a SPLIT_END record.";
+  char* data;
+  if (mapped_data_ != nullptr) {
+    if (!ReadMappedRecord(&data, &p)) {
       return nullptr;
     }
-    read_record_size_ += header.size;
-    header = RecordHeader(buf.data());
-    p.reset(new char[header.size]);
-    memcpy(p.get(), buf.data(), buf.size());
   } else {
-    p.reset(new char[header.size]);
-    memcpy(p.get(), header_buf, Record::header_size());
-    if (header.size > Record::header_size()) {
-      if (!Read(p.get() + Record::header_size(), header.size - Record::header_size())) {
+    char header_buf[Record::header_size()];
+    if (!ReadData(header_buf, Record::header_size())) {
+      return nullptr;
+    }
+    RecordHeader header(header_buf);
+    if (header.type == SIMPLE_PERF_RECORD_SPLIT) {
+      // Read until meeting a RECORD_SPLIT_END record.
+      std::vector<char> buf;
+      size_t cur_size = 0;
+      char header_buf[Record::header_size()];
+      while (header.type == SIMPLE_PERF_RECORD_SPLIT) {
+        size_t bytes_to_read = header.size - Record::header_size();
+        buf.resize(cur_size + bytes_to_read);
+        if (!ReadData(&buf[cur_size], bytes_to_read)) {
+          return nullptr;
+        }
+        cur_size += bytes_to_read;
+        read_record_size_ += header.size;
+        if (!ReadData(header_buf, Record::header_size())) {
+          return nullptr;
+        }
+        header = RecordHeader(header_buf);
+      }
+      if (header.type != SIMPLE_PERF_RECORD_SPLIT_END) {
+        LOG(ERROR) << "SPLIT records are not followed by a SPLIT_END record.";
         return nullptr;
       }
+      read_record_size_ += header.size;
+      header = RecordHeader(buf.data());
+      p.reset(new char[header.size]);
+      memcpy(p.get(), buf.data(), buf.size());
+    } else {
+      p.reset(new char[header.size]);
+      memcpy(p.get(), header_buf, Record::header_size());
+      if (header.size > Record::header_size()) {
+        if (!ReadData(p.get() + Record::header_size(), header.size - Record::header_size())) {
+          return nullptr;
+        }
+      }
+      read_record_size_ += header.size;
     }
-    read_record_size_ += header.size;
+    data = p.get();
   }
+  RecordHeader header(data);
 
   const perf_event_attr* attr = &file_attrs_[0].attr;
   if (file_attrs_.size() > 1 && header.type < PERF_RECORD_USER_DEFINED_TYPE_START) {
@@ -303,12 +366,12 @@ std::unique_ptr<Record> RecordFileReader::ReadRecord() {
     if (header.type == PERF_RECORD_SAMPLE) {
       if (header.size > event_id_pos_in_sample_records_ + sizeof(uint64_t)) {
         has_event_id = true;
-        event_id = *reinterpret_cast<uint64_t*>(p.get() + event_id_pos_in_sample_records_);
+        event_id = *reinterpret_cast<uint64_t*>(data + event_id_pos_in_sample_records_);
       }
     } else {
       if (header.size > event_id_reverse_pos_in_non_sample_records_) {
         has_event_id = true;
-        event_id = *reinterpret_cast<uint64_t*>(p.get() + header.size - event_id_reverse_pos_in_non_sample_records_);
+        event_id = *reinterpret_cast<uint64_t*>(data + header.size - event_id_reverse_pos_in_non_sample_records_);
       }
     }
     if (has_event_id) {
@@ -318,19 +381,73 @@ std::unique_ptr<Record> RecordFileReader::ReadRecord() {
       }
     }
   }
-  auto r = ReadRecordFromOwnedBuffer(*attr, header.type, p.release());
+  std::unique_ptr<Record> r;
+  if (p) {
+    r = ReadRecordFromOwnedBuffer(*attr, header.type, p.release());
+  } else {
+    r = ReadRecordFromBuffer(*attr, header.type, data);
+  }
   if (r->type() == PERF_RECORD_AUXTRACE) {
     auto auxtrace = static_cast<AuxTraceRecord*>(r.get());
     auxtrace->location.file_offset = header_.data.offset + read_record_size_;
     read_record_size_ += auxtrace->data->aux_size;
-    if (fseek(record_fp_, auxtrace->data->aux_size, SEEK_CUR) != 0) {
-      PLOG(ERROR) << "fseek() failed";
+    if (mapped_data_ == nullptr && !SkipData(auxtrace->data->aux_size)) {
       return nullptr;
     }
   }
   return r;
 }
 
+// Set [data] to the next record in the mapped data section. SPLIT records are joined into a new
+// buffer, which is returned in [owned].
+bool RecordFileReader::ReadMappedRecord(char** data, std::unique_ptr<char[]>* owned) {
+  auto next_header = [&](RecordHeader* header) {
+    uint64_t left = header_.data.size - read_record_size_;
+    if (left < Record::header_size()) {
+      LOG(ERROR) << "failed to read record header in " << filename_;
+      return false;
+    }
+    *header = RecordHeader(mapped_data_ + read_record_size_);
+    if (header->size < Record::header_size() || header->size > left) {
+      LOG(ERROR) << "invalid record size " << header->size << " in " << filename_;
+      return false;
+    }
+    return true;
+  };
+  RecordHeader header;
+  if (!next_header(&header)) {
+    return false;
+  }
+  if (header.type == SIMPLE_PERF_RECORD_SPLIT) {
+    std::vector<char> buf;
+    while (header.type == SIMPLE_PERF_RECORD_SPLIT) {
+      char* p = mapped_data_ + read_record_size_;
+      buf.insert(buf.end(), p + Record::header_size(), p + header.size);
+      read_record_size_ += header.size;
+      if (!next_header(&header)) {
+        return false;
+      }
+    }
+    if (header.type != SIMPLE_PERF_RECORD_SPLIT_END) {
+      LOG(ERROR) << "SPLIT records are not followed by a SPLIT_END record.";
+      return false;
+    }
+    read_record_size_ += header.size;
+    if (buf.size() < Record::header_size()) {
+      LOG(ERROR) << "invalid SPLIT records in " << filename_;
+      return false;
+    }
+    header = RecordHeader(buf.data());
+    owned->reset(new char[std::max<size_t>(header.size, buf.size())]);
+    memcpy(owned->get(), buf.data(), buf.size());
+    *data = owned->get();
+    return true;
+  }
+  *data = mapped_data_ + read_record_size_;
+  read_record_size_ += header.size;
+  return true;
+}
+
 bool RecordFileReader::Read(void* buf, size_t len) {
   if (len != 0 && fread(buf, len, 1, record_fp_) != 1) {
     PLOG(FATAL) << "failed to read file " << filename_;
@@ -347,6 +464,42 @@ bool RecordFileReader::ReadAtOffset(uint64_t offset, void* buf, size_t len) {
   return Read(buf, len);
 }
 
+bool RecordFileReader::ReadData(void* buf, size_t len) {
+  if (compressed_data_ != nullptr) {
+    return compressed_data_->Read(buf, len);
+  }
+  return Read(buf, len);
+}
+
+bool RecordFileReader::SkipData(uint64_t len) {
+  if (compressed_data_ != nullptr) {
+    return compressed_data_->Skip(len);
+  }
+  if (fseek(record_fp_, len, SEEK_CUR) != 0) {
+    PLOG(ERROR) << "fseek() failed";
+    return false;
+  }
+  return true;
+}
+
+// Read data at [offset] of the file, which is in the data section. When the data section is
+// compressed, offsets are positions as if it wasn't compressed.
+bool RecordFileReader::ReadDataAtOffset(uint64_t offset, void* buf, size_t len) {
+  if (compressed_data_ == nullptr) {
+    return ReadAtOffset(offset, buf, len);
+  }
+  if (offset < header_.data.offset) {
+    LOG(ERROR) << "offset " << offset << " isn't in the data section of " << filename_;
+    return false;
+  }
+  if (!random_access_data_) {
+    random_access_data_.reset(
+        new CompressedDataReader(record_fp_, filename_, compressed_data_->Frames()));
+  }
+  return random_access_data_->Seek(offset - header_.data.offset) &&
+         random_access_data_->Read(buf, len);
+}
+
 void RecordFileReader::ProcessEventIdRecord(const EventIdRecord& r) {
   for (size_t i = 0; i < r.count; ++i) {
     event_ids_for_file_attrs_[r.data[i].attr_id].push_back(r.data[i].event_id);
@@ -455,6 +608,89 @@ std::vector<uint64_t> RecordFileReader::ReadAuxTraceFeature() {
   return auxtrace_offset;
 }
 
+bool RecordFileReader::ReadCompressionFeature(uint32_t* compression_type, uint64_t* data_size,
+                                              std::vector<CompressedFrame>* frames) {
+  std::vector<char> buf;
+  if (!ReadFeatureSection(FEAT_COMPRESSION, &buf)) {
+    return false;
+  }
+  const char* p = buf.data();
+  const char* end = buf.data() + buf.size();
+  uint32_t frame_count;
+  if (buf.size() < sizeof(uint32_t) * 2 + sizeof(uint64_t)) {
+    LOG(ERROR) << "invalid compression feature section in " << filename_;
+    return false;
+  }
+  MoveFromBinaryFormat(*compression_type, p);
+  MoveFromBinaryFormat(frame_count, p);
+  MoveFromBinaryFormat(*data_size, p);
+  if (static_cast<size_t>(end - p) != frame_count * sizeof(CompressedFrame)) {
+    LOG(ERROR) << "invalid compression feature section in " << filename_;
+    return false;
+  }
+  frames->resize(frame_count);
+  MoveFromBinaryFormat(frames->data(), frame_count, p);
+  return true;
+}
+
+bool RecordFileReader::ReadAdaptiveSamplingFeature(
+    std::vector<AdaptiveSamplingDecision>* decisions) {
+  std::vector<char> buf;
+  if (!ReadFeatureSection(FEAT_ADAPTIVE_SAMPLING, &buf)) {
+    return false;
+  }
+  const char* p = buf.data();
+  uint32_t decision_count;
+  if (buf.size() < sizeof(uint32_t)) {
+    LOG(ERROR) << "invalid adaptive_sampling feature section in " << filename_;
+    return false;
+  }
+  MoveFromBinaryFormat(decision_count, p);
+  if (buf.size() - sizeof(uint32_t) != decision_count * sizeof(AdaptiveSamplingDecision)) {
+    LOG(ERROR) << "invalid adaptive_sampling feature section in " << filename_;
+    return false;
+  }
+  decisions->resize(decision_count);
+  MoveFromBinaryFormat(decisions->data(), decision_count, p);
+  return true;
+}
+
+bool RecordFileReader::UseCompressedData() {
+  if (!HasFeature(FEAT_COMPRESSION)) {
+    return true;
+  }
+  uint32_t compression_type;
+  uint64_t data_size;
+  std::vector<CompressedFrame> frames;
+  if (!ReadCompressionFeature(&compression_type, &data_size, &frames)) {
+    return false;
+  }
+  if (compression_type != COMPRESSION_ZLIB) {
+    LOG(ERROR) << "unsupported compression type " << compression_type << " in " << filename_;
+    return false;
+  }
+  // Frames should cover the data section one after another, both in the file and after
+  // decompression.
+  uint64_t file_offset = header_.data.offset;
+  uint64_t data_offset = 0;
+  for (const auto& frame : frames) {
+    if (frame.file_offset != file_offset || frame.data_offset != data_offset ||
+        frame.data_size == 0) {
+      LOG(ERROR) << "invalid compressed frames in " << filename_;
+      return false;
+    }
+    file_offset += frame.compressed_size;
+    data_offset += frame.data_size;
+  }
+  if (file_offset != header_.data.offset + header_.data.size || data_offset != data_size) {
+    LOG(ERROR) << "compressed frames don't match the data section in " << filename_;
+    return false;
+  }
+  data_size_ = data_size;
+  compressed_data_.reset(new CompressedDataReader(record_fp_, filename_, frames));
+  return true;
+}
+
 bool RecordFileReader::ReadFileFeature(size_t& read_pos,
                                        std::string* file_path,
                                        uint32_t* file_type,
@@ -588,7 +824,7 @@ bool RecordFileReader::ReadAuxData(uint32_t cpu, uint64_t aux_offset, void* buf,
                << aux_offset << ", size " << size;
     return false;
   }
-  if (!ReadAtOffset(aux_offset - location->aux_offset + location->file_offset, buf, size)) {
+  if (!ReadDataAtOffset(aux_offset - location->aux_offset + location->file_offset, buf, size)) {
     return false;
   }
   if (fseek(record_fp_, saved_pos, SEEK_SET) != 0) {
@@ -606,7 +842,7 @@ bool RecordFileReader::BuildAuxDataLocation() {
   }
   std::unique_ptr<char[]> buf(new char[AuxTraceRecord::Size()]);
   for (auto offset : auxtrace_offset) {
-    if (!ReadAtOffset(offset, buf.get(), AuxTraceRecord::Size())) {
+    if (!ReadDataAtOffset(offset, buf.get(), AuxTraceRecord::Size())) {
       return false;
     }
     AuxTraceRecord auxtrace(buf.get());
@@ -624,3 +860,79 @@ std::vector<std::unique_ptr<Record>> RecordFileReader::DataSection() {
   });
   return records;
 }
+
+CompressedDataReader::CompressedDataReader(FILE* fp, const std::string& filename,
+                                           const std::vector<CompressedFrame>& frames)
+    : fp_(fp), filename_(filename), frames_(frames), data_size_(0), pos_(0),
+      frame_index_(frames.size()) {
+  if (!frames_.empty()) {
+    data_size_ = frames_.back().data_offset + frames_.back().data_size;
+  }
+}
+
+bool CompressedDataReader::Read(void* buf, size_t len) {
+  char* p = static_cast<char*>(buf);
+  while (len > 0) {
+    if (frame_index_ == frames_.size() || pos_ < frames_[frame_index_].data_offset ||
+        pos_ >= frames_[frame_index_].data_offset + frames_[frame_index_].data_size) {
+      if (!LoadFrameAtPos()) {
+        return false;
+      }
+    }
+    const CompressedFrame& frame = frames_[frame_index_];
+    size_t offset_in_frame = pos_ - frame.data_offset;
+    size_t n = std::min<uint64_t>(len, frame.data_size - offset_in_frame);
+    memcpy(p, frame_data_.data() + offset_in_frame, n);
+    p += n;
+    len -= n;
+    pos_ += n;
+  }
+  return true;
+}
+
+bool CompressedDataReader::Skip(uint64_t len) {
+  return Seek(pos_ + len);
+}
+
+bool CompressedDataReader::Seek(uint64_t offset) {
+  if (offset > data_size_) {
+    LOG(ERROR) << "failed to seek to " << offset << " in compressed data of " << filename_;
+    return false;
+  }
+  pos_ = offset;
+  return true;
+}
+
+bool CompressedDataReader::LoadFrameAtPos() {
+  if (pos_ >= data_size_) {
+    LOG(ERROR) << "failed to read compressed data of " << filename_ << " at " << pos_;
+    return false;
+  }
+  // Records are mostly read in order, so try the next frame first.
+  size_t index = frame_index_ + 1;
+  if (index >= frames_.size() || pos_ < frames_[index].data_offset ||
+      pos_ >= frames_[index].data_offset + frames_[index].data_size) {
+    auto comp = [](uint64_t pos, const CompressedFrame& frame) { return pos < frame.data_offset; };
+    index = std::upper_bound(frames_.begin(), frames_.end(), pos_, comp) - frames_.begin() - 1;
+  }
+  const CompressedFrame& frame = frames_[index];
+  frame_index_ = frames_.size();
+  compressed_buf_.resize(frame.compressed_size);
+  frame_data_.resize(frame.data_size);
+  if (fseek(fp_, frame.file_offset, SEEK_SET) != 0 ||
+      fread(compressed_buf_.data(), compressed_buf_.size(), 1, fp_) != 1) {
+    PLOG(ERROR) << "failed to read compressed data of " << filename_;
+    return false;
+  }
+  uLongf data_size = frame.data_size;
+  if (uncompress(reinterpret_cast<Bytef*>(frame_data_.data()), &data_size,
+                 reinterpret_cast<const Bytef*>(compressed_buf_.data()),
+                 compressed_buf_.size()) != Z_OK ||
+      data_size != frame.data_size) {
+    LOG(ERROR) << "failed to decompress data of " << filename_ << " at file offset "
+               << frame.file_offset;
+    return false;
+  }
+  frame_index_ = index;
+  return true;
+}
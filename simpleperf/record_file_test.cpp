@@ -27,6 +27,7 @@
 #include "event_type.h"
 #include "record.h"
 #include "record_file.h"
+#include "utils.h"
 
 #include "record_equal_test.h"
 
@@ -146,3 +147,153 @@ TEST_F(RecordFileTest, write_meta_info_feature_section) {
   ASSERT_TRUE(reader != nullptr);
   ASSERT_EQ(reader->GetMetaInfoFeature(), info_map);
 }
+
+TEST_F(RecordFileTest, write_adaptive_sampling_feature_section) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+
+  ASSERT_TRUE(writer->BeginWriteFeatures(1));
+  std::vector<AdaptiveSamplingDecision> decisions = {
+      {100, DECISION_STACK_SIZE_LIMIT, 2, 4096},
+      {200, DECISION_SAMPLE_DROP_RATE, 0, 100},
+  };
+  ASSERT_TRUE(writer->WriteAdaptiveSamplingFeature(decisions));
+  ASSERT_TRUE(writer->EndWriteFeatures());
+  ASSERT_TRUE(writer->Close());
+
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  std::vector<AdaptiveSamplingDecision> read_decisions;
+  ASSERT_TRUE(reader->ReadAdaptiveSamplingFeature(&read_decisions));
+  ASSERT_EQ(read_decisions.size(), decisions.size());
+  for (size_t i = 0; i < decisions.size(); ++i) {
+    ASSERT_EQ(read_decisions[i].time, decisions[i].time);
+    ASSERT_EQ(read_decisions[i].type, decisions[i].type);
+    ASSERT_EQ(read_decisions[i].id, decisions[i].id);
+    ASSERT_EQ(read_decisions[i].value, decisions[i].value);
+  }
+}
+
+TEST_F(RecordFileTest, read_records_from_mapped_data_section) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+
+  // The tracing data record is bigger than 64K, so it is written as SPLIT records.
+  std::vector<std::unique_ptr<Record>> records;
+  records.emplace_back(new MmapRecord(*(attr_ids_[0].attr), true, 1, 1, 0x1000, 0x2000, 0x3000,
+                                      "mmap_record_example", attr_ids_[0].ids[0]));
+  records.emplace_back(new TracingDataRecord(std::vector<char>(100000, 't')));
+  records.emplace_back(new CommRecord(*(attr_ids_[0].attr), 1, 2, "comm_record_example",
+                                      attr_ids_[0].ids[0], 0));
+  for (auto& record : records) {
+    ASSERT_TRUE(writer->WriteRecord(*record));
+  }
+  ASSERT_TRUE(writer->Close());
+
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  ASSERT_TRUE(reader->MapDataSection());
+  std::vector<std::unique_ptr<Record>> read_records = reader->DataSection();
+  ASSERT_EQ(records.size(), read_records.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    CheckRecordEqual(*records[i], *read_records[i]);
+    ASSERT_EQ(0, memcmp(records[i]->Binary(), read_records[i]->Binary(), records[i]->size()));
+  }
+}
+
+TEST_F(RecordFileTest, write_records_to_data_shards) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+  ASSERT_TRUE(writer->UseDataShards(3));
+
+  // Write enough samples to fill buffers of shards, and records split into SPLIT records.
+  const perf_event_attr& attr = *attr_ids_[0].attr;
+  std::vector<std::unique_ptr<Record>> records;
+  records.emplace_back(new TracingDataRecord(std::vector<char>(100000, 't')));
+  for (uint64_t i = 0; i < 50000; ++i) {
+    if (i % 1000 == 0) {
+      records.emplace_back(new MmapRecord(attr, false, 1, 1, 0x1000 * i, 0x1000, 0,
+                                          "mmap_record_example", attr_ids_[0].ids[0], i));
+    }
+    records.emplace_back(new SampleRecord(attr, attr_ids_[0].ids[0], 0x1000 * i, 1, 1, i,
+                                          i % 5, 1, {}, {}, 0));
+  }
+  for (auto& record : records) {
+    ASSERT_TRUE(writer->WriteRecord(*record));
+  }
+  ASSERT_TRUE(writer->Close());
+  for (size_t i = 0; i < 3; ++i) {
+    ASSERT_FALSE(IsRegularFile(tmpfile_.path + std::string(".shard") + std::to_string(i)));
+  }
+
+  // Records are in the order of writing them.
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  std::vector<std::unique_ptr<Record>> read_records = reader->DataSection();
+  ASSERT_EQ(records.size(), read_records.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    ASSERT_EQ(records[i]->size(), read_records[i]->size());
+    ASSERT_EQ(0, memcmp(records[i]->Binary(), read_records[i]->Binary(), records[i]->size()));
+  }
+}
+
+TEST_F(RecordFileTest, write_compressed_data_section) {
+  std::unique_ptr<RecordFileWriter> writer = RecordFileWriter::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(writer != nullptr);
+  AddEventType("cpu-cycles");
+  ASSERT_TRUE(writer->WriteAttrSection(attr_ids_));
+  ASSERT_TRUE(writer->SetCompressionLevel(1));
+
+  // Write enough records to need several frames, and records split into SPLIT records.
+  const perf_event_attr& attr = *attr_ids_[0].attr;
+  std::vector<std::unique_ptr<Record>> records;
+  records.emplace_back(new TracingDataRecord(std::vector<char>(100000, 't')));
+  for (uint64_t i = 0; i < 50000; ++i) {
+    if (i % 1000 == 0) {
+      records.emplace_back(new MmapRecord(attr, false, 1, 1, 0x1000 * i, 0x1000, 0,
+                                          "mmap_record_example", attr_ids_[0].ids[0], i));
+    }
+    records.emplace_back(new SampleRecord(attr, attr_ids_[0].ids[0], 0x1000 * i, 1, 1, i,
+                                          i % 5, 1, {}, {}, 0));
+  }
+  for (auto& record : records) {
+    ASSERT_TRUE(writer->WriteRecord(*record));
+  }
+  uint64_t data_size = writer->GetDataSectionSize();
+  size_t sample_count = 0;
+  ASSERT_TRUE(writer->ReadDataSection([&](const Record* r) {
+    if (r->type() == PERF_RECORD_SAMPLE) {
+      ASSERT_EQ(static_cast<const SampleRecord*>(r)->ip_data.ip, 0x1000 * sample_count);
+      sample_count++;
+    }
+  }));
+  ASSERT_EQ(sample_count, 50000u);
+  ASSERT_TRUE(writer->BeginWriteFeatures(1));
+  ASSERT_TRUE(writer->WriteCmdlineFeature({"simpleperf", "record", "-z", "1"}));
+  ASSERT_TRUE(writer->EndWriteFeatures());
+  ASSERT_TRUE(writer->Close());
+
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(tmpfile_.path);
+  ASSERT_TRUE(reader != nullptr);
+  ASSERT_LT(reader->FileHeader().data.size, data_size);
+  uint32_t compression_type;
+  uint64_t read_data_size;
+  std::vector<CompressedFrame> frames;
+  ASSERT_TRUE(reader->ReadCompressionFeature(&compression_type, &read_data_size, &frames));
+  ASSERT_EQ(compression_type, COMPRESSION_ZLIB);
+  ASSERT_EQ(read_data_size, data_size);
+  ASSERT_GT(frames.size(), 1u);
+  ASSERT_EQ(reader->ReadCmdlineFeature().size(), 4u);
+  std::vector<std::unique_ptr<Record>> read_records = reader->DataSection();
+  ASSERT_EQ(records.size(), read_records.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    ASSERT_EQ(records[i]->size(), read_records[i]->size());
+    ASSERT_EQ(0, memcmp(records[i]->Binary(), read_records[i]->Binary(), records[i]->size()));
+  }
+}
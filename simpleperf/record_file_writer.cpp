@@ -21,13 +21,18 @@
 #include <sys/mman.h>
 #include <unistd.h>
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
+#include <zlib.h>
 
 #include "dso.h"
 #include "event_attr.h"
@@ -53,6 +58,239 @@ std::unique_ptr<RecordFileWriter> RecordFileWriter::CreateInstance(const std::st
   return std::unique_ptr<RecordFileWriter>(new RecordFileWriter(filename, fp));
 }
 
+// Max buffers waiting for a write thread, before blocking the main thread.
+static constexpr size_t kMaxPendingBuffers = 8;
+
+// BufferWriteThread runs a thread to write buffers filled by the main thread, so the main thread
+// only waits for writing files when too many buffers are pending.
+class BufferWriteThread {
+ public:
+  explicit BufferWriteThread(std::function<bool(const std::vector<char>&)> write_function)
+      : write_function_(std::move(write_function)) {
+    thread_ = std::thread([this]() { Run(); });
+  }
+
+  ~BufferWriteThread() { Stop(); }
+
+  // Pass [buffer] to the write thread, and replace it with an empty buffer of the same capacity.
+  bool SubmitBuffer(std::vector<char>* buffer) {
+    size_t capacity = buffer->capacity();
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [&]() { return pending_buffers_.size() < kMaxPendingBuffers || failed_; });
+    if (failed_) {
+      return false;
+    }
+    pending_buffers_.push_back(std::move(*buffer));
+    if (!free_buffers_.empty()) {
+      *buffer = std::move(free_buffers_.back());
+      free_buffers_.pop_back();
+    } else {
+      *buffer = std::vector<char>();
+      buffer->reserve(capacity);
+    }
+    cond_.notify_all();
+    return true;
+  }
+
+  // Wait until all submitted buffers are written. Return false if failing to write any buffer.
+  bool Stop() {
+    if (thread_.joinable()) {
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        finished_ = true;
+      }
+      cond_.notify_all();
+      thread_.join();
+    }
+    return !failed_;
+  }
+
+ private:
+  void Run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      cond_.wait(lock, [&]() { return !pending_buffers_.empty() || finished_; });
+      if (pending_buffers_.empty()) {
+        break;
+      }
+      std::vector<char> data = std::move(pending_buffers_.front());
+      pending_buffers_.pop_front();
+      lock.unlock();
+      bool result = write_function_(data);
+      data.clear();
+      lock.lock();
+      if (!result) {
+        failed_ = true;
+        pending_buffers_.clear();
+        cond_.notify_all();
+        break;
+      }
+      free_buffers_.push_back(std::move(data));
+      cond_.notify_all();
+    }
+  }
+
+  std::function<bool(const std::vector<char>&)> write_function_;
+  std::thread thread_;
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  // Below are guarded by mutex_.
+  std::deque<std::vector<char>> pending_buffers_;
+  std::vector<std::vector<char>> free_buffers_;
+  bool finished_ = false;
+  bool failed_ = false;
+};
+
+// A data shard file has frames of record data written to it, each is a DataShardFrameHeader
+// followed by data. Frames of a record are consecutive in a shard.
+struct DataShardFrameHeader {
+  uint64_t record_id;
+  uint64_t size;
+};
+
+// Size of buffers passed to the write thread of a data shard.
+static constexpr size_t kDataShardBufferSize = 1024 * 1024;
+
+struct RecordFileWriter::DataShard {
+  std::string path;
+  FILE* fp = nullptr;
+  // Filled by the main thread.
+  std::vector<char> buffer;
+  std::unique_ptr<BufferWriteThread> write_thread;
+
+  ~DataShard() {
+    write_thread.reset();
+    if (fp != nullptr) {
+      fclose(fp);
+      unlink(path.c_str());
+    }
+  }
+
+  bool Open(const std::string& shard_path) {
+    path = shard_path;
+    fp = fopen(path.c_str(), "web+");
+    if (fp == nullptr) {
+      PLOG(ERROR) << "failed to open data shard '" << path << "'";
+      return false;
+    }
+    buffer.reserve(kDataShardBufferSize);
+    write_thread.reset(new BufferWriteThread([this](const std::vector<char>& data) {
+      if (fwrite(data.data(), data.size(), 1, fp) != 1) {
+        PLOG(ERROR) << "failed to write data shard '" << path << "'";
+        return false;
+      }
+      return true;
+    }));
+    return true;
+  }
+
+  bool Append(uint64_t record_id, const void* data, size_t size) {
+    DataShardFrameHeader header = {record_id, size};
+    const char* p = reinterpret_cast<const char*>(&header);
+    buffer.insert(buffer.end(), p, p + sizeof(header));
+    p = static_cast<const char*>(data);
+    buffer.insert(buffer.end(), p, p + size);
+    return buffer.size() < kDataShardBufferSize || write_thread->SubmitBuffer(&buffer);
+  }
+
+  // Write all data to the shard file, and prepare for reading it from the start.
+  bool FinishWriting() {
+    if (!buffer.empty() && !write_thread->SubmitBuffer(&buffer)) {
+      return false;
+    }
+    if (!write_thread->Stop()) {
+      return false;
+    }
+    if (fflush(fp) != 0 || fseek(fp, 0, SEEK_SET) != 0) {
+      PLOG(ERROR) << "failed to rewind data shard '" << path << "'";
+      return false;
+    }
+    return true;
+  }
+};
+
+// Size of data compressed in a frame, except the last frame of the data section.
+static constexpr size_t kCompressionFrameSize = 1024 * 1024;
+
+// DataCompressor compresses data appended to the data section in frames, and writes them to the
+// record file in a separate thread.
+struct RecordFileWriter::DataCompressor {
+  FILE* fp;
+  std::string filename;
+  int level;
+  // Filled by the main thread.
+  std::vector<char> buffer;
+  std::unique_ptr<BufferWriteThread> write_thread;
+  bool finished = false;
+  bool result = true;
+
+  // Below are used by the write thread until finished.
+  std::vector<CompressedFrame> frames;
+  uint64_t file_offset;
+  uint64_t data_offset = 0;
+  std::vector<char> compressed_buf;
+
+  DataCompressor(FILE* fp, const std::string& filename, int level, uint64_t file_offset)
+      : fp(fp), filename(filename), level(level), file_offset(file_offset) {
+    buffer.reserve(kCompressionFrameSize);
+    write_thread.reset(new BufferWriteThread(
+        [this](const std::vector<char>& data) { return CompressFrame(data); }));
+  }
+
+  bool CompressFrame(const std::vector<char>& data) {
+    uLongf compressed_size = compressBound(data.size());
+    compressed_buf.resize(compressed_size);
+    if (compress2(reinterpret_cast<Bytef*>(compressed_buf.data()), &compressed_size,
+                  reinterpret_cast<const Bytef*>(data.data()), data.size(), level) != Z_OK) {
+      LOG(ERROR) << "failed to compress data for record file '" << filename << "'";
+      return false;
+    }
+    if (fwrite(compressed_buf.data(), compressed_size, 1, fp) != 1) {
+      PLOG(ERROR) << "failed to write to record file '" << filename << "'";
+      return false;
+    }
+    CompressedFrame frame;
+    frame.file_offset = file_offset;
+    frame.data_offset = data_offset;
+    frame.compressed_size = compressed_size;
+    frame.data_size = data.size();
+    frames.push_back(frame);
+    file_offset += compressed_size;
+    data_offset += data.size();
+    return true;
+  }
+
+  bool Append(const void* data, size_t size) {
+    CHECK(!finished);
+    const char* p = static_cast<const char*>(data);
+    while (size > 0) {
+      size_t n = std::min(size, kCompressionFrameSize - buffer.size());
+      buffer.insert(buffer.end(), p, p + n);
+      p += n;
+      size -= n;
+      if (buffer.size() == kCompressionFrameSize && !write_thread->SubmitBuffer(&buffer)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Compress all data, and wait until all frames are written.
+  bool Finish() {
+    if (!finished) {
+      finished = true;
+      if (!buffer.empty() && !write_thread->SubmitBuffer(&buffer)) {
+        result = false;
+      }
+      if (!write_thread->Stop()) {
+        result = false;
+      }
+      buffer = std::vector<char>();
+    }
+    return result;
+  }
+};
+
 RecordFileWriter::RecordFileWriter(const std::string& filename, FILE* fp)
     : filename_(filename),
       record_fp_(fp),
@@ -65,6 +303,8 @@ RecordFileWriter::RecordFileWriter(const std::string& filename, FILE* fp)
 }
 
 RecordFileWriter::~RecordFileWriter() {
+  // Stop the compression thread before closing the file it writes to.
+  data_compressor_.reset();
   if (record_fp_ != nullptr) {
     fclose(record_fp_);
     unlink(filename_.c_str());
@@ -122,7 +362,120 @@ bool RecordFileWriter::WriteAttrSection(const std::vector<EventAttrWithId>& attr
   return true;
 }
 
+bool RecordFileWriter::UseDataShards(size_t shard_count) {
+  CHECK(data_shards_.empty());
+  for (size_t i = 0; i < shard_count; ++i) {
+    std::string path = filename_ + ".shard" + std::to_string(i);
+    std::string err;
+    if (!android::base::RemoveFileIfExists(path, &err)) {
+      LOG(ERROR) << "failed to remove file " << path << ": " << err;
+      return false;
+    }
+    data_shards_.emplace_back(new DataShard);
+    if (!data_shards_.back()->Open(path)) {
+      data_shards_.clear();
+      return false;
+    }
+  }
+  return true;
+}
+
+bool RecordFileWriter::SetCompressionLevel(int level) {
+  CHECK(data_compressor_ == nullptr);
+  CHECK_EQ(data_section_size_, 0u);
+  if (level < 1 || level > 9) {
+    LOG(ERROR) << "invalid compression level: " << level;
+    return false;
+  }
+  if (fseek(record_fp_, data_section_offset_, SEEK_SET) != 0) {
+    PLOG(ERROR) << "fseek() failed";
+    return false;
+  }
+  data_compressor_.reset(new DataCompressor(record_fp_, filename_, level, data_section_offset_));
+  return true;
+}
+
+// Write all records to the data section in the file. It is called before reading the data
+// section, writing features or closing the file.
+bool RecordFileWriter::FinishDataSection() {
+  if (!MergeDataShards()) {
+    return false;
+  }
+  return data_compressor_ == nullptr || data_compressor_->Finish();
+}
+
+uint64_t RecordFileWriter::GetDataSectionFileSize() const {
+  if (data_compressor_ != nullptr) {
+    return data_compressor_->file_offset - data_section_offset_;
+  }
+  return data_section_size_;
+}
+
+bool RecordFileWriter::MergeDataShards() {
+  if (data_shards_.empty()) {
+    return true;
+  }
+  std::vector<std::unique_ptr<DataShard>> shards = std::move(data_shards_);
+  data_shards_.clear();
+  cur_data_shard_ = nullptr;
+  for (auto& shard : shards) {
+    if (!shard->FinishWriting()) {
+      return false;
+    }
+  }
+  // Each shard has frames in increasing order of record ids. So repeatedly writing the frame with
+  // the smallest record id recovers the order of writing records.
+  std::vector<DataShardFrameHeader> headers(shards.size());
+  std::vector<bool> has_frame(shards.size());
+  auto read_frame_header = [&](size_t i) {
+    has_frame[i] = fread(&headers[i], sizeof(DataShardFrameHeader), 1, shards[i]->fp) == 1;
+    if (!has_frame[i] && ferror(shards[i]->fp)) {
+      PLOG(ERROR) << "failed to read data shard '" << shards[i]->path << "'";
+      return false;
+    }
+    return true;
+  };
+  for (size_t i = 0; i < shards.size(); ++i) {
+    if (!read_frame_header(i)) {
+      return false;
+    }
+  }
+  std::vector<char> data;
+  while (true) {
+    size_t min_i = shards.size();
+    for (size_t i = 0; i < shards.size(); ++i) {
+      if (has_frame[i] &&
+          (min_i == shards.size() || headers[i].record_id < headers[min_i].record_id)) {
+        min_i = i;
+      }
+    }
+    if (min_i == shards.size()) {
+      break;
+    }
+    data.resize(headers[min_i].size);
+    if (!data.empty() && fread(data.data(), data.size(), 1, shards[min_i]->fp) != 1) {
+      PLOG(ERROR) << "failed to read data shard '" << shards[min_i]->path << "'";
+      return false;
+    }
+    if (!WriteToDataSection(data.data(), data.size()) || !read_frame_header(min_i)) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool RecordFileWriter::WriteRecord(const Record& record) {
+  if (!data_shards_.empty()) {
+    size_t shard = 0;
+    if (record.type() == PERF_RECORD_SAMPLE) {
+      auto& r = static_cast<const SampleRecord&>(record);
+      if (r.sample_type & PERF_SAMPLE_CPU) {
+        shard = r.cpu_data.cpu % data_shards_.size();
+      }
+    }
+    cur_data_shard_ = data_shards_[shard].get();
+    cur_record_id_++;
+  }
   // linux-tools-perf only accepts records with size <= 65535 bytes. To make
   // perf.data generated by simpleperf be able to be parsed by linux-tools-perf,
   // Split simpleperf custom records which are > 65535 into a bunch of
@@ -165,13 +518,24 @@ bool RecordFileWriter::WriteRecord(const Record& record) {
 }
 
 bool RecordFileWriter::WriteData(const void* buf, size_t len) {
-  if (!Write(buf, len)) {
+  if (cur_data_shard_ != nullptr) {
+    if (!cur_data_shard_->Append(cur_record_id_, buf, len)) {
+      return false;
+    }
+  } else if (!WriteToDataSection(buf, len)) {
     return false;
   }
   data_section_size_ += len;
   return true;
 }
 
+bool RecordFileWriter::WriteToDataSection(const void* buf, size_t len) {
+  if (data_compressor_ != nullptr) {
+    return data_compressor_->Append(buf, len);
+  }
+  return Write(buf, len);
+}
+
 bool RecordFileWriter::Write(const void* buf, size_t len) {
   if (len != 0u && fwrite(buf, len, 1, record_fp_) != 1) {
     PLOG(ERROR) << "failed to write to record file '" << filename_ << "'";
@@ -189,21 +553,32 @@ bool RecordFileWriter::Read(void* buf, size_t len) {
 }
 
 bool RecordFileWriter::ReadDataSection(const std::function<void(const Record*)>& callback) {
-  if (fseek(record_fp_, data_section_offset_, SEEK_SET) == -1) {
+  if (!FinishDataSection()) {
+    return false;
+  }
+  std::unique_ptr<CompressedDataReader> compressed_data;
+  if (data_compressor_ != nullptr) {
+    compressed_data.reset(
+        new CompressedDataReader(record_fp_, filename_, data_compressor_->frames));
+  } else if (fseek(record_fp_, data_section_offset_, SEEK_SET) == -1) {
     PLOG(ERROR) << "fseek() failed";
     return false;
   }
+  auto read_data = [&](void* buf, size_t len) {
+    return compressed_data ? compressed_data->Read(buf, len) : Read(buf, len);
+  };
   std::vector<char> record_buf(512);
   uint64_t read_pos = 0;
   while (read_pos < data_section_size_) {
-    if (!Read(record_buf.data(), Record::header_size())) {
+    if (!read_data(record_buf.data(), Record::header_size())) {
       return false;
     }
     RecordHeader header(record_buf.data());
     if (record_buf.size() < header.size) {
       record_buf.resize(header.size);
     }
-    if (!Read(record_buf.data() + Record::header_size(), header.size - Record::header_size())) {
+    if (!read_data(record_buf.data() + Record::header_size(),
+                   header.size - Record::header_size())) {
       return false;
     }
     read_pos += header.size;
@@ -211,7 +586,11 @@ bool RecordFileWriter::ReadDataSection(const std::function<void(const Record*)>&
     if (r->type() == PERF_RECORD_AUXTRACE) {
       auto auxtrace = static_cast<AuxTraceRecord*>(r.get());
       auxtrace->location.file_offset = data_section_offset_ + read_pos;
-      if (fseek(record_fp_, auxtrace->data->aux_size, SEEK_CUR) != 0) {
+      if (compressed_data) {
+        if (!compressed_data->Skip(auxtrace->data->aux_size)) {
+          return false;
+        }
+      } else if (fseek(record_fp_, auxtrace->data->aux_size, SEEK_CUR) != 0) {
         PLOG(ERROR) << "fseek() failed";
         return false;
       }
@@ -233,9 +612,13 @@ bool RecordFileWriter::GetFilePos(uint64_t* file_pos) {
 }
 
 bool RecordFileWriter::BeginWriteFeatures(size_t feature_count) {
-  feature_section_offset_ = data_section_offset_ + data_section_size_;
-  feature_count_ = feature_count;
-  uint64_t feature_header_size = feature_count * sizeof(SectionDesc);
+  if (!FinishDataSection()) {
+    return false;
+  }
+  feature_section_offset_ = data_section_offset_ + GetDataSectionFileSize();
+  // Reserve a feature for the compression feature section.
+  feature_count_ = feature_count + (data_compressor_ != nullptr ? 1 : 0);
+  uint64_t feature_header_size = feature_count_ * sizeof(SectionDesc);
 
   // Reserve enough space in the record file for the feature header.
   std::vector<unsigned char> zero_data(feature_header_size);
@@ -441,7 +824,37 @@ bool RecordFileWriter::WriteFeatureEnd(int feature) {
   return true;
 }
 
+bool RecordFileWriter::WriteAdaptiveSamplingFeature(
+    const std::vector<AdaptiveSamplingDecision>& decisions) {
+  std::vector<char> buf(sizeof(uint32_t) + decisions.size() * sizeof(AdaptiveSamplingDecision));
+  char* p = buf.data();
+  uint32_t decision_count = decisions.size();
+  MoveToBinaryFormat(decision_count, p);
+  MoveToBinaryFormat(decisions.data(), decisions.size(), p);
+  return WriteFeature(FEAT_ADAPTIVE_SAMPLING, buf);
+}
+
+bool RecordFileWriter::WriteCompressionFeature() {
+  const std::vector<CompressedFrame>& frames = data_compressor_->frames;
+  std::vector<char> buf(sizeof(uint32_t) * 2 + sizeof(uint64_t) +
+                        frames.size() * sizeof(CompressedFrame));
+  char* p = buf.data();
+  uint32_t compression_type = COMPRESSION_ZLIB;
+  MoveToBinaryFormat(compression_type, p);
+  uint32_t frame_count = frames.size();
+  MoveToBinaryFormat(frame_count, p);
+  MoveToBinaryFormat(data_section_size_, p);
+  MoveToBinaryFormat(frames.data(), frames.size(), p);
+  CHECK_EQ(buf.size(), static_cast<size_t>(p - buf.data()));
+  return WriteFeature(FEAT_COMPRESSION, buf);
+}
+
 bool RecordFileWriter::EndWriteFeatures() {
+  // Records can't be read without the compression feature section.
+  if (data_compressor_ != nullptr && features_.count(FEAT_COMPRESSION) == 0 &&
+      !WriteCompressionFeature()) {
+    return false;
+  }
   // Used features (features_.size()) should be <= allocated feature space.
   CHECK_LE(features_.size(), feature_count_);
   if (fseek(record_fp_, feature_section_offset_, SEEK_SET) == -1) {
@@ -465,7 +878,7 @@ bool RecordFileWriter::WriteFileHeader() {
   header.attrs.offset = attr_section_offset_;
   header.attrs.size = attr_section_size_;
   header.data.offset = data_section_offset_;
-  header.data.size = data_section_size_;
+  header.data.size = GetDataSectionFileSize();
   for (const auto& pair : features_) {
     int i = pair.first / 8;
     int j = pair.first % 8;
@@ -483,7 +896,12 @@ bool RecordFileWriter::WriteFileHeader() {
 
 bool RecordFileWriter::Close() {
   CHECK(record_fp_ != nullptr);
-  bool result = true;
+  bool result = FinishDataSection();
+  // A compressed data section needs the compression feature section, even if no other feature is
+  // written.
+  if (result && data_compressor_ != nullptr && feature_count_ == 0) {
+    result = BeginWriteFeatures(0) && EndWriteFeatures();
+  }
 
   // Write file header. We gather enough information to write file header only after
   // writing data section and feature section.
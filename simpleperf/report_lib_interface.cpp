@@ -104,6 +104,7 @@ void DestroyReportLib(ReportLib* report_lib) EXPORT;
 // verbose, debug, info, warning, error, fatal.
 bool SetLogSeverity(ReportLib* report_lib, const char* log_level) EXPORT;
 bool SetSymfs(ReportLib* report_lib, const char* symfs_dir) EXPORT;
+bool SetSymbolCache(ReportLib* report_lib, const char* symbol_cache_dir) EXPORT;
 bool SetRecordFile(ReportLib* report_lib, const char* record_file) EXPORT;
 bool SetKallsymsFile(ReportLib* report_lib, const char* kallsyms_file) EXPORT;
 void ShowIpForUnknownSymbol(ReportLib* report_lib) EXPORT;
@@ -145,6 +146,9 @@ class ReportLib {
   bool SetLogSeverity(const char* log_level);
 
   bool SetSymfs(const char* symfs_dir) { return Dso::SetSymFsDir(symfs_dir); }
+  bool SetSymbolCache(const char* symbol_cache_dir) {
+    return Dso::SetSymbolCacheDir(symbol_cache_dir);
+  }
 
   bool SetRecordFile(const char* record_file) {
     record_filename_ = record_file;
@@ -227,6 +231,7 @@ bool ReportLib::OpenRecordFileIfNecessary() {
     if (record_file_reader_ == nullptr) {
       return false;
     }
+    record_file_reader_->MapDataSection();
     record_file_reader_->LoadBuildIdAndFileFeatures(thread_tree_);
     auto& meta_info = record_file_reader_->GetMetaInfoFeature();
     if (auto it = meta_info.find("trace_offcpu"); it != meta_info.end()) {
@@ -479,6 +484,10 @@ bool SetSymfs(ReportLib* report_lib, const char* symfs_dir) {
   return report_lib->SetSymfs(symfs_dir);
 }
 
+bool SetSymbolCache(ReportLib* report_lib, const char* symbol_cache_dir) {
+  return report_lib->SetSymbolCache(symbol_cache_dir);
+}
+
 bool SetRecordFile(ReportLib* report_lib, const char* record_file) {
   return report_lib->SetRecordFile(record_file);
 }
@@ -17,7 +17,9 @@
 #ifndef SIMPLE_PERF_SAMPLE_TREE_H_
 #define SIMPLE_PERF_SAMPLE_TREE_H_
 
+#include <set>
 #include <unordered_map>
+#include <vector>
 
 #include "callchain.h"
 #include "OfflineUnwinder.h"
@@ -52,6 +54,98 @@ using namespace simpleperf;
 // 3. At last, the sorted SampleTree is passed to SampleTreeDisplayer, which
 //    displays each sample in the SampleTree.
 
+// SampleSet is a set of samples, in which samples compared the same by the
+// comparator are the same sample. If the comparator has key functions, samples
+// are looked up in a hash table by their keys. Otherwise they are looked up in
+// a std::set ordered by the comparator.
+template <typename EntryT>
+class SampleSet {
+ public:
+  explicit SampleSet(const SampleComparator<EntryT>& comparator)
+      : comparator_(comparator), ordered_set_(comparator) {}
+
+  EntryT* Find(const EntryT* sample) const {
+    if (!comparator_.HasKeys()) {
+      auto it = ordered_set_.find(const_cast<EntryT*>(sample));
+      return it == ordered_set_.end() ? nullptr : *it;
+    }
+    if (slots_.empty()) {
+      return nullptr;
+    }
+    uint64_t hash = comparator_.HashSample(sample);
+    size_t mask = slots_.size() - 1;
+    for (size_t i = hash & mask; slots_[i].sample != nullptr; i = (i + 1) & mask) {
+      if (slots_[i].hash == hash && comparator_.IsSameSample(slots_[i].sample, sample)) {
+        return slots_[i].sample;
+      }
+    }
+    return nullptr;
+  }
+
+  // The sample shouldn't be in the set.
+  void Insert(EntryT* sample) {
+    if (!comparator_.HasKeys()) {
+      ordered_set_.insert(sample);
+      return;
+    }
+    // Keep the load factor under 1/2, so probe sequences are short.
+    if ((sample_count_ + 1) * 2 > slots_.size()) {
+      Rehash(std::max<size_t>(slots_.size() * 2, 16));
+    }
+    InsertSlot(comparator_.HashSample(sample), sample);
+    sample_count_++;
+  }
+
+  // Returns samples in the comparator's order if the comparator has no key
+  // functions, otherwise in no particular order.
+  std::vector<EntryT*> GetSamples() const {
+    std::vector<EntryT*> result;
+    if (!comparator_.HasKeys()) {
+      result.assign(ordered_set_.begin(), ordered_set_.end());
+      return result;
+    }
+    result.reserve(sample_count_);
+    for (const auto& slot : slots_) {
+      if (slot.sample != nullptr) {
+        result.push_back(slot.sample);
+      }
+    }
+    return result;
+  }
+
+ private:
+  struct Slot {
+    uint64_t hash;
+    EntryT* sample;
+  };
+
+  void InsertSlot(uint64_t hash, EntryT* sample) {
+    size_t mask = slots_.size() - 1;
+    size_t i = hash & mask;
+    while (slots_[i].sample != nullptr) {
+      i = (i + 1) & mask;
+    }
+    slots_[i] = Slot{hash, sample};
+  }
+
+  void Rehash(size_t size) {
+    std::vector<Slot> old_slots(size, Slot{0, nullptr});
+    old_slots.swap(slots_);
+    for (const auto& slot : old_slots) {
+      if (slot.sample != nullptr) {
+        InsertSlot(slot.hash, slot.sample);
+      }
+    }
+  }
+
+  const SampleComparator<EntryT> comparator_;
+  // Used when the comparator has key functions. The size is a power of two.
+  std::vector<Slot> slots_;
+  size_t sample_count_ = 0;
+  // Used when the comparator doesn't have key functions.
+  std::set<EntryT*, SampleComparator<EntryT>> ordered_set_;
+};
+
 template <typename EntryT, typename AccumulateInfoT>
 class SampleTreeBuilder {
  public:
@@ -175,14 +269,65 @@ class SampleTreeBuilder {
     }
   }
 
-  std::vector<EntryT*> GetSamples() const {
-    std::vector<EntryT*> result;
-    for (auto& entry : sample_set_) {
-      result.push_back(entry);
+  // Moves samples from another builder using the same options, which processed the records
+  // following the ones processed by this builder. The result is the same as processing all of the
+  // records in this builder.
+  void Merge(SampleTreeBuilder& other) {
+    // Map each sample of the other builder to the sample of this builder it is merged into.
+    std::unordered_map<EntryT*, EntryT*> merged;
+    for (EntryT* sample : other.sample_set_.GetSamples()) {
+      EntryT* found = sample_set_.Find(sample);
+      if (found == nullptr) {
+        sample_set_.Insert(sample);
+        merged[sample] = sample;
+      } else {
+        MergeSample(found, sample);
+        merged[sample] = found;
+      }
+    }
+    for (EntryT* sample : other.callchain_sample_set_.GetSamples()) {
+      EntryT* found = callchain_sample_set_.Find(sample);
+      if (found == nullptr) {
+        callchain_sample_set_.Insert(sample);
+        merged[sample] = sample;
+      } else {
+        merged[sample] = found;
+      }
+    }
+    auto get_entry = [&](EntryT* sample) { return merged.find(sample)->second; };
+    for (auto& sample : other.sample_storage_) {
+      if (get_entry(sample.get()) == sample.get()) {
+        sample_storage_.push_back(std::move(sample));
+      }
+    }
+
+    auto is_same_sample = [&](const EntryT* s1, const EntryT* s2) {
+      return sample_comparator_.IsSameSample(s1, s2);
+    };
+    for (auto& pair : merged) {
+      if (pair.first->callchain.children.empty()) {
+        continue;
+      }
+      // A moved sample still refers to samples of the other builder in its callchains.
+      CallChainRoot<EntryT> callchain = std::move(pair.first->callchain);
+      pair.first->callchain = CallChainRoot<EntryT>();
+      pair.second->callchain.Merge(callchain, get_entry, is_same_sample);
+    }
+
+    for (auto& pair : other.callchain_parent_map_) {
+      EntryT* sample = get_entry(pair.first);
+      EntryT* parent = get_entry(pair.second.parent);
+      auto it = callchain_parent_map_.find(sample);
+      if (it == callchain_parent_map_.end()) {
+        callchain_parent_map_[sample] = CallChainParentInfo{parent, pair.second.has_multiple_parents};
+      } else if (it->second.parent != parent || pair.second.has_multiple_parents) {
+        it->second.has_multiple_parents = true;
+      }
     }
-    return result;
   }
 
+  std::vector<EntryT*> GetSamples() const { return sample_set_.GetSamples(); }
+
  protected:
   virtual EntryT* CreateSample(const SampleRecord& r, bool in_kernel,
                                AccumulateInfoT* acc_info) = 0;
@@ -205,15 +350,13 @@ class SampleTreeBuilder {
       return nullptr;
     }
     UpdateSummary(sample.get());
-    EntryT* result;
-    auto it = sample_set_.find(sample.get());
-    if (it == sample_set_.end()) {
+    EntryT* result = sample_set_.Find(sample.get());
+    if (result == nullptr) {
       result = sample.get();
-      sample_set_.insert(sample.get());
+      sample_set_.Insert(sample.get());
       sample_storage_.push_back(std::move(sample));
     } else {
-      result = *it;
-      MergeSample(*it, sample.get());
+      MergeSample(result, sample.get());
     }
     return result;
   }
@@ -225,23 +368,22 @@ class SampleTreeBuilder {
     }
     if (!FilterSample(sample.get())) {
       // Store in callchain_sample_set_ for use in other EntryT's callchain.
-      auto it = callchain_sample_set_.find(sample.get());
-      if (it != callchain_sample_set_.end()) {
-        return *it;
+      EntryT* found = callchain_sample_set_.Find(sample.get());
+      if (found != nullptr) {
+        return found;
       }
       EntryT* result = sample.get();
-      callchain_sample_set_.insert(sample.get());
+      callchain_sample_set_.Insert(sample.get());
       sample_storage_.push_back(std::move(sample));
       return result;
     }
 
-    auto it = sample_set_.find(sample.get());
-    if (it != sample_set_.end()) {
-      EntryT* sample = *it;
+    EntryT* found = sample_set_.Find(sample.get());
+    if (found != nullptr) {
       // Process only once for recursive function call.
-      if (std::find(callchain.begin(), callchain.end(), sample) !=
+      if (std::find(callchain.begin(), callchain.end(), found) !=
           callchain.end()) {
-        return sample;
+        return found;
       }
     }
     return InsertSample(std::move(sample));
@@ -259,7 +401,7 @@ class SampleTreeBuilder {
 
   void AddCallChainDuplicateInfo() {
     if (build_callchain_) {
-      for (EntryT* sample : sample_set_) {
+      for (EntryT* sample : sample_set_.GetSamples()) {
         auto it = callchain_parent_map_.find(sample);
         if (it != callchain_parent_map_.end() && !it->second.has_multiple_parents) {
           sample->callchain.duplicated = true;
@@ -268,7 +410,7 @@ class SampleTreeBuilder {
     }
   }
 
-  std::set<EntryT*, SampleComparator<EntryT>> sample_set_;
+  SampleSet<EntryT> sample_set_;
   bool accumulate_callchain_;
 
  private:
@@ -290,7 +432,7 @@ class SampleTreeBuilder {
   const SampleComparator<EntryT> sample_comparator_;
   // If a CallChainSample is filtered out, it is stored in callchain_sample_set_
   // and only used in other EntryT's callchain.
-  std::set<EntryT*, SampleComparator<EntryT>> callchain_sample_set_;
+  SampleSet<EntryT> callchain_sample_set_;
   std::vector<std::unique_ptr<EntryT>> sample_storage_;
 
   struct CallChainParentInfo {
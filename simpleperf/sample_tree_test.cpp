@@ -44,6 +44,9 @@ BUILD_COMPARE_VALUE_FUNCTION(TestComparePid, pid);
 BUILD_COMPARE_VALUE_FUNCTION(TestCompareTid, tid);
 BUILD_COMPARE_STRING_FUNCTION(TestCompareDsoName, dso_name.c_str());
 BUILD_COMPARE_VALUE_FUNCTION(TestCompareMapStartAddr, map_start_addr);
+BUILD_KEY_FUNCTION(TestPidKey, pid);
+BUILD_KEY_FUNCTION(TestTidKey, tid);
+BUILD_KEY_FUNCTION(TestMapStartAddrKey, map_start_addr);
 
 class TestSampleComparator : public SampleComparator<SampleEntry> {
  public:
@@ -232,6 +235,28 @@ TEST(sample_tree, overlapped_map) {
   CheckSamples(sample_tree_builder.GetSamples(), expected_samples);
 }
 
+TEST(sample_tree, sample_set_with_keys) {
+  SampleComparator<SampleEntry> comparator;
+  comparator.AddCompareFunction(TestComparePid, TestPidKey);
+  comparator.AddCompareFunction(TestCompareTid, TestTidKey);
+  comparator.AddCompareFunction(TestCompareMapStartAddr, TestMapStartAddrKey);
+  ASSERT_TRUE(comparator.HasKeys());
+  SampleSet<SampleEntry> sample_set(comparator);
+  std::vector<std::unique_ptr<SampleEntry>> samples;
+  for (int i = 0; i < 100; ++i) {
+    samples.emplace_back(new SampleEntry(1, i % 10, "thread", "map", i / 10));
+    ASSERT_EQ(sample_set.Find(samples.back().get()), nullptr);
+    sample_set.Insert(samples.back().get());
+  }
+  ASSERT_EQ(sample_set.GetSamples().size(), 100u);
+  for (auto& sample : samples) {
+    SampleEntry same_sample(sample->pid, sample->tid, "thread", "map", sample->map_start_addr);
+    ASSERT_EQ(sample_set.Find(&same_sample), sample.get());
+  }
+  SampleEntry new_sample(2, 0, "thread", "map", 0);
+  ASSERT_EQ(sample_set.Find(&new_sample), nullptr);
+}
+
 TEST(thread_tree, symbol_ULLONG_MAX) {
   ThreadTree thread_tree;
   thread_tree.ShowIpForUnknownSymbol();
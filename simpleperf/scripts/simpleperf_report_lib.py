@@ -283,6 +283,14 @@ class ReportLib(object):
         cond = self._SetSymfsFunc(self.getInstance(), _char_pt(symfs_dir))
         _check(cond, 'Failed to set symbols directory')
 
+    def SetSymbolCache(self, symbol_cache_dir):
+        """ Set directory used to cache symbols read from elf files across runs."""
+        # Prebuilt libraries older than the script may not export SetSymbolCache.
+        _check(hasattr(self._lib, 'SetSymbolCache'),
+               'SetSymbolCache is not supported by %s' % self._lib._name)
+        cond = self._lib.SetSymbolCache(self.getInstance(), _char_pt(symbol_cache_dir))
+        _check(cond, 'Failed to set symbol cache directory')
+
     def SetRecordFile(self, record_file):
         """ Set the path of record file, like perf.data."""
         cond = self._SetRecordFileFunc(self.getInstance(), _char_pt(record_file))
@@ -18,6 +18,7 @@
 
 #include <inttypes.h>
 
+#include <algorithm>
 #include <limits>
 
 #include <android-base/logging.h>
@@ -196,20 +197,71 @@ void ThreadTree::InsertMap(MapSet& maps, const MapEntry& entry) {
 }
 
 const MapEntry* MapSet::FindMapByAddr(uint64_t addr) const {
-  auto it = maps.upper_bound(addr);
-  if (it != maps.begin()) {
-    --it;
-    if (it->second->get_end_addr() > addr) {
-      return it->second;
+  if (sorted_maps_version_ != version) {
+    // Building the sorted arrays takes O(n) time. When maps change often (like when reading
+    // mmap records of a starting process), search in maps until enough lookups pay for it.
+    if (++lookups_in_maps_ * 8 < maps.size()) {
+      auto it = maps.upper_bound(addr);
+      if (it != maps.begin()) {
+        --it;
+        if (it->second->get_end_addr() > addr) {
+          return it->second;
+        }
+      }
+      return nullptr;
+    }
+    BuildSortedMaps();
+  }
+  auto it = std::upper_bound(sorted_start_addrs_.begin(), sorted_start_addrs_.end(), addr);
+  if (it != sorted_start_addrs_.begin()) {
+    const MapEntry* map = sorted_maps_[it - sorted_start_addrs_.begin() - 1];
+    if (map->get_end_addr() > addr) {
+      return map;
     }
   }
   return nullptr;
 }
 
+void MapSet::Clear() {
+  maps.clear();
+  version++;
+  sorted_start_addrs_.clear();
+  sorted_maps_.clear();
+  lookups_in_maps_ = 0;
+}
+
+void MapSet::BuildSortedMaps() const {
+  sorted_start_addrs_.clear();
+  sorted_maps_.clear();
+  sorted_start_addrs_.reserve(maps.size());
+  sorted_maps_.reserve(maps.size());
+  for (auto& pair : maps) {
+    sorted_start_addrs_.push_back(pair.first);
+    sorted_maps_.push_back(pair.second);
+  }
+  sorted_maps_version_ = version;
+  lookups_in_maps_ = 0;
+}
+
+// Find a map in the user space maps of a thread, checking the map hit last time first.
+static const MapEntry* FindUserMap(const ThreadEntry* thread, uint64_t ip) {
+  const MapSet& maps = *thread->maps;
+  if (thread->last_map != nullptr && thread->last_map_version == maps.version &&
+      thread->last_map->Contains(ip)) {
+    return thread->last_map;
+  }
+  const MapEntry* result = maps.FindMapByAddr(ip);
+  if (result != nullptr) {
+    thread->last_map = result;
+    thread->last_map_version = maps.version;
+  }
+  return result;
+}
+
 const MapEntry* ThreadTree::FindMap(const ThreadEntry* thread, uint64_t ip, bool in_kernel) {
   const MapEntry* result = nullptr;
   if (!in_kernel) {
-    result = thread->maps->FindMapByAddr(ip);
+    result = FindUserMap(thread, ip);
   } else {
     result = kernel_maps_.FindMapByAddr(ip);
   }
@@ -217,7 +269,7 @@ const MapEntry* ThreadTree::FindMap(const ThreadEntry* thread, uint64_t ip, bool
 }
 
 const MapEntry* ThreadTree::FindMap(const ThreadEntry* thread, uint64_t ip) {
-  const MapEntry* result = thread->maps->FindMapByAddr(ip);
+  const MapEntry* result = FindUserMap(thread, ip);
   if (result != nullptr) {
     return result;
   }
@@ -273,7 +325,7 @@ const Symbol* ThreadTree::FindKernelSymbol(uint64_t ip) {
 void ThreadTree::ClearThreadAndMap() {
   thread_tree_.clear();
   thread_comm_storage_.clear();
-  kernel_maps_.maps.clear();
+  kernel_maps_.Clear();
   map_storage_.clear();
 }
 
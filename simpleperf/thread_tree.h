@@ -23,6 +23,7 @@
 #include <map>
 #include <memory>
 #include <unordered_map>
+#include <vector>
 
 #include "dso.h"
 
@@ -76,6 +77,19 @@ struct MapSet {
   uint64_t version = 0u;  // incremented each time changing maps
 
   const MapEntry* FindMapByAddr(uint64_t addr) const;
+  // Remove all maps. Lookups cached for the old maps become invalid.
+  void Clear();
+
+ private:
+  void BuildSortedMaps() const;
+
+  // Lookups binary search sorted arrays of start addresses and map entries, which are rebuilt
+  // lazily after maps change.
+  mutable std::vector<uint64_t> sorted_start_addrs_;
+  mutable std::vector<const MapEntry*> sorted_maps_;
+  mutable uint64_t sorted_maps_version_ = std::numeric_limits<uint64_t>::max();
+  // Lookups done in maps since the sorted arrays were last built.
+  mutable size_t lookups_in_maps_ = 0;
 };
 
 struct ThreadEntry {
@@ -83,6 +97,10 @@ struct ThreadEntry {
   int tid;
   const char* comm;  // It always refers to the latest comm.
   std::shared_ptr<MapSet> maps;  // maps is shared by threads in the same process.
+  // The map hit by the last lookup in maps, valid while maps->version doesn't change. Samples of
+  // a thread often hit the same map.
+  mutable const MapEntry* last_map = nullptr;
+  mutable uint64_t last_map_version = 0u;
 };
 
 // ThreadTree contains thread information (in ThreadEntry) and mmap information
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks map lookups for the ips of callchains in a recording file. Run as:
+//   simpleperf_thread_tree_benchmark [--record_file <perf.data>] [benchmark options]
+// By default, testdata/perf_with_interpreter_frames.data beside the executable is
+// used, which has callchains of an app process with about a thousand maps.
+
+#include <string.h>
+
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <android-base/file.h>
+#include <android-base/logging.h>
+#include <benchmark/benchmark.h>
+
+#include "perf_event.h"
+#include "record.h"
+#include "record_file.h"
+#include "thread_tree.h"
+
+using namespace simpleperf;
+
+namespace {
+
+struct MapLookup {
+  const ThreadEntry* thread;
+  uint64_t ip;
+  bool in_kernel;
+};
+
+std::string record_file;
+ThreadTree thread_tree;
+// Threads can exit while reading records, so lookups use copies of them, which share maps with
+// the threads in the thread tree.
+std::map<std::pair<int, int>, ThreadEntry> threads;
+std::vector<MapLookup> lookups;
+
+bool LoadLookups() {
+  std::unique_ptr<RecordFileReader> reader = RecordFileReader::CreateInstance(record_file);
+  if (!reader) {
+    return false;
+  }
+  auto callback = [&](std::unique_ptr<Record> r) {
+    thread_tree.Update(*r);
+    if (r->type() != PERF_RECORD_SAMPLE) {
+      return true;
+    }
+    auto sample = static_cast<SampleRecord*>(r.get());
+    auto key = std::make_pair(sample->tid_data.pid, sample->tid_data.tid);
+    auto it = threads.find(key);
+    if (it == threads.end()) {
+      it = threads.emplace(key, *thread_tree.FindThreadOrNew(key.first, key.second)).first;
+    }
+    const ThreadEntry* thread = &it->second;
+    bool in_kernel = sample->InKernel();
+    lookups.push_back({thread, sample->ip_data.ip, in_kernel});
+    if (sample->sample_type & PERF_SAMPLE_CALLCHAIN) {
+      for (uint64_t i = 0; i < sample->callchain_data.ip_nr; ++i) {
+        uint64_t ip = sample->callchain_data.ips[i];
+        if (ip == PERF_CONTEXT_KERNEL) {
+          in_kernel = true;
+        } else if (ip == PERF_CONTEXT_USER) {
+          in_kernel = false;
+        } else if (ip < PERF_CONTEXT_MAX) {
+          lookups.push_back({thread, ip, in_kernel});
+        }
+      }
+    }
+    return true;
+  };
+  if (!reader->ReadDataSection(callback)) {
+    return false;
+  }
+  return !lookups.empty();
+}
+
+// The lookup used before maps had sorted arrays and threads cached the last hit map. Like the
+// old MapSet::FindMapByAddr(), it isn't inlined in the benchmark loop.
+__attribute__((noinline)) const MapEntry* FindMapInStdMap(const MapSet& map_set, uint64_t addr) {
+  auto it = map_set.maps.upper_bound(addr);
+  if (it != map_set.maps.begin()) {
+    --it;
+    if (it->second->get_end_addr() > addr) {
+      return it->second;
+    }
+  }
+  return nullptr;
+}
+
+void BM_FindMapInStdMap(benchmark::State& state) {
+  const MapSet& kernel_maps = thread_tree.GetKernelMaps();
+  for (auto _ : state) {
+    for (const MapLookup& lookup : lookups) {
+      const MapSet& maps = lookup.in_kernel ? kernel_maps : *lookup.thread->maps;
+      benchmark::DoNotOptimize(FindMapInStdMap(maps, lookup.ip));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * lookups.size());
+}
+BENCHMARK(BM_FindMapInStdMap);
+
+void BM_FindMap(benchmark::State& state) {
+  for (auto _ : state) {
+    for (const MapLookup& lookup : lookups) {
+      benchmark::DoNotOptimize(thread_tree.FindMap(lookup.thread, lookup.ip, lookup.in_kernel));
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * lookups.size());
+}
+BENCHMARK(BM_FindMap);
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  android::base::InitLogging(argv, android::base::StderrLogger);
+  record_file =
+      android::base::GetExecutableDirectory() + "/testdata/perf_with_interpreter_frames.data";
+  std::vector<char*> args;
+  for (int i = 0; i < argc; ++i) {
+    if (strcmp(argv[i], "--record_file") == 0 && i + 1 < argc) {
+      record_file = argv[++i];
+    } else {
+      args.push_back(argv[i]);
+    }
+  }
+  if (!LoadLookups()) {
+    LOG(ERROR) << "failed to read callchains from " << record_file;
+    return 1;
+  }
+  int benchmark_argc = args.size();
+  benchmark::Initialize(&benchmark_argc, args.data());
+  benchmark::RunSpecifiedBenchmarks();
+  return 0;
+}
@@ -120,3 +120,36 @@ TEST_F(ThreadTreeTest, reused_tid_without_thread_exit) {
   thread_tree_.ForkThread(1, 2, 1, 1);
   thread_tree_.ForkThread(2, 2, 1, 1);
 }
+
+TEST_F(ThreadTreeTest, find_map_after_changing_maps) {
+  // Use enough maps to search in the std::map for a few lookups after each change.
+  for (uint64_t i = 0; i < 100; ++i) {
+    AddMap(i * 10, i * 10 + 5, std::to_string(i));
+  }
+  CheckMaps();
+  // Hit the map found last time, then change it.
+  ThreadEntry* thread = thread_tree_.FindThreadOrNew(0, 0);
+  ASSERT_EQ(thread_tree_.FindMap(thread, 501, false)->dso->Path(), "50");
+  ASSERT_EQ(thread_tree_.FindMap(thread, 502, false)->dso->Path(), "50");
+  AddMap(500, 503, "new");
+  ASSERT_EQ(thread_tree_.FindMap(thread, 502, false)->dso->Path(), "new");
+  ASSERT_EQ(thread_tree_.FindMap(thread, 503, false)->dso->Path(), "50");
+  ASSERT_TRUE(thread_tree_.IsUnknownDso(thread_tree_.FindMap(thread, 505, false)->dso));
+  CheckMaps();
+}
+
+TEST_F(ThreadTreeTest, find_map_after_clearing_maps) {
+  for (uint64_t i = 0; i < 10; ++i) {
+    thread_tree_.AddKernelMap(i * 10, 5, 0, "kernel_module_" + std::to_string(i));
+  }
+  // Look up enough times to search in sorted arrays.
+  ThreadEntry* thread = thread_tree_.FindThreadOrNew(1, 1);
+  for (int i = 0; i < 10; ++i) {
+    ASSERT_EQ(thread_tree_.FindMap(thread, 21, true)->dso->Path(), "kernel_module_2");
+  }
+  thread_tree_.ClearThreadAndMap();
+  thread = thread_tree_.FindThreadOrNew(1, 1);
+  ASSERT_TRUE(thread_tree_.IsUnknownDso(thread_tree_.FindMap(thread, 21, true)->dso));
+  thread_tree_.AddKernelMap(20, 5, 0, "kernel_module_new");
+  ASSERT_EQ(thread_tree_.FindMap(thread, 21, true)->dso->Path(), "kernel_module_new");
+}
@@ -62,6 +62,13 @@ const char* OneTimeFreeAllocator::AllocateString(std::string_view s) {
   return result;
 }
 
+void OneTimeFreeAllocator::TakeMemoryFrom(OneTimeFreeAllocator& other) {
+  v_.insert(v_.end(), other.v_.begin(), other.v_.end());
+  other.v_.clear();
+  other.cur_ = nullptr;
+  other.end_ = nullptr;
+}
+
 
 android::base::unique_fd FileHelper::OpenReadOnly(const std::string& filename) {
     int fd = TEMP_FAILURE_RETRY(open(filename.c_str(), O_RDONLY | O_BINARY));
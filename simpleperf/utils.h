@@ -56,6 +56,8 @@ class OneTimeFreeAllocator {
 
   void Clear();
   const char* AllocateString(std::string_view s);
+  // Take over the memory of another allocator, so strings allocated by it live as long as this.
+  void TakeMemoryFrom(OneTimeFreeAllocator& other);
 
  private:
   const size_t unit_size_;
@@ -16,6 +16,8 @@
 
 #include "verity/build_verity_tree.h"
 
+#include <fcntl.h>
+
 #include <android-base/logging.h>
 #include <android-base/unique_fd.h>
 #include <sparse/sparse.h>
@@ -52,6 +54,17 @@ bool generate_verity_tree(const std::string& data_filename,
     return false;
   }
 
+  // Stream the hash tree straight to the output file, so the levels are never
+  // all held in memory.
+  android::base::unique_fd verity_fd(open(verity_filename.c_str(),
+                                          O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC,
+                                          0666));
+  if (verity_fd == -1) {
+    PLOG(ERROR) << "failed to open " << verity_filename;
+    return false;
+  }
+  builder->SetOutputFd(verity_fd, 0);
+
   // Initialize the builder to compute the hash tree.
   if (!builder->Initialize(len, salt_content)) {
     LOG(ERROR) << "Failed to initialize HashTreeBuilder";
@@ -67,9 +80,5 @@ bool generate_verity_tree(const std::string& data_filename,
   sparse_file_callback(file, false, false, hash_callback, builder);
   sparse_file_destroy(file);
 
-  if (!builder->BuildHashTree()) {
-    return false;
-  }
-
-  return builder->WriteHashTreeToFile(verity_filename);
+  return builder->BuildHashTree();
 }
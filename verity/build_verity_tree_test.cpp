@@ -21,6 +21,7 @@
 #include <string>
 #include <vector>
 
+#include <android-base/file.h>
 #include <gtest/gtest.h>
 #include <openssl/evp.h>
 
@@ -48,6 +49,11 @@ class BuildVerityTreeTest : public ::testing::Test {
   const std::vector<std::vector<unsigned char>>& verity_tree() const {
     return builder->verity_tree_;
   }
+  size_t stream_blocks() const { return builder->stream_blocks_; }
+  bool HashBlocks(const std::vector<unsigned char>& data,
+                  std::vector<unsigned char>* output) {
+    return builder->HashBlocks(data.data(), data.size(), output);
+  }
 
   void GenerateHashTree(const std::vector<unsigned char>& data,
                         const std::vector<unsigned char>& salt) {
@@ -193,3 +199,136 @@ TEST_F(BuildVerityTreeTest, SHA1MultipleBlocks) {
   ASSERT_EQ("7ea287e6167929988810077abaafbc313b2b8593000000000000000000000000",
             HashTreeBuilder::BytesArrayToString(builder->root_hash()));
 }
+
+TEST_F(BuildVerityTreeTest, MultipleThreads) {
+  // Enough blocks for several threads, and more than one upper level.
+  std::vector<unsigned char> data(128 * 1024 * 4096 / 64);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = rand();
+  }
+
+  GenerateHashTree(data, salt_hex);
+  std::string expected_root_hash =
+      HashTreeBuilder::BytesArrayToString(builder->root_hash());
+  auto expected_tree = verity_tree();
+
+  for (size_t threads : {2, 3, 4, 8, 16}) {
+    builder.reset(new HashTreeBuilder(4096, EVP_sha256(), threads));
+    GenerateHashTree(data, salt_hex);
+    ASSERT_EQ(expected_root_hash,
+              HashTreeBuilder::BytesArrayToString(builder->root_hash()));
+    ASSERT_EQ(expected_tree, verity_tree());
+  }
+}
+
+TEST_F(BuildVerityTreeTest, StreamToFd) {
+  // More than one slice of base level hashes, and three levels.
+  std::vector<unsigned char> data(130 * 128 * 4096);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = rand();
+  }
+
+  GenerateHashTree(data, salt_hex);
+  std::string expected_root_hash =
+      HashTreeBuilder::BytesArrayToString(builder->root_hash());
+  TemporaryFile expected_file;
+  ASSERT_TRUE(builder->WriteHashTreeToFd(expected_file.fd, 0));
+  std::string expected_tree;
+  ASSERT_TRUE(android::base::ReadFileToString(expected_file.path,
+                                              &expected_tree));
+  ASSERT_EQ(builder->CalculateSize(data.size()), expected_tree.size());
+
+  constexpr uint64_t kOffset = 8192;
+  TemporaryFile streamed_file;
+  builder.reset(new HashTreeBuilder(4096, EVP_sha256(), 2));
+  builder->SetOutputFd(streamed_file.fd, kOffset);
+  // Feeds the data in uneven pieces.
+  ASSERT_TRUE(builder->Initialize(data.size(), salt_hex));
+  for (size_t pos = 0; pos < data.size(); pos += 3 * 1024 * 1024 + 100) {
+    size_t len = std::min<size_t>(3 * 1024 * 1024 + 100, data.size() - pos);
+    ASSERT_TRUE(builder->Update(data.data() + pos, len));
+  }
+  ASSERT_TRUE(builder->BuildHashTree());
+  ASSERT_EQ(expected_root_hash,
+            HashTreeBuilder::BytesArrayToString(builder->root_hash()));
+  // Only the latest slice of the base level is kept in memory.
+  ASSERT_EQ(1u, verity_tree().size());
+  ASSERT_TRUE(verity_tree()[0].empty());
+
+  std::string streamed_tree;
+  ASSERT_TRUE(android::base::ReadFileToString(streamed_file.path,
+                                              &streamed_tree));
+  ASSERT_EQ(expected_tree, streamed_tree.substr(kOffset));
+  ASSERT_TRUE(builder->CheckHashTree(std::vector<unsigned char>(
+      expected_tree.begin(), expected_tree.end())));
+
+  TemporaryFile copied_file;
+  ASSERT_TRUE(builder->WriteHashTreeToFd(copied_file.fd, 0));
+  std::string copied_tree;
+  ASSERT_TRUE(android::base::ReadFileToString(copied_file.path, &copied_tree));
+  ASSERT_EQ(expected_tree, copied_tree);
+}
+
+TEST_F(BuildVerityTreeTest, StreamToFdWithManyThreads) {
+  std::vector<unsigned char> data(130 * 128 * 4096);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = rand();
+  }
+  GenerateHashTree(data, salt_hex);
+  std::string expected_root_hash =
+      HashTreeBuilder::BytesArrayToString(builder->root_hash());
+
+  for (size_t threads : {8, 16}) {
+    TemporaryFile streamed_file;
+    builder.reset(new HashTreeBuilder(4096, EVP_sha256(), threads));
+    // Each slice has enough blocks for all the threads.
+    ASSERT_GE(stream_blocks(), threads * 256);
+    builder->SetOutputFd(streamed_file.fd, 0);
+    GenerateHashTree(data, salt_hex);
+    ASSERT_EQ(expected_root_hash,
+              HashTreeBuilder::BytesArrayToString(builder->root_hash()));
+  }
+}
+
+TEST_F(BuildVerityTreeTest, SparseZeroRuns) {
+  // Three levels, with zero runs long enough to cover whole upper level
+  // blocks in between a few data blocks.
+  constexpr size_t kBlocks = 130 * 128;
+  std::vector<unsigned char> data(kBlocks * 4096);
+  for (size_t block : {0, 5000, 5001, 16383, 16500}) {
+    for (size_t i = 0; i < 4096; i++) {
+      data[block * 4096 + i] = rand();
+    }
+  }
+
+  ASSERT_TRUE(builder->Initialize(data.size(), salt_hex));
+  size_t pos = 0;
+  for (size_t block : {0, 5000, 5001, 16383, 16500}) {
+    ASSERT_TRUE(builder->Update(nullptr, block * 4096 - pos));
+    ASSERT_TRUE(builder->Update(data.data() + block * 4096, 4096));
+    pos = (block + 1) * 4096;
+  }
+  ASSERT_TRUE(builder->Update(nullptr, data.size() - pos));
+  ASSERT_TRUE(builder->BuildHashTree());
+  ASSERT_EQ(3u, verity_tree().size());
+
+  // Hashes every block of every level to compare with.
+  std::vector<std::vector<unsigned char>> expected_tree(1);
+  ASSERT_TRUE(HashBlocks(data, &expected_tree[0]));
+  while (true) {
+    auto& level = expected_tree.back();
+    level.resize(div_round_up(level.size(), 4096) * 4096);
+    if (level.size() == 4096) {
+      break;
+    }
+    std::vector<unsigned char> next_level;
+    ASSERT_TRUE(HashBlocks(level, &next_level));
+    expected_tree.emplace_back(std::move(next_level));
+  }
+  ASSERT_EQ(expected_tree, verity_tree());
+
+  std::vector<unsigned char> expected_root_hash;
+  ASSERT_TRUE(
+      builder->CalculateRootDigest(expected_tree.back(), &expected_root_hash));
+  ASSERT_EQ(expected_root_hash, builder->root_hash());
+}
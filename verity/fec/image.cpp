@@ -32,7 +32,12 @@ extern "C" {
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <sparse/sparse.h>
+
+#include <algorithm>
+#include <memory>
+
 #include "image.h"
 
 #if defined(__linux__)
@@ -43,6 +48,26 @@ extern "C" {
     #define O_LARGEFILE 0
 #endif
 
+/* a range of the input backed by a file */
+struct image_segment {
+    uint64_t start;
+    uint64_t len;
+    int fd;
+};
+
+struct image_stream {
+    std::vector<image_segment> segments;
+    /* the number of codewords in a full window */
+    uint64_t codewords;
+    /* two windows of rs_n rows of `codewords' bytes each, so the next one
+       can be read while the current one is processed */
+    std::unique_ptr<uint8_t[]> buf[2];
+    /* the window being processed, and the codewords it contains */
+    const uint8_t *window;
+    uint64_t first;
+    uint64_t count;
+};
+
 void image_init(image *ctx)
 {
     memset(ctx, 0, sizeof(*ctx));
@@ -60,6 +85,14 @@ void image_free(image *ctx)
         delete[] ctx->fec;
     }
 
+    if (ctx->stream) {
+        for (const auto& segment : ctx->stream->segments) {
+            close(segment.fd);
+        }
+
+        delete ctx->stream;
+    }
+
     image_init(ctx);
 }
 
@@ -170,6 +203,170 @@ bool image_load(const std::vector<std::string>& filenames, image *ctx)
     return true;
 }
 
+struct sparse_spill {
+    int fd;
+    uint64_t pos;
+};
+
+static int spill_chunk(void *priv, const void *data, size_t len)
+{
+    sparse_spill *spill = (sparse_spill *)priv;
+
+    if (data && !android::base::WriteFullyAtOffset(spill->fd, data, len,
+                    spill->pos)) {
+        return -1;
+    }
+
+    spill->pos += len;
+    return 0;
+}
+
+/* expands a sparse file into an unlinked temporary file so it can be read
+   in windows like a raw file; chunks without data are left as holes */
+static int spill_sparse_file(struct sparse_file *file, uint64_t len,
+        const std::string& filename)
+{
+    const char *tmpdir = getenv("TMPDIR");
+    std::string path = std::string(tmpdir ? tmpdir : "/tmp") + "/fec-XXXXXX";
+
+    int fd = mkstemp(&path[0]);
+
+    if (fd < 0) {
+        FATAL("failed to create a temporary file in '%s': %s\n",
+            tmpdir ? tmpdir : "/tmp", strerror(errno));
+    }
+
+    unlink(path.c_str());
+
+    if (ftruncate64(fd, len) < 0) {
+        FATAL("failed to extend temporary file: %s\n", strerror(errno));
+    }
+
+    sparse_spill spill = { fd, 0 };
+
+    if (sparse_file_callback(file, false, false, spill_chunk, &spill) != 0) {
+        FATAL("failed to expand sparse file '%s': %s\n", filename.c_str(),
+            strerror(errno));
+    }
+
+    assert(spill.pos == len);
+    return fd;
+}
+
+bool image_stream_load(const std::vector<std::string>& filenames, image *ctx)
+{
+    assert(ctx->roots > 0 && ctx->roots < FEC_RSM);
+    ctx->rs_n = FEC_RSM - ctx->roots;
+
+    image_stream *stream = new image_stream();
+    uint64_t size = 0;
+
+    for (const auto& fn : filenames) {
+        int fd = TEMP_FAILURE_RETRY(open(fn.c_str(), O_RDONLY | O_LARGEFILE));
+
+        if (fd < 0) {
+            FATAL("failed to open file '%s': %s\n", fn.c_str(), strerror(errno));
+        }
+
+        uint64_t len;
+        struct sparse_file *file = sparse_file_import(fd, false, false);
+
+        if (file) {
+            len = sparse_file_len(file, false, false);
+
+            int spill_fd = spill_sparse_file(file, len, fn);
+
+            sparse_file_destroy(file);
+            close(fd);
+            fd = spill_fd;
+        } else if (ctx->sparse) {
+            FATAL("failed to read file %s\n", fn.c_str());
+        } else {
+            /* raw input is read directly from the file */
+            off64_t end = lseek64(fd, 0, SEEK_END);
+
+            if (end < 0) {
+                FATAL("failed to get the size of '%s': %s\n", fn.c_str(),
+                    strerror(errno));
+            }
+
+            len = (uint64_t)end;
+        }
+
+        if (len > 0) {
+            stream->segments.push_back({ size, len, fd });
+        } else {
+            close(fd);
+        }
+
+        size += len;
+    }
+
+    calculate_rounds(size, ctx);
+
+    uint64_t codewords = ctx->window / (2 * ctx->rs_n);
+
+    codewords -= codewords % IMAGE_BATCH_CODEWORDS;
+    codewords = std::max<uint64_t>(codewords, IMAGE_BATCH_CODEWORDS);
+    stream->codewords = std::min(codewords, ctx->rounds * FEC_BLOCKSIZE);
+
+    if (ctx->verbose) {
+        INFO("allocating %" PRIu64 " bytes of memory for windows of %" PRIu64
+            " codewords\n", 2 * ctx->rs_n * stream->codewords,
+            stream->codewords);
+    }
+
+    for (auto& buf : stream->buf) {
+        buf.reset(new uint8_t[ctx->rs_n * stream->codewords]);
+    }
+
+    ctx->stream = stream;
+    return true;
+}
+
+/* reads `count' bytes of input from `offset' to `out', anything past the end
+   of the input is read as zeros */
+static void stream_read(image *ctx, uint64_t offset, size_t count,
+        uint8_t *out)
+{
+    uint64_t end = offset + count;
+    size_t n = 0;
+
+    for (const auto& segment : ctx->stream->segments) {
+        if (segment.start + segment.len <= offset + n) {
+            continue;
+        }
+
+        if (segment.start >= end) {
+            break;
+        }
+
+        size_t len = (size_t)(std::min(end, segment.start + segment.len) -
+                        (offset + n));
+
+        if (!android::base::ReadFullyAtOffset(segment.fd, &out[n], len,
+                offset + n - segment.start)) {
+            FATAL("failed to read input: %s\n", strerror(errno));
+        }
+
+        n += len;
+    }
+
+    memset(&out[n], 0, count - n);
+}
+
+/* reads the symbols of `count' codewords starting from `first' to `buf' */
+static void stream_read_window(image *ctx, uint64_t first, uint64_t count,
+        uint8_t *buf)
+{
+    for (int j = 0; j < ctx->rs_n; ++j) {
+        uint64_t offset = fec_ecc_interleave(first * ctx->rs_n + j,
+                            ctx->rs_n, ctx->rounds);
+
+        stream_read(ctx, offset, count, &buf[j * ctx->stream->codewords]);
+    }
+}
+
 bool image_save(const std::string& filename, image *ctx)
 {
     /* TODO: support saving as a sparse file */
@@ -343,13 +540,194 @@ bool image_ecc_save(image *ctx)
     return true;
 }
 
+/* sets rows[j] to point to symbol `j' of `count' consecutive RS codewords
+   starting from `codeword', for use with fec_rs_simd_encode; symbols past the
+   end of the input are read as zeros from `buf', which must have space for
+   2 * count bytes */
+void image_get_interleaved_rows(uint64_t codeword, size_t count, image *ctx,
+        const uint8_t **rows, uint8_t *buf)
+{
+    if (ctx->stream) {
+        const image_stream *stream = ctx->stream;
+
+        assert(codeword >= stream->first &&
+            codeword + count <= stream->first + stream->count);
+
+        for (int j = 0; j < ctx->rs_n; ++j) {
+            rows[j] = &stream->window[j * stream->codewords +
+                        (codeword - stream->first)];
+        }
+
+        return;
+    }
+
+    uint8_t *zeros = buf;
+    uint8_t *partial = &buf[count];
+
+    memset(zeros, 0, count);
+
+    for (int j = 0; j < ctx->rs_n; ++j) {
+        uint64_t offset = fec_ecc_interleave(codeword * ctx->rs_n + j,
+                            ctx->rs_n, ctx->rounds);
+
+        if (offset + count <= ctx->inp_size) {
+            rows[j] = &ctx->input[offset];
+        } else if (offset >= ctx->inp_size) {
+            rows[j] = zeros;
+        } else {
+            /* the end of the input can only be within one row */
+            size_t n = (size_t)(ctx->inp_size - offset);
+
+            memcpy(partial, &ctx->input[offset], n);
+            memset(&partial[n], 0, count - n);
+            rows[j] = partial;
+        }
+    }
+}
+
+struct image_work_queue {
+    pthread_mutex_t mutex;
+    /* signaled when codewords are queued, when the last queued chunk is
+       done, and when the workers should exit */
+    pthread_cond_t cond;
+    /* codewords [next, end) are waiting for a thread */
+    uint64_t next;
+    uint64_t end;
+    /* codewords queued but not processed yet */
+    uint64_t pending;
+    uint64_t chunk;
+    bool quit;
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* takes chunks of codewords from the queue until told to quit */
 static void * process(void *cookie)
 {
     image_proc_ctx *ctx = (image_proc_ctx *)cookie;
-    ctx->func(ctx);
+    image_work_queue *queue = ctx->queue;
+    image *fcx = ctx->ctx;
+
+    pthread_mutex_lock(&queue->mutex);
+
+    while (true) {
+        while (!queue->quit && queue->next >= queue->end) {
+            pthread_cond_wait(&queue->cond, &queue->mutex);
+        }
+
+        if (queue->next >= queue->end) {
+            break;
+        }
+
+        uint64_t current = queue->next;
+        uint64_t count = std::min(queue->chunk, queue->end - current);
+
+        queue->next += count;
+        pthread_mutex_unlock(&queue->mutex);
+
+        uint64_t start = now_ns();
+
+        ctx->fec_pos = current * fcx->roots;
+        ctx->start = current * fcx->rs_n;
+        ctx->end = (current + count) * fcx->rs_n;
+        ctx->func(ctx);
+
+        ctx->busy_ns += now_ns() - start;
+        ctx->codewords += count;
+
+        pthread_mutex_lock(&queue->mutex);
+        queue->pending -= count;
+
+        if (queue->pending == 0) {
+            pthread_cond_broadcast(&queue->cond);
+        }
+    }
+
+    pthread_mutex_unlock(&queue->mutex);
+    return nullptr;
+}
+
+/* queues codewords [first, first + count) and waits until the threads have
+   processed all of them */
+static void process_codewords(image_work_queue *queue, uint64_t first,
+        uint64_t count)
+{
+    pthread_mutex_lock(&queue->mutex);
+
+    assert(queue->pending == 0);
+    queue->next = first;
+    queue->end = first + count;
+    queue->pending = count;
+    pthread_cond_broadcast(&queue->cond);
+
+    while (queue->pending > 0) {
+        pthread_cond_wait(&queue->cond, &queue->mutex);
+    }
+
+    pthread_mutex_unlock(&queue->mutex);
+}
+
+struct window_read_ctx {
+    image *ctx;
+    uint64_t first;
+    uint64_t count;
+    uint8_t *buf;
+};
+
+static void * read_window(void *cookie)
+{
+    window_read_ctx *reader = (window_read_ctx *)cookie;
+    stream_read_window(reader->ctx, reader->first, reader->count, reader->buf);
     return nullptr;
 }
 
+/* processes the input a window at a time, reading the next window on
+   another thread while the worker threads process the current one */
+static void process_stream(image_work_queue *queue, image *ctx)
+{
+    image_stream *stream = ctx->stream;
+    uint64_t total = ctx->rounds * FEC_BLOCKSIZE;
+    int current = 0;
+
+    stream_read_window(ctx, 0, std::min(stream->codewords, total),
+        stream->buf[current].get());
+
+    for (uint64_t first = 0; first < total; first += stream->codewords) {
+        uint64_t next = first + stream->codewords;
+        window_read_ctx reader;
+        pthread_t pthread;
+
+        if (next < total) {
+            reader.ctx = ctx;
+            reader.first = next;
+            reader.count = std::min(stream->codewords, total - next);
+            reader.buf = stream->buf[current ^ 1].get();
+
+            if (pthread_create(&pthread, nullptr, read_window, &reader) != 0) {
+                FATAL("failed to create reader thread\n");
+            }
+        }
+
+        stream->window = stream->buf[current].get();
+        stream->first = first;
+        stream->count = std::min(stream->codewords, total - first);
+
+        process_codewords(queue, first, stream->count);
+
+        if (next < total && pthread_join(pthread, nullptr) != 0) {
+            FATAL("failed to join reader thread: %s\n", strerror(errno));
+        }
+
+        current ^= 1;
+    }
+}
+
 bool image_process(image_proc_func func, image *ctx)
 {
     int threads = ctx->threads;
@@ -376,69 +754,106 @@ bool image_process(image_proc_func func, image *ctx)
             ctx->rs_n);
     }
 
-    pthread_t pthreads[threads];
-    image_proc_ctx args[threads];
+    /* the threads take chunks of codewords from a shared queue, so that
+       they keep busy until everything has been processed, even if some
+       of them fall behind; give each at least a few chunks per range */
+    uint64_t range = ctx->stream ? ctx->stream->codewords :
+                        ctx->rounds * FEC_BLOCKSIZE;
 
-    uint64_t current = 0;
-    uint64_t end = ctx->rounds * ctx->rs_n * FEC_BLOCKSIZE;
-    uint64_t rs_blocks_per_thread =
-        fec_div_round_up(ctx->rounds * FEC_BLOCKSIZE, threads);
+    image_work_queue queue;
+
+    pthread_mutex_init(&queue.mutex, nullptr);
+    pthread_cond_init(&queue.cond, nullptr);
+    queue.next = 0;
+    queue.end = 0;
+    queue.pending = 0;
+    queue.chunk = std::max<uint64_t>(IMAGE_MIN_CHUNK_CODEWORDS,
+                    std::min<uint64_t>(IMAGE_BATCH_CODEWORDS,
+                        range / (4 * threads)));
+    queue.quit = false;
 
     if (ctx->verbose) {
-        INFO("computing %" PRIu64 " codes per thread\n", rs_blocks_per_thread);
+        INFO("processing %" PRIu64 " codewords at a time\n", queue.chunk);
     }
 
+    pthread_t pthreads[threads];
+    image_proc_ctx args[threads];
+
     for (int i = 0; i < threads; ++i) {
         args[i].func = func;
         args[i].id = i;
         args[i].ctx = ctx;
+        args[i].queue = &queue;
         args[i].rv = 0;
-        args[i].fec_pos = current * ctx->roots;
-        args[i].start = current * ctx->rs_n;
-        args[i].end = (current + rs_blocks_per_thread) * ctx->rs_n;
+        args[i].codewords = 0;
+        args[i].busy_ns = 0;
 
         args[i].rs = init_rs_char(FEC_PARAMS(ctx->roots));
+        args[i].rs_simd = fec_rs_simd_init(ctx->roots);
 
-        if (!args[i].rs) {
+        if (!args[i].rs || !args[i].rs_simd) {
             FATAL("failed to initialize encoder for thread %d\n", i);
         }
 
-        if (args[i].end > end) {
-            args[i].end = end;
-        } else if (i == threads && args[i].end + rs_blocks_per_thread *
-                                        ctx->rs_n > end) {
-            args[i].end = end;
-        }
-
-        if (ctx->verbose) {
-            INFO("thread %d: [%" PRIu64 ", %" PRIu64 ")\n",
-                i, args[i].start, args[i].end);
+        if (ctx->verbose && i == 0) {
+            INFO("using %s RS kernel\n", fec_rs_simd_kernel(args[i].rs_simd));
         }
+    }
 
-        assert(args[i].start < args[i].end);
-        assert((args[i].end - args[i].start) % ctx->rs_n == 0);
+    uint64_t start = now_ns();
 
+    for (int i = 0; i < threads; ++i) {
         if (pthread_create(&pthreads[i], nullptr, process, &args[i]) != 0) {
             FATAL("failed to create thread %d\n", i);
         }
+    }
 
-        current += rs_blocks_per_thread;
+    if (ctx->stream) {
+        process_stream(&queue, ctx);
+    } else {
+        process_codewords(&queue, 0, ctx->rounds * FEC_BLOCKSIZE);
     }
 
+    pthread_mutex_lock(&queue.mutex);
+    queue.quit = true;
+    pthread_cond_broadcast(&queue.cond);
+    pthread_mutex_unlock(&queue.mutex);
+
     ctx->rv = 0;
 
     for (int i = 0; i < threads; ++i) {
         if (pthread_join(pthreads[i], nullptr) != 0) {
             FATAL("failed to join thread %d: %s\n", i, strerror(errno));
         }
+    }
+
+    uint64_t elapsed = now_ns() - start;
 
+    for (int i = 0; i < threads; ++i) {
         ctx->rv += args[i].rv;
 
+        if (ctx->verbose) {
+            double busy = args[i].busy_ns / 1e9;
+
+            INFO("thread %d: %" PRIu64 " codewords, %.1f MiB/s, %.1f%% idle\n",
+                i, args[i].codewords,
+                busy > 0 ? args[i].codewords * ctx->rs_n / busy / 1048576 : 0,
+                elapsed > 0 ? 100.0 * (elapsed - args[i].busy_ns) / elapsed : 0);
+        }
+
         if (args[i].rs) {
             free_rs_char(args[i].rs);
             args[i].rs = nullptr;
         }
+
+        if (args[i].rs_simd) {
+            fec_rs_simd_free(args[i].rs_simd);
+            args[i].rs_simd = nullptr;
+        }
     }
 
+    pthread_cond_destroy(&queue.cond);
+    pthread_mutex_destroy(&queue.mutex);
+
     return true;
 }
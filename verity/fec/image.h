@@ -22,10 +22,22 @@
 #include <vector>
 #include <fec/io.h>
 #include <fec/ecc.h>
+#include <fec/rs_simd.h>
 
 #define IMAGE_MIN_THREADS     1
 #define IMAGE_MAX_THREADS     128
 
+/* number of RS codewords encoded at a time by each thread */
+#define IMAGE_BATCH_CODEWORDS FEC_BLOCKSIZE
+
+/* threads take codewords from a shared queue in chunks of at most
+   IMAGE_BATCH_CODEWORDS, and no smaller than this unless there are fewer
+   codewords left */
+#define IMAGE_MIN_CHUNK_CODEWORDS 256
+
+/* default amount of memory for buffering input when encoding */
+#define IMAGE_DEFAULT_WINDOW  (64 * 1024 * 1024)
+
 #define INFO(x...) \
     fprintf(stderr, x);
 #define FATAL(x...) { \
@@ -35,6 +47,8 @@
 
 #define unlikely(x)    __builtin_expect(!!(x), 0)
 
+struct image_stream;
+
 struct image {
     /* if true, decode file in place instead of creating a new output file */
     bool inplace;
@@ -58,26 +72,41 @@ struct image {
     uint64_t pos;
     uint64_t rounds;
     uint64_t rv;
+    /* the maximum number of bytes of input buffered in memory at a time by
+       image_stream_load */
+    uint64_t window;
     uint8_t *fec;
     uint8_t *input;
     uint8_t *output;
+    /* if set, input is read in windows of codewords instead of held in
+       memory */
+    image_stream *stream;
 };
 
 struct image_proc_ctx;
 typedef void (*image_proc_func)(image_proc_ctx *);
 
+struct image_work_queue;
+
 struct image_proc_ctx {
     image_proc_func func;
     int id;
     image *ctx;
+    image_work_queue *queue;
     uint64_t rv;
     uint64_t fec_pos;
     uint64_t start;
     uint64_t end;
     void *rs;
+    fec_rs_simd *rs_simd;
+    /* the number of codewords processed, and the time spent doing so */
+    uint64_t codewords;
+    uint64_t busy_ns;
 };
 
 extern bool image_load(const std::vector<std::string>& filename, image *ctx);
+extern bool image_stream_load(const std::vector<std::string>& filename,
+        image *ctx);
 extern bool image_save(const std::string& filename, image *ctx);
 
 extern bool image_ecc_new(const std::string& filename, image *ctx);
@@ -86,6 +115,9 @@ extern bool image_ecc_save(image *ctx);
 
 extern bool image_process(image_proc_func f, image *ctx);
 
+extern void image_get_interleaved_rows(uint64_t codeword, size_t count,
+        image *ctx, const uint8_t **rows, uint8_t *buf);
+
 extern void image_init(image *ctx);
 extern void image_free(image *ctx);
 
@@ -28,6 +28,9 @@ extern "C" {
 #include <stdlib.h>
 #include <string.h>
 
+#include <algorithm>
+#include <memory>
+
 #include <android-base/file.h>
 #include "image.h"
 
@@ -42,17 +45,23 @@ enum {
 static void encode_rs(struct image_proc_ctx *ctx)
 {
     struct image *fcx = ctx->ctx;
-    int j;
-    uint8_t data[fcx->rs_n];
-    uint64_t i;
-
-    for (i = ctx->start; i < ctx->end; i += fcx->rs_n) {
-        for (j = 0; j < fcx->rs_n; ++j) {
-            data[j] = image_get_interleaved_byte(i + j, fcx);
-        }
-
-        encode_rs_char(ctx->rs, data, &fcx->fec[ctx->fec_pos]);
-        ctx->fec_pos += fcx->roots;
+    const uint8_t *rows[FEC_RSM];
+    uint8_t buf[2 * IMAGE_BATCH_CODEWORDS];
+    uint64_t i = ctx->start / fcx->rs_n;
+    uint64_t end = ctx->end / fcx->rs_n;
+
+    /* neighbouring codewords have their symbols next to each other in the
+       input, so encode them in batches */
+    while (i < end) {
+        size_t count = (size_t)std::min<uint64_t>(end - i,
+                                                  IMAGE_BATCH_CODEWORDS);
+
+        image_get_interleaved_rows(i, count, fcx, rows, buf);
+        fec_rs_simd_encode(ctx->rs_simd, rows, count,
+            &fcx->fec[ctx->fec_pos]);
+
+        ctx->fec_pos += count * fcx->roots;
+        i += count;
     }
 }
 
@@ -61,31 +70,55 @@ static void decode_rs(struct image_proc_ctx *ctx)
     struct image *fcx = ctx->ctx;
     int j, rv;
     uint8_t data[fcx->rs_n + fcx->roots];
-    uint64_t i;
+    const uint8_t *rows[FEC_RSM];
+    uint8_t buf[2 * IMAGE_BATCH_CODEWORDS];
+    std::unique_ptr<uint8_t[]> parity(
+        new uint8_t[IMAGE_BATCH_CODEWORDS * fcx->roots]);
+    uint64_t i = ctx->start / fcx->rs_n;
+    uint64_t end = ctx->end / fcx->rs_n;
 
     assert(sizeof(data) == FEC_RSM);
 
-    for (i = ctx->start; i < ctx->end; i += fcx->rs_n) {
-        for (j = 0; j < fcx->rs_n; ++j) {
-            data[j] = image_get_interleaved_byte(i + j, fcx);
-        }
+    while (i < end) {
+        size_t count = (size_t)std::min<uint64_t>(end - i,
+                                                  IMAGE_BATCH_CODEWORDS);
+
+        /* codewords whose parity matches have no errors, so only run the
+           decoder for the others */
+        image_get_interleaved_rows(i, count, fcx, rows, buf);
+        fec_rs_simd_encode(ctx->rs_simd, rows, count, parity.get());
 
-        memcpy(&data[fcx->rs_n], &fcx->fec[ctx->fec_pos], fcx->roots);
-        rv = decode_rs_char(ctx->rs, data, nullptr, 0);
+        for (size_t n = 0; n < count; ++n) {
+            const uint8_t *ecc = &fcx->fec[ctx->fec_pos + n * fcx->roots];
+
+            if (!memcmp(&parity[n * fcx->roots], ecc, fcx->roots)) {
+                continue;
+            }
+
+            uint64_t pos = (i + n) * fcx->rs_n;
 
-        if (rv < 0) {
-            FATAL("failed to recover [%" PRIu64 ", %" PRIu64 ")\n",
-                i, i + fcx->rs_n);
-        } else if (rv > 0) {
-            /* copy corrected data to output */
             for (j = 0; j < fcx->rs_n; ++j) {
-                image_set_interleaved_byte(i + j, fcx, data[j]);
+                data[j] = image_get_interleaved_byte(pos + j, fcx);
             }
 
-            ctx->rv += rv;
+            memcpy(&data[fcx->rs_n], ecc, fcx->roots);
+            rv = decode_rs_char(ctx->rs, data, nullptr, 0);
+
+            if (rv < 0) {
+                FATAL("failed to recover [%" PRIu64 ", %" PRIu64 ")\n",
+                    pos, pos + fcx->rs_n);
+            } else if (rv > 0) {
+                /* copy corrected data to output */
+                for (j = 0; j < fcx->rs_n; ++j) {
+                    image_set_interleaved_byte(pos + j, fcx, data[j]);
+                }
+
+                ctx->rv += rv;
+            }
         }
 
-        ctx->fec_pos += fcx->roots;
+        ctx->fec_pos += count * fcx->roots;
+        i += count;
     }
 }
 
@@ -108,6 +141,7 @@ static int usage()
            "  -S                                treat data as a sparse file\n"
            "encoding options:\n"
            "  -p, --padding=<bytes>             add padding after ECC data\n"
+           "  -w, --window=<bytes>              max. input to buffer in memory\n"
            "decoding options:\n"
            "  -i, --inplace                     correct <data> in place\n"
         );
@@ -176,7 +210,7 @@ static int encode(image& ctx, const std::vector<std::string>& inp_filenames,
         FATAL("invalid parameters: inplace can only used when decoding\n");
     }
 
-    if (!image_load(inp_filenames, &ctx)) {
+    if (!image_stream_load(inp_filenames, &ctx)) {
         FATAL("failed to read input\n");
     }
 
@@ -276,6 +310,7 @@ int main(int argc, char **argv)
 
     image_init(&ctx);
     ctx.roots = FEC_DEFAULT_ROOTS;
+    ctx.window = IMAGE_DEFAULT_WINDOW;
 
     while (1) {
         const static struct option long_options[] = {
@@ -290,10 +325,11 @@ int main(int argc, char **argv)
             {"get-ecc-start", required_argument, nullptr, 'E'},
             {"get-verity-start", required_argument, nullptr, 'V'},
             {"padding", required_argument, nullptr, 'p'},
+            {"window", required_argument, nullptr, 'w'},
             {"verbose", no_argument, nullptr, 'v'},
             {nullptr, 0, nullptr, 0}
         };
-        int c = getopt_long(argc, argv, "hedSr:ij:s:E:V:p:v", long_options, nullptr);
+        int c = getopt_long(argc, argv, "hedSr:ij:s:E:V:p:w:v", long_options, nullptr);
         if (c < 0) {
             break;
         }
@@ -351,6 +387,9 @@ int main(int argc, char **argv)
                 FATAL("padding must be multiple of %u\n", FEC_BLOCKSIZE);
             }
             break;
+        case 'w':
+            ctx.window = parse_arg(optarg, "window", UINT64_MAX);
+            break;
         case 'v':
             ctx.verbose = true;
             break;
@@ -16,8 +16,14 @@
 
 #include "verity/hash_tree_builder.h"
 
+#include <string.h>
+
 #include <algorithm>
+#include <condition_variable>
+#include <functional>
 #include <memory>
+#include <mutex>
+#include <thread>
 
 #include <android-base/file.h>
 #include <android-base/logging.h>
@@ -28,6 +34,92 @@
 
 #include "build_verity_tree_utils.h"
 
+// Don't start a worker thread for less than this many blocks.
+constexpr size_t kMinBlocksPerThread = 256;
+// The number of blocks hashed at a time per thread when streaming the hash
+// tree to an output fd, which bounds the memory used for buffering. Slices
+// grow with the thread count so that every thread gets a share of each.
+constexpr size_t kStreamBlocksPerThread = 1024;
+constexpr size_t kMinStreamBlocks = 2048;
+
+// Runs batches of tasks on |threads| - 1 worker threads and the calling
+// thread. The workers wait for the next batch instead of exiting, so that
+// hashing many small batches doesn't pay for starting threads each time.
+class HashTreeBuilder::WorkerPool {
+ public:
+  explicit WorkerPool(size_t threads) {
+    for (size_t i = 1; i < threads; i++) {
+      workers_.emplace_back([this]() { WorkerLoop(); });
+    }
+  }
+
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    work_cond_.notify_all();
+    for (auto& worker : workers_) {
+      worker.join();
+    }
+  }
+
+  // Runs task(0) ... task(count - 1), and returns false if any of them fails.
+  bool Run(size_t count, const std::function<bool(size_t)>& task) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    task_ = &task;
+    task_count_ = count;
+    next_task_ = 0;
+    finished_tasks_ = 0;
+    success_ = true;
+    work_cond_.notify_all();
+    while (next_task_ < task_count_) {
+      RunNextTask(lock);
+    }
+    done_cond_.wait(lock, [this]() { return finished_tasks_ == task_count_; });
+    task_ = nullptr;
+    return success_;
+  }
+
+ private:
+  void WorkerLoop() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      work_cond_.wait(lock, [this]() {
+        return stop_ || (task_ != nullptr && next_task_ < task_count_);
+      });
+      if (stop_) {
+        return;
+      }
+      RunNextTask(lock);
+    }
+  }
+
+  // Called with |lock| held, which is released while running the task.
+  void RunNextTask(std::unique_lock<std::mutex>& lock) {
+    size_t index = next_task_++;
+    const std::function<bool(size_t)>& task = *task_;
+    lock.unlock();
+    bool result = task(index);
+    lock.lock();
+    success_ &= result;
+    if (++finished_tasks_ == task_count_) {
+      done_cond_.notify_all();
+    }
+  }
+
+  std::mutex mutex_;
+  std::condition_variable work_cond_;
+  std::condition_variable done_cond_;
+  const std::function<bool(size_t)>* task_ = nullptr;
+  size_t task_count_ = 0;
+  size_t next_task_ = 0;
+  size_t finished_tasks_ = 0;
+  bool success_ = true;
+  bool stop_ = false;
+  std::vector<std::thread> workers_;
+};
+
 const EVP_MD* HashTreeBuilder::HashFunction(const std::string& hash_name) {
   if (android::base::EqualsIgnoreCase(hash_name, "sha1")) {
     return EVP_sha1();
@@ -46,8 +138,18 @@ const EVP_MD* HashTreeBuilder::HashFunction(const std::string& hash_name) {
   return nullptr;
 }
 
-HashTreeBuilder::HashTreeBuilder(size_t block_size, const EVP_MD* md)
-    : block_size_(block_size), data_size_(0), md_(md) {
+HashTreeBuilder::HashTreeBuilder(size_t block_size, const EVP_MD* md,
+                                 size_t threads)
+    : block_size_(block_size),
+      data_size_(0),
+      md_(md),
+      threads_(std::max<size_t>(threads, 1)),
+      stream_blocks_(
+          std::max(kMinStreamBlocks, threads_ * kStreamBlocksPerThread)),
+      salted_ctx_(nullptr, EVP_MD_CTX_free),
+      output_fd_(-1),
+      output_offset_(0),
+      base_level_written_(0) {
   CHECK(md_ != nullptr) << "Failed to initialize md";
 
   hash_size_raw_ = EVP_MD_size(md_);
@@ -60,6 +162,8 @@ HashTreeBuilder::HashTreeBuilder(size_t block_size, const EVP_MD* md)
   CHECK_LT(hash_size_ * 2, block_size_);
 }
 
+HashTreeBuilder::~HashTreeBuilder() = default;
+
 std::string HashTreeBuilder::BytesArrayToString(
     const std::vector<unsigned char>& bytes) {
   std::string result;
@@ -106,10 +210,17 @@ uint64_t HashTreeBuilder::CalculateSize(uint64_t input_size) const {
   return verity_blocks * block_size_;
 }
 
+void HashTreeBuilder::SetOutputFd(int fd, uint64_t offset) {
+  CHECK(verity_tree_.empty()) << "SetOutputFd() must precede Initialize()";
+  output_fd_ = fd;
+  output_offset_ = offset;
+}
+
 bool HashTreeBuilder::Initialize(int64_t expected_data_size,
                                  const std::vector<unsigned char>& salt) {
   data_size_ = expected_data_size;
   salt_ = salt;
+  salted_ctx_.reset();
 
   if (data_size_ % block_size_ != 0) {
     LOG(ERROR) << "file size " << data_size_
@@ -117,41 +228,121 @@ bool HashTreeBuilder::Initialize(int64_t expected_data_size,
     return false;
   }
 
-  // Reserve enough space for the hash of the input data.
-  size_t base_level_blocks =
-      verity_tree_blocks(data_size_, block_size_, hash_size_, 0);
-  std::vector<unsigned char> base_level;
-  base_level.reserve(base_level_blocks * block_size_);
-  verity_tree_.emplace_back(std::move(base_level));
+  if (streaming()) {
+    level_sizes_.clear();
+    size_t level_blocks;
+    do {
+      level_blocks = verity_tree_blocks(data_size_, block_size_, hash_size_,
+                                        level_sizes_.size());
+      level_sizes_.push_back(level_blocks * block_size_);
+    } while (level_blocks > 1);
+
+    level_offsets_.resize(level_sizes_.size());
+    uint64_t level_offset = 0;
+    for (size_t i = level_sizes_.size(); i > 0; i--) {
+      level_offsets_[i - 1] = level_offset;
+      level_offset += level_sizes_[i - 1];
+    }
+    CHECK_EQ(CalculateSize(data_size_), level_offset);
+
+    base_level_written_ = 0;
+    std::vector<unsigned char> base_level;
+    base_level.reserve(stream_blocks_ * hash_size_);
+    verity_tree_.emplace_back(std::move(base_level));
+  } else {
+    // Reserve enough space for the hash of the input data.
+    size_t base_level_blocks =
+        verity_tree_blocks(data_size_, block_size_, hash_size_, 0);
+    std::vector<unsigned char> base_level;
+    base_level.reserve(base_level_blocks * block_size_);
+    verity_tree_.emplace_back(std::move(base_level));
+  }
 
   // Save the hash of the zero block to avoid future recalculation.
   std::vector<unsigned char> zero_block(block_size_, 0);
   zero_block_hash_.resize(hash_size_);
   HashBlock(zero_block.data(), zero_block_hash_.data());
 
+  // Same for the blocks of each upper level covering only zero blocks, so
+  // that long runs of them in sparse images don't need hashing.
+  size_t levels = 0;
+  while (verity_tree_blocks(data_size_, block_size_, hash_size_, levels++) >
+         1) {
+  }
+  zero_level_hashes_.assign(1, zero_block_hash_);
+  for (size_t level = 1; level < levels; level++) {
+    FillZeroHashes(zero_block.data(), block_size_ / hash_size_, level - 1);
+    std::vector<unsigned char> hash(hash_size_);
+    HashBlock(zero_block.data(), hash.data());
+    zero_level_hashes_.emplace_back(std::move(hash));
+  }
+
   return true;
 }
 
+const EVP_MD_CTX* HashTreeBuilder::SaltedContext() {
+  if (!salted_ctx_) {
+    salted_ctx_.reset(EVP_MD_CTX_new());
+    CHECK(salted_ctx_ != nullptr);
+    int ret = 1;
+    ret &= EVP_DigestInit_ex(salted_ctx_.get(), md_, nullptr);
+    ret &= EVP_DigestUpdate(salted_ctx_.get(), salt_.data(), salt_.size());
+    CHECK_EQ(1, ret);
+  }
+  return salted_ctx_.get();
+}
+
 bool HashTreeBuilder::HashBlock(const unsigned char* block,
                                 unsigned char* out) {
-  unsigned int s;
-  int ret = 1;
+  return HashBlocksSerial(block, 1, out);
+}
 
-  EVP_MD_CTX* mdctx = EVP_MD_CTX_create();
+bool HashTreeBuilder::HashBlocksSerial(const unsigned char* data, size_t blocks,
+                                       unsigned char* out) {
+  const EVP_MD_CTX* salted_ctx = SaltedContext();
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> mdctx(
+      EVP_MD_CTX_new(), EVP_MD_CTX_free);
   CHECK(mdctx != nullptr);
-  ret &= EVP_DigestInit_ex(mdctx, md_, nullptr);
-  ret &= EVP_DigestUpdate(mdctx, salt_.data(), salt_.size());
-  ret &= EVP_DigestUpdate(mdctx, block, block_size_);
-  ret &= EVP_DigestFinal_ex(mdctx, out, &s);
-  EVP_MD_CTX_destroy(mdctx);
 
-  CHECK_EQ(1, ret);
-  CHECK_EQ(hash_size_raw_, s);
-  std::fill(out + s, out + hash_size_, 0);
+  for (size_t i = 0; i < blocks; i++) {
+    unsigned int s;
+    int ret = 1;
+
+    ret &= EVP_MD_CTX_copy_ex(mdctx.get(), salted_ctx);
+    ret &= EVP_DigestUpdate(mdctx.get(), data + i * block_size_, block_size_);
+    ret &= EVP_DigestFinal_ex(mdctx.get(), out + i * hash_size_, &s);
+
+    CHECK_EQ(1, ret);
+    CHECK_EQ(hash_size_raw_, s);
+    std::fill(out + i * hash_size_ + s, out + (i + 1) * hash_size_, 0);
+  }
 
   return true;
 }
 
+bool HashTreeBuilder::HashBlocksParallel(const unsigned char* data,
+                                         size_t blocks, unsigned char* out) {
+  size_t threads = std::min(threads_, blocks / kMinBlocksPerThread);
+  if (threads <= 1) {
+    return HashBlocksSerial(data, blocks, out);
+  }
+
+  // Creates the salted context before the workers start sharing it.
+  SaltedContext();
+
+  if (!worker_pool_) {
+    worker_pool_.reset(new WorkerPool(threads_));
+  }
+
+  size_t blocks_per_thread = div_round_up(blocks, threads);
+  return worker_pool_->Run(threads, [&](size_t i) {
+    size_t begin = i * blocks_per_thread;
+    size_t count = std::min(blocks_per_thread, blocks - begin);
+    return HashBlocksSerial(data + begin * block_size_, count,
+                            out + begin * hash_size_);
+  });
+}
+
 bool HashTreeBuilder::HashBlocks(const unsigned char* data, size_t len,
                                  std::vector<unsigned char>* output_vector) {
   if (len == 0) {
@@ -159,23 +350,71 @@ bool HashTreeBuilder::HashBlocks(const unsigned char* data, size_t len,
   }
   CHECK_EQ(0, len % block_size_);
 
+  size_t blocks = len / block_size_;
+  size_t offset = output_vector->size();
+  output_vector->resize(offset + blocks * hash_size_);
+  unsigned char* out = output_vector->data() + offset;
+
   if (data == nullptr) {
-    for (size_t i = 0; i < len; i += block_size_) {
-      output_vector->insert(output_vector->end(), zero_block_hash_.begin(),
-                            zero_block_hash_.end());
-    }
+    FillZeroHashes(out, blocks, 0);
     return true;
   }
 
-  for (size_t i = 0; i < len; i += block_size_) {
-    unsigned char hash_buffer[hash_size_];
-    if (!HashBlock(data + i, hash_buffer)) {
+  return HashBlocksParallel(data, blocks, out);
+}
+
+void HashTreeBuilder::FillZeroHashes(unsigned char* out, size_t count,
+                                     size_t level) const {
+  size_t len = count * hash_size_;
+  if (len == 0) {
+    return;
+  }
+
+  // Copies the hash once, then keeps doubling the filled range.
+  memcpy(out, zero_level_hashes_[level].data(), hash_size_);
+  for (size_t filled = hash_size_; filled < len; filled *= 2) {
+    memcpy(out + filled, out, std::min(filled, len - filled));
+  }
+}
+
+bool HashTreeBuilder::HashUpperLevel(const unsigned char* data, size_t len,
+                                     size_t level,
+                                     std::vector<unsigned char>* output_vector) {
+  CHECK_EQ(0, len % block_size_);
+  CHECK_LT(level + 1, zero_level_hashes_.size());
+
+  size_t blocks = len / block_size_;
+  size_t offset = output_vector->size();
+  output_vector->resize(offset + blocks * hash_size_);
+  unsigned char* out = output_vector->data() + offset;
+
+  // A block of this level that only covers zero blocks.
+  std::vector<unsigned char> zero_node(block_size_);
+  FillZeroHashes(zero_node.data(), block_size_ / hash_size_, level);
+  auto is_zero_node = [&](size_t block) {
+    return memcmp(data + block * block_size_, zero_node.data(), block_size_) ==
+           0;
+  };
+
+  // Hashes the runs of blocks in between the zero nodes.
+  size_t begin = 0;
+  bool zero = blocks > 0 && is_zero_node(0);
+  while (begin < blocks) {
+    size_t end = begin + 1;
+    bool next_zero = false;
+    while (end < blocks && (next_zero = is_zero_node(end)) == zero) {
+      end++;
+    }
+
+    if (zero) {
+      FillZeroHashes(out + begin * hash_size_, end - begin, level + 1);
+    } else if (!HashBlocksParallel(data + begin * block_size_, end - begin,
+                                   out + begin * hash_size_)) {
       return false;
     }
-    output_vector->insert(output_vector->end(), hash_buffer,
-                          hash_buffer + hash_size_);
+    begin = end;
+    zero = next_zero;
   }
-
   return true;
 }
 
@@ -193,7 +432,7 @@ bool HashTreeBuilder::Update(const unsigned char* data, size_t len) {
     if (leftover_.size() < block_size_) {
       return true;
     }
-    if (!HashBlocks(leftover_.data(), leftover_.size(), &verity_tree_[0])) {
+    if (!HashBaseLevel(leftover_.data(), leftover_.size())) {
       return false;
     }
     leftover_.clear();
@@ -210,7 +449,116 @@ bool HashTreeBuilder::Update(const unsigned char* data, size_t len) {
     }
     len -= len % block_size_;
   }
-  return HashBlocks(data, len, &verity_tree_[0]);
+  return HashBaseLevel(data, len);
+}
+
+bool HashTreeBuilder::HashBaseLevel(const unsigned char* data, size_t len) {
+  if (!streaming()) {
+    return HashBlocks(data, len, &verity_tree_[0]);
+  }
+
+  while (len > 0) {
+    size_t slice = std::min(len, stream_blocks_ * block_size_);
+    if (!HashBlocks(data, slice, &verity_tree_[0]) || !FlushBaseLevel()) {
+      return false;
+    }
+    if (data != nullptr) {
+      data += slice;
+    }
+    len -= slice;
+  }
+  return true;
+}
+
+bool HashTreeBuilder::FlushBaseLevel() {
+  auto& buffer = verity_tree_[0];
+  if (base_level_written_ + buffer.size() > level_sizes_[0]) {
+    LOG(ERROR) << "More data than the expected " << data_size_ << " bytes";
+    return false;
+  }
+
+  uint64_t offset = output_offset_ + level_offsets_[0] + base_level_written_;
+  if (!android::base::WriteFullyAtOffset(output_fd_, buffer.data(),
+                                         buffer.size(), offset)) {
+    PLOG(ERROR) << "Failed to write the hash tree base level at " << offset;
+    return false;
+  }
+
+  base_level_written_ += buffer.size();
+  buffer.clear();
+  return true;
+}
+
+bool HashTreeBuilder::WriteStreamedPadding(uint64_t offset, size_t len) {
+  if (len == 0) {
+    return true;
+  }
+  CHECK_LT(len, block_size_);
+
+  std::vector<unsigned char> padding(len, 0);
+  if (!android::base::WriteFullyAtOffset(output_fd_, padding.data(), len,
+                                         output_offset_ + offset)) {
+    PLOG(ERROR) << "Failed to write the hash tree padding at " << offset;
+    return false;
+  }
+  return true;
+}
+
+bool HashTreeBuilder::BuildStreamedHashTree() {
+  uint64_t base_level_hashes = data_size_ / block_size_ * hash_size_;
+  CHECK_EQ(base_level_hashes, base_level_written_);
+  if (!WriteStreamedPadding(level_offsets_[0] + base_level_written_,
+                            level_sizes_[0] - base_level_written_)) {
+    return false;
+  }
+
+  std::vector<unsigned char> input(stream_blocks_ * block_size_);
+  std::vector<unsigned char> hashes;
+  hashes.reserve(stream_blocks_ * hash_size_);
+
+  for (size_t level = 0; level + 1 < level_sizes_.size(); level++) {
+    // Computes the next level of the verity tree based on the hash of the
+    // current level, a slice at a time.
+    uint64_t written = 0;
+    for (uint64_t pos = 0; pos < level_sizes_[level]; pos += input.size()) {
+      size_t len = std::min<uint64_t>(input.size(), level_sizes_[level] - pos);
+      uint64_t offset = output_offset_ + level_offsets_[level] + pos;
+      if (!android::base::ReadFullyAtOffset(output_fd_, input.data(), len,
+                                            offset)) {
+        PLOG(ERROR) << "Failed to read the hash tree level " << level
+                    << " at " << offset;
+        return false;
+      }
+
+      hashes.clear();
+      if (!HashUpperLevel(input.data(), len, level, &hashes)) {
+        return false;
+      }
+
+      offset = output_offset_ + level_offsets_[level + 1] + written;
+      if (!android::base::WriteFullyAtOffset(output_fd_, hashes.data(),
+                                             hashes.size(), offset)) {
+        PLOG(ERROR) << "Failed to write the hash tree level " << level + 1
+                    << " at " << offset;
+        return false;
+      }
+      written += hashes.size();
+    }
+
+    if (!WriteStreamedPadding(level_offsets_[level + 1] + written,
+                              level_sizes_[level + 1] - written)) {
+      return false;
+    }
+  }
+
+  // The top level is the first block of the output.
+  std::vector<unsigned char> top_level(block_size_);
+  if (!android::base::ReadFullyAtOffset(output_fd_, top_level.data(),
+                                        block_size_, output_offset_)) {
+    PLOG(ERROR) << "Failed to read the top level of the hash tree";
+    return false;
+  }
+  return CalculateRootDigest(top_level, &root_hash_);
 }
 
 bool HashTreeBuilder::CalculateRootDigest(const std::vector<unsigned char>& root_verity,
@@ -230,6 +578,10 @@ bool HashTreeBuilder::BuildHashTree() {
     return false;
   }
 
+  if (streaming()) {
+    return BuildStreamedHashTree();
+  }
+
   // Expects the base level to have the same size as the total hash size of
   // input data.
   AppendPaddings(&verity_tree_.back());
@@ -246,7 +598,10 @@ bool HashTreeBuilder::BuildHashTree() {
     std::vector<unsigned char> next_level;
     next_level.reserve(next_level_blocks * block_size_);
 
-    HashBlocks(current_level.data(), current_level.size(), &next_level);
+    if (!HashUpperLevel(current_level.data(), current_level.size(),
+                        verity_tree_.size() - 1, &next_level)) {
+      return false;
+    }
     AppendPaddings(&next_level);
 
     // Checks the size of the next level.
@@ -260,6 +615,33 @@ bool HashTreeBuilder::BuildHashTree() {
 
 bool HashTreeBuilder::CheckHashTree(
     const std::vector<unsigned char>& hash_tree) const {
+  if (streaming()) {
+    uint64_t tree_size = level_offsets_[0] + level_sizes_[0];
+    if (tree_size != hash_tree.size()) {
+      LOG(ERROR) << "Hash tree size mismatch: " << hash_tree.size()
+                 << " != " << tree_size;
+      return false;
+    }
+    std::vector<unsigned char> buffer(stream_blocks_ * block_size_);
+    for (uint64_t pos = 0; pos < tree_size; pos += buffer.size()) {
+      size_t len = std::min<uint64_t>(buffer.size(), tree_size - pos);
+      if (!android::base::ReadFullyAtOffset(output_fd_, buffer.data(), len,
+                                            output_offset_ + pos)) {
+        PLOG(ERROR) << "Failed to read the hash tree at " << pos;
+        return false;
+      }
+      auto iter = std::mismatch(buffer.begin(), buffer.begin() + len,
+                                hash_tree.begin() + pos)
+                      .first;
+      if (iter != buffer.begin() + len) {
+        LOG(ERROR) << "Mismatch found at the hash tree offset "
+                   << pos + std::distance(buffer.begin(), iter);
+        return false;
+      }
+    }
+    return true;
+  }
+
   size_t offset = 0;
   // Reads reversely to output the verity tree top-down.
   for (size_t i = verity_tree_.size(); i > 0; i--) {
@@ -305,6 +687,28 @@ bool HashTreeBuilder::WriteHashTreeToFd(int fd, uint64_t offset) const {
     return false;
   }
 
+  if (streaming()) {
+    // The tree is already in place if this is the fd it was streamed to.
+    if (fd == output_fd_ && offset == output_offset_) {
+      return true;
+    }
+    uint64_t tree_size = level_offsets_[0] + level_sizes_[0];
+    std::vector<unsigned char> buffer(stream_blocks_ * block_size_);
+    for (uint64_t pos = 0; pos < tree_size; pos += buffer.size()) {
+      size_t len = std::min<uint64_t>(buffer.size(), tree_size - pos);
+      if (!android::base::ReadFullyAtOffset(output_fd_, buffer.data(), len,
+                                            output_offset_ + pos)) {
+        PLOG(ERROR) << "Failed to read the hash tree at " << pos;
+        return false;
+      }
+      if (!android::base::WriteFully(fd, buffer.data(), len)) {
+        PLOG(ERROR) << "Failed to write the hash tree at " << pos;
+        return false;
+      }
+    }
+    return true;
+  }
+
   // Reads reversely to output the verity tree top-down.
   for (size_t i = verity_tree_.size(); i > 0; i--) {
     const auto& level_blocks = verity_tree_[i - 1];
@@ -0,0 +1,53 @@
+/*
+ * Copyright (C) 2020 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Benchmarks building the hash tree of 64 MiB of data with 1 to 16 hashing
+// threads. The throughput is reported in bytes per second of input data.
+
+#include <memory>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+#include <openssl/evp.h>
+
+#include "verity/hash_tree_builder.h"
+
+static constexpr size_t kDataSize = 64 * 1024 * 1024;
+
+static void BM_BuildHashTree(benchmark::State& state) {
+  size_t threads = state.range(0);
+  std::vector<unsigned char> data(kDataSize, 0xa5);
+  std::vector<unsigned char> salt(32, 0x5a);
+
+  for (auto _ : state) {
+    HashTreeBuilder builder(4096, EVP_sha256(), threads);
+    if (!builder.Initialize(data.size(), salt) ||
+        !builder.Update(data.data(), data.size()) || !builder.BuildHashTree()) {
+      state.SkipWithError("failed to build the hash tree");
+      return;
+    }
+    benchmark::DoNotOptimize(builder.root_hash());
+  }
+  state.SetBytesProcessed(state.iterations() * kDataSize);
+}
+BENCHMARK(BM_BuildHashTree)
+    ->RangeMultiplier(2)
+    ->Range(1, 16)
+    ->ArgName("threads")
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -20,6 +20,7 @@
 #include <inttypes.h>
 #include <stddef.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -29,12 +30,21 @@
 // the length of hash size. It also supports the streaming of input data while
 // the total data size should be know in advance. Once all the data is ready,
 // appropriate functions can be called to build the upper levels of the hash
-// tree and output the tree to a file.
+// tree and output the tree to a file. Large inputs and the upper levels
+// are hashed by up to |threads| threads, which are kept until the builder is
+// destroyed.
 class HashTreeBuilder {
  public:
-  HashTreeBuilder(size_t block_size, const EVP_MD* md);
+  HashTreeBuilder(size_t block_size, const EVP_MD* md, size_t threads = 1);
+  ~HashTreeBuilder();
   // Returns the size of the verity tree in bytes given the input data size.
   uint64_t CalculateSize(uint64_t input_size) const;
+  // Writes the hash tree to |fd| at |offset| while it is being built instead
+  // of keeping all the levels in memory, so that memory use doesn't grow with
+  // the input size. Must be called before Initialize(). The upper levels are
+  // computed by reading back the lower ones, so |fd| must be open for reading
+  // and writing, and must stay open until BuildHashTree() returns.
+  void SetOutputFd(int fd, uint64_t offset);
   // Gets ready for the hash tree computation. We expect |expected_data_size|
   // bytes source data.
   bool Initialize(int64_t expected_data_size,
@@ -71,6 +81,8 @@ class HashTreeBuilder {
 
  private:
   friend class BuildVerityTreeTest;
+  class WorkerPool;
+
   // Calculates the hash of one single block. Write the result to |out|, a
   // buffer allocated by the caller.
   bool HashBlock(const unsigned char* block, unsigned char* out);
@@ -78,8 +90,35 @@ class HashTreeBuilder {
   // result to |output_vector|.
   bool HashBlocks(const unsigned char* data, size_t len,
                   std::vector<unsigned char>* output_vector);
+  // Calculates the hashes of |blocks| blocks starting from |data| and writes
+  // them to |out|, splitting the work across the worker threads.
+  bool HashBlocksParallel(const unsigned char* data, size_t blocks,
+                          unsigned char* out);
+  // Same as above on the calling thread, reusing a single digest context.
+  bool HashBlocksSerial(const unsigned char* data, size_t blocks,
+                        unsigned char* out);
+  // Computes the hashes of |len| bytes of tree level |level| and appends them
+  // to |output_vector|. Blocks made of nothing but zero hashes of that level
+  // are not hashed, they get the precomputed zero hash of the next level.
+  bool HashUpperLevel(const unsigned char* data, size_t len, size_t level,
+                      std::vector<unsigned char>* output_vector);
+  // Writes |count| copies of the zero hash of |level| to |out|.
+  void FillZeroHashes(unsigned char* out, size_t count, size_t level) const;
+  // Returns a digest context that has already absorbed the salt; hashing a
+  // block starts from a copy of it.
+  const EVP_MD_CTX* SaltedContext();
   // Aligns |data| with block_size by padding 0s to the end.
   void AppendPaddings(std::vector<unsigned char>* data);
+  // Hashes |len| bytes of source data into the base level. When streaming to
+  // an output fd, the hashes are written out in bounded slices.
+  bool HashBaseLevel(const unsigned char* data, size_t len);
+  // Writes the base level hashes buffered in verity_tree_[0] to output_fd_.
+  bool FlushBaseLevel();
+  // Computes the upper levels from the ones already in output_fd_.
+  bool BuildStreamedHashTree();
+  // Writes |len| zero bytes to output_fd_ at |offset| in the hash tree.
+  bool WriteStreamedPadding(uint64_t offset, size_t len);
+  bool streaming() const { return output_fd_ != -1; }
 
   size_t block_size_;
   // Expected size of the source data, which is used to compute the hash for the
@@ -91,9 +130,20 @@ class HashTreeBuilder {
   size_t hash_size_raw_;
   // Hash size rounded up to the next power of 2. (e.g. 20 -> 32)
   size_t hash_size_;
+  // The maximum number of threads used to compute the hashes.
+  size_t threads_;
+  // The number of blocks hashed at a time when streaming to output_fd_.
+  size_t stream_blocks_;
+  // Created on first use when threads_ > 1.
+  std::unique_ptr<WorkerPool> worker_pool_;
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> salted_ctx_;
 
   // Pre-calculated hash of a zero block.
   std::vector<unsigned char> zero_block_hash_;
+  // Pre-calculated hash found at each level of the tree for a range of zero
+  // blocks, i.e. zero_block_hash_ for the base level, and for the upper ones
+  // the hash of a block filled with the zero hash of the level below.
+  std::vector<std::vector<unsigned char>> zero_level_hashes_;
   std::vector<unsigned char> root_hash_;
   // Storage of the verity tree. The base level hash stores in verity_tree_[0]
   // and the top level hash stores in verity_tree_.back().
@@ -101,6 +151,17 @@ class HashTreeBuilder {
   // The remaining data passed to the last call to Update() that's less than a
   // block.
   std::vector<unsigned char> leftover_;
+
+  // The fd and offset the hash tree is streamed to, see SetOutputFd(). In
+  // that case verity_tree_[0] only buffers the latest base level hashes.
+  int output_fd_;
+  uint64_t output_offset_;
+  // Size of each level, and its offset relative to output_offset_ given that
+  // the tree is stored top-down. The base level comes first.
+  std::vector<uint64_t> level_sizes_;
+  std::vector<uint64_t> level_offsets_;
+  // The number of base level bytes written to output_fd_.
+  uint64_t base_level_written_;
 };
 
 #endif  // __HASH_TREE_BUILDER_H__